@@ -0,0 +1,302 @@
+#!/usr/bin/env python3
+
+import concurrent.futures
+import csv
+import http.client
+import json
+import os
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+import argparse
+
+# Constants
+
+ROOT        = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+SPIDEY      = os.path.join(ROOT, 'bin', 'spidey')
+WWW         = os.path.join(ROOT, 'www')
+PLUGIN      = os.path.join(ROOT, 'lib', 'hello.so')
+
+MODES       = ['single', 'forking', 'hybrid', 'coroutine']
+LEVELS      = [1, 2, 4, 8]
+
+# tcp: loopback TCP; unix: the -u socket; proxy: the -u socket, each
+# connection starting with a PROXY v1 header as a local balancer would send
+TRANSPORTS  = ['tcp', 'unix', 'proxy']
+
+FIXTURES    = {
+    'test-1kb.img':     1 << 10,
+    'test-10mb.img':    10 << 20,
+    'test-1gb.img':     1 << 30,
+}
+
+# (name, kind, path, throws per hammer)
+SCENARIOS   = [
+    ('browse',      'directory', '/html/',                      20),
+    ('file-1kb',    'static',    '/images/test-1kb.img',        20),
+    ('file-10mb',   'static',    '/images/test-10mb.img',       4),
+    ('file-1gb',    'static',    '/images/test-1gb.img',        1),
+    ('cgi',         'cgi',       '/scripts/hello.py?user=world', 10),
+    ('plugin',      'plugin',    '/plugins/hello?user=world',   10),
+]
+
+FIELDS      = ['label', 'mode', 'transport', 'scenario', 'kind', 'path', 'hammers',
+               'requests', 'errors', 'bytes', 'elapsed', 'rps', 'mbps',
+               'mean_ms', 'p50_ms', 'p90_ms', 'p99_ms', 'max_ms']
+
+# Functions
+
+def usage(status=0):
+    progname = os.path.basename(sys.argv[0])
+    print(f'''Usage: {progname} [options]
+    -c  MODES       Comma separated server modes ({",".join(MODES)})
+    -l  LEVELS      Comma separated concurrency levels ({",".join(map(str, LEVELS))})
+    -T  TRANSPORTS  Comma separated transports ({",".join(TRANSPORTS)}) (tcp)
+    -s  SCENARIOS   Comma separated scenarios ({",".join(s[0] for s in SCENARIOS)})
+    -t  THROWS      Override throws per hammer for every scenario
+    -f  FORMAT      Output format: csv or json (csv)
+    -o  PATH        Write results to PATH instead of stdout
+    -L  LABEL       Build label recorded with every row (git describe)
+    -q              Quick run: skip the 1 GB fixture
+    ''')
+    sys.exit(status)
+
+def build_label():
+    ''' Describe the current build so results from different builds can be
+    told apart. '''
+    try:
+        return subprocess.check_output(['git', 'describe', '--always', '--dirty'],
+                                       cwd=ROOT, stderr=subprocess.DEVNULL).decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return 'unknown'
+
+def make_fixtures(workspace, quick=False):
+    ''' Copy the document root into workspace and generate the static file
+    fixtures referenced by the throughput scenarios (all but the 1 GB one
+    when quick).
+
+    Return the path of the generated document root.
+    '''
+    root = os.path.join(workspace, 'www')
+    shutil.copytree(WWW, root, symlinks=True)
+
+    for name, size in FIXTURES.items():
+        if quick and size >= 1 << 30:
+            continue
+        path = os.path.join(root, 'images', name)
+        with open(path, 'wb') as fs:
+            block = os.urandom(min(size, 1 << 20))
+            left  = size
+            while left > 0:
+                left -= fs.write(block[:left])
+
+    return root
+
+def free_port():
+    ''' Ask the kernel for an ephemeral localhost port. '''
+    with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
+        s.bind(('127.0.0.1', 0))
+        return s.getsockname()[1]
+
+class UnixHTTPConnection(http.client.HTTPConnection):
+    ''' HTTP connection over a UNIX socket, optionally announcing a client
+    address with a PROXY v1 header first. '''
+
+    def __init__(self, path, proxy=False, timeout=60):
+        super().__init__('localhost', timeout=timeout)
+        self.path  = path
+        self.proxy = proxy
+
+    def connect(self):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.settimeout(self.timeout)
+        self.sock.connect(self.path)
+        if self.proxy:
+            self.sock.sendall(b'PROXY TCP4 192.0.2.1 127.0.0.1 40000 80\r\n')
+
+def connect(target):
+    ''' Open an HTTP connection to (transport, port, socket path). '''
+    transport, port, path = target
+    if transport == 'tcp':
+        return http.client.HTTPConnection('127.0.0.1', port, timeout=60)
+    return UnixHTTPConnection(path, transport == 'proxy')
+
+def start_server(mode, root, port, log, path=None):
+    ''' Start bin/spidey in the specified mode (also listening on the UNIX
+    socket path, if any) and wait until it accepts connections. '''
+    command = [SPIDEY, '-c', mode, '-r', root, '-p', str(port)]
+    if path:
+        command += ['-u', path]
+    if os.path.exists(PLUGIN):
+        command += ['-x', f'/plugins/hello={PLUGIN}']
+    server = subprocess.Popen(command, stdout=log, stderr=log, start_new_session=True)
+
+    deadline = time.time() + 5
+    while time.time() < deadline:
+        if server.poll() is not None:
+            raise RuntimeError(f'spidey exited with status {server.returncode}')
+        try:
+            socket.create_connection(('127.0.0.1', port), timeout=0.1).close()
+            return server
+        except OSError:
+            time.sleep(0.05)
+
+    stop_server(server)
+    raise RuntimeError(f'spidey did not listen on port {port}')
+
+def stop_server(server):
+    ''' Terminate the server and any children it forked. '''
+    try:
+        os.killpg(server.pid, signal.SIGTERM)
+    except ProcessLookupError:
+        pass
+    server.wait()
+
+def hammer(target, path, throws):
+    ''' Hammer the specified path by making multiple throws (ie. HTTP
+    requests).
+
+    Return a list of (elapsed seconds, bytes received, ok) tuples.
+    '''
+    results = []
+    for throw in range(0, throws):
+        t = time.perf_counter()
+        try:
+            conn = connect(target)
+            conn.request('GET', path)
+            resp = conn.getresponse()
+            size = 0
+            while True:
+                data = resp.read(1 << 16)
+                if not data:
+                    break
+                size += len(data)
+            ok   = resp.status == 200
+            conn.close()
+        except (OSError, http.client.HTTPException):
+            size, ok = 0, False
+        results.append((time.perf_counter() - t, size, ok))
+
+    return results
+
+def percentile(values, p):
+    ''' Return the p-th percentile of the sorted values. '''
+    if not values:
+        return 0
+    index = min(len(values) - 1, int(round(p / 100 * (len(values) - 1))))
+    return values[index]
+
+def run_scenario(target, path, hammers, throws):
+    ''' Run one scenario at the given concurrency level and summarize it. '''
+    start = time.perf_counter()
+    with concurrent.futures.ThreadPoolExecutor(hammers) as executor:
+        futures = [executor.submit(hammer, target, path, throws) for _ in range(hammers)]
+        samples = [s for f in futures for s in f.result()]
+    elapsed = time.perf_counter() - start
+
+    latencies = sorted(s[0] * 1000 for s in samples)
+    nbytes    = sum(s[1] for s in samples)
+    errors    = sum(1 for s in samples if not s[2])
+
+    return {
+        'hammers':  hammers,
+        'requests': len(samples),
+        'errors':   errors,
+        'bytes':    nbytes,
+        'elapsed':  round(elapsed, 4),
+        'rps':      round(len(samples) / elapsed, 2),
+        'mbps':     round(nbytes / elapsed / (1 << 20), 2),
+        'mean_ms':  round(sum(latencies) / len(latencies), 3),
+        'p50_ms':   round(percentile(latencies, 50), 3),
+        'p90_ms':   round(percentile(latencies, 90), 3),
+        'p99_ms':   round(percentile(latencies, 99), 3),
+        'max_ms':   round(latencies[-1], 3),
+    }
+
+def write_results(rows, fmt, stream):
+    ''' Emit rows as CSV or JSON. '''
+    if fmt == 'json':
+        json.dump(rows, stream, indent=2)
+        stream.write('\n')
+    else:
+        writer = csv.DictWriter(stream, fieldnames=FIELDS)
+        writer.writeheader()
+        writer.writerows(rows)
+
+def main():
+    parser = argparse.ArgumentParser(description='Bench', add_help=False)
+    parser.add_argument('-c', dest='modes', default=','.join(MODES))
+    parser.add_argument('-l', dest='levels', default=','.join(map(str, LEVELS)))
+    parser.add_argument('-T', dest='transports', default='tcp')
+    parser.add_argument('-s', dest='scenarios', default=','.join(s[0] for s in SCENARIOS))
+    parser.add_argument('-t', dest='throws', type=int, default=0)
+    parser.add_argument('-f', dest='format', choices=['csv', 'json'], default='csv')
+    parser.add_argument('-o', dest='output', default=None)
+    parser.add_argument('-L', dest='label', default=None)
+    parser.add_argument('-q', dest='quick', action='store_true', default=False)
+    parser.add_argument('-h', dest='help', action='store_true', default=False)
+
+    try:
+        args = parser.parse_args()
+    except SystemExit:
+        usage(1)
+
+    if args.help:
+        usage(0)
+
+    if not os.access(SPIDEY, os.X_OK):
+        print(f'{SPIDEY} is missing: run make first', file=sys.stderr)
+        sys.exit(1)
+
+    modes     = args.modes.split(',')
+    levels    = [int(l) for l in args.levels.split(',')]
+    transports = args.transports.split(',')
+    if any(t not in TRANSPORTS for t in transports):
+        usage(1)
+    wanted    = args.scenarios.split(',')
+    scenarios = [s for s in SCENARIOS if s[0] in wanted]
+    if args.quick:
+        scenarios = [s for s in scenarios if s[0] != 'file-1gb']
+    label     = args.label or build_label()
+
+    rows = []
+    with tempfile.TemporaryDirectory(prefix='spidey-bench-') as workspace:
+        root = make_fixtures(workspace, args.quick)
+        log  = open(os.path.join(workspace, 'spidey.log'), 'w')
+
+        sock = os.path.join(workspace, 'spidey.sock')
+        for mode in modes:
+            port   = free_port()
+            server = start_server(mode, root, port, log, sock if transports != ['tcp'] else None)
+            try:
+                for name, kind, path, throws in scenarios:
+                    for transport in transports:
+                        for hammers in levels:
+                            print(f'{label} {mode:8} {transport:5} {name:10} x{hammers}', file=sys.stderr)
+                            row = {'label': label, 'mode': mode, 'transport': transport,
+                                   'scenario': name, 'kind': kind, 'path': path}
+                            row.update(run_scenario((transport, port, sock), path, hammers,
+                                                    args.throws or throws))
+                            rows.append(row)
+            finally:
+                stop_server(server)
+
+        log.close()
+
+    if args.output:
+        with open(args.output, 'w') as stream:
+            write_results(rows, args.format, stream)
+    else:
+        write_results(rows, args.format, sys.stdout)
+
+# Main execution
+
+if __name__ == '__main__':
+    main()
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
@@ -0,0 +1,265 @@
+#!/usr/bin/env python3
+
+import argparse
+import csv
+import json
+import os
+import resource
+import signal
+import socket
+import subprocess
+import sys
+import time
+
+# Constants
+
+ROOT        = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+SPIDEY      = os.path.join(ROOT, 'bin', 'spidey')
+WWW         = os.path.join(ROOT, 'www')
+
+COUNTS      = [10000, 100000]
+PATH        = '/html/index.html'
+BATCH       = 256                       # Connections opened before reading
+PER_SOURCE  = 25000                     # Connections per 127.0.0.x source
+SPARE_FDS   = 64                        # Descriptors kept free for everything else
+
+FIELDS      = ['label', 'mode', 'connections', 'opened', 'errors',
+               'rss_base_kb', 'rss_idle_kb', 'bytes_per_conn', 'elapsed']
+
+# Functions
+
+def usage(status=0):
+    progname = os.path.basename(sys.argv[0])
+    print(f'''Usage: {progname} [options]
+    -c  COUNTS      Comma separated idle connection counts ({",".join(map(str, COUNTS))})
+    -w  WORKERS     Run spidey with -w WORKERS instead of a single server
+    -u  PATH        Path requested before each connection goes idle ({PATH});
+                    an empty PATH leaves connections waiting for a request
+    -f  FORMAT      Output format: csv or json (csv)
+    -o  PATH        Write results to PATH instead of stdout
+    -L  LABEL       Build label recorded with every row (git describe)
+
+Opens COUNTS keep-alive connections to bin/spidey, makes one request on each
+and leaves them idle, then reports the server's resident set size per idle
+connection.  Counts beyond what RLIMIT_NOFILE allows are capped.
+    ''')
+    sys.exit(status)
+
+def build_label():
+    ''' Describe the checked out build. '''
+    try:
+        return subprocess.check_output(['git', 'describe', '--always', '--dirty'],
+                                       cwd=ROOT, stderr=subprocess.DEVNULL).decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return 'unknown'
+
+def raise_fd_limit():
+    ''' Raise the soft descriptor limit to the hard limit (inherited by
+    spidey) and return it. '''
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    if soft != hard:
+        resource.setrlimit(resource.RLIMIT_NOFILE, (hard, hard))
+    return hard
+
+def free_port():
+    ''' Ask the kernel for an ephemeral localhost port. '''
+    with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
+        s.bind(('127.0.0.1', 0))
+        return s.getsockname()[1]
+
+def start_server(port, workers, log):
+    ''' Start bin/spidey with no header or idle deadlines and wait until it
+    accepts connections. '''
+    command = [SPIDEY, '-c', 'single', '-r', WWW, '-p', str(port), '-t', 'header=0,idle=0']
+    if workers:
+        command += ['-w', str(workers)]
+    server = subprocess.Popen(command, stdout=log, stderr=log, start_new_session=True)
+
+    deadline = time.time() + 5
+    while time.time() < deadline:
+        if server.poll() is not None:
+            raise RuntimeError(f'spidey exited with status {server.returncode}')
+        try:
+            socket.create_connection(('127.0.0.1', port), timeout=0.1).close()
+            return server
+        except OSError:
+            time.sleep(0.05)
+
+    stop_server(server)
+    raise RuntimeError(f'spidey did not listen on port {port}')
+
+def stop_server(server):
+    ''' Terminate the server and any children it forked. '''
+    try:
+        os.killpg(server.pid, signal.SIGTERM)
+    except ProcessLookupError:
+        pass
+    server.wait()
+
+def server_rss(server):
+    ''' Return the resident set size of the server and its workers in KB. '''
+    pids  = [server.pid]
+    total = 0
+    try:
+        with open(f'/proc/{server.pid}/task/{server.pid}/children') as stream:
+            pids += [int(pid) for pid in stream.read().split()]
+    except OSError:
+        pass
+    for pid in pids:
+        try:
+            with open(f'/proc/{pid}/status') as stream:
+                for line in stream:
+                    if line.startswith('VmRSS:'):
+                        total += int(line.split()[1])
+        except OSError:
+            pass
+    return total
+
+def read_response(s):
+    ''' Read one response delimited by Content-Length or chunked encoding;
+    return True on 200. '''
+    data = b''
+    while b'\r\n\r\n' not in data:
+        chunk = s.recv(65536)
+        if not chunk:
+            return False
+        data += chunk
+
+    head, _, body = data.partition(b'\r\n\r\n')
+    length  = 0
+    chunked = False
+    for line in head.split(b'\r\n')[1:]:
+        name, _, value = line.partition(b':')
+        name = name.strip().lower()
+        if name == b'content-length':
+            length = int(value)
+        elif name == b'transfer-encoding':
+            chunked = b'chunked' in value.lower()
+
+    # The last chunk ends the body; nothing follows it on an idle connection
+    while (len(body) < length) if not chunked else not body.endswith(b'0\r\n\r\n'):
+        chunk = s.recv(65536)
+        if not chunk:
+            return False
+        body += chunk
+    return head.split(b' ')[1] == b'200'
+
+def open_idle(port, path, count):
+    ''' Open count connections, make one request on each and return the
+    sockets left idle along with the number of failures. '''
+    request = f'GET {path} HTTP/1.1\r\nHost: localhost\r\n\r\n'.encode() if path else b''
+    sockets = []
+    errors  = 0
+
+    for start in range(0, count, BATCH):
+        batch = []
+        for i in range(start, min(start + BATCH, count)):
+            s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            try:
+                s.bind((f'127.0.0.{1 + i // PER_SOURCE}', 0))
+                s.connect(('127.0.0.1', port))
+                if request:
+                    s.sendall(request)
+                batch.append(s)
+            except OSError:
+                s.close()
+                errors += 1
+        for s in batch:
+            try:
+                if not request or read_response(s):
+                    sockets.append(s)
+                    continue
+            except OSError:
+                pass
+            s.close()
+            errors += 1
+
+    return sockets, errors
+
+def run_count(port, path, count, server):
+    ''' Measure the server with count idle connections. '''
+    base  = server_rss(server)
+    start = time.perf_counter()
+    sockets, errors = open_idle(port, path, count)
+    elapsed = time.perf_counter() - start
+
+    time.sleep(0.5)
+    idle = server_rss(server)
+    for s in sockets:
+        s.close()
+
+    return {
+        'connections':    count,
+        'opened':         len(sockets),
+        'errors':         errors,
+        'rss_base_kb':    base,
+        'rss_idle_kb':    idle,
+        'bytes_per_conn': round((idle - base) * 1024 / max(len(sockets), 1)),
+        'elapsed':        round(elapsed, 3),
+    }
+
+def write_results(rows, fmt, stream):
+    ''' Emit rows as CSV or JSON. '''
+    if fmt == 'json':
+        json.dump(rows, stream, indent=2)
+        stream.write('\n')
+    else:
+        writer = csv.DictWriter(stream, fieldnames=FIELDS)
+        writer.writeheader()
+        writer.writerows(rows)
+
+def main():
+    parser = argparse.ArgumentParser(description='Idle connection bench', add_help=False)
+    parser.add_argument('-c', dest='counts', default=','.join(map(str, COUNTS)))
+    parser.add_argument('-w', dest='workers', type=int, default=0)
+    parser.add_argument('-u', dest='path', default=PATH)
+    parser.add_argument('-f', dest='format', choices=['csv', 'json'], default='csv')
+    parser.add_argument('-o', dest='output', default=None)
+    parser.add_argument('-L', dest='label', default=None)
+    parser.add_argument('-h', dest='help', action='store_true', default=False)
+
+    try:
+        args = parser.parse_args()
+    except SystemExit:
+        usage(1)
+
+    if args.help:
+        usage(0)
+
+    if not os.access(SPIDEY, os.X_OK):
+        print(f'{SPIDEY} is missing: run make first', file=sys.stderr)
+        sys.exit(1)
+
+    limit  = raise_fd_limit() - SPARE_FDS
+    label  = args.label or build_label()
+    mode   = f'workers={args.workers}' if args.workers else 'single'
+    rows   = []
+
+    for count in [int(c) for c in args.counts.split(',')]:
+        if count > limit:
+            print(f'Capping {count} connections at RLIMIT_NOFILE ({limit})', file=sys.stderr)
+            count = limit
+
+        # A fresh server for every count, so each starts from the same base
+        port = free_port()
+        with open(os.devnull, 'w') as log:
+            server = start_server(port, args.workers, log)
+            try:
+                row = run_count(port, args.path, count, server)
+            finally:
+                stop_server(server)
+
+        row.update(label=label, mode=mode)
+        rows.append(row)
+        print(f'{mode:>10} {row["opened"]:>7} idle connections: '
+              f'{row["rss_idle_kb"] - row["rss_base_kb"]} KB, '
+              f'{row["bytes_per_conn"]} bytes each', file=sys.stderr)
+
+    if args.output:
+        with open(args.output, 'w') as stream:
+            write_results(rows, args.format, stream)
+    else:
+        write_results(rows, args.format, sys.stdout)
+
+if __name__ == '__main__':
+    main()
@@ -1,5 +1,8 @@
 #!/bin/bash
 
+# Usage: test_latency.sh [HOST:PORT] (defaults to localhost:9894)
+
+SERVER=${1:-localhost:9894}
 
 for j in `seq 1 3`
 do
@@ -16,7 +19,7 @@ do
         echo "**** cgi script **** --> path : $path"
     fi
 
-    ./thor.py -t 10 -h 4 http://student04.cse.nd.edu:9894/$path
-    echo "./thor.py -t 10 -h 4 http://student04.cse.nd.edu:9894/$path"
+    ./thor.py -t 10 -h 4 http://$SERVER/$path
+    echo "./thor.py -t 10 -h 4 http://$SERVER/$path"
     echo
 done
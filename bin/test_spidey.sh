@@ -37,7 +37,7 @@ check_md5sum() {
 
 check_header() {
     status=$(head -n 1 $WORKSPACE/header | tr -d '\r\n')
-    content=$(awk '/Content/ { print $2 }' $WORKSPACE/header | tr -d '\r\n')
+    content=$(awk 'tolower($1) == "content-type:" { print $2 }' $WORKSPACE/header | tr -d '\r\n')
     if [ "$status" != "$1" ]; then
 	echo "FAILURE: $status != $1" > $WORKSPACE/test
 	return 1;
@@ -291,6 +291,9 @@ sleep 1
 
 printf "\n %-64s ... \n" "Handle CGI Requests"
 
+# CGI output is streamed with chunked encoding, which needs HTTP/1.1
+STATUS="HTTP/1.1 200 OK"
+
 printf "     %-60s ... " "/scripts/env.sh"
 CONTENT="text/plain"
 HEADERS="DOCUMENT_ROOT QUERY_STRING REMOTE_ADDR REMOTE_PORT REQUEST_METHOD REQUEST_URI SCRIPT_FILENAME SERVER_PORT HTTP_HOST HTTP_USER_AGENT"
@@ -1,5 +1,10 @@
 #!/bin/bash
 
+# Usage: test_throughput.sh [HOST:PORT] (defaults to localhost:9894)
+
+SERVER=${1:-localhost:9894}
+
+# The test-*.img fixtures are generated by bin/bench.py (make bench)
 
 for j in `seq 1 3`
 do
@@ -16,7 +21,7 @@ do
         echo "**** large file **** --> path : $path"
     fi
 
-    ./thor.py -t 10 -h 2 http://student04.cse.nd.edu:9894/$path
-    echo "./thor.py -t 10 -h 2 http://student04.cse.nd.edu:9894/$path"
+    ./thor.py -t 10 -h 2 http://$SERVER/$path
+    echo "./thor.py -t 10 -h 2 http://$SERVER/$path"
     echo
 done
@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+
+import argparse
+import http.server
+import os
+import socket
+import socketserver
+import sys
+
+# Handler
+
+class UpstreamHandler(http.server.BaseHTTPRequestHandler):
+    ''' Stand-in application backend for spidey -P.
+
+    GET /<prefix>/bytes/N       N bytes of payload with Content-Length
+    GET /<prefix>/chunked/N     N bytes of payload in chunks of up to 4096
+    GET /<prefix>/close/N       N bytes of payload delimited by closing
+    POST anything               Echo the request body back
+    anything else               Name, connection and forwarded headers
+    '''
+    protocol_version = 'HTTP/1.1'
+    server_version   = 'upstream'
+
+    def payload(self, n):
+        line = (f'{self.server.name} ' * 16)[:63] + '\n'
+        data = (line * (n // len(line) + 1)).encode()
+        return data[:n]
+
+    def do_GET(self):
+        parts = self.path.split('?')[0].strip('/').split('/')
+        mode  = parts[-2] if len(parts) >= 2 else ''
+        size  = int(parts[-1]) if parts[-1].isdigit() else 0
+
+        if mode == 'bytes':
+            self.reply(self.payload(size))
+        elif mode == 'chunked':
+            data = self.payload(size)
+            self.send_response(200)
+            self.send_header('Content-Type', 'application/octet-stream')
+            self.send_header('Transfer-Encoding', 'chunked')
+            self.end_headers()
+            for offset in range(0, len(data), 4096):
+                chunk = data[offset:offset + 4096]
+                self.wfile.write(b'%x\r\n%s\r\n' % (len(chunk), chunk))
+            self.wfile.write(b'0\r\n\r\n')
+        elif mode == 'close':
+            self.send_response(200)
+            self.send_header('Content-Type', 'application/octet-stream')
+            self.send_header('Connection', 'close')
+            self.end_headers()
+            self.wfile.write(self.payload(size))
+            self.close_connection = True
+        else:
+            self.reply('\n'.join([
+                f'upstream {self.server.name}',
+                f'connection {self.client_address} request {self.server.count(self.connection)}',
+                f'path {self.path}',
+                f'host {self.headers.get("Host")}',
+                f'x-forwarded-for {self.headers.get("X-Forwarded-For")}',
+                f'x-forwarded-proto {self.headers.get("X-Forwarded-Proto")}',
+                '',
+            ]).encode(), 'text/plain')
+
+    def do_HEAD(self):
+        self.send_response(200)
+        self.send_header('Content-Length', '1234')
+        self.end_headers()
+
+    def do_POST(self):
+        length = int(self.headers.get('Content-Length', 0))
+        self.reply(self.rfile.read(length))
+
+    def reply(self, data, mimetype='application/octet-stream'):
+        self.send_response(200)
+        self.send_header('Content-Type', mimetype)
+        self.send_header('Content-Length', str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def log_message(self, format, *args):
+        if self.server.verbose:
+            super().log_message(format, *args)
+
+# Servers
+
+class UpstreamMixin:
+    daemon_threads = True
+
+    def setup_upstream(self, name, verbose):
+        self.name     = name
+        self.verbose  = verbose
+        self.requests = {}
+
+    def count(self, connection):
+        key = id(connection)
+        self.requests[key] = self.requests.get(key, 0) + 1
+        return self.requests[key]
+
+class TCPUpstream(UpstreamMixin, socketserver.ThreadingMixIn, http.server.HTTPServer):
+    allow_reuse_address = True
+
+class UNIXUpstream(UpstreamMixin, socketserver.ThreadingUnixStreamServer):
+    def get_request(self):
+        request, _ = super().get_request()
+        return request, ('unix', 0)
+
+# Main execution
+
+def main():
+    parser = argparse.ArgumentParser(description='Stand-in upstream for spidey -P')
+    parser.add_argument('-n', '--name', default=None, help='Name reported in responses')
+    parser.add_argument('-v', '--verbose', action='store_true', help='Log each request')
+    parser.add_argument('address', help='PORT, HOST:PORT or unix:PATH to listen on')
+    args = parser.parse_args()
+
+    if args.address.startswith('unix:'):
+        path = args.address[5:]
+        if os.path.exists(path):
+            os.unlink(path)
+        server = UNIXUpstream(path, UpstreamHandler)
+    else:
+        host, _, port = args.address.rpartition(':')
+        server = TCPUpstream((host or '127.0.0.1', int(port)), UpstreamHandler)
+
+    server.setup_upstream(args.name or args.address, args.verbose)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,68 @@
+/* plugin.h: Native Handler Plugin ABI */
+
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * A plugin is a shared object that serves every URI under a prefix given
+ * with -x, called directly by the process handling the request:
+ *
+ *      ./bin/spidey -x /hello=lib/hello.so
+ *
+ * It must export spidey_plugin_abi (set to SPIDEY_PLUGIN_ABI) and
+ * spidey_handle.  spidey_init, if exported, runs once when the plugin is
+ * loaded, before any worker is forked; a non-zero return stops the server.
+ *
+ * spidey_handle gets a read-only view of the request and a response builder.
+ * Everything in the view (strings included) is only valid during the call.
+ * The response is sent when spidey_handle returns 0; any other return value
+ * discards it and sends 500 Internal Server Error instead.  Plugins must not
+ * block for long: a single-mode worker serves nobody else meanwhile.
+ *
+ * Only this header is needed to build a plugin:
+ *
+ *      gcc -shared -fPIC -Iinclude -o lib/hello.so src/plugin_hello.c
+ */
+
+#define SPIDEY_PLUGIN_ABI   1
+
+typedef struct SpideyRequest SpideyRequest;
+struct SpideyRequest {
+    const char *method;                 /*< HTTP method */
+    const char *uri;                    /*< URI without the query string */
+    const char *path;                   /*< Part of uri after the prefix */
+    const char *query;                  /*< Query string (NULL if none) */
+    const char *version;                /*< HTTP version (NULL for HTTP/2) */
+    const char *remote_addr;            /*< Numeric address of client */
+
+    /* Value of the first header called name (case-insensitive), or NULL */
+    const char *(*header)(const SpideyRequest *request, const char *name);
+
+    /* Read up to size bytes of the request body: 0 at its end, -1 on error */
+    ssize_t     (*read)(const SpideyRequest *request, void *buffer, size_t size);
+
+    void        *internal;              /*< Owned by spidey */
+};
+
+typedef struct SpideyResponse SpideyResponse;
+struct SpideyResponse {
+    /* Set the status (200 OK unless called) */
+    void        (*status)(SpideyResponse *response, int code, const char *reason);
+
+    /* Add a header; Content-Length and Connection are set by spidey */
+    void        (*header)(SpideyResponse *response, const char *name, const char *value);
+
+    /* Append to the body */
+    void        (*write)(SpideyResponse *response, const void *data, size_t size);
+    void        (*printf)(SpideyResponse *response, const char *format, ...)
+                    __attribute__((format(printf, 2, 3)));
+
+    void        *internal;              /*< Owned by spidey */
+};
+
+typedef int (*SpideyInit)(const char *prefix);
+typedef int (*SpideyHandler)(const SpideyRequest *request, SpideyResponse *response);
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,67 @@
+/* probe.h: Static USDT Tracepoints */
+
+#pragma once
+
+/*
+ * PROBE(name), PROBE1(name, a) and PROBE2(name, a, b) mark a USDT probe
+ * spidey:name that bpftrace, perf or SystemTap can attach to:
+ *
+ *      bpftrace -e 'usdt:./bin/spidey:spidey:stat_done { @bytes = hist(arg0); }'
+ *
+ * A probe compiles to a single nop plus an ELF note describing where its
+ * arguments live, so it costs nothing until a tracer attaches.  Arguments
+ * are passed as 64-bit integers (pointers included).
+ *
+ * <sys/sdt.h> is used when it is installed; otherwise the note is emitted
+ * directly in the same (version 3) format.
+ */
+
+#if defined(__has_include) && __has_include(<sys/sdt.h>)
+
+#include <sys/sdt.h>
+
+#define PROBE(name)             DTRACE_PROBE(spidey, name)
+#define PROBE1(name, a)         DTRACE_PROBE1(spidey, name, (long)(a))
+#define PROBE2(name, a, b)      DTRACE_PROBE2(spidey, name, (long)(a), (long)(b))
+
+#elif defined(__x86_64__) || defined(__aarch64__)
+
+#define PROBE_NOTE(name, args)                                              \
+    "990:   nop\n"                                                          \
+    "       .pushsection .note.stapsdt,\"?\",\"note\"\n"                    \
+    "       .balign 4\n"                                                    \
+    "       .4byte 992f-991f, 994f-993f, 3\n"                               \
+    "991:   .asciz \"stapsdt\"\n"                                           \
+    "992:   .balign 4\n"                                                    \
+    "993:   .8byte 990b\n"                                                  \
+    "       .8byte _.stapsdt.base\n"                                        \
+    "       .8byte 0\n"                                                     \
+    "       .asciz \"spidey\"\n"                                            \
+    "       .asciz \"" #name "\"\n"                                         \
+    "       .asciz \"" args "\"\n"                                          \
+    "994:   .balign 4\n"                                                    \
+    "       .popsection\n"                                                  \
+    "       .ifndef _.stapsdt.base\n"                                       \
+    "       .pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    "       .weak _.stapsdt.base\n"                                         \
+    "       .hidden _.stapsdt.base\n"                                       \
+    "_.stapsdt.base: .space 1\n"                                            \
+    "       .size _.stapsdt.base, 1\n"                                      \
+    "       .popsection\n"                                                  \
+    "       .endif\n"
+
+#define PROBE(name)             __asm__ __volatile__(PROBE_NOTE(name, ""))
+#define PROBE1(name, a)         __asm__ __volatile__(PROBE_NOTE(name, "-8@%0") \
+                                    :: "nor"((long)(a)))
+#define PROBE2(name, a, b)      __asm__ __volatile__(PROBE_NOTE(name, "-8@%0 -8@%1") \
+                                    :: "nor"((long)(a)), "nor"((long)(b)))
+
+#else
+
+#define PROBE(name)             do { } while (0)
+#define PROBE1(name, a)         do { (void)(a); } while (0)
+#define PROBE2(name, a, b)      do { (void)(a); (void)(b); } while (0)
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -7,8 +7,13 @@
 #include <stdlib.h>
 
 #include <netdb.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include "probe.h"
+
 /* Constants */
 
 #define WHITESPACE	" \t\n"
@@ -19,6 +24,8 @@
 typedef enum {
     SINGLE,                             /**< Single connection */
     FORKING,                            /**< Process per connection */
+    HYBRID,                             /**< Event loop plus blocking task threads */
+    COROUTINE,                          /**< Event loop running a coroutine per request */
     UNKNOWN
 } ServerMode;
 
@@ -29,6 +36,25 @@ extern char *MimeTypesPath;             /**< Path to mime.types file */
 extern char *DefaultMimeType;           /**< Default file mimetype */
 extern char *RootPath;                  /**< Path to root directory */
 extern char *root;
+extern char *BundlePath;                /**< Path to static site bundle */
+extern int   RootFd;                    /**< O_PATH descriptor of RootPath */
+
+extern int   HeaderTimeout;             /**< Milliseconds to receive request headers */
+extern int   BodyTimeout;               /**< Milliseconds a request body read may block */
+extern int   IdleTimeout;               /**< Milliseconds a keep-alive connection may idle */
+extern int   WriteTimeout;              /**< Milliseconds a response write may block */
+extern int   DrainTimeout;              /**< Milliseconds to finish requests when stopping */
+extern int   UpstreamTimeout;           /**< Milliseconds an upstream connect or read may block */
+extern int   CgiTimeout;                /**< Milliseconds a CGI script may go without output */
+
+extern int   MaxConnections;            /**< Open connections before shedding (0 = unlimited) */
+extern int   MaxQueue;                  /**< Connections waiting for dispatch before shedding */
+extern int   MaxCGI;                    /**< Concurrent CGI processes across workers */
+extern int   PoolThreads;               /**< Blocking task threads of a hybrid server */
+extern int   CoroutineStack;            /**< Bytes mapped for each coroutine stack */
+extern int   AdaptiveTarget;            /**< Queueing delay target in milliseconds (0 = off) */
+extern int   RetryAfter;                /**< Retry-After seconds sent with 503 */
+extern long  MaxBodySize;               /**< Largest request body in bytes (0 = unlimited) */
 
 /* Logging Macros */
 
@@ -41,6 +67,35 @@ extern char *root;
 #define fatal(M, ...)   fprintf(stderr, "[%5d] FATAL %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__); exit(EXIT_FAILURE)
 #define log(M, ...)     fprintf(stderr, "[%5d] LOG   %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__)
 
+/* Timer Wheel */
+
+#define TIMER_LEVELS    4               /* Wheels (covers 64^4 ticks) */
+#define TIMER_SLOTS     64              /* Slots per wheel */
+#define TIMER_TICK_MS   10              /* Resolution of level 0 */
+
+typedef struct timer Timer;
+struct timer {
+    Timer    *next;                     /*< Next timer in slot */
+    Timer    *prev;                     /*< Previous timer in slot */
+    uint64_t  expires;                  /*< Expiration tick */
+    void    (*callback)(Timer *timer);  /*< Called when timer expires */
+};
+
+typedef struct {
+    uint64_t  tick;                     /*< Current tick */
+    size_t    count;                    /*< Number of armed timers */
+    Timer     slots[TIMER_LEVELS][TIMER_SLOTS];
+} TimerWheel;
+
+#define timer_pending(t)    ((t)->next != NULL)
+
+uint64_t    timer_now(void);
+void        timer_wheel_init(TimerWheel *w, uint64_t now);
+void        timer_add(TimerWheel *w, Timer *t, uint64_t delay);
+void        timer_cancel(TimerWheel *w, Timer *t);
+void        timer_advance(TimerWheel *w, uint64_t now);
+int         timer_wheel_timeout(TimerWheel *w);
+
 /* HTTP Request */
 
 typedef struct header Header;
@@ -50,43 +105,380 @@ struct header {
     Header  *next;                      /*< Next header entry */
 };
 
-typedef struct {
+struct ssl_st;
+
+/* Client address (IPv4 or IPv6) in binary form */
+typedef union {
+    struct sockaddr     sa;
+    struct sockaddr_in  in;
+    struct sockaddr_in6 in6;
+} Address;
+
+typedef struct request Request;
+struct request {
     int     fd;                         /*< Client socket file descripter */
     FILE    *stream;                    /*< Client socket file stream */
+    struct ssl_st *ssl;                 /*< TLS session while handshaking */
+    bool     secure;                    /*< Accepted on the TLS listener */
+    bool     local;                     /*< Accepted on the UNIX listener, PROXY header not yet seen */
     char    *method;                    /*< HTTP method */
     char    *uri;                       /*< HTTP uniform resource identifier */
     char    *path;                      /*< Real path corrsponding to URI and RootPath */
     char    *query;                     /*< HTTP query string */
+    char    *version;                   /*< HTTP version (NULL for HTTP/2 streams) */
 
-    char     host[NI_MAXHOST];          /*< Host name of client */
-    char     port[NI_MAXSERV];          /*< Port number of client */
+    Address  addr;                      /*< Address of client */
+    char    *buffer;                    /*< Stream buffer borrowed while active */
 
     Header  *headers;                   /*< List of name, data Header pairs */
-} Request;
+    bool     persistent;                /*< Response was delimited: keep connection open */
+
+    uint64_t accepted;                  /*< Time connection was accepted (timer_now) */
+    bool     idle;                      /*< Kept alive, no bytes of the next request yet */
+    bool     closing;                   /*< Freed once the loop's current batch is done */
+    int      class;                     /*< Scheduling class (hybrid mode) */
+    uint64_t queued;                    /*< Time handed to the task pool (timer_now) */
+    Timer    timer;                     /*< Header or idle deadline */
+    Request *next;                      /*< Next request waiting in event loop */
+    Request *prev;                      /*< Previous request waiting in event loop */
+};
 
 Request *   accept_request(int sfd);
 void	    free_request(Request *request);
+void        free_headers(Header *headers);
 int	    parse_request(Request *request);
+int         parse_request_method(Request *request);
+int         parse_request_headers(Request *request);
+bool        request_keep_alive(Request *request);
+void        request_reset(Request *request);
+bool        request_await(Request *request, int timeout);
+bool        request_attach(Request *request);
+void        request_detach(Request *request);
+const char *request_host(const Request *request);
+const char *request_port(const Request *request);
+int         request_proxy(Request *request);
+
+/* Request Body */
+
+int         request_body(Request *request, off_t *length);
+pid_t       body_feed(Request *request, int fd, off_t length, pid_t cgi);
+bool        body_finish(pid_t feeder);
+size_t      stream_pending(FILE *stream);
 
 /* HTTP Request Handlers */
 
 typedef enum {
     HTTP_STATUS_OK = 0,			/* 200 OK */
+    HTTP_STATUS_NOT_MODIFIED,		/* 304 Not Modified */
     HTTP_STATUS_BAD_REQUEST,		/* 400 Bad Request */
     HTTP_STATUS_NOT_FOUND,		/* 404 Not Found */
+    HTTP_STATUS_LENGTH_REQUIRED,	/* 411 Length Required */
+    HTTP_STATUS_PAYLOAD_TOO_LARGE,	/* 413 Payload Too Large */
+    HTTP_STATUS_TOO_MANY_REQUESTS,	/* 429 Too Many Requests */
+    HTTP_STATUS_HEADER_FIELDS_TOO_LARGE,/* 431 Request Header Fields Too Large */
     HTTP_STATUS_INTERNAL_SERVER_ERROR,	/* 500 Internal Server Error */
+    HTTP_STATUS_BAD_GATEWAY,		/* 502 Bad Gateway */
+    HTTP_STATUS_SERVICE_UNAVAILABLE,	/* 503 Service Unavailable */
+    HTTP_STATUS_GATEWAY_TIMEOUT,	/* 504 Gateway Timeout */
 } Status;
 
 Status      handle_request(Request *request);
+Status      handle_error(Request *request, Status status);
+const char *request_header(Request *request, const char *name);
+
+/* CGI Microcache */
+
+typedef struct {
+    void       *slot;                   /*< Entry being filled (NULL if none) */
+    size_t      length;                 /*< Bytes of response captured */
+    size_t      status_length;          /*< Bytes of status captured */
+    size_t      headers_length;         /*< Bytes of headers captured */
+    long        max_age;                /*< Seconds the response may be cached */
+    bool        failed;                 /*< Response too large to cache */
+} Microcache;
+
+bool        parse_microcache(char *spec);
+void        microcache_init(void);
+bool        microcache_lookup(Request *request, Microcache *cache);
+void        microcache_headers(Microcache *cache, const char *status, const char *headers, size_t length);
+void        microcache_body(Microcache *cache, const char *data, size_t length);
+void        microcache_finish(Microcache *cache, bool complete);
+
+/* Request Classes */
+
+typedef enum {
+    CLASS_STATIC = 0,
+    CLASS_BROWSE,
+    CLASS_CGI,
+    CLASS_PROXY,
+    CLASS_PLUGIN,
+    CLASS_COUNT,
+} RequestClass;
+
+bool        parse_schedule(char *spec);
+void        schedule_init(void);
+void        schedule_classify(Request *request);
+void        schedule_push(Request *request);
+Request *   schedule_pop(void);
+void        schedule_done(Request *request);
+bool        schedule_routed(const char *uri);
+Status      schedule_status(Request *request);
+
+/* File Metadata Cache */
+
+#define METADATA_MIME_MAX   96          /* Longest mimetype cached */
+#define METADATA_ETAG_MAX   64          /* Room for a quoted ETag */
+
+typedef struct {
+    char        mimetype[METADATA_MIME_MAX];
+    char        etag[METADATA_ETAG_MAX];
+} Metadata;
+
+bool        parse_metadata(char *spec);
+void        metadata_init(void);
+void        metadata_lookup(const char *path, const struct stat *stats, Metadata *metadata);
+
+/* Directory Listings */
+
+Status      handle_browse_request(Request *request, int fd);
+bool        browse_query(const char *query);
+
+/* Native Handler Plugins */
+
+bool        parse_plugins(char *spec);
+void        plugin_init(void);
+bool        plugin_routed(const char *uri);
+Status      plugin_request(Request *request);
+
+/* Reverse Proxy */
+
+bool        parse_proxy(char *spec);
+void        proxy_init(void);
+bool        proxy_routed(const char *uri);
+Status      proxy_request(Request *request);
+
+/* Rate Limiting */
+
+bool        parse_rates(char *spec);
+void        rate_init(void);
+bool        rate_admit(Request *request);
+Status      rate_reject(Request *request);
+
+/* Tracing */
+
+extern __thread bool Tracing;           /**< Current request is sampled */
+
+bool        parse_trace(char *spec);
+void        trace_init(void);
+void        trace_request(void);
+void        trace_event(const char *name, char phase);
+void        trace_finish(Request *request, Status status);
+void        trace_discard(void);
+
+/* Mark a phase of the current request for USDT probes and the tracer */
+#define TRACE_BEGIN(phase)      do { PROBE(phase##_start); \
+                                     if (Tracing) trace_event(#phase, 'B'); } while (0)
+#define TRACE_END(phase)        do { PROBE(phase##_done); \
+                                     if (Tracing) trace_event(#phase, 'E'); } while (0)
+#define TRACE_END1(phase, a)    do { PROBE1(phase##_done, a); \
+                                     if (Tracing) trace_event(#phase, 'E'); } while (0)
+
+/* Static Site Bundle */
+
+#define BUNDLE_MAGIC    "SPDYBNDL"
+#define BUNDLE_VERSION  1
+
+/**
+ * Encodings stored for each bundle entry
+ */
+typedef enum {
+    BUNDLE_IDENTITY = 0,                /**< Body as found on disk */
+    BUNDLE_GZIP,                        /**< Precompressed gzip body */
+    BUNDLE_ENCODINGS
+} BundleEncoding;
+
+/*
+ * On-disk layout: a BundleHeader at offset 0, followed by the BundleEntry
+ * index sorted by path, followed by the NUL-terminated strings the entries
+ * point at.  Every body starts on a page boundary.  All offsets are relative
+ * to the start of the file.
+ */
+typedef struct {
+    uint64_t headers;                   /*< Offset of response header block */
+    uint64_t headers_length;            /*< Length of response header block (0 if absent) */
+    uint64_t body;                      /*< Offset of response body */
+    uint64_t length;                    /*< Length of response body */
+} BundleVariant;
+
+typedef struct {
+    uint64_t      path;                 /*< Offset of URI path */
+    uint64_t      mimetype;             /*< Offset of mimetype */
+    uint64_t      etag;                 /*< Offset of quoted ETag */
+    BundleVariant variants[BUNDLE_ENCODINGS];
+} BundleEntry;
+
+typedef struct {
+    char     magic[8];                  /*< BUNDLE_MAGIC */
+    uint32_t version;                   /*< BUNDLE_VERSION */
+    uint32_t page_size;                 /*< Alignment of bodies */
+    uint64_t entries;                   /*< Number of index entries */
+    uint64_t index;                     /*< Offset of BundleEntry index */
+    uint64_t size;                      /*< Total size of bundle */
+} BundleHeader;
+
+typedef struct {
+    int                 fd;             /*< Bundle file descriptor */
+    size_t              size;           /*< Size of mapping */
+    const char         *base;           /*< Start of mapping */
+    const BundleHeader *header;         /*< Bundle header */
+    const BundleEntry  *entries;        /*< Sorted entry index */
+} Bundle;
+
+extern Bundle *StaticBundle;            /**< Bundle to serve from (if any) */
+
+Bundle *    bundle_open(const char *path);
+void        bundle_close(Bundle *bundle);
+const BundleEntry *bundle_lookup(const Bundle *bundle, const char *uri);
+
+/* HPACK Header Compression */
+
+#define HPACK_TABLE_SIZE    4096        /* SETTINGS_HEADER_TABLE_SIZE we advertise */
+
+typedef struct {
+    char        *name;
+    char        *value;
+} HpackField;
+
+typedef struct {
+    HpackField  *fields;                /*< Dynamic table entries, newest first */
+    size_t       count;                 /*< Number of entries */
+    size_t       capacity;              /*< Allocated entries */
+    size_t       size;                  /*< Table size (names + values + 32 each) */
+    size_t       max_size;              /*< Current maximum size */
+    size_t       limit;                 /*< Largest size the peer may switch to */
+} HpackTable;
+
+void        hpack_table_init(HpackTable *t, size_t max_size);
+void        hpack_table_free(HpackTable *t);
+bool        hpack_decode(HpackTable *t, const uint8_t *block, size_t length, Header **headers);
+size_t      hpack_encode(uint8_t *buffer, size_t size, const char *name, const char *value);
+size_t      hpack_encode_status(uint8_t *buffer, size_t size, int status);
+
+/* HTTP/2 */
+
+bool        http2_preface(Request *request);
+bool        http2_upgradable(Request *request);
+Status      http2_serve(Request *request);
+Status      http2_upgrade(Request *request);
+
+/* TLS */
+
+#define TLS_INHERIT_ENV     "SPIDEY_TLS_FD"     /* TLS listening socket passed on upgrade */
+
+extern char *TlsPort;                   /**< TLS port number (NULL = no TLS listener) */
+extern char *TlsCertificate;            /**< Path to PEM certificate chain */
+extern char *TlsKey;                    /**< Path to PEM private key */
+extern int   TlsSocket;                 /**< TLS listening socket (-1 if none) */
+
+bool        parse_tls(char *spec);
+bool        tls_init(void);
+bool        tls_accept(Request *request);
+int         tls_handshake(Request *request);
+bool        tls_offload(Request *request);
+void        tls_free(Request *request);
 
 /* HTTP Server */
 
 int         single_server(int sfd);
 int         forking_server(int sfd);
+int         fork_detached(void);
+int         hybrid_server(int sfd);
+void        hybrid_pause(void);
+void        hybrid_resume(void);
+void        hybrid_idle(void);
+void        hybrid_busy(void);
+
+/* Coroutines */
+
+typedef struct coroutine Coroutine;
+
+Coroutine * coroutine_create(void (*function)(void *), void *arg);
+bool        coroutine_resume(Coroutine *co);
+void        coroutine_yield(void);
+bool        coroutine_running(void);
+void        coroutine_wake(Coroutine *co);
+int         coroutine_poll(struct pollfd *fds, nfds_t n, int timeout);
+bool        coroutine_wait(int fd, short events, int timeout);
+ssize_t     coroutine_read(int fd, void *buffer, size_t size, int timeout);
+ssize_t     coroutine_write(int fd, const void *buffer, size_t size, int timeout);
+void        coroutine_nonblock(int fd);
+size_t      coroutine_stacks(size_t *idle);
+void        coroutine_reload(void);
+void        coroutine_idle(void);
+void        coroutine_busy(void);
+int         coroutine_server(int sfd);
+
+/* Workers */
+
+extern int   Workers;                   /**< Worker processes (0 = serve from main process) */
+extern bool  PinWorkers;                /**< Pin workers to CPUs and NUMA nodes */
+
+int         workers_server(ServerMode mode);
+void        worker_unpin(void);
+
+/* Event Loop */
+
+typedef bool (*Dispatcher)(Request *request);
+
+int         event_loop(int sfd, Dispatcher dispatch);
+void        event_loop_detach(void);
+bool        event_loop_watch(int fd, void (*callback)(void));
+void        event_loop_resume(Request *request);
+bool        event_loop_park(Coroutine *co, int fd, short events);
+void        event_loop_unpark(int fd);
+void        event_loop_timer(Timer *timer, int timeout);
+bool        parse_timeouts(char *spec);
+
+/* Large Files */
+
+extern off_t LargeFileSize;             /**< Files streamed around the page cache (0 = none) */
+
+bool        parse_large(char *spec);
+bool        large_file(off_t size);
+off_t       large_send(Request *request, int fd, off_t size);
+
+/* Admission Control */
+
+bool        parse_limits(char *spec);
+void        admission_init(void);
+bool        admission_shed(int sfd, size_t pending);
+void        admission_sample(uint64_t delay, uint64_t now, size_t pending);
+void        admission_begin(void);
+void        admission_end(void);
+bool        cgi_acquire(void);
+void        cgi_release(void);
+size_t      admission_active(void);
+
+/* Reload and Upgrade */
+
+extern char **ExecArguments;            /**< Command line to re-execute on upgrade */
+
+void        save_arguments(int argc, char *argv[]);
+bool        server_reload(void);
+void        server_upgrade(int sfd);
+void        upgrade_complete(void);
 
 /* Socket */
 
-int	    socket_listen(const char *port);
+#define SOCKET_INHERIT_ENV  "SPIDEY_LISTEN_FD"  /* Listening socket passed on upgrade */
+#define UNIX_INHERIT_ENV    "SPIDEY_UNIX_FD"    /* UNIX listening socket passed on upgrade */
+
+extern char *UnixPath;                  /**< UNIX socket path (NULL = no UNIX listener) */
+extern int   UnixSocket;                /**< UNIX listening socket (-1 if none) */
+
+int	    socket_listen(const char *port, int cpu);
+int         socket_listen_unix(const char *path);
+int         socket_inherit(const char *name);
 
 /* Utilities */
 
@@ -95,6 +487,8 @@ int	    socket_listen(const char *port);
 char *      chomp(char* s);
 char *	    determine_mimetype(const char *path);
 char *	    determine_request_path(const char *uri);
+bool        open_root(const char *path);
+int         open_request_path(const char *uri);
 const char *http_status_string(Status status);
 char *	    skip_nonwhitespace(char *s);
 char *	    skip_whitespace(char *s);
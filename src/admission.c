@@ -0,0 +1,294 @@
+/* admission.c: Admission Control and Load Shedding */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Global Variables */
+int MaxConnections  = 0;
+int MaxQueue        = 0;
+int MaxCGI          = 0;
+int AdaptiveTarget  = 0;
+int RetryAfter      = 1;
+int PoolThreads     = 16;
+int CoroutineStack  = 128 << 10;
+
+/* Constants */
+
+#define ADAPTIVE_INTERVAL   100         /* Milliseconds per latency window */
+#define ADAPTIVE_FLOOR      4           /* Smallest adaptive connection limit */
+#define ADAPTIVE_CEILING    4096        /* Largest adaptive limit without conns= */
+
+/* Internal State */
+
+static volatile int  Active = 0;        /* Requests being handled (children) */
+static pid_t        *CGIs   = NULL;     /* Thread holding each CGI slot (0 = free) */
+
+/*
+ * The adaptive limit follows CoDel: the minimum queueing delay seen in each
+ * interval tells a standing queue apart from a burst.  An interval whose best
+ * request still waited longer than the target shrinks the limit to three
+ * quarters of the connections currently open, any other interval grows it by
+ * one.
+ */
+static int      AdaptiveLimit  = ADAPTIVE_CEILING;
+static uint64_t WindowEnd      = 0;
+static uint64_t WindowMin      = UINT64_MAX;
+
+/**
+ * Parse admission limits specification.
+ *
+ * @param   spec        Comma separated name=value pairs, where name is one of
+ *                      conns, queue, cgi, adaptive (target delay in
+ *                      milliseconds), retry (Retry-After seconds), body
+ *                      (largest request body in bytes), threads (blocking
+ *                      task threads of a hybrid server), or stack (KB mapped
+ *                      per coroutine, a multiple of 4).
+ * @return  true if parsing was successful, false if there was an error.
+ **/
+bool parse_limits(char *spec) {
+    for (char *pair = strtok(spec, ","); pair; pair = strtok(NULL, ",")) {
+        char *value = strchr(pair, '=');
+        char *end;
+        if (!value) {
+            return false;
+        }
+        *value++ = '\0';
+        long n = strtol(value, &end, 10);
+        if (*end || end == value || n < 0) {
+            return false;
+        }
+
+        if (streq(pair, "conns")) {
+            MaxConnections = n;
+        } else if (streq(pair, "queue")) {
+            MaxQueue = n;
+        } else if (streq(pair, "cgi")) {
+            MaxCGI = n;
+        } else if (streq(pair, "adaptive")) {
+            AdaptiveTarget = n;
+        } else if (streq(pair, "retry")) {
+            RetryAfter = n;
+        } else if (streq(pair, "body")) {
+            MaxBodySize = n;
+        } else if (streq(pair, "threads") && n > 0) {
+            PoolThreads = n;
+        } else if (streq(pair, "stack") && n >= 16 && n % 4 == 0) {
+            CoroutineStack = n << 10;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Prepare admission control before any worker is forked.
+ *
+ * This places the CGI slots in shared memory so every forked worker sees
+ * the same ones.
+ **/
+void admission_init(void) {
+    if (MaxCGI > 0) {
+        CGIs = mmap(NULL, MaxCGI * sizeof(pid_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (CGIs == MAP_FAILED) {
+            fatal("Unable to mmap CGI slots: %s", strerror(errno));
+        }
+    }
+
+    if (AdaptiveTarget > 0 && MaxConnections > 0) {
+        AdaptiveLimit = MaxConnections;
+    }
+}
+
+/**
+ * Decide whether the next connection must be turned away.
+ *
+ * @param   pending     Connections waiting in the event loop.
+ * @return  true if the connection should be shed.
+ **/
+static bool admission_full(size_t pending) {
+    size_t open = pending + __atomic_load_n(&Active, __ATOMIC_RELAXED);
+
+    if (MaxConnections > 0 && open >= (size_t)MaxConnections) {
+        return true;
+    }
+    if (MaxQueue > 0 && pending >= (size_t)MaxQueue) {
+        return true;
+    }
+    if (AdaptiveTarget > 0 && open >= (size_t)AdaptiveLimit) {
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Render the 503 response with the current Retry-After.
+ **/
+static size_t admission_rejection(char *response, size_t size) {
+    const char *status = http_status_string(HTTP_STATUS_SERVICE_UNAVAILABLE);
+    char body[64];
+    int  length = snprintf(body, sizeof(body), "<strong>%s</strong>", status);
+
+    return snprintf(response, size,
+        "HTTP/1.0 %s\r\n"
+        "Retry-After: %d\r\n"
+        "Content-Type: text/html\r\n"
+        "Content-Length: %d\r\n"
+        "Connection: close\r\n"
+        "\r\n"
+        "%s", status, RetryAfter, length, body);
+}
+
+/**
+ * Shed the next connection if the server is over its limits.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @param   pending     Connections waiting in the event loop.
+ * @return  true if a connection was accepted and turned away.
+ *
+ * The rejected connection never gets a Request: it is accepted, sent a 503
+ * without parsing, drained and closed.
+ **/
+bool admission_shed(int sfd, size_t pending) {
+    char buffer[BUFSIZ];
+    char response[256];
+
+    if (!admission_full(pending)) {
+        return false;
+    }
+
+    int fd = accept4(sfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+        /* Nothing left to accept */
+        return true;
+    }
+    size_t length = admission_rejection(response, sizeof(response));
+    if (send(fd, response, length, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+        debug("Unable to send 503: %s", strerror(errno));
+    }
+    /* Drain whatever request bytes already arrived so close sends FIN, not RST */
+    while (recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0);
+    close(fd);
+    debug("Shed connection (%zu pending, %d active)", pending, Active);
+    return true;
+}
+
+/**
+ * Record how long a new connection waited between accept and dispatch.
+ *
+ * @param   delay       Queueing delay in milliseconds.
+ * @param   now         Current time (timer_now).
+ * @param   pending     Connections waiting in the event loop.
+ **/
+void admission_sample(uint64_t delay, uint64_t now, size_t pending) {
+    if (AdaptiveTarget <= 0) {
+        return;
+    }
+
+    if (delay < WindowMin) {
+        WindowMin = delay;
+    }
+    if (now < WindowEnd) {
+        return;
+    }
+
+    int ceiling = MaxConnections > 0 ? MaxConnections : ADAPTIVE_CEILING;
+    int open = pending + __atomic_load_n(&Active, __ATOMIC_RELAXED);
+    if (WindowEnd && WindowMin > (uint64_t)AdaptiveTarget) {
+        if (open < AdaptiveLimit) {
+            AdaptiveLimit = open;
+        }
+        AdaptiveLimit -= AdaptiveLimit / 4;
+        if (AdaptiveLimit < ADAPTIVE_FLOOR) {
+            AdaptiveLimit = ADAPTIVE_FLOOR;
+        }
+        log("Queueing delay %lums above target: limiting to %d connections", (unsigned long)WindowMin, AdaptiveLimit);
+    } else if (AdaptiveLimit < ceiling) {
+        AdaptiveLimit++;
+    }
+    WindowEnd = now + ADAPTIVE_INTERVAL;
+    WindowMin = UINT64_MAX;
+}
+
+/**
+ * Track requests handled outside the event loop (ie. forked children).
+ **/
+void admission_begin(void) {
+    __atomic_add_fetch(&Active, 1, __ATOMIC_RELAXED);
+}
+
+void admission_end(void) {
+    __atomic_sub_fetch(&Active, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Return number of requests being handled outside the event loop.
+ **/
+size_t admission_active(void) {
+    return __atomic_load_n(&Active, __ATOMIC_RELAXED);
+}
+
+/**
+ * Return whether the thread holding a CGI slot still exists.
+ **/
+static bool cgi_holder_alive(pid_t holder) {
+    return kill(holder, 0) == 0 || errno == EPERM;
+}
+
+/**
+ * Reserve a CGI process slot.
+ *
+ * @return  true if the CGI script may be started.
+ *
+ * Slots record the thread holding them, so one left behind by a worker or
+ * forked child that died before releasing it is taken over once every slot
+ * is in use.
+ **/
+bool cgi_acquire(void) {
+    if (!CGIs) {
+        return true;
+    }
+
+    pid_t self = gettid();
+    for (int i = 0; i < MaxCGI; i++) {
+        pid_t holder = 0;
+        if (__atomic_compare_exchange_n(&CGIs[i], &holder, self, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return true;
+        }
+    }
+    for (int i = 0; i < MaxCGI; i++) {
+        pid_t holder = __atomic_load_n(&CGIs[i], __ATOMIC_ACQUIRE);
+        if (holder && !cgi_holder_alive(holder) &&
+            __atomic_compare_exchange_n(&CGIs[i], &holder, self, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            log("Reclaimed CGI slot from exited %d", holder);
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Release a CGI slot this thread holds.
+ **/
+void cgi_release(void) {
+    if (!CGIs) {
+        return;
+    }
+
+    pid_t self = gettid();
+    for (int i = 0; i < MaxCGI; i++) {
+        pid_t holder = self;
+        if (__atomic_compare_exchange_n(&CGIs[i], &holder, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
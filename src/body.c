@@ -0,0 +1,310 @@
+/* body.c: Request Body Functions */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Global Variables */
+long MaxBodySize = 1L << 30;
+
+/* Constants */
+
+#define BODY_SPLICE     (1 << 16)       /* Largest single splice */
+#define BODY_LINE       256             /* Longest chunk size or trailer line */
+
+/*
+ * A request body is moved into a CGI script's standard input by a feeder
+ * process, so the script can produce output while its input is still
+ * arriving without either side waiting on the other.  The bytes stdio read
+ * past the header block are handed over first; everything else goes from
+ * the socket to the pipe with splice(2) and never enters user space.
+ * Chunked bodies are decoded on the way: only the size lines are read, the
+ * chunk data itself is spliced.
+ */
+
+typedef struct {
+    int     fd;                         /*< Client socket */
+    char    buffer[BUFSIZ];             /*< Bytes read but not yet written */
+    size_t  start;                      /*< First unconsumed byte */
+    size_t  end;                        /*< End of buffered bytes */
+} BodySource;
+
+/**
+ * Return how many bytes stdio has buffered but not yet returned.
+ **/
+size_t stream_pending(FILE *fs) {
+    return fs->_IO_read_ptr < fs->_IO_read_end ? fs->_IO_read_end - fs->_IO_read_ptr : 0;
+}
+
+/**
+ * Determine the framing of the request body.
+ *
+ * @param   r           Parsed request.
+ * @param   length      Set to the Content-Length, or -1 for a chunked body.
+ * @return  1 if there is a body, 0 if there is none, -1 if the framing is
+ *          invalid.
+ *
+ * HTTP/2 streams never have a body to feed: their DATA frames are consumed
+ * by the connection.
+ **/
+int request_body(Request *r, off_t *length) {
+    const char *encoding = request_header(r, "Transfer-Encoding");
+    const char *value    = request_header(r, "Content-Length");
+
+    *length = 0;
+    if (!r->version) {
+        return 0;
+    }
+    if (encoding) {
+        if (strcasecmp(encoding, "chunked") != 0 || value) {
+            return -1;
+        }
+        *length = -1;
+        return 1;
+    }
+    if (!value) {
+        return 0;
+    }
+
+    char *end;
+    errno = 0;
+    long long n = strtoll(value, &end, 10);
+    if (errno || end == value || *skip_whitespace(end) || n < 0) {
+        return -1;
+    }
+    *length = n;
+    return n > 0;
+}
+
+/**
+ * Read more of the body into the source buffer.
+ **/
+static bool source_fill(BodySource *s) {
+    if (s->start == s->end) {
+        s->start = s->end = 0;
+    }
+    if (s->end == sizeof(s->buffer)) {
+        return false;
+    }
+    ssize_t n = coroutine_read(s->fd, s->buffer + s->end, sizeof(s->buffer) - s->end, BodyTimeout);
+    if (n <= 0) {
+        return false;
+    }
+    s->end += n;
+    return true;
+}
+
+/**
+ * Read one CRLF terminated line (chunk size or trailer) from the source.
+ **/
+static bool source_line(BodySource *s, char *line, size_t size) {
+    size_t length = 0;
+    for (;;) {
+        while (s->start < s->end) {
+            char c = s->buffer[s->start++];
+            if (c == '\n') {
+                if (length && line[length - 1] == '\r') {
+                    length--;
+                }
+                line[length] = '\0';
+                return true;
+            }
+            if (length + 1 >= size) {
+                return false;
+            }
+            line[length++] = c;
+        }
+        if (!source_fill(s)) {
+            return false;
+        }
+    }
+}
+
+/**
+ * Write exactly length bytes to fd.
+ **/
+static bool write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data   += n;
+        length -= n;
+    }
+    return true;
+}
+
+/**
+ * Move length body bytes from the source to the pipe.
+ *
+ * Buffered bytes are written out first; the remainder is spliced from the
+ * socket, falling back to read and write if splice is not supported.
+ **/
+static bool source_copy(BodySource *s, int fd, off_t length) {
+    size_t buffered = s->end - s->start;
+    if (buffered > (uint64_t)length) {
+        buffered = length;
+    }
+    if (!write_all(fd, s->buffer + s->start, buffered)) {
+        return false;
+    }
+    s->start += buffered;
+    length   -= buffered;
+
+    bool spliceable = true;
+    while (length > 0) {
+        size_t  want = length < BODY_SPLICE ? length : BODY_SPLICE;
+        ssize_t n;
+        if (spliceable) {
+            n = splice(s->fd, NULL, fd, NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n < 0 && errno == EINVAL) {
+                spliceable = false;
+                continue;
+            }
+            if (n < 0 && errno == EAGAIN && coroutine_wait(s->fd, POLLIN, BodyTimeout)) {
+                continue;
+            }
+        } else {
+            if (want > sizeof(s->buffer)) {
+                want = sizeof(s->buffer);
+            }
+            n = coroutine_read(s->fd, s->buffer, want, BodyTimeout);
+            if (n > 0 && !write_all(fd, s->buffer, n)) {
+                return false;
+            }
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            debug("Request body ended early: %s", n < 0 ? strerror(errno) : "EOF");
+            return false;
+        }
+        length -= n;
+    }
+    return true;
+}
+
+/**
+ * Decode a chunked body from the source into the pipe.
+ **/
+static bool source_dechunk(BodySource *s, int fd) {
+    char  line[BODY_LINE];
+    off_t total = 0;
+
+    for (;;) {
+        if (!source_line(s, line, sizeof(line))) {
+            return false;
+        }
+        char *end;
+        errno = 0;
+        long long size = strtoll(line, &end, 16);
+        if (errno || end == line || size < 0 || (*end && *end != ';' && *end != ' ')) {
+            debug("Bad chunk size: %s", line);
+            return false;
+        }
+        if (size == 0) {
+            break;
+        }
+        total += size;
+        if (MaxBodySize > 0 && total > MaxBodySize) {
+            log("Chunked request body exceeds %ld bytes", MaxBodySize);
+            return false;
+        }
+        if (!source_copy(s, fd, size) || !source_line(s, line, sizeof(line)) || *line) {
+            return false;
+        }
+    }
+
+    /* Skip trailer fields up to the blank line */
+    do {
+        if (!source_line(s, line, sizeof(line))) {
+            return false;
+        }
+    } while (*line);
+    return true;
+}
+
+/**
+ * Start feeding the request body to a CGI script.
+ *
+ * @param   r           Request whose headers have been parsed.
+ * @param   fd          Write end of the script's standard input.
+ * @param   length      Content-Length, or -1 for a chunked body.
+ * @param   cgi         Script to kill if the body is malformed or too large.
+ * @return  Feeder pid, or -1 on failure.
+ *
+ * The body bytes already buffered in the request stream are taken out
+ * before forking, so the stream is left positioned just past a
+ * Content-Length body.  A client waiting on Expect: 100-continue is told to
+ * go ahead first.
+ **/
+pid_t body_feed(Request *r, int fd, off_t length, pid_t cgi) {
+    BodySource s = { .fd = r->fd };
+    size_t     pending = stream_pending(r->stream);
+
+    if (length >= 0 && pending > (uint64_t)length) {
+        pending = length;
+    }
+    if (pending > sizeof(s.buffer)) {
+        pending = sizeof(s.buffer);
+    }
+    s.end = fread(s.buffer, 1, pending, r->stream);
+
+    const char *expect = request_header(r, "Expect");
+    if (expect && strcasecmp(expect, "100-continue") == 0 && streq(r->version, "HTTP/1.1")) {
+        static const char Continue[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        if (!write_all(r->fd, Continue, sizeof(Continue) - 1)) {
+            return -1;
+        }
+    }
+
+    pid_t pid = fork();
+    if (pid != 0) {
+        if (pid < 0) {
+            log("Unable to fork body feeder: %s", strerror(errno));
+        }
+        return pid;
+    }
+
+    event_loop_detach();
+    bool fed = length >= 0 ? source_copy(&s, fd, length) : source_dechunk(&s, fd);
+    if (!fed && cgi > 0) {
+        /* Never let a script act on a truncated or oversized body */
+        kill(cgi, SIGKILL);
+    }
+    _exit(fed ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/**
+ * Wait for the body feeder once the script has exited.
+ *
+ * @param   feeder      Feeder pid.
+ * @return  true if the whole body was read from the connection.
+ *
+ * With the script gone the feeder cannot block on the pipe: it either
+ * finishes reading the body from the client (bounded by BodyTimeout) or
+ * fails with EPIPE, in which case the rest of the body is still in the
+ * socket and the connection cannot be reused.
+ **/
+bool body_finish(pid_t feeder) {
+    int   status;
+    pid_t pid;
+
+    do {
+        pid = waitpid(feeder, &status, 0);
+    } while (pid < 0 && errno == EINTR);
+    return pid == feeder && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
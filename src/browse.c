@@ -0,0 +1,330 @@
+/* browse.c: Streaming Directory Listings */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define BROWSE_BATCH    (32 * 1024)     /* Bytes of entries per getdents64 */
+#define BROWSE_SORT_MAX (64 * 1024)     /* Largest listing sorted by default */
+
+/* Internal State */
+
+typedef enum {
+    SORT_AUTO = 0,                      /* Sort if the listing is small */
+    SORT_NAME,                          /* Always sort (reads everything) */
+    SORT_NONE,                          /* Directory order */
+} BrowseSort;
+
+typedef struct {
+    Request    *request;
+    const char *slash;                  /*< "/" if the URI lacks a trailing one */
+    int         fd;                     /*< Directory being listed */
+    bool        json;                   /*< JSON instead of HTML */
+    BrowseSort  sort;
+    long        offset;                 /*< Entries to skip */
+    long        limit;                  /*< Entries to send (0 = all) */
+    long        seen;                   /*< Entries considered so far */
+    long        sent;                   /*< Entries sent so far */
+    bool        more;                   /*< Entries remain past the limit */
+} Browse;
+
+/*
+ * Entries are read with getdents64 in BROWSE_BATCH sized batches and written
+ * as each batch arrives, flushing the stream in between, so the first byte
+ * of a listing goes out after one system call however large the directory
+ * is, and memory use does not grow with it.
+ *
+ * Sorting needs every name first.  By default a listing is sorted (like
+ * scandir with alphasort) when the whole directory fits in BROWSE_SORT_MAX
+ * bytes of entries and is streamed in directory order otherwise; sort=name
+ * and sort=none force either behavior.  Directory order is stable while the
+ * directory is not modified, so offset and limit page through it as well.
+ */
+
+/**
+ * Find a parameter in a query string.
+ *
+ * @param   query       Query string (name=value pairs separated by &).
+ * @param   name        Parameter name.
+ * @return  Start of the value (ending at & or NUL), or NULL if absent.
+ **/
+static const char * query_value(const char *query, const char *name) {
+    size_t length = strlen(name);
+    for (const char *s = query; s && *s; s = strchr(s, '&'), s = s ? s + 1 : NULL) {
+        if (strncmp(s, name, length) == 0 && s[length] == '=') {
+            return s + length + 1;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Check whether a query value equals word.
+ **/
+static bool query_is(const char *value, const char *word) {
+    size_t length = strlen(word);
+    return value && strncmp(value, word, length) == 0 && (value[length] == '&' || value[length] == '\0');
+}
+
+/**
+ * Check whether a query asks for a particular listing.
+ *
+ * @param   query       Query string of the request (may be NULL).
+ * @return  true if it sets offset, limit, format or sort.
+ *
+ * Bundled listings are rendered once, in full, so dispatch_request leaves
+ * these requests to the filesystem.
+ **/
+bool browse_query(const char *query) {
+    return query_value(query, "offset") || query_value(query, "limit") ||
+           query_value(query, "format") || query_value(query, "sort");
+}
+
+/**
+ * Write a string as a JSON string literal.
+ **/
+static void json_string(FILE *stream, const char *s) {
+    fputc('"', stream);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fputc('\\', stream);
+            fputc(c, stream);
+        } else if (c < ' ') {
+            fprintf(stream, "\\u%04x", c);
+        } else {
+            fputc(c, stream);
+        }
+    }
+    fputc('"', stream);
+}
+
+/**
+ * Describe the type of a directory entry for JSON listings.
+ **/
+static const char * entry_type(Browse *b, const struct dirent64 *e) {
+    unsigned char type = e->d_type;
+    struct stat   st;
+
+    /* Not every filesystem fills in d_type */
+    if (type == DT_UNKNOWN && fstatat(b->fd, e->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+    }
+    switch (type) {
+        case DT_DIR: return "directory";
+        case DT_REG: return "file";
+        case DT_LNK: return "symlink";
+        default:     return "other";
+    }
+}
+
+/**
+ * Write one entry if it falls in the requested page.
+ *
+ * @return  false once the page is complete.
+ **/
+static bool browse_entry(Browse *b, const struct dirent64 *e) {
+    Request *r = b->request;
+
+    if (streq(e->d_name, ".")) {
+        return true;
+    }
+    if (b->seen++ < b->offset) {
+        return true;
+    }
+    if (b->limit > 0 && b->sent == b->limit) {
+        b->more = true;
+        return false;
+    }
+
+    if (b->json) {
+        fputs(b->sent ? ",\n{\"name\":" : "\n{\"name\":", r->stream);
+        json_string(r->stream, e->d_name);
+        fprintf(r->stream, ",\"type\":\"%s\"}", entry_type(b, e));
+    } else {
+        fprintf(r->stream, "<li><a href=\"%s%s%s\">%s</a></li>\n", r->uri, b->slash, e->d_name, e->d_name);
+    }
+    b->sent++;
+    return true;
+}
+
+/**
+ * Write the entries of a getdents64 batch in order.
+ *
+ * @return  false once the page is complete.
+ **/
+static bool browse_batch(Browse *b, const char *buffer, size_t length) {
+    for (size_t i = 0; i < length; ) {
+        const struct dirent64 *e = (const struct dirent64 *)(buffer + i);
+        if (!browse_entry(b, e)) {
+            return false;
+        }
+        i += e->d_reclen;
+    }
+    return true;
+}
+
+static int entry_compare(const void *a, const void *b) {
+    return strcoll((*(const struct dirent64 **)a)->d_name, (*(const struct dirent64 **)b)->d_name);
+}
+
+/**
+ * Write buffered entries sorted by name.
+ **/
+static bool browse_sorted(Browse *b, const char *buffer, size_t length) {
+    size_t count = 0;
+    for (size_t i = 0; i < length; i += ((const struct dirent64 *)(buffer + i))->d_reclen) {
+        count++;
+    }
+
+    const struct dirent64 **entries = malloc(count * sizeof(*entries));
+    if (!entries) {
+        return false;
+    }
+    count = 0;
+    for (size_t i = 0; i < length; i += entries[count++]->d_reclen) {
+        entries[count] = (const struct dirent64 *)(buffer + i);
+    }
+    qsort(entries, count, sizeof(*entries), entry_compare);
+
+    for (size_t i = 0; i < count && browse_entry(b, entries[i]); i++);
+    free(entries);
+    return true;
+}
+
+/**
+ * Begin the response once the first batch has been read.
+ **/
+static void browse_start(Browse *b) {
+    Request *r = b->request;
+
+    fprintf(r->stream, "HTTP/1.0 200 OK\r\n");
+    fprintf(r->stream, "Content-Type: %s\r\n", b->json ? "application/json" : "text/html");
+    fprintf(r->stream, "\r\n");
+    if (b->json) {
+        fputs("{\"uri\":", r->stream);
+        json_string(r->stream, r->uri);
+        fprintf(r->stream, ",\"offset\":%ld,\"entries\":[", b->offset);
+    } else {
+        fprintf(r->stream, "<ul>\n");
+    }
+}
+
+/**
+ * End the response, pointing at the next page if there is one.
+ **/
+static void browse_finish(Browse *b) {
+    Request *r    = b->request;
+    long     next = b->offset + b->sent;
+
+    if (b->json) {
+        fputs("\n],\"next\":", r->stream);
+        if (b->more) {
+            fprintf(r->stream, "%ld", next);
+        } else {
+            fputs("null", r->stream);
+        }
+        fputs("}\n", r->stream);
+        return;
+    }
+    fprintf(r->stream, "</ul>\n");
+    if (b->more) {
+        fprintf(r->stream, "<a href=\"%s?offset=%ld&amp;limit=%ld%s\">Next</a>\n", r->uri, next, b->limit,
+                b->sort == SORT_NAME ? "&amp;sort=name" : b->sort == SORT_NONE ? "&amp;sort=none" : "");
+    }
+}
+
+/**
+ * Handle browse request.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   fd          Directory opened by dispatch_request.
+ * @return  Status of the HTTP browse request.
+ *
+ * This lists the contents of a directory in HTML (or JSON with format=json),
+ * streaming it as it is read.  The query may select a page of the listing
+ * with offset and limit, and the order with sort=name or sort=none.
+ *
+ * If the directory cannot be read, then handle error with
+ * HTTP_STATUS_NOT_FOUND.
+ **/
+Status  handle_browse_request(Request *r, int fd) {
+    const char *format = query_value(r->query, "format");
+    const char *sort   = query_value(r->query, "sort");
+    const char *offset = query_value(r->query, "offset");
+    const char *limit  = query_value(r->query, "limit");
+    Browse b = {
+        .request = r,
+        .slash   = r->uri[strlen(r->uri) - 1] == '/' ? "" : "/",
+        .fd      = fd,
+        .json    = query_is(format, "json"),
+        .sort    = query_is(sort, "name") ? SORT_NAME : query_is(sort, "none") ? SORT_NONE : SORT_AUTO,
+        .offset  = offset ? strtol(offset, NULL, 10) : 0,
+        .limit   = limit  ? strtol(limit, NULL, 10)  : 0,
+    };
+    if (b.offset < 0 || b.limit < 0) {
+        return HTTP_STATUS_BAD_REQUEST;
+    }
+
+    /* Entries read before deciding whether to sort stay in one buffer */
+    size_t capacity = b.sort == SORT_NONE ? BROWSE_BATCH : BROWSE_SORT_MAX;
+    size_t length   = 0;
+    char  *buffer   = malloc(capacity);
+    if (!buffer) {
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    ssize_t n = getdents64(fd, buffer, BROWSE_BATCH);
+    if (n < 0) {
+        debug("getdents64 failed: %s", strerror(errno));
+        free(buffer);
+        return HTTP_STATUS_NOT_FOUND;
+    }
+    browse_start(&b);
+    length = n;
+
+    /* Gather entries while they may still be sorted */
+    while (n > 0 && b.sort != SORT_NONE) {
+        if (capacity - length < BROWSE_BATCH) {
+            if (b.sort == SORT_AUTO) {
+                break;
+            }
+            char *grown = realloc(buffer, capacity * 2);
+            if (!grown) {
+                break;
+            }
+            buffer    = grown;
+            capacity *= 2;
+        }
+        n = getdents64(fd, buffer + length, BROWSE_BATCH);
+        length += n > 0 ? n : 0;
+    }
+
+    if (n <= 0 && b.sort != SORT_NONE) {
+        /* Everything has been read: sort it */
+        browse_sorted(&b, buffer, length);
+    } else {
+        /* Too large to sort (or not asked to): stream in directory order */
+        bool more = browse_batch(&b, buffer, length);
+        while (more && fflush(r->stream) == 0 && (n = getdents64(fd, buffer, BROWSE_BATCH)) > 0) {
+            more = browse_batch(&b, buffer, n);
+        }
+        if (n < 0) {
+            debug("getdents64 failed: %s", strerror(errno));
+        }
+    }
+
+    browse_finish(&b);
+    free(buffer);
+    return HTTP_STATUS_OK;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
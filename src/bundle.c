@@ -0,0 +1,157 @@
+/* bundle.c: Memory-mapped static site bundle */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Global Variables */
+Bundle *StaticBundle = NULL;
+
+/**
+ * Check that a string offset lies inside the bundle and is terminated.
+ *
+ * @param   b           Bundle structure.
+ * @param   offset      Offset of string in bundle.
+ * @return  true if the string can be safely read.
+ **/
+static bool bundle_string_valid(const Bundle *b, uint64_t offset) {
+    return offset < b->size && memchr(b->base + offset, '\0', b->size - offset) != NULL;
+}
+
+/**
+ * Open and map a static site bundle.
+ *
+ * @param   path        Path to bundle produced by bin/bundler.
+ * @return  Newly allocated Bundle structure (or NULL on failure).
+ *
+ * The bundle is mapped read-only and shared, so forked children serve from
+ * the parent's mapping.  The header and index are validated once here so
+ * lookups do not need to bounds check.
+ **/
+Bundle * bundle_open(const char *path) {
+    struct stat st;
+    Bundle *b = calloc(1, sizeof(Bundle));
+    if (!b) {
+        debug("Unable to allocate bundle: %s", strerror(errno));
+        return NULL;
+    }
+    b->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (b->fd < 0) {
+        debug("Unable to open %s: %s", path, strerror(errno));
+        goto fail;
+    }
+    if (fstat(b->fd, &st) < 0 || (size_t)st.st_size < sizeof(BundleHeader)) {
+        debug("Invalid bundle %s", path);
+        goto fail;
+    }
+    b->size = st.st_size;
+    b->base = mmap(NULL, b->size, PROT_READ, MAP_SHARED, b->fd, 0);
+    if (b->base == MAP_FAILED) {
+        debug("Unable to mmap %s: %s", path, strerror(errno));
+        b->base = NULL;
+        goto fail;
+    }
+
+    /* Validate header */
+    b->header = (const BundleHeader *)b->base;
+    if (memcmp(b->header->magic, BUNDLE_MAGIC, sizeof(b->header->magic)) != 0 ||
+        b->header->version != BUNDLE_VERSION || b->header->size != b->size ||
+        b->header->index > b->size ||
+        b->header->entries > (b->size - b->header->index) / sizeof(BundleEntry)) {
+        debug("Invalid bundle header in %s", path);
+        goto fail;
+    }
+
+    /* Validate index */
+    b->entries = (const BundleEntry *)(b->base + b->header->index);
+    for (uint64_t i = 0; i < b->header->entries; i++) {
+        const BundleEntry *e = &b->entries[i];
+        if (!bundle_string_valid(b, e->path) || !bundle_string_valid(b, e->mimetype) ||
+            !bundle_string_valid(b, e->etag)) {
+            debug("Invalid bundle entry %lu in %s", (unsigned long)i, path);
+            goto fail;
+        }
+        for (int v = 0; v < BUNDLE_ENCODINGS; v++) {
+            const BundleVariant *var = &e->variants[v];
+            if (var->headers > b->size || var->headers_length > b->size - var->headers ||
+                var->body > b->size || var->length > b->size - var->body) {
+                debug("Invalid bundle variant %lu in %s", (unsigned long)i, path);
+                goto fail;
+            }
+        }
+        if (i > 0 && strcmp(b->base + b->entries[i - 1].path, b->base + e->path) >= 0) {
+            debug("Unsorted bundle index in %s", path);
+            goto fail;
+        }
+    }
+
+    /* Bodies are read through sendfile from here on */
+    posix_madvise((void *)b->base, b->size, POSIX_MADV_RANDOM);
+    return b;
+
+fail:
+    bundle_close(b);
+    return NULL;
+}
+
+/**
+ * Unmap and deallocate bundle.
+ *
+ * @param   b           Bundle structure.
+ **/
+void bundle_close(Bundle *b) {
+    if (!b) {
+        return;
+    }
+    if (b->base) {
+        munmap((void *)b->base, b->size);
+    }
+    if (b->fd >= 0) {
+        close(b->fd);
+    }
+    free(b);
+}
+
+/**
+ * Lookup the entry for a request URI.
+ *
+ * @param   b           Bundle structure.
+ * @param   uri         Request URI (without query).
+ * @return  Matching entry (or NULL if the URI is not in the bundle).
+ *
+ * Trailing slashes are ignored so /html and /html/ map to the same listing.
+ **/
+const BundleEntry * bundle_lookup(const Bundle *b, const char *uri) {
+    size_t length = strlen(uri);
+    while (length > 1 && uri[length - 1] == '/') {
+        length--;
+    }
+
+    size_t lo = 0;
+    size_t hi = b->header->entries;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const char *path = b->base + b->entries[mid].path;
+        int cmp = strncmp(path, uri, length);
+        if (cmp == 0 && path[length] != '\0') {
+            cmp = 1;
+        }
+        if (cmp == 0) {
+            return &b->entries[mid];
+        } else if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
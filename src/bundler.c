@@ -0,0 +1,427 @@
+/* bundler.c: Pack a document root into a static site bundle */
+
+#include "spidey.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+/* Global Variables */
+char *Port	      = "9894";
+char *MimeTypesPath   = "/etc/mime.types";
+char *DefaultMimeType = "text/plain";
+char *RootPath;
+char *root = "www";
+
+/* Bundle Items */
+
+typedef struct {
+    char       *path;                   /*< URI path */
+    char       *mimetype;               /*< Content-Type */
+    char        etag[24];               /*< Quoted ETag */
+    const char *data[BUNDLE_ENCODINGS]; /*< Body of each variant */
+    size_t      length[BUNDLE_ENCODINGS];
+    char       *headers[BUNDLE_ENCODINGS];
+    void       *mapping;                /*< Mapped source file (if any) */
+    char       *owned[BUNDLE_ENCODINGS];/*< Generated bodies to free */
+    BundleEntry entry;                  /*< Index entry being built */
+} Item;
+
+static Item  *Items     = NULL;
+static size_t NItems    = 0;
+static size_t Capacity  = 0;
+static bool   Compress  = false;
+
+/**
+ * Append a new zeroed item for the specified URI path.
+ **/
+Item * item_new(const char *path) {
+    if (NItems == Capacity) {
+        Capacity = Capacity ? Capacity * 2 : 64;
+        Items = realloc(Items, Capacity * sizeof(Item));
+        if (!Items) {
+            fatal("Unable to allocate items: %s", strerror(errno));
+        }
+    }
+    Item *item = &Items[NItems++];
+    memset(item, 0, sizeof(Item));
+    item->path = strdup(path);
+    return item;
+}
+
+/**
+ * Compute ETag from FNV-1a hash of the body.
+ **/
+void item_etag(Item *item) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    const unsigned char *p = (const unsigned char *)item->data[BUNDLE_IDENTITY];
+    for (size_t i = 0; i < item->length[BUNDLE_IDENTITY]; i++) {
+        hash = (hash ^ p[i]) * 0x100000001b3ULL;
+    }
+    snprintf(item->etag, sizeof(item->etag), "\"%016llx\"", (unsigned long long)hash);
+}
+
+/**
+ * Store a gzip variant of the body if it saves at least 10%.
+ **/
+void item_compress(Item *item) {
+    size_t   length = item->length[BUNDLE_IDENTITY];
+    z_stream z      = {0};
+    if (length < 256 || deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return;
+    }
+
+    size_t bound = deflateBound(&z, length);
+    char  *out   = malloc(bound);
+    if (!out) {
+        deflateEnd(&z);
+        return;
+    }
+    z.next_in   = (Bytef *)item->data[BUNDLE_IDENTITY];
+    z.avail_in  = length;
+    z.next_out  = (Bytef *)out;
+    z.avail_out = bound;
+    if (deflate(&z, Z_FINISH) != Z_STREAM_END || z.total_out > length - length / 10) {
+        free(out);
+        deflateEnd(&z);
+        return;
+    }
+    item->data[BUNDLE_GZIP]   = item->owned[BUNDLE_GZIP] = out;
+    item->length[BUNDLE_GZIP] = z.total_out;
+    deflateEnd(&z);
+}
+
+/**
+ * Render the response header block for each variant of the item.
+ **/
+void item_headers(Item *item) {
+    bool gzip = item->data[BUNDLE_GZIP] != NULL;
+    for (int v = 0; v < BUNDLE_ENCODINGS; v++) {
+        if (v == BUNDLE_GZIP && !gzip) {
+            continue;
+        }
+        if (asprintf(&item->headers[v],
+                "HTTP/1.0 200 OK\r\n"
+                "Content-Type: %s\r\n"
+                "Content-Length: %zu\r\n"
+                "ETag: %s\r\n"
+                "%s%s"
+                "\r\n",
+                item->mimetype, item->length[v], item->etag,
+                v == BUNDLE_GZIP ? "Content-Encoding: gzip\r\n" : "",
+                gzip ? "Vary: Accept-Encoding\r\n" : "") < 0) {
+            fatal("Unable to format headers: %s", strerror(errno));
+        }
+    }
+}
+
+/**
+ * Add a directory listing item, rendered the way handle_browse_request does.
+ **/
+void add_listing(const char *uri, struct dirent **entries, int n) {
+    Item  *item = item_new(uri);
+    char  *body = NULL;
+    size_t size = 0;
+    FILE  *fs   = open_memstream(&body, &size);
+    if (!fs) {
+        fatal("Unable to open_memstream: %s", strerror(errno));
+    }
+
+    const char *sl = uri[strlen(uri) - 1] == '/' ? "" : "/";
+    fprintf(fs, "<ul>\n");
+    for (int i = 0; i < n; i++) {
+        if (strcmp(".", entries[i]->d_name) != 0) {
+            fprintf(fs, "<li><a href=\"%s%s%s\">%s</a></li>\n", uri, sl, entries[i]->d_name, entries[i]->d_name);
+        }
+    }
+    fprintf(fs, "</ul>\n");
+    fclose(fs);
+
+    item->mimetype = strdup("text/html");
+    item->data[BUNDLE_IDENTITY]   = item->owned[BUNDLE_IDENTITY] = body;
+    item->length[BUNDLE_IDENTITY] = size;
+}
+
+/**
+ * Add a regular file item, mapping its contents.
+ **/
+void add_file(const char *uri, const char *path, size_t size) {
+    Item *item = item_new(uri);
+
+    item->mimetype = determine_mimetype(uri);
+    if (!item->mimetype) {
+        item->mimetype = strdup(DefaultMimeType);
+    }
+
+    item->length[BUNDLE_IDENTITY] = size;
+    item->data[BUNDLE_IDENTITY]   = "";
+    if (size > 0) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            fatal("Unable to open %s: %s", path, strerror(errno));
+        }
+        item->mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (item->mapping == MAP_FAILED) {
+            fatal("Unable to mmap %s: %s", path, strerror(errno));
+        }
+        item->data[BUNDLE_IDENTITY] = item->mapping;
+    }
+}
+
+/**
+ * Return whether a resolved path is the document root or beneath it.
+ **/
+bool beneath_root(const char *resolved) {
+    size_t length = strlen(RootPath);
+    if (strncmp(resolved, RootPath, length) != 0) {
+        return false;
+    }
+    return resolved[length] == '/' || resolved[length] == '\0' || streq(RootPath, "/");
+}
+
+/**
+ * Recursively collect the directory at path, served as uri.
+ *
+ * Executables are skipped since they are CGI scripts that must run from the
+ * filesystem, as are symlinks that escape the document root.
+ **/
+void collect(const char *path, const char *uri) {
+    struct dirent **entries;
+    int n = scandir(path, &entries, 0, alphasort);
+    if (n < 0) {
+        fatal("Unable to scandir %s: %s", path, strerror(errno));
+    }
+
+    add_listing(uri, entries, n);
+
+    const char *sl = uri[strlen(uri) - 1] == '/' ? "" : "/";
+    for (int i = 0; i < n; i++) {
+        char child[PATH_MAX];
+        char child_uri[PATH_MAX];
+        char resolved[PATH_MAX];
+        struct stat st;
+        const char *name = entries[i]->d_name;
+
+        if (streq(name, ".") || streq(name, "..")) {
+            free(entries[i]);
+            continue;
+        }
+        snprintf(child, sizeof(child), "%s/%s", path, name);
+        snprintf(child_uri, sizeof(child_uri), "%s%s%s", uri, sl, name);
+
+        if (!realpath(child, resolved) || !beneath_root(resolved) ||
+            stat(child, &st) < 0) {
+            log("Skipping %s", child);
+        } else if (S_ISDIR(st.st_mode)) {
+            collect(child, child_uri);
+        } else if (S_ISREG(st.st_mode)) {
+            if ((st.st_mode & S_IXOTH) && access(child, X_OK) == 0) {
+                log("Skipping CGI script %s", child);
+            } else {
+                add_file(child_uri, child, st.st_size);
+            }
+        }
+        free(entries[i]);
+    }
+    free(entries);
+}
+
+int item_compare(const void *a, const void *b) {
+    return strcmp(((const Item *)a)->path, ((const Item *)b)->path);
+}
+
+/**
+ * Write padding so the stream is aligned to the specified boundary.
+ **/
+void pad(FILE *fs, uint64_t offset, uint64_t aligned) {
+    static const char zeros[4096];
+    while (offset < aligned) {
+        size_t n = aligned - offset < sizeof(zeros) ? aligned - offset : sizeof(zeros);
+        fwrite(zeros, 1, n, fs);
+        offset += n;
+    }
+}
+
+/**
+ * Lay out and write the bundle.
+ **/
+void write_bundle(const char *output) {
+    uint64_t page   = sysconf(_SC_PAGESIZE);
+    char    *strings = NULL;
+    size_t   nstrings = 0;
+    FILE    *ss     = open_memstream(&strings, &nstrings);
+    if (!ss) {
+        fatal("Unable to open_memstream: %s", strerror(errno));
+    }
+
+    /* Strings follow the index; record offsets relative to the start */
+    uint64_t base = sizeof(BundleHeader) + NItems * sizeof(BundleEntry);
+    for (size_t i = 0; i < NItems; i++) {
+        Item *item = &Items[i];
+        fflush(ss);
+        item->entry.path = base + nstrings;
+        fprintf(ss, "%s%c", item->path, '\0');
+        fflush(ss);
+        item->entry.mimetype = base + nstrings;
+        fprintf(ss, "%s%c", item->mimetype, '\0');
+        fflush(ss);
+        item->entry.etag = base + nstrings;
+        fprintf(ss, "%s%c", item->etag, '\0');
+        for (int v = 0; v < BUNDLE_ENCODINGS; v++) {
+            if (!item->headers[v]) {
+                continue;
+            }
+            fflush(ss);
+            item->entry.variants[v].headers        = base + nstrings;
+            item->entry.variants[v].headers_length = strlen(item->headers[v]);
+            fprintf(ss, "%s%c", item->headers[v], '\0');
+        }
+    }
+    fclose(ss);
+
+    /* Bodies each start on a page boundary */
+    uint64_t offset = base + nstrings;
+    for (size_t i = 0; i < NItems; i++) {
+        for (int v = 0; v < BUNDLE_ENCODINGS; v++) {
+            if (!Items[i].headers[v]) {
+                continue;
+            }
+            offset = (offset + page - 1) & ~(page - 1);
+            Items[i].entry.variants[v].body   = offset;
+            Items[i].entry.variants[v].length = Items[i].length[v];
+            offset += Items[i].length[v];
+        }
+    }
+
+    BundleHeader header = {
+        .version    = BUNDLE_VERSION,
+        .page_size  = page,
+        .entries    = NItems,
+        .index      = sizeof(BundleHeader),
+        .size       = offset,
+    };
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+
+    FILE *fs = fopen(output, "w");
+    if (!fs) {
+        fatal("Unable to open %s: %s", output, strerror(errno));
+    }
+    fwrite(&header, sizeof(header), 1, fs);
+    for (size_t i = 0; i < NItems; i++) {
+        fwrite(&Items[i].entry, sizeof(BundleEntry), 1, fs);
+    }
+    fwrite(strings, 1, nstrings, fs);
+    offset = base + nstrings;
+    for (size_t i = 0; i < NItems; i++) {
+        for (int v = 0; v < BUNDLE_ENCODINGS; v++) {
+            if (!Items[i].headers[v]) {
+                continue;
+            }
+            pad(fs, offset, Items[i].entry.variants[v].body);
+            fwrite(Items[i].data[v], 1, Items[i].length[v], fs);
+            offset = Items[i].entry.variants[v].body + Items[i].length[v];
+        }
+    }
+    if (fclose(fs) != 0) {
+        fatal("Unable to write %s: %s", output, strerror(errno));
+    }
+    free(strings);
+
+    log("Wrote %zu entries (%llu bytes) to %s", NItems, (unsigned long long)header.size, output);
+}
+
+void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [hmMz] -o bundle [root]\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -m path       Path to mimetypes file\n");
+    fprintf(stderr, "    -M mimetype   Default mimetype\n");
+    fprintf(stderr, "    -o path       Output bundle path\n");
+    fprintf(stderr, "    -z            Store gzip variants of compressible files\n");
+    exit(status);
+}
+
+/**
+ * Pack the document root into a bundle that spidey -b can serve.
+ **/
+int main(int argc, char *argv[]) {
+    char  buffer[PATH_MAX];
+    char *output = NULL;
+
+    int argind = 1;
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
+        char *arg = argv[argind++];
+        if (argind >= argc && arg[1] != 'h' && arg[1] != 'z') {
+            usage(argv[0], EXIT_FAILURE);
+        }
+        switch (arg[1]) {
+            case 'h':
+                usage(argv[0], EXIT_SUCCESS);
+                break;
+            case 'm':
+                MimeTypesPath = argv[argind++];
+                break;
+            case 'M':
+                DefaultMimeType = argv[argind++];
+                break;
+            case 'o':
+                output = argv[argind++];
+                break;
+            case 'z':
+                Compress = true;
+                break;
+            default:
+                usage(argv[0], EXIT_FAILURE);
+                break;
+        }
+    }
+    if (argind < argc) {
+        root = argv[argind++];
+    }
+    if (!output || argind != argc) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+
+    RootPath = realpath(root, buffer);
+    if (!RootPath) {
+        fatal("Unable to resolve root %s: %s", root, strerror(errno));
+    }
+
+    collect(RootPath, "/");
+    qsort(Items, NItems, sizeof(Item), item_compare);
+
+    for (size_t i = 0; i < NItems; i++) {
+        item_etag(&Items[i]);
+        if (Compress) {
+            item_compress(&Items[i]);
+        }
+        item_headers(&Items[i]);
+    }
+
+    write_bundle(output);
+
+    for (size_t i = 0; i < NItems; i++) {
+        if (Items[i].mapping) {
+            munmap(Items[i].mapping, Items[i].length[BUNDLE_IDENTITY]);
+        }
+        for (int v = 0; v < BUNDLE_ENCODINGS; v++) {
+            free(Items[i].owned[v]);
+            free(Items[i].headers[v]);
+        }
+        free(Items[i].path);
+        free(Items[i].mimetype);
+    }
+    free(Items);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,550 @@
+/* coroutine.c: Coroutine HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define COROUTINE_GUARD     4096        /* Inaccessible page below every stack */
+#define COROUTINE_WARM      64          /* Idle stacks kept resident */
+
+/* Context Switching */
+
+/*
+ * On x86-64 a switch saves the callee-saved registers and the floating point
+ * control words on the current stack, stores the stack pointer and loads the
+ * other one: a few nanoseconds and no system call.  Elsewhere swapcontext is
+ * used, which also saves the signal mask with a system call.
+ */
+#if defined(__x86_64__) && !defined(COROUTINE_UCONTEXT)
+
+typedef void *Context;                  /* Stack pointer of a suspended context */
+
+void coroutine_switch(Context *save, Context load);
+
+__asm__(
+    ".text\n"
+    ".globl coroutine_switch\n"
+    ".hidden coroutine_switch\n"
+    ".type coroutine_switch, @function\n"
+    "coroutine_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size coroutine_switch, .-coroutine_switch\n"
+);
+
+/**
+ * Lay out a fresh stack as if coroutine_switch had suspended entry on it.
+ **/
+static void context_init(Context *context, char *bottom, char *top, void (*entry)(void)) {
+    uint64_t *sp = (uint64_t *)((uintptr_t)top & ~(uintptr_t)15);
+
+    *--sp = 0;                          /* Return address of entry (none) */
+    *--sp = (uint64_t)entry;            /* Where coroutine_switch returns */
+    for (int i = 0; i < 6; i++) {
+        *--sp = 0;                      /* rbp, rbx, r12 - r15 */
+    }
+    *--sp = 0x037F00001F80ULL;          /* Default x87 control word and MXCSR */
+    *context = sp;
+}
+
+#define context_switch(save, load)  coroutine_switch((save), *(load))
+
+#else
+
+#include <ucontext.h>
+
+typedef ucontext_t Context;
+
+static void context_init(Context *context, char *bottom, char *top, void (*entry)(void)) {
+    getcontext(context);
+    context->uc_stack.ss_sp   = bottom;
+    context->uc_stack.ss_size = top - bottom;
+    context->uc_link          = NULL;
+    makecontext(context, entry, 0);
+}
+
+#define context_switch(save, load)  swapcontext((save), (load))
+
+#endif
+
+/* Internal State */
+
+struct coroutine {
+    Context     context;                /*< Registers while suspended */
+    void      (*function)(void *);      /*< Body of the coroutine */
+    void       *arg;                    /*< Argument of function */
+    bool        finished;               /*< Function has returned */
+    bool        parked;                 /*< Waiting in coroutine_poll */
+    bool        expired;                /*< Timer fired while parked */
+    Timer       timer;                  /*< Deadline while parked */
+    Coroutine  *next;                   /*< Next idle or waiting coroutine */
+};
+
+static __thread Coroutine *Current = NULL;  /* Running coroutine (NULL in the loop) */
+static Context     Loop;                /* Context that resumed Current */
+
+static Coroutine  *Idle      = NULL;    /* Pooled stacks, most recently used first */
+static size_t      IdleCount = 0;
+static size_t      Stacks    = 0;       /* Stacks mapped */
+
+static size_t      Busy      = 0;       /* Coroutines using the configuration */
+static bool        Reloading = false;   /* Reload waits for Busy to reach 0 */
+static Coroutine  *Waiting   = NULL;    /* Coroutines held back by the reload */
+static Coroutine **WaitingTail = &Waiting;
+
+/*
+ * A coroutine runs on its own small stack, mapped once and reused: the
+ * Coroutine itself sits at the top of the mapping, the stack grows down from
+ * it, and an inaccessible page at the bottom turns an overflow into a crash
+ * rather than silent corruption.  Only the pages a request actually touches
+ * take memory; idle stacks beyond COROUTINE_WARM give theirs back.
+ *
+ * Coroutines are only ever resumed from the event loop's thread, and yield
+ * back to it.  A coroutine waiting for a descriptor is parked: the
+ * descriptor is added to the loop's epoll set (tagged with the coroutine)
+ * and a timer bounds the wait.  Stacks are never unmapped, so an event that
+ * arrives for a coroutine that has moved on is recognised and ignored.
+ */
+
+/**
+ * Start the body of Current on its own stack and return to the loop for good.
+ **/
+static void coroutine_entry(void) {
+    Coroutine *co = Current;
+
+    co->function(co->arg);
+    co->finished = true;
+    context_switch(&co->context, &Loop);
+    abort();
+}
+
+/**
+ * Forget the running coroutine in a forked child, which never yields.
+ **/
+static void coroutine_forked(void) {
+    Current = NULL;
+}
+
+/**
+ * Map a new stack with its Coroutine at the top.
+ **/
+static Coroutine * coroutine_map(void) {
+    char *base = mmap(NULL, CoroutineStack, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (base == MAP_FAILED) {
+        debug("Unable to map coroutine stack: %s", strerror(errno));
+        return NULL;
+    }
+    if (mprotect(base, COROUTINE_GUARD, PROT_NONE) < 0) {
+        debug("Unable to protect coroutine stack: %s", strerror(errno));
+        munmap(base, CoroutineStack);
+        return NULL;
+    }
+    Stacks++;
+    return (Coroutine *)(base + CoroutineStack - sizeof(Coroutine));
+}
+
+/**
+ * Create a coroutine (it runs when first resumed).
+ *
+ * @param   function    Body of the coroutine.
+ * @param   arg         Argument passed to function.
+ * @return  Suspended coroutine, or NULL if no stack could be mapped.
+ **/
+Coroutine * coroutine_create(void (*function)(void *), void *arg) {
+    static bool registered = false;
+    Coroutine  *co = Idle;
+
+    if (!registered) {
+        pthread_atfork(NULL, NULL, coroutine_forked);
+        registered = true;
+    }
+
+    if (co) {
+        Idle = co->next;
+        IdleCount--;
+    } else if (!(co = coroutine_map())) {
+        return NULL;
+    }
+
+    *co = (Coroutine){
+        .function = function,
+        .arg      = arg,
+    };
+    char *base = (char *)co + sizeof(Coroutine) - CoroutineStack;
+    context_init(&co->context, base + COROUTINE_GUARD, (char *)co, coroutine_entry);
+    return co;
+}
+
+/**
+ * Return a finished coroutine's stack to the pool.
+ **/
+static void coroutine_release(Coroutine *co) {
+    if (IdleCount >= COROUTINE_WARM) {
+        /* Keep the mapping (and the Coroutine's page) but drop the stack */
+        char  *base = (char *)co + sizeof(Coroutine) - CoroutineStack;
+        size_t used = ((uintptr_t)co & ~(uintptr_t)(COROUTINE_GUARD - 1)) - (uintptr_t)base;
+        madvise(base + COROUTINE_GUARD, used - COROUTINE_GUARD, MADV_DONTNEED);
+    }
+    co->next = Idle;
+    Idle     = co;
+    IdleCount++;
+}
+
+/**
+ * Apply a reload that was waiting for coroutines, then let them continue.
+ **/
+static void coroutine_reloaded(void) {
+    Reloading = false;
+    server_reload();
+
+    Coroutine *co = Waiting;
+    Waiting     = NULL;
+    WaitingTail = &Waiting;
+    while (co) {
+        Coroutine *next = co->next;
+        coroutine_resume(co);
+        co = next;
+    }
+}
+
+/**
+ * Run a coroutine until it yields or finishes.
+ *
+ * @param   co          Suspended coroutine (only resumed from the loop).
+ * @return  true if it is suspended again, false if it finished (its stack is
+ *          then back in the pool).
+ **/
+bool coroutine_resume(Coroutine *co) {
+    Current = co;
+    context_switch(&Loop, &co->context);
+    Current = NULL;
+
+    bool finished = co->finished;
+    if (finished) {
+        coroutine_release(co);
+    }
+    if (Reloading && Busy == 0) {
+        coroutine_reloaded();
+    }
+    return !finished;
+}
+
+/**
+ * Suspend the running coroutine until the loop resumes it.
+ **/
+void coroutine_yield(void) {
+    Coroutine *co = Current;
+    context_switch(&co->context, &Loop);
+}
+
+/**
+ * Return whether the caller is running in a coroutine.
+ **/
+bool coroutine_running(void) {
+    return Current != NULL;
+}
+
+/**
+ * Resume a parked coroutine whose descriptor is ready.
+ *
+ * Called from the event loop; events that arrive after the coroutine has
+ * stopped waiting (or finished) are ignored.
+ **/
+void coroutine_wake(Coroutine *co) {
+    if (co->parked) {
+        co->parked = false;
+        coroutine_resume(co);
+    }
+}
+
+static void coroutine_expired(Timer *t) {
+    Coroutine *co = (Coroutine *)((char *)t - offsetof(Coroutine, timer));
+    co->expired = true;
+    coroutine_wake(co);
+}
+
+/**
+ * Wait for descriptors like poll, yielding to the loop inside a coroutine.
+ *
+ * @param   fds         Descriptors and events (negative descriptors are skipped).
+ * @param   n           Number of descriptors.
+ * @param   timeout     Milliseconds to wait (negative waits forever).
+ * @return  Number of ready descriptors, 0 on timeout, -1 on error.
+ *
+ * Outside a coroutine this is poll.
+ **/
+int coroutine_poll(struct pollfd *fds, nfds_t n, int timeout) {
+    Coroutine *co = Current;
+    if (!co) {
+        return poll(fds, n, timeout);
+    }
+
+    int ready = poll(fds, n, 0);
+    if (ready != 0 || timeout == 0) {
+        return ready;
+    }
+
+    uint64_t deadline = timeout > 0 ? timer_now() + timeout : 0;
+    for (;;) {
+        uint64_t now = timer_now();
+        if (deadline && now >= deadline) {
+            return 0;
+        }
+
+        nfds_t parked = 0;
+        while (parked < n && (fds[parked].fd < 0 || event_loop_park(co, fds[parked].fd, fds[parked].events))) {
+            parked++;
+        }
+        if (parked == n) {
+            co->timer.callback = coroutine_expired;
+            co->expired = false;
+            co->parked  = true;
+            event_loop_timer(&co->timer, deadline ? (int)(deadline - now) : 0);
+            coroutine_yield();
+            event_loop_timer(&co->timer, 0);
+        }
+        for (nfds_t i = 0; i < parked; i++) {
+            if (fds[i].fd >= 0) {
+                event_loop_unpark(fds[i].fd);
+            }
+        }
+
+        /* A descriptor the loop cannot watch: wait without yielding */
+        if (parked < n) {
+            return poll(fds, n, timeout);
+        }
+        ready = poll(fds, n, 0);
+        if (ready != 0 || co->expired) {
+            return ready;
+        }
+    }
+}
+
+/**
+ * Wait for a descriptor that just failed with EAGAIN.
+ *
+ * @param   fd          Descriptor.
+ * @param   events      POLLIN or POLLOUT.
+ * @param   timeout     Milliseconds to wait (0 waits forever).
+ * @return  true if the operation should be retried, false if it timed out.
+ *
+ * A blocking descriptor only fails with EAGAIN once its SO_RCVTIMEO or
+ * SO_SNDTIMEO has expired, so there is nothing left to wait for.
+ **/
+bool coroutine_wait(int fd, short events, int timeout) {
+    if (!Current && !(fcntl(fd, F_GETFL) & O_NONBLOCK)) {
+        return false;
+    }
+    struct pollfd pfd = {
+        .fd     = fd,
+        .events = events,
+    };
+    int ready = coroutine_poll(&pfd, 1, timeout > 0 ? timeout : -1);
+    if (ready == 0) {
+        errno = EAGAIN;
+    }
+    return ready > 0;
+}
+
+/**
+ * Read from a descriptor as if it were blocking.
+ *
+ * @param   fd          Descriptor.
+ * @param   buffer      Buffer to read into.
+ * @param   size        Size of buffer.
+ * @param   timeout     Milliseconds to wait for data (0 waits forever).
+ * @return  Bytes read, 0 at end of file, -1 on error (EAGAIN on timeout).
+ **/
+ssize_t coroutine_read(int fd, void *buffer, size_t size, int timeout) {
+    for (;;) {
+        ssize_t n = read(fd, buffer, size);
+        if (n >= 0 || (errno != EINTR && !(errno == EAGAIN && coroutine_wait(fd, POLLIN, timeout)))) {
+            return n;
+        }
+    }
+}
+
+/**
+ * Write to a descriptor as if it were blocking (see coroutine_read).
+ *
+ * A blocking socket takes the whole buffer, and stdio takes a short write
+ * as the end of the stream, so this keeps writing until everything is out.
+ **/
+ssize_t coroutine_write(int fd, const void *buffer, size_t size, int timeout) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = write(fd, (const char *)buffer + written, size - written);
+        if (n > 0) {
+            written += n;
+        } else if (n == 0 || (errno != EINTR && !(errno == EAGAIN && coroutine_wait(fd, POLLOUT, timeout)))) {
+            return written > 0 ? (ssize_t)written : n;
+        }
+    }
+    return written;
+}
+
+/**
+ * Make a descriptor non-blocking if it is used from a coroutine.
+ **/
+void coroutine_nonblock(int fd) {
+    if (Current) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+}
+
+/**
+ * Return the number of stacks mapped and the number currently idle.
+ **/
+size_t coroutine_stacks(size_t *idle) {
+    if (idle) {
+        *idle = IdleCount;
+    }
+    return Stacks;
+}
+
+/* Configuration Reloads */
+
+/*
+ * A reload swaps the root and the bundle that handlers read from, so it has
+ * to wait until no coroutine is in the middle of a request.  Coroutines that
+ * want to start meanwhile are held back, so the wait is bounded by the
+ * requests already running.  An HTTP/2 connection waiting for its client
+ * does not count (see coroutine_idle).
+ */
+
+/**
+ * Reload configuration now, or as soon as no coroutine is using it.
+ **/
+void coroutine_reload(void) {
+    if (Busy > 0) {
+        log("Reloading once %zu running requests finish", Busy);
+        Reloading = true;
+        return;
+    }
+    server_reload();
+}
+
+/**
+ * Mark the running coroutine as not using the configuration.
+ **/
+void coroutine_idle(void) {
+    if (Current) {
+        Busy--;
+    }
+}
+
+/**
+ * Mark the running coroutine as using the configuration again, waiting for
+ * a pending reload first.
+ **/
+void coroutine_busy(void) {
+    Coroutine *co = Current;
+    if (!co) {
+        return;
+    }
+    while (Reloading) {
+        co->next     = NULL;
+        *WaitingTail = co;
+        WaitingTail  = &co->next;
+        coroutine_yield();
+    }
+    Busy++;
+}
+
+/* Coroutine HTTP Server */
+
+/**
+ * Handle one request on a connection, then wait for the next or close it.
+ **/
+static void coroutine_task(void *arg) {
+    Request *r = arg;
+
+    coroutine_busy();
+    handle_request(r);
+    bool persistent = r->persistent;    /* Cleared by the reset */
+    if (persistent) {
+        request_reset(r);
+    }
+    coroutine_idle();
+
+    admission_end();
+    if (persistent) {
+        event_loop_resume(r);
+    } else {
+        free_request(r);
+    }
+}
+
+/**
+ * Handle request on a coroutine.
+ *
+ * @param   request     Request whose headers have arrived.
+ * @return  false since the coroutine owns the connection until it is done.
+ **/
+static bool coroutine_dispatch(Request *request) {
+    /* Sockets carry no other status flags worth keeping */
+    fcntl(request->fd, F_SETFL, O_NONBLOCK);
+
+    Coroutine *co = coroutine_create(coroutine_task, request);
+    if (!co) {
+        /* Out of stacks: handle it inline, blocking the loop meanwhile */
+        handle_request(request);
+        if (request->persistent) {
+            request_reset(request);
+            return true;
+        }
+        free_request(request);
+        return false;
+    }
+
+    admission_begin();
+    coroutine_resume(co);
+    return false;
+}
+
+/**
+ * Handle every request on a coroutine of the event loop.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Exit status of server (EXIT_SUCCESS) once drained.
+ *
+ * Handlers keep their straight-line code: whenever one would block on the
+ * client, a CGI pipe or an upstream, its coroutine yields to the loop, which
+ * meanwhile runs the others.  Run one per CPU with -w N -a.
+ **/
+int coroutine_server(int sfd) {
+    log("Handling requests on coroutines with %d KB stacks", CoroutineStack >> 10);
+    return event_loop(sfd, coroutine_dispatch);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
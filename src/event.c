@@ -0,0 +1,732 @@
+/* event.c: Connection Event Loop */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* Global Variables */
+int HeaderTimeout = 10000;
+int BodyTimeout   = 30000;
+int IdleTimeout   = 15000;
+int WriteTimeout  = 30000;
+int DrainTimeout  = 30000;
+int UpstreamTimeout = 30000;
+int CgiTimeout    = 30000;
+
+/* Constants */
+
+#define EVENT_MAX       64              /* Events per epoll_wait */
+#define HEADER_MAX      (2 * BUFSIZ)    /* Largest header block we wait for */
+#define DRAIN_POLL      100             /* Milliseconds between drain checks */
+
+/* Internal State */
+
+static int        EpollFd = -1;
+static TimerWheel Wheel;
+
+/*
+ * Connections waiting for their request headers are kept on a list so a
+ * forked child can close every socket that does not belong to it.
+ */
+static Request    Pending = {.next = &Pending, .prev = &Pending};
+static size_t     PendingCount = 0;
+
+/* Connections closed while handling a batch of events are freed after it,
+ * since later events of the batch may still point at them */
+static Request   *Closing = NULL;
+
+/*
+ * Signals are turned into events through a self-pipe, so reloading, upgrading
+ * and draining all happen between requests rather than inside a handler.
+ */
+static int        SignalPipe[2] = {-1, -1};
+#define SIGNAL_EVENT    ((void *)SignalPipe)
+
+/* Connections on the TLS listener start with a handshake */
+#define TLS_EVENT       ((void *)&TlsSocket)
+
+/* Connections on the UNIX listener may start with a PROXY header */
+#define UNIX_EVENT      ((void *)&UnixSocket)
+
+/* A hybrid server's task pool reports finished requests through WatchFd */
+static int        WatchFd = -1;
+static void     (*WatchCallback)(void) = NULL;
+#define WATCH_EVENT     ((void *)&WatchFd)
+
+/* Coroutines parked on a descriptor are tagged in the low bit */
+#define PARKED_TAG      ((uintptr_t)1)
+
+/* Only the thread running the loop may touch Pending */
+static __thread bool LoopThread = false;
+
+static bool       Draining = false;
+static bool       Stopped  = false;
+static Timer      DrainTimer;
+
+/**
+ * Parse timeout specification.
+ *
+ * @param   spec        Comma separated name=seconds pairs, where name is one
+ *                      of header, body, idle, write, drain, upstream, or
+ *                      cgi (0 disables).
+ * @return  true if parsing was successful, false if there was an error.
+ **/
+bool parse_timeouts(char *spec) {
+    for (char *pair = strtok(spec, ","); pair; pair = strtok(NULL, ",")) {
+        char *value = strchr(pair, '=');
+        char *end;
+        if (!value) {
+            return false;
+        }
+        *value++ = '\0';
+        double seconds = strtod(value, &end);
+        if (*end || end == value || seconds < 0) {
+            return false;
+        }
+
+        int ms = (int)(seconds * 1000);
+        if (streq(pair, "header")) {
+            HeaderTimeout = ms;
+        } else if (streq(pair, "body")) {
+            BodyTimeout = ms;
+        } else if (streq(pair, "idle")) {
+            IdleTimeout = ms;
+        } else if (streq(pair, "write")) {
+            WriteTimeout = ms;
+        } else if (streq(pair, "drain")) {
+            DrainTimeout = ms;
+        } else if (streq(pair, "upstream")) {
+            UpstreamTimeout = ms;
+        } else if (streq(pair, "cgi")) {
+            CgiTimeout = ms;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Set a blocking socket timeout (SO_RCVTIMEO or SO_SNDTIMEO).
+ **/
+static void socket_timeout(int fd, int option, int ms) {
+    struct timeval tv = {
+        .tv_sec  = ms / 1000,
+        .tv_usec = (ms % 1000) * 1000,
+    };
+    if (setsockopt(fd, SOL_SOCKET, option, &tv, sizeof(tv)) < 0) {
+        debug("Unable to set socket timeout: %s", strerror(errno));
+    }
+}
+
+static void pending_remove(Request *r) {
+    PendingCount--;
+    r->prev->next = r->next;
+    r->next->prev = r->prev;
+    r->next = r->prev = NULL;
+}
+
+/**
+ * Close connection that missed its deadline.
+ **/
+static void request_expired(Timer *t) {
+    Request *r = (Request *)((char *)t - offsetof(Request, timer));
+
+    log("Timed out waiting for request from %s:%s", request_host(r), request_port(r));
+    epoll_ctl(EpollFd, EPOLL_CTL_DEL, r->fd, NULL);
+    pending_remove(r);
+    free_request(r);
+}
+
+/**
+ * Start waiting for request headers on a connection.
+ *
+ * @param   r           Request structure.
+ * @param   timeout     Deadline in milliseconds (0 for none).
+ * @return  true if the connection is now being waited on.
+ **/
+static bool request_wait(Request *r, int timeout) {
+    struct epoll_event event = {
+        .events   = EPOLLIN | EPOLLRDHUP,
+        .data.ptr = r,
+    };
+    if (epoll_ctl(EpollFd, EPOLL_CTL_ADD, r->fd, &event) < 0) {
+        debug("Unable to add to epoll: %s", strerror(errno));
+        return false;
+    }
+
+    r->next            = &Pending;
+    r->prev            = Pending.prev;
+    Pending.prev->next = r;
+    Pending.prev       = r;
+    PendingCount++;
+
+    r->timer.callback = request_expired;
+    if (timeout > 0) {
+        timer_add(&Wheel, &r->timer, timeout);
+    }
+    return true;
+}
+
+/**
+ * Stop waiting on connection and hand it back to the caller.
+ **/
+static void request_ready(Request *r) {
+    r->idle = false;
+    epoll_ctl(EpollFd, EPOLL_CTL_DEL, r->fd, NULL);
+    timer_cancel(&Wheel, &r->timer);
+    pending_remove(r);
+
+    /* Bound every blocking read and write made while handling the request */
+    socket_timeout(r->fd, SO_RCVTIMEO, BodyTimeout);
+    socket_timeout(r->fd, SO_SNDTIMEO, WriteTimeout);
+}
+
+/**
+ * Check whether the complete header block has arrived.
+ *
+ * @param   r           Request structure.
+ * @param   hangup      Whether the peer has shut down its side.
+ * @param   status      Set when the connection is to be turned away: 431 if
+ *                      the header block is larger than HEADER_MAX, 400 if
+ *                      the peer hung up before finishing it.
+ * @return  1 if ready to dispatch, 0 to keep waiting, -1 to drop connection,
+ *          -2 to turn it away with status.
+ *
+ * The socket is only peeked at, so the request parser later reads the same
+ * bytes through the request stream.  Only complete header blocks are
+ * dispatched, so the parser never waits on the client.  A request line
+ * without an HTTP version (HTTP/0.9, or garbage) has no headers after
+ * it, and a header line without a colon can never end well, so either is
+ * dispatched at once for the parser to serve or answer with 400.
+ **/
+static int request_complete(Request *r, bool hangup, Status *status) {
+    char buffer[HEADER_MAX + 1];
+    char version[9];
+    ssize_t n = recv(r->fd, buffer, HEADER_MAX, MSG_PEEK | MSG_DONTWAIT);
+    if (n < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+    if (n == 0) {
+        return -1;
+    }
+    buffer[n] = '\0';
+    if (strstr(buffer, "\r\n\r\n") || strstr(buffer, "\n\n")) {
+        return 1;
+    }
+
+    char *eol = strchr(buffer, '\n');
+    if (eol) {
+        *eol = '\0';
+        if (sscanf(buffer, "%*s %*s %8s", version) != 1 || strncmp(version, "HTTP/", 5) != 0) {
+            return 1;
+        }
+        for (char *line = eol + 1; (eol = strchr(line, '\n')); line = eol + 1) {
+            if (!memchr(line, ':', eol - line)) {
+                return 1;
+            }
+        }
+    }
+    if (n == HEADER_MAX) {
+        *status = HTTP_STATUS_HEADER_FIELDS_TOO_LARGE;
+        return -2;
+    }
+    if (hangup) {
+        *status = HTTP_STATUS_BAD_REQUEST;
+        return -2;
+    }
+    return 0;
+}
+
+/**
+ * Turn away a connection whose header block will never be dispatched.
+ **/
+static void request_reject(Request *r, Status status) {
+    char buffer[BUFSIZ];
+
+    log("Rejecting header block from %s:%s: %s", request_host(r), request_port(r), http_status_string(status));
+    if (request_attach(r)) {
+        handle_error(r, status);
+        fflush(r->stream);
+    }
+    /* Drain what already arrived so close sends FIN, not RST */
+    while (recv(r->fd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0);
+}
+
+/**
+ * Advance the TLS handshake of a connection still waiting for its headers.
+ *
+ * @param   r           Request with a handshake in progress.
+ *
+ * Once the handshake is done the connection is offloaded (which may replace
+ * its socket) and waits for its headers for the rest of HeaderTimeout.
+ **/
+static void request_handshake(Request *r) {
+    int status = tls_handshake(r);
+    if (status == 0) {
+        return;
+    }
+
+    uint64_t elapsed = timer_now() - r->accepted;
+    request_ready(r);
+    if (status < 0 || !tls_offload(r)) {
+        free_request(r);
+        return;
+    }
+
+    int timeout = 0;
+    if (HeaderTimeout > 0) {
+        timeout = elapsed < (uint64_t)HeaderTimeout ? HeaderTimeout - elapsed : 1;
+    }
+    if (!request_wait(r, timeout)) {
+        free_request(r);
+    }
+}
+
+/**
+ * Accept every connection waiting on a listening socket.
+ *
+ * @param   fd          Listening socket.
+ * @param   tls         Whether connections start with a TLS handshake.
+ *
+ * The accept queue is drained so waiting connections are visible to
+ * admission control (turning away any over the limits).  Workers share the
+ * UNIX listener, so another may have taken its connections first.
+ **/
+static void event_accept(int fd, bool tls) {
+    while (!admission_shed(fd, PendingCount)) {
+        Request *request = accept_request(fd);
+        if (!request) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log("Unable to accept request: %s", strerror(errno));
+            }
+            break;
+        }
+        if (tls && !tls_accept(request)) {
+            free_request(request);
+            continue;
+        }
+        request->local = fd == UnixSocket;
+        request->accepted = timer_now();
+        if (!request_wait(request, HeaderTimeout)) {
+            free_request(request);
+        }
+    }
+}
+
+/**
+ * Close every connection this process inherited from the event loop.
+ *
+ * Forked children call this so that sockets they do not own are closed as
+ * soon as the parent is done with them.  Reload and upgrade signals are meant
+ * for the event loop, so a child ignores them and just finishes its request.
+ **/
+void event_loop_detach(void) {
+    /* A child forked by a hybrid server's task thread may have caught the
+     * list mid-update: its inherited sockets close when it exits instead */
+    while (LoopThread && Pending.next != &Pending) {
+        Request *r = Pending.next;
+        pending_remove(r);
+        close(r->fd);
+    }
+    if (EpollFd >= 0) {
+        close(EpollFd);
+        EpollFd = -1;
+    }
+
+    signal(SIGHUP,  SIG_IGN);
+    signal(SIGUSR2, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    for (int i = 0; i < 2; i++) {
+        if (SignalPipe[i] >= 0) {
+            close(SignalPipe[i]);
+            SignalPipe[i] = -1;
+        }
+    }
+}
+
+/**
+ * Forward signal to the event loop.
+ **/
+static void event_signal(int signum) {
+    int           saved = errno;
+    unsigned char c     = signum;
+    if (write(SignalPipe[1], &c, 1) < 0) {
+        /* Pipe full: the same signal is already queued */
+    }
+    errno = saved;
+}
+
+/**
+ * Stop the event loop once the drain deadline passes.
+ **/
+static void event_drain_expired(Timer *t) {
+    log("Drain deadline reached with %zu waiting and %zu active requests",
+        PendingCount, admission_active());
+    Stopped = true;
+}
+
+/**
+ * Stop accepting connections and finish the ones already accepted.
+ *
+ * @param   sfd         Server socket file descriptor.
+ *
+ * Connections still waiting for their first request are served; idle
+ * keep-alive connections are closed right away.  The loop returns once
+ * nothing is left or DrainTimeout expires.
+ **/
+static void event_drain(int sfd) {
+    if (Draining) {
+        return;
+    }
+    Draining = true;
+
+    if (sfd >= 0) {
+        epoll_ctl(EpollFd, EPOLL_CTL_DEL, sfd, NULL);
+        close(sfd);
+    }
+    if (TlsSocket >= 0) {
+        epoll_ctl(EpollFd, EPOLL_CTL_DEL, TlsSocket, NULL);
+        close(TlsSocket);
+        TlsSocket = -1;
+    }
+    if (UnixSocket >= 0) {
+        epoll_ctl(EpollFd, EPOLL_CTL_DEL, UnixSocket, NULL);
+        close(UnixSocket);
+        UnixSocket = -1;
+    }
+
+    for (Request *r = Pending.next, *next; r != &Pending; r = next) {
+        next = r->next;
+        if (!r->accepted) {
+            epoll_ctl(EpollFd, EPOLL_CTL_DEL, r->fd, NULL);
+            timer_cancel(&Wheel, &r->timer);
+            pending_remove(r);
+            r->closing = true;
+            r->next    = Closing;
+            Closing    = r;
+        }
+    }
+
+    DrainTimer.callback = event_drain_expired;
+    if (DrainTimeout > 0) {
+        timer_add(&Wheel, &DrainTimer, DrainTimeout);
+    }
+    log("Draining %zu waiting and %zu active requests", PendingCount, admission_active());
+}
+
+/**
+ * Act on signals forwarded through the self-pipe.
+ *
+ * SIGHUP reloads configuration, SIGUSR2 starts a new binary on the same
+ * listening socket, and SIGQUIT drains this server.
+ **/
+static void event_signals(int sfd) {
+    unsigned char signals[16];
+    ssize_t       n;
+
+    while ((n = read(SignalPipe[0], signals, sizeof(signals))) > 0) {
+        for (ssize_t i = 0; i < n; i++) {
+            switch (signals[i]) {
+                case SIGHUP:
+                    /* Swap configuration while no task is using it */
+                    hybrid_pause();
+                    coroutine_reload();
+                    hybrid_resume();
+                    break;
+                case SIGUSR2:
+                    if (!Draining) {
+                        server_upgrade(sfd);
+                    }
+                    break;
+                case SIGQUIT:
+                    event_drain(sfd);
+                    break;
+            }
+        }
+    }
+}
+
+/**
+ * Route reload, upgrade and drain signals through the self-pipe.
+ **/
+static void event_signals_init(void) {
+    if (pipe2(SignalPipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        fatal("Unable to create signal pipe: %s", strerror(errno));
+    }
+    struct epoll_event event = {
+        .events   = EPOLLIN,
+        .data.ptr = SIGNAL_EVENT,
+    };
+    if (epoll_ctl(EpollFd, EPOLL_CTL_ADD, SignalPipe[0], &event) < 0) {
+        fatal("Unable to add signal pipe to epoll: %s", strerror(errno));
+    }
+
+    struct sigaction action = {
+        .sa_handler = event_signal,
+        .sa_flags   = SA_RESTART,
+    };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGHUP,  &action, NULL);
+    sigaction(SIGUSR2, &action, NULL);
+    sigaction(SIGQUIT, &action, NULL);
+}
+
+/**
+ * Watch a descriptor from the event loop.
+ *
+ * @param   fd          Descriptor to watch for input.
+ * @param   callback    Called from the loop whenever fd is readable.
+ * @return  true (the descriptor is registered when the loop starts).
+ *
+ * Only one descriptor can be watched; a hybrid server uses it to learn that
+ * its task pool has finished requests.
+ **/
+bool event_loop_watch(int fd, void (*callback)(void)) {
+    WatchFd       = fd;
+    WatchCallback = callback;
+    return true;
+}
+
+/**
+ * Wait for the next request on a connection a dispatcher handed back.
+ *
+ * @param   r           Request whose response is done (already reset).
+ *
+ * The connection is closed instead if the server is draining.  Dispatchers
+ * that return true get this done for them.
+ **/
+void event_loop_resume(Request *r) {
+    /* Time spent idle on a kept-alive connection is not queueing */
+    r->accepted = 0;
+    request_detach(r);
+    if (Draining || !request_wait(r, IdleTimeout)) {
+        free_request(r);
+        return;
+    }
+    r->idle = true;
+}
+
+/**
+ * Wake a coroutine once a descriptor is ready.
+ *
+ * @param   co          Coroutine to pass to coroutine_wake.
+ * @param   fd          Descriptor not otherwise watched by the loop.
+ * @param   events      POLLIN and/or POLLOUT (the same bits as EPOLLIN and
+ *                      EPOLLOUT).
+ * @return  true if the descriptor is being watched until event_loop_unpark.
+ **/
+bool event_loop_park(Coroutine *co, int fd, short events) {
+    struct epoll_event event = {
+        .events   = (uint16_t)events,
+        .data.ptr = (void *)((uintptr_t)co | PARKED_TAG),
+    };
+    return epoll_ctl(EpollFd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+void event_loop_unpark(int fd) {
+    epoll_ctl(EpollFd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/**
+ * Arm a timer on the loop's wheel (0 disarms it).
+ **/
+void event_loop_timer(Timer *t, int timeout) {
+    if (timeout > 0) {
+        timer_add(&Wheel, t, timeout);
+    } else {
+        timer_cancel(&Wheel, t);
+    }
+}
+
+/**
+ * Accept connections and dispatch each one once its headers have arrived.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @param   dispatch    Called with each request whose headers are complete;
+ *                      returns true if the connection should wait for another
+ *                      request (keep-alive), false if it took ownership.
+ * @return  Exit status of server (EXIT_SUCCESS) once drained.
+ *
+ * A client that connects and then sends its headers slowly (or not at all)
+ * only costs an epoll registration and a timer until HeaderTimeout expires,
+ * so it can no longer stall a single server or pin a forked process.
+ **/
+int event_loop(int sfd, Dispatcher dispatch) {
+    struct epoll_event events[EVENT_MAX];
+
+    EpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (EpollFd < 0) {
+        fatal("Unable to epoll_create1: %s", strerror(errno));
+    }
+    struct epoll_event event = {
+        .events   = EPOLLIN,
+        .data.ptr = NULL,
+    };
+    if (sfd >= 0) {
+        if (epoll_ctl(EpollFd, EPOLL_CTL_ADD, sfd, &event) < 0) {
+            fatal("Unable to add server socket to epoll: %s", strerror(errno));
+        }
+        if (fcntl(sfd, F_SETFL, fcntl(sfd, F_GETFL) | O_NONBLOCK) < 0) {
+            fatal("Unable to make server socket non-blocking: %s", strerror(errno));
+        }
+    }
+    if (TlsSocket >= 0) {
+        event.data.ptr = TLS_EVENT;
+        if (epoll_ctl(EpollFd, EPOLL_CTL_ADD, TlsSocket, &event) < 0) {
+            fatal("Unable to add TLS socket to epoll: %s", strerror(errno));
+        }
+        if (fcntl(TlsSocket, F_SETFL, fcntl(TlsSocket, F_GETFL) | O_NONBLOCK) < 0) {
+            fatal("Unable to make TLS socket non-blocking: %s", strerror(errno));
+        }
+    }
+    if (UnixSocket >= 0) {
+        /* Shared by every worker: wake only one of them per connection */
+        struct epoll_event shared = {
+            .events   = EPOLLIN | (Workers > 0 ? EPOLLEXCLUSIVE : 0),
+            .data.ptr = UNIX_EVENT,
+        };
+        if (epoll_ctl(EpollFd, EPOLL_CTL_ADD, UnixSocket, &shared) < 0) {
+            fatal("Unable to add UNIX socket to epoll: %s", strerror(errno));
+        }
+        if (fcntl(UnixSocket, F_SETFL, fcntl(UnixSocket, F_GETFL) | O_NONBLOCK) < 0) {
+            fatal("Unable to make UNIX socket non-blocking: %s", strerror(errno));
+        }
+    }
+    if (WatchFd >= 0) {
+        event.data.ptr = WATCH_EVENT;
+        if (epoll_ctl(EpollFd, EPOLL_CTL_ADD, WatchFd, &event) < 0) {
+            fatal("Unable to add watched descriptor to epoll: %s", strerror(errno));
+        }
+    }
+    timer_wheel_init(&Wheel, timer_now());
+    event_signals_init();
+    LoopThread = true;
+
+    /* Tell the server we are replacing (if any) that it can drain now */
+    upgrade_complete();
+
+    while (!Stopped) {
+        /* Forked children finish without an event: poll for them */
+        int timeout = timer_wheel_timeout(&Wheel);
+        if (Draining && (timeout < 0 || timeout > DRAIN_POLL)) {
+            timeout = DRAIN_POLL;
+        }
+
+        int n = epoll_wait(EpollFd, events, EVENT_MAX, timeout);
+        if (n < 0 && errno != EINTR) {
+            fatal("Unable to epoll_wait: %s", strerror(errno));
+        }
+
+        for (int i = 0; i < n; i++) {
+            Request *request = events[i].data.ptr;
+
+            if ((uintptr_t)request & PARKED_TAG) {
+                coroutine_wake((Coroutine *)((uintptr_t)request & ~PARKED_TAG));
+                continue;
+            }
+
+            if (request == SIGNAL_EVENT) {
+                event_signals(sfd);
+                continue;
+            }
+
+            if (request == WATCH_EVENT) {
+                WatchCallback();
+                continue;
+            }
+
+            if (!request || request == TLS_EVENT) {
+                event_accept(request ? TlsSocket : sfd, request != NULL);
+                continue;
+            }
+
+            if (request == UNIX_EVENT) {
+                event_accept(UnixSocket, false);
+                continue;
+            }
+
+            /* Closed earlier in this batch (see event_drain) */
+            if (request->closing) {
+                continue;
+            }
+
+            /* Finish the TLS handshake before looking for headers */
+            if (request->ssl) {
+                request_handshake(request);
+                continue;
+            }
+
+            /* Take the client address from a PROXY header first */
+            int    status = request->local ? request_proxy(request) : 1;
+            Status reject;
+
+            /* Dispatch request once its headers are complete */
+            if (status > 0) {
+                status = request_complete(request, events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR), &reject);
+            }
+            if (status == -2) {
+                request_ready(request);
+                request_reject(request, reject);
+                free_request(request);
+            } else if (status < 0) {
+                request_ready(request);
+                free_request(request);
+            } else if (status == 0 && request->idle) {
+                /* A request has begun: the rest of its headers get
+                 * HeaderTimeout, not whatever is left of IdleTimeout */
+                request->idle = false;
+                if (HeaderTimeout > 0) {
+                    timer_add(&Wheel, &request->timer, HeaderTimeout);
+                } else {
+                    timer_cancel(&Wheel, &request->timer);
+                }
+            } else if (status > 0) {
+                request_ready(request);
+                if (!request_attach(request)) {
+                    free_request(request);
+                    continue;
+                }
+                if (request->accepted) {
+                    uint64_t now = timer_now();
+                    admission_sample(now - request->accepted, now, PendingCount);
+                }
+                if (dispatch(request)) {
+                    event_loop_resume(request);
+                }
+            }
+        }
+
+        while (Closing) {
+            Request *r = Closing;
+            Closing = r->next;
+            free_request(r);
+        }
+
+        timer_advance(&Wheel, timer_now());
+
+        if (Draining && PendingCount == 0 && admission_active() == 0) {
+            Stopped = true;
+        }
+    }
+
+    /* Close whatever missed the drain deadline */
+    while (Pending.next != &Pending) {
+        Request *r = Pending.next;
+        pending_remove(r);
+        free_request(r);
+    }
+    log("Drained: exiting");
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
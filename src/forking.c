@@ -6,48 +6,117 @@
 #include <signal.h>
 #include <string.h>
 
+#include <sys/wait.h>
 #include <unistd.h>
 
 /**
- * Fork incoming HTTP requests to handle the concurrently.
- *
- * @param   sfd         Server socket file descriptor.
- * @return  Exit status of server (EXIT_SUCCESS).
- *
- * The parent should accept a request and then fork off and let the child
- * handle the request.
+ * Reap finished request children so admission control knows how many are
+ * running (every other child is reaped where it is forked).
  **/
-int forking_server(int sfd) {
-    /* Accept and handle HTTP request */
+static void forking_reap(int signum) {
+    int saved = errno;
+    while (waitpid(-1, NULL, WNOHANG) > 0) {
+        admission_end();
+    }
+    errno = saved;
+}
 
-    signal(SIGCHLD, SIG_IGN);
+/**
+ * Fork off a child to handle request.
+ *
+ * @param   request     Request whose headers have arrived.
+ * @return  false since the child owns the connection.
+ **/
+static bool forking_dispatch(Request *request) {
+    // fork stuff
+    pid_t pid = fork();
+    if(pid == 0){      // child
+        debug("Handle child connection");
+        signal(SIGCHLD, SIG_DFL);
+        event_loop_detach();
+        worker_unpin();
+        handle_request(request);
+        /* Serve the rest of a persistent connection in this child */
+        while (request->persistent) {
+            request_reset(request);
+            if (!request_await(request, IdleTimeout)) {
+                break;
+            }
+            handle_request(request);
+        }
+        free_request(request);
+        exit(EXIT_SUCCESS);
+    }
+    else               // parent
+    {
+        if (pid < 0)
+            log("Unable to fork: %s", strerror(errno));
+        else
+            admission_begin();
+        free_request(request);
+    }
+    return false;
+}
 
+/**
+ * Fork a process that is not a child of this one.
+ *
+ * @return  0 in the new process, 1 in this one, -1 on failure.
+ *
+ * The new process is started from an intermediate child, so it may outlive
+ * this one.  SIGCHLD stays blocked until the intermediate child has been
+ * reaped here, so forking_reap never counts it as a finished request.
+ **/
+int fork_detached(void) {
+    sigset_t chld, saved;
+    int      status = 0;
 
-    while (true) {
-        /* Accept request */
-        Request *request = accept_request(sfd);
-        if(!request){
-            log("Unable to accept request: %s" , strerror(errno));
-            continue;
-        }
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &saved);
 
-        // fork stuff
-        pid_t pid = fork();
-        if(pid == 0){      // child
-            debug("Handle child connection");
-            handle_request(request);
-            free_request(request);
-            exit(EXIT_SUCCESS);
-        }
-        else               // parent
-        {
-            free_request(request);
+    pid_t child = fork();
+    if (child == 0) {
+        pid_t grandchild = fork();
+        if (grandchild != 0) {
+            if (grandchild < 0) {
+                log("Unable to fork: %s", strerror(errno));
+            }
+            _exit(grandchild < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
         }
+        sigprocmask(SIG_SETMASK, &saved, NULL);
+        return 0;
+    }
+    if (child < 0) {
+        log("Unable to fork: %s", strerror(errno));
+    } else {
+        while (waitpid(child, &status, 0) < 0 && errno == EINTR);
+    }
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+    return child > 0 && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS ? 1 : -1;
+}
 
+/**
+ * Fork incoming HTTP requests to handle the concurrently.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * The parent waits for each connection's headers in the event loop and only
+ * then forks off a child to handle the request, so slow clients do not pile
+ * up as processes.
+ **/
+int forking_server(int sfd) {
+    struct sigaction action = {
+        .sa_handler = forking_reap,
+        .sa_flags   = SA_NOCLDSTOP | SA_RESTART,
+    };
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGCHLD, &action, NULL) < 0) {
+        fatal("Unable to install SIGCHLD handler: %s", strerror(errno));
     }
 
-    /* Close server socket */
-    return EXIT_SUCCESS;
+    return event_loop(sfd, forking_dispatch);
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
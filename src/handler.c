@@ -6,15 +6,23 @@
 #include <limits.h>
 #include <string.h>
 
-#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+/* Constants */
+#define CGI_HEADER_MAX  (2 * BUFSIZ)    /* Largest CGI header block */
+
 /* Internal Declarations */
-Status handle_browse_request(Request *request);
-Status handle_file_request(Request *request);
-Status handle_cgi_request(Request *request);
-Status handle_error(Request *request, Status status);
+Status dispatch_request(Request *request);
+Status handle_bundle_request(Request *request);
+Status handle_file_request(Request *request, int fd, const struct stat *stats);
+Status handle_cgi_request(Request *request, int fd);
+Status handle_cgi_response(Request *request, int fd, pid_t pid, Microcache *cache);
 
 /**
  * Handle HTTP Request.
@@ -22,139 +30,236 @@ Status handle_error(Request *request, Status status);
  * @param   r           HTTP Request structure
  * @return  Status of the HTTP request.
  *
- * This parses a request, determines the request path, determines the request
- * type, and then dispatches to the appropriate handler type.
+ * This wraps dispatch_request with the request_start and request_done probes
+ * and, when the request is sampled, writes its phases to the trace file.
+ **/
+Status  handle_request(Request *r) {
+    trace_request();
+    PROBE1(request_start, r->fd);
+    Status result = dispatch_request(r);
+    PROBE1(request_done, result);
+    trace_finish(r, result);
+    return result;
+}
+
+/**
+ * Dispatch HTTP Request.
+ *
+ * @param   r           HTTP Request structure
+ * @return  Status of the HTTP request.
+ *
+ * This parses a request, opens the resource beneath the root, determines the
+ * request type from the open descriptor, and then dispatches to the
+ * appropriate handler type with that descriptor.
  *
  * On error, handle_error should be used with an appropriate HTTP status code.
  **/
-Status  handle_request(Request *r) {
+Status  dispatch_request(Request *r) {
     Status result;
 
-    /* Parse request */
-    int c = parse_request(r);
-    if (c < 0)
-    {
-        debug("Failed to parse request");
-        return handle_error(r, HTTP_STATUS_BAD_REQUEST);
+    /* Parse request (HTTP/2 streams arrive already parsed and are traced
+     * individually, not as one connection) */
+    if (!r->method) {
+        if (http2_preface(r)) {
+            trace_discard();
+            return http2_serve(r);
+        }
+
+        /* Clients over their rate limit are turned away after the request
+         * line, before any header is parsed */
+        TRACE_BEGIN(parse);
+        int c = parse_request_method(r);
+        if (c == 0 && !rate_admit(r)) {
+            TRACE_END1(parse, c);
+            return rate_reject(r);
+        }
+        if (c == 0) {
+            c = parse_request_headers(r);
+        }
+        TRACE_END1(parse, c);
+        if (c < 0)
+        {
+            debug("Failed to parse request");
+            return handle_error(r, HTTP_STATUS_BAD_REQUEST);
+        }
+
+        if (http2_upgradable(r)) {
+            trace_discard();
+            return http2_upgrade(r);
+        }
+
+        off_t length;
+        int   body = request_body(r, &length);
+        if (body < 0) {
+            debug("Bad request body framing");
+            return handle_error(r, HTTP_STATUS_BAD_REQUEST);
+        }
+        if (MaxBodySize > 0 && length > MaxBodySize) {
+            log("Request body of %lld bytes exceeds %ld", (long long)length, MaxBodySize);
+            return handle_error(r, HTTP_STATUS_PAYLOAD_TOO_LARGE);
+        }
+    } else if (!rate_admit(r)) {
+        return rate_reject(r);
+    }
+
+    /* Answer the request class statistics */
+    if (schedule_routed(r->uri)) {
+        result = schedule_status(r);
+        log("HTTP REQUEST STATUS: %s", http_status_string(result));
+        return result;
+    }
+
+    /* Forward to an upstream when the URI is under a proxied prefix */
+    if (proxy_routed(r->uri)) {
+        TRACE_BEGIN(proxy);
+        result = proxy_request(r);
+        TRACE_END1(proxy, result);
+        log("HTTP REQUEST STATUS: %s", http_status_string(result));
+        return result == HTTP_STATUS_OK ? result : handle_error(r, result);
     }
 
     /* Determine request path */
     debug("---URI-----: %s", r->uri);
     debug("---QUERY---: %s", r->query);
-    if (r->query) r->uri = strtok(r->uri, "?");
-
-    if (strcmp(r->uri, "/favicon.ico") == 0){
-        r->path = determine_request_path("/");
+    if (r->query) *strchrnul(r->uri, '?') = '\0';
+
+    /* Call the plugin serving the URI's prefix, if any, in this process */
+    if (plugin_routed(r->uri)) {
+        TRACE_BEGIN(plugin);
+        result = plugin_request(r);
+        TRACE_END1(plugin, result);
+        log("HTTP REQUEST STATUS: %s", http_status_string(result));
+        return result == HTTP_STATUS_OK ? result : handle_error(r, result);
     }
-    else{
-        r->path = determine_request_path(r->uri);
+
+    /* Serve straight from the static bundle when the URI is packed in it
+     * (bundled listings cannot be paged or reformatted) */
+    if (StaticBundle && !browse_query(r->query)) {
+        TRACE_BEGIN(bundle);
+        result = handle_bundle_request(r);
+        TRACE_END1(bundle, result);
+        if (result != HTTP_STATUS_NOT_FOUND) {
+            log("HTTP REQUEST STATUS: %s", http_status_string(result));
+            return result;
+        }
     }
 
-    if(!r->path)
+    const char *uri = strcmp(r->uri, "/favicon.ico") == 0 ? "/" : r->uri;
+    TRACE_BEGIN(open);
+    int fd = open_request_path(uri);
+    TRACE_END1(open, fd);
+
+    if (fd < 0)
     {
-        debug("Couldn't determine path");
+        debug("Couldn't open path: %s", strerror(errno));
         return handle_error(r, HTTP_STATUS_NOT_FOUND);
     }
 
+    /* Path for CGI scripts, mimetypes and logs (already resolved above) */
+    r->path = cat(RootPath, uri);
     debug("HTTP REQUEST PATH: %s", r->path);
 
     // Dispatch to appropriate request handler type based on file type 
     struct stat stats;
-    if (stat(r->path, &stats) < 0 )
+    TRACE_BEGIN(stat);
+    int found = fstat(fd, &stats);
+    TRACE_END1(stat, found < 0 ? -1 : stats.st_size);
+    if (found < 0 || !r->path)
     {
         debug("Stat error");
+        close(fd);
         return handle_error(r, HTTP_STATUS_NOT_FOUND);
     }
 
-    if (access(r->path, F_OK) < 0)
-    {
-        debug("Cannot access file");
-        return handle_error(r, HTTP_STATUS_BAD_REQUEST);
-    }
-    if (stats.st_mode & S_IFDIR){ // its a directory
+    result = HTTP_STATUS_NOT_FOUND;
+    if (S_ISDIR(stats.st_mode)){ // its a directory
         debug("Browse request");
-        result = handle_browse_request(r);
+        TRACE_BEGIN(browse);
+        result = handle_browse_request(r, fd);
+        TRACE_END1(browse, result);
     }
-    else if (stats.st_mode & S_IFREG){ // regular file
+    else if (S_ISREG(stats.st_mode)){ // regular file
         debug("Regular File");
-        if ((stats.st_mode & S_IXOTH) && access(r->path, X_OK) == 0)   // executable
+        if (stats.st_mode & S_IXOTH)   // executable
         {
             debug("CGI request");
-            result = handle_cgi_request(r);
+            TRACE_BEGIN(cgi);
+            result = handle_cgi_request(r, fd);
+            TRACE_END1(cgi, result);
         }
         else{
             debug("File request");
-            result = handle_file_request(r);
+            TRACE_BEGIN(file);
+            result = handle_file_request(r, fd, &stats);
+            TRACE_END1(file, result);
         }
     }
-
+    close(fd);
 
     log("HTTP REQUEST STATUS: %s", http_status_string(result));
-    if(result != HTTP_STATUS_OK) 
+    if(result != HTTP_STATUS_OK && result != HTTP_STATUS_NOT_MODIFIED) 
         return handle_error(r, result);
 
     return result;
 }
 
 /**
- * Handle browse request.
+ * Handle bundle request.
  *
  * @param   r           HTTP Request structure.
- * @return  Status of the HTTP browse request.
+ * @return  Status of the HTTP bundle request.
  *
- * This lists the contents of a directory in HTML.
+ * This serves a file or directory listing out of StaticBundle using the
+ * precomputed response headers, choosing the gzip variant when the client
+ * accepts it and answering If-None-Match with 304 Not Modified.  The body is
+ * sent with sendfile straight from the bundle.
  *
- * If the path cannot be opened or scanned as a directory, then handle error
- * with HTTP_STATUS_NOT_FOUND.
+ * If the URI is not in the bundle, then return HTTP_STATUS_NOT_FOUND so the
+ * request falls back to the filesystem.
  **/
-Status  handle_browse_request(Request *r) {
-    struct dirent **entries;
-    int n;
-
-    /* Open a directory for reading or scanning */
-    char* path;
-
-    n = scandir(r->path, &entries, 0, alphasort);
-    if (n < 0)
-    {
-        debug("scandir failed: %s", strerror(errno));
+Status  handle_bundle_request(Request *r) {
+    const Bundle      *b = StaticBundle;
+    const BundleEntry *e = bundle_lookup(b, r->uri);
+    if (!e) {
         return HTTP_STATUS_NOT_FOUND;
     }
 
-    /* Write HTTP Header with OK Status and text/html Content-Type */
-    fprintf(r->stream, "HTTP/1.0 200 OK\r\n");
-    fprintf(r->stream, "Content-Type: text/html\r\n");
-    fprintf(r->stream, "\r\n");
+    const char *etag = b->base + e->etag;
+    const char *match = request_header(r, "If-None-Match");
+    if (match && streq(match, etag)) {
+        fprintf(r->stream, "HTTP/1.0 %s\r\n", http_status_string(HTTP_STATUS_NOT_MODIFIED));
+        fprintf(r->stream, "ETag: %s\r\n", etag);
+        fprintf(r->stream, "\r\n");
+        return HTTP_STATUS_NOT_MODIFIED;
+    }
 
-    /* For each entry in directory, emit HTML list item */
-    fprintf(r->stream, "<ul>\n");
-    
-    /* BOOTSTRAP */
-    // retHTML(r, "html/pre.html");
-    char buffer[BUFSIZ];
-    for (int i = 0; i < n; i++)
-    {
-        if (strcmp(".", entries[i]->d_name) != 0)
-        {
-            char *link;
-            char *sl = "";
-            debug("URI: %s", r->uri);
-            if(r->uri[strlen(r->uri) - 1] != '/')
-            {
-                sl = "/";
-            }
+    const BundleVariant *v = &e->variants[BUNDLE_IDENTITY];
+    const char *encoding = request_header(r, "Accept-Encoding");
+    if (e->variants[BUNDLE_GZIP].headers_length && encoding && strstr(encoding, "gzip")) {
+        v = &e->variants[BUNDLE_GZIP];
+    }
 
-            fprintf(r->stream, "<li><a href=\"%s%s%s\">%s</a></li>\n", r->uri, sl, entries[i]->d_name, entries[i]->d_name);
-        }
-        free(entries[i]);
+    /* Write precomputed HTTP Headers */
+    fwrite(b->base + v->headers, 1, v->headers_length, r->stream);
+    if (fflush(r->stream) != 0) {
+        debug("fflush failed: %s", strerror(errno));
+        return HTTP_STATUS_OK;
     }
-    fprintf(r->stream, "</ul>\n");
-    
-    /* BOOTSRAP */
-    // retHTML(r, "html/post.html");
 
-    free(entries);
-    /* Return OK */
+    /* Send body from the bundle without copying through user space */
+    off_t  offset = v->body;
+    size_t left   = v->length;
+    while (left > 0) {
+        ssize_t nsent = sendfile(r->fd, b->fd, &offset, left);
+        if (nsent < 0 && (errno == EINTR || (errno == EAGAIN && coroutine_wait(r->fd, POLLOUT, WriteTimeout)))) {
+            continue;
+        }
+        if (nsent <= 0) {
+            debug("sendfile failed: %s", strerror(errno));
+            break;
+        }
+        left -= nsent;
+    }
     return HTTP_STATUS_OK;
 }
 
@@ -162,173 +267,512 @@ Status  handle_browse_request(Request *r) {
  * Handle file request.
  *
  * @param   r           HTTP Request structure.
+ * @param   fd          File opened by dispatch_request.
+ * @param   stats       Status of the file when it was opened.
  * @return  Status of the HTTP file request.
  *
- * This opens and streams the contents of the specified file to the socket.
+ * This streams the contents of the specified file to the socket.  HTTP/1.1
+ * clients get exactly its size in bytes with a Content-Length and
+ * Connection: keep-alive, so the connection can be kept alive.  The ETag
+ * comes from the metadata cache along with the mimetype, and a matching
+ * If-None-Match is answered with 304 Not Modified.
  *
- * If the path cannot be opened for reading, then handle error with
- * HTTP_STATUS_NOT_FOUND.
+ * If the file cannot be read, then handle error with
+ * HTTP_STATUS_INTERNAL_SERVER_ERROR.
  **/
-Status  handle_file_request(Request *r) {
-    FILE *fs;
+Status  handle_file_request(Request *r, int fd, const struct stat *stats) {
     char buffer[BUFSIZ];
-    char *mimetype = NULL;
-    size_t nread;
-
-    /* Open file for reading */
-
-    fs = fopen(r->path, "r");
-    if (!fs)
-    {
-        debug("fopen failed: %s", strerror(errno));
-        return HTTP_STATUS_NOT_FOUND;
+    Metadata metadata;
+    ssize_t nread;
+    off_t size = stats->st_size;
+    off_t sent = 0;
+
+    /* Determine mimetype and ETag */
+    TRACE_BEGIN(mimetype);
+    metadata_lookup(r->path, stats, &metadata);
+    TRACE_END1(mimetype, metadata.mimetype);
+
+    /* Only plain GETs stay open: a request body would be read as the next
+     * request and HEAD still gets the body */
+    r->persistent = streq(r->method, "GET") && request_keep_alive(r) &&
+                    !request_header(r, "Content-Length") && !request_header(r, "Transfer-Encoding");
+
+    const char *match = request_header(r, "If-None-Match");
+    if (match && streq(match, metadata.etag)) {
+        fprintf(r->stream, "HTTP/1.0 %s\r\n", http_status_string(HTTP_STATUS_NOT_MODIFIED));
+        fprintf(r->stream, "ETag: %s\r\n", metadata.etag);
+        if (r->persistent) {
+            fprintf(r->stream, "Connection: keep-alive\r\n");
+        }
+        fprintf(r->stream, "\r\n");
+        if (fflush(r->stream) != 0) {
+            r->persistent = false;
+        }
+        return HTTP_STATUS_NOT_MODIFIED;
     }
 
-    /* Determine mimetype */
-    mimetype = determine_mimetype(r->path);
+    /* A large file is read only by large_send: a small read first would
+     * start the kernel's own readahead, which defeats dropping pages */
+    TRACE_BEGIN(send);
+    bool large = large_file(size);
+    nread = large ? 0 : read(fd, buffer, BUFSIZ);
+    if (nread < 0 || (nread == 0 && size > 0 && !large)) goto fail;
 
     /* Write HTTP Headers with OK status and determined Content-Type */
     fprintf(r->stream, "HTTP/1.0 200 OK\r\n");
-    fprintf(r->stream, "Content-Type: %s\r\n", mimetype);
+    fprintf(r->stream, "Content-Type: %s\r\n", metadata.mimetype);
+    fprintf(r->stream, "ETag: %s\r\n", metadata.etag);
+    if (r->persistent) {
+        fprintf(r->stream, "Content-Length: %lld\r\n", (long long)size);
+        fprintf(r->stream, "Connection: keep-alive\r\n");
+    }
     fprintf(r->stream, "\r\n");
 
+    /* Stream a large file around the page cache (see large_send) */
+    if (large) {
+        sent = large_send(r, fd, size);
+    }
+
     /* Read from file and write to socket in chunks */
-    nread = fread(buffer, 1, BUFSIZ, fs);
-    if (nread < 1) goto fail;
     while (nread > 0)
     {
+        if (r->persistent && nread > size - sent) {
+            nread = size - sent;
+        }
         fwrite(buffer, 1, nread, r->stream);
-        nread = fread(buffer, 1, BUFSIZ, fs);
+        sent += nread;
+        if (r->persistent && sent == size) {
+            break;
+        }
+        nread = read(fd, buffer, BUFSIZ);
+    }
+    TRACE_END1(send, sent);
+
+    /* A file that shrank (or a failed write) leaves the body short */
+    if (r->persistent && (sent < size || fflush(r->stream) != 0)) {
+        r->persistent = false;
     }
 
-    /* Close file, deallocate mimetype, return OK */
-    fclose(fs);
-    free(mimetype);
+    /* Return OK (dispatch_request closes the file) */
     return HTTP_STATUS_OK;
 
 fail:
-    /* Close file, free mimetype, return INTERNAL_SERVER_ERROR */
-    fclose(fs);
-    free(mimetype);
+    /* Return INTERNAL_SERVER_ERROR */
+    TRACE_END1(send, sent);
+    r->persistent = false;
     return HTTP_STATUS_INTERNAL_SERVER_ERROR;
 }
 
+/* CGI environment variables set per request; inherited ones are dropped */
+static const char *CGIVariables[] = {
+    "DOCUMENT_ROOT", "SERVER_PORT", "HTTPS", "QUERY_STRING", "REMOTE_ADDR",
+    "REMOTE_PORT", "REQUEST_METHOD", "REQUEST_URI", "SCRIPT_FILENAME",
+    "CONTENT_LENGTH", "CONTENT_TYPE", NULL,
+};
+
+/* Request headers exported as HTTP_* variables */
+static const char *CGIHeaders[][2] = {
+    {"Accept",          "HTTP_ACCEPT"},
+    {"Accept-Encoding", "HTTP_ACCEPT_ENCODING"},
+    {"Accept-Language", "HTTP_ACCEPT_LANGUAGE"},
+    {"Connection",      "HTTP_CONNECTION"},
+    {"Host",            "HTTP_HOST"},
+    {"User-Agent",      "HTTP_USER_AGENT"},
+};
+
+/**
+ * Append NAME=value to a CGI environment.
+ **/
+static bool cgi_export(char **env, size_t *n, const char *name, const char *value) {
+    if (asprintf(&env[*n], "%s=%s", name, value) < 0) {
+        env[*n] = NULL;
+        debug("ERROR: failed to export %s", name);
+        return false;
+    }
+    (*n)++;
+    return true;
+}
+
+/**
+ * Return whether an inherited variable is one a request sets.
+ **/
+static bool cgi_variable(const char *entry) {
+    if (strncmp(entry, "HTTP_", 5) == 0) {
+        return true;
+    }
+    for (const char **v = CGIVariables; *v; v++) {
+        size_t length = strlen(*v);
+        if (strncmp(entry, *v, length) == 0 && entry[length] == '=') {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Free a CGI environment.
+ **/
+static void cgi_environment_free(char **env) {
+    for (char **e = env; *e; e++) {
+        free(*e);
+    }
+    free(env);
+}
+
+/**
+ * Build the environment of a CGI script:
+ * http://en.wikipedia.org/wiki/Common_Gateway_Interface
+ *
+ * @param   r           HTTP Request structure.
+ * @param   length      Length of the request body (-1 if chunked or none).
+ * @return  NULL terminated array of NAME=value strings, or NULL on failure.
+ *
+ * The array is built per request rather than with setenv, which would leak
+ * variables between requests of a long-lived worker and race between the
+ * task threads of a hybrid server.
+ **/
+static char ** cgi_environment(Request *r, off_t length) {
+    size_t count = 0;
+    for (char **e = environ; *e; e++) {
+        count++;
+    }
+
+    char **env = calloc(count + 20, sizeof(char *));
+    size_t n   = 0;
+    if (!env) {
+        return NULL;
+    }
+    for (char **e = environ; *e; e++) {
+        if (!cgi_variable(*e) && !(env[n++] = strdup(*e))) {
+            goto fail;
+        }
+    }
+
+    char content_length[32];
+    snprintf(content_length, sizeof(content_length), "%lld", (long long)length);
+
+    /* CONTENT_LENGTH is left unset for a chunked body: the script reads its
+     * input until EOF */
+    const char *type = request_header(r, "Content-Type");
+    if (!cgi_export(env, &n, "DOCUMENT_ROOT", RootPath) ||
+        !cgi_export(env, &n, "SERVER_PORT", r->secure ? TlsPort : Port ? Port : "0") ||
+        (r->secure && !cgi_export(env, &n, "HTTPS", "on")) ||
+        !cgi_export(env, &n, "QUERY_STRING", r->query ? r->query : "") ||
+        !cgi_export(env, &n, "REMOTE_ADDR", request_host(r)) ||
+        !cgi_export(env, &n, "REMOTE_PORT", request_port(r)) ||
+        !cgi_export(env, &n, "REQUEST_METHOD", r->method) ||
+        !cgi_export(env, &n, "REQUEST_URI", r->uri) ||
+        !cgi_export(env, &n, "SCRIPT_FILENAME", r->path) ||
+        (length >= 0 && !cgi_export(env, &n, "CONTENT_LENGTH", content_length)) ||
+        (type && !cgi_export(env, &n, "CONTENT_TYPE", type))) {
+        goto fail;
+    }
+
+    /* Export the last of each header, as repeated setenv calls did */
+    for (size_t i = 0; i < sizeof(CGIHeaders) / sizeof(CGIHeaders[0]); i++) {
+        const char *value = NULL;
+        for (Header *h = r->headers; h; h = h->next) {
+            if (strcasecmp(h->name, CGIHeaders[i][0]) == 0) {
+                value = h->data;
+            }
+        }
+        if (value && !cgi_export(env, &n, CGIHeaders[i][1], value)) {
+            goto fail;
+        }
+    }
+    return env;
+
+fail:
+    cgi_environment_free(env);
+    return NULL;
+}
+
 /**
  * Handle CGI request
  *
  * @param   r           HTTP Request structure.
+ * @param   fd          Script opened by dispatch_request.
  * @return  Status of the HTTP file request.
  *
- * This popens and streams the results of the specified executables to the
- * socket.
+ * This runs the specified executable and streams its results to the socket.
+ * The script's header block (either a full status line or CGI
+ * Status/Content-Type/Location headers) is parsed first; for HTTP/1.1 the
+ * body is then relayed with chunked transfer encoding as it is produced, so
+ * the connection can be kept alive.  A request body is fed to the script's
+ * standard input while its output is relayed (see body_feed).
  *
- * If the path cannot be popened, then handle error with
- * HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ * With -C, responses the script marks cacheable are answered from the
+ * microcache, and concurrent misses for one key run the script once.
+ *
+ * If the script cannot be started or does not produce a header block, then
+ * handle error with HTTP_STATUS_INTERNAL_SERVER_ERROR.  If MaxCGI scripts
+ * are already running, then handle error with
+ * HTTP_STATUS_SERVICE_UNAVAILABLE.
  **/
-Status  handle_cgi_request(Request *r) {
-    FILE *pfs;
-    char buffer[BUFSIZ];
+Status  handle_cgi_request(Request *r, int fd) {
+    off_t length;
+    int   body = request_body(r, &length);
+    int   input[2];
+    int   output[2];
+    int   exited = -1;
+
+    /* Answer from the microcache, or become the request that fills it */
+    Microcache cache;
+    TRACE_BEGIN(microcache);
+    bool hit = microcache_lookup(r, &cache);
+    TRACE_END1(microcache, hit);
+    if (hit) {
+        return HTTP_STATUS_OK;
+    }
 
-    /* Export CGI environment variables from request:
-     * http://en.wikipedia.org/wiki/Common_Gateway_Interface */
-    if (setenv("DOCUMENT_ROOT", RootPath, 1))
-    {
-        debug("ERROR: failed to export DOCUMENT_ROOT");
+    /* Build the script's environment (freed once it is started) */
+    char **env = cgi_environment(r, body > 0 ? length : -1);
+    if (!env) {
+        microcache_finish(&cache, false);
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
     }
-    if (setenv("SERVER_PORT", Port, 1))
-    {
-        debug("ERROR: failed to export SERVER_ROOT");
+
+    /* Reserve a CGI slot and start CGI Script */
+    TRACE_BEGIN(cgi_spawn);
+    if (!cgi_acquire()) {
+        debug("CGI limit reached");
+        cgi_environment_free(env);
+        microcache_finish(&cache, false);
+        return HTTP_STATUS_SERVICE_UNAVAILABLE;
     }
-    if (r->query)
-    {
-        if (setenv("QUERY_STRING", r->query, 1))
-        {
-            debug("ERROR: failed to export QUERY_STRING");
-        }
-    } else
-    {
-        setenv("QUERY_STRING", "\0", 1);
+    if (pipe2(input, O_CLOEXEC) < 0) {
+        debug("pipe failed: %s", strerror(errno));
+        cgi_environment_free(env);
+        cgi_release();
+        microcache_finish(&cache, false);
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
     }
-    if (setenv("REMOTE_ADDR", r->host, 1))
-    {
-        debug("ERROR: failed to export REMOTE_ADDR");
+    if (pipe2(output, O_CLOEXEC) < 0) {
+        debug("pipe failed: %s", strerror(errno));
+        close(input[0]);
+        close(input[1]);
+        cgi_environment_free(env);
+        cgi_release();
+        microcache_finish(&cache, false);
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
     }
-    if (setenv("REMOTE_PORT", r->port, 1))
-    {
-        debug("ERROR: failed to export REMOTE_PORT");
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(input[0], STDIN_FILENO);
+        dup2(output[1], STDOUT_FILENO);
+        signal(SIGPIPE, SIG_DFL);
+        worker_unpin();
+        /* Task threads of a hybrid server run with every signal blocked */
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        /* Execute the file that was checked; an interpreter started for a
+         * #! script reopens it through /dev/fd, so it must survive exec */
+        char *argv[] = {r->path, NULL};
+        fcntl(fd, F_SETFD, 0);
+        syscall(SYS_execveat, fd, "", argv, env, AT_EMPTY_PATH);
+        _exit(127);
     }
-    if (setenv("REQUEST_METHOD", r->method, 1))
-    {
-        debug("ERROR: failed to export REQUEST_METHOD");
+    close(input[0]);
+    close(output[1]);
+    cgi_environment_free(env);
+    if (pid < 0) {
+        debug("fork failed: %s", strerror(errno));
+        close(input[1]);
+        close(output[0]);
+        cgi_release();
+        microcache_finish(&cache, false);
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
     }
-    if (setenv("REQUEST_URI", r->uri, 1))
-    {
-        debug("ERROR: failed to export REQUEST_URI");
+
+    /* Feed request body to script */
+    pid_t feeder = -1;
+    if (body > 0) {
+        feeder = body_feed(r, input[1], length, pid);
+        if (feeder < 0) {
+            kill(pid, SIGKILL);
+        }
     }
-    if (setenv("SCRIPT_FILENAME", r->path, 1))
-    {
-        debug("ERROR: failed to export SCRIPT_FILENAME");
+    close(input[1]);
+    TRACE_END1(cgi_spawn, pid);
+
+    /* Relay script output to socket (non-blocking even off a coroutine, so
+     * reads can time out) */
+    TRACE_BEGIN(cgi_response);
+    fcntl(output[0], F_SETFL, O_NONBLOCK);
+    Status result = handle_cgi_response(r, output[0], pid, &cache);
+    TRACE_END1(cgi_response, result);
+
+    /* Reap script (and feeder), release CGI slot, store the response if it
+     * came from a script that succeeded, return result */
+    TRACE_BEGIN(cgi_wait);
+    close(output[0]);
+    while (waitpid(pid, &exited, 0) < 0 && errno == EINTR);
+    if (body > 0 && (feeder < 0 || !body_finish(feeder))) {
+        r->persistent = false;
     }
+    cgi_release();
+    microcache_finish(&cache, result == HTTP_STATUS_OK && WIFEXITED(exited) && WEXITSTATUS(exited) == 0);
+    TRACE_END1(cgi_wait, pid);
+    return result;
+}
 
-    /* Export CGI environment variables from request headers */
-    for (Header* h = r->headers; h; h=h->next)
-    {
-        if (streq(h->name, "Accept") )
-        {
-            if (setenv("HTTP_ACCEPT", h->data, 1))
-            {
-                debug("ERROR: failed to export HTTP_ACCEPT");
-            }
+/**
+ * Kill a CGI script that went CgiTimeout without output.
+ **/
+static void cgi_expire(Request *r, pid_t pid) {
+    log("CGI script %s was silent for %d ms: killing it", r->path, CgiTimeout);
+    kill(pid, SIGKILL);
+}
+
+/**
+ * Relay CGI script output as an HTTP response.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   fd          Read end of the script's standard output.
+ * @param   pid         Script, killed if it goes CgiTimeout without output.
+ * @return  Status of the HTTP CGI request.
+ *
+ * Output is read with read(2) rather than stdio so each piece the script
+ * writes is forwarded (and flushed) as soon as it arrives; a coroutine waits
+ * for it on the loop.  When the request is filling the microcache, the
+ * response is also captured into it.  A script that times out before its
+ * header block is answered with 504; after it, the response is left
+ * unterminated and the connection closed.
+ **/
+Status  handle_cgi_response(Request *r, int fd, pid_t pid, Microcache *cache) {
+    char    head[CGI_HEADER_MAX + 1];
+    char    buffer[BUFSIZ];
+    size_t  length = 0;
+    char   *end = NULL;
+    ssize_t nread;
+
+    /* Read header block */
+    while (!end && length < CGI_HEADER_MAX) {
+        nread = coroutine_read(fd, head + length, CGI_HEADER_MAX - length, CgiTimeout);
+        if (nread < 0 && errno == EAGAIN) {
+            cgi_expire(r, pid);
+            return HTTP_STATUS_GATEWAY_TIMEOUT;
         }
-        if (streq(h->name, "Accept-Encoding") )
-        {
-            if (setenv("HTTP_ACCEPT_ENCODING", h->data, 1))
-            {
-                debug("ERROR: failed to export HTTP_ACCEPT_ENCODING");
-            }
+        if (nread <= 0) {
+            break;
         }
-        if (streq(h->name, "Accept-Language") )
-        {
-            if (setenv("HTTP_ACCEPT_LANGUAGE", h->data, 1))
-            {
-                debug("ERROR: failed to export HTTP_ACCEPT_LANGUAGE");
-            }
+        length += nread;
+        head[length] = '\0';
+
+        char *crlf = strstr(head, "\r\n\r\n");
+        char *lf   = strstr(head, "\n\n");
+        if (crlf && (!lf || crlf < lf)) {
+            end = crlf + 4;
+        } else if (lf) {
+            end = lf + 2;
         }
-        if (streq(h->name, "Connection") )
-        {
-            if (setenv("HTTP_CONNECTION", h->data, 1))
-            {
-                debug("ERROR: failed to export HTTP_CONNECTION");
-            }
+    }
+    if (!end) {
+        debug("CGI script did not produce a header block");
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+    size_t body = end - head;
+    end[-1] = '\0';
+
+    /* Determine status from status line or Status/Location headers */
+    const char *status   = NULL;
+    bool        location = false;
+    char       *save;
+    char       *line     = strtok_r(head, "\r\n", &save);
+    if (line && strncmp(line, "HTTP/", 5) == 0) {
+        status = strchr(line, ' ');
+        status = status ? skip_whitespace((char *)status) : NULL;
+        line   = strtok_r(NULL, "\r\n", &save);
+    }
+
+    bool http11  = r->version && streq(r->version, "HTTP/1.1");
+    bool chunked = http11;
+
+    /* Write headers, dropping the ones spidey now decides */
+    char headers[CGI_HEADER_MAX + 1];
+    size_t nheaders = 0;
+    for (; line; line = strtok_r(NULL, "\r\n", &save)) {
+        char *value = strchr(line, ':');
+        if (!value) {
+            continue;
         }
-        if (streq(h->name, "Host") )
-        {
-            if (setenv("HTTP_HOST", h->data, 1))
-            {
-                debug("ERROR: failed to export HTTP_HOST");
-            }
+        *value++ = '\0';
+        value = skip_whitespace(value);
+
+        if (strcasecmp(line, "Status") == 0) {
+            status = value;
+            continue;
         }
-        if (streq(h->name, "User-Agent") )
-        {
-            if (setenv("HTTP_USER_AGENT", h->data, 1))
-            {
-                debug("ERROR: failed to export HTTP_USER_AGENT");
-            }
+        if (strcasecmp(line, "Location") == 0) {
+            location = true;
+        }
+        if (strcasecmp(line, "Connection") == 0 || strcasecmp(line, "Transfer-Encoding") == 0 ||
+            (chunked && strcasecmp(line, "Content-Length") == 0)) {
+            continue;
         }
+        int n = snprintf(headers + nheaders, sizeof(headers) - nheaders, "%s: %s\r\n", line, value);
+        if (n < 0 || (size_t)n >= sizeof(headers) - nheaders) {
+            return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        }
+        nheaders += n;
+    }
+    if (!status) {
+        status = location ? "302 Found" : "200 OK";
     }
+    microcache_headers(cache, status, headers, nheaders);
+    r->persistent = chunked && request_keep_alive(r);
 
-    /* POpen CGI Script */
-    pfs = popen(r->path, "r");
-    /* Copy data from popen to socket */
-    size_t nread = fread(buffer, 1, BUFSIZ, pfs);
+    fprintf(r->stream, "%s %s\r\n", http11 ? "HTTP/1.1" : "HTTP/1.0", status);
+    fwrite(headers, 1, nheaders, r->stream);
+    if (chunked) {
+        fprintf(r->stream, "Transfer-Encoding: chunked\r\n");
+    }
+    if (http11 && !r->persistent) {
+        fprintf(r->stream, "Connection: close\r\n");
+    }
+    fprintf(r->stream, "\r\n");
 
-    while (nread > 0)
-    {
-        fwrite(buffer, 1, nread, r->stream);
-        nread = fread(buffer, 1, BUFSIZ, pfs);
+    /* Stream body: whatever followed the header block, then the rest */
+    char  *data = head + body;
+    nread = length - body;
+    do {
+        if (nread > 0) {
+            if (chunked) {
+                fprintf(r->stream, "%zx\r\n", (size_t)nread);
+            }
+            fwrite(data, 1, nread, r->stream);
+            if (chunked) {
+                fprintf(r->stream, "\r\n");
+            }
+            microcache_body(cache, data, nread);
+            if (fflush(r->stream) != 0) {
+                debug("fflush failed: %s", strerror(errno));
+                r->persistent = false;
+                cache->failed = true;
+                return HTTP_STATUS_OK;
+            }
+        }
+        data  = buffer;
+        nread = coroutine_read(fd, buffer, sizeof(buffer), CgiTimeout);
+    } while (nread > 0);
+
+    if (nread < 0) {
+        if (errno == EAGAIN) {
+            cgi_expire(r, pid);
+        }
+        fflush(r->stream);
+        r->persistent = false;
+        cache->failed = true;
+        return HTTP_STATUS_OK;
+    }
+
+    if (chunked) {
+        fprintf(r->stream, "0\r\n\r\n");
+    }
+    if (fflush(r->stream) != 0) {
+        r->persistent = false;
     }
-    /* Close popen, return OK */
-    pclose(pfs);
     return HTTP_STATUS_OK;
 }
 
@@ -343,8 +787,13 @@ Status  handle_cgi_request(Request *r) {
  **/
 Status  handle_error(Request *r, Status status) {
     const char *status_string = http_status_string(status);
+    /* The page has no Content-Length: only closing the connection ends it */
+    r->persistent = false;
     /* Write HTTP Header */
     fprintf(r->stream, "HTTP/1.0 %s\r\n", status_string);
+    if (status == HTTP_STATUS_SERVICE_UNAVAILABLE) {
+        fprintf(r->stream, "Retry-After: %d\r\n", RetryAfter);
+    }
     fprintf(r->stream, "Content-Type: text/html\r\n");
     fprintf(r->stream, "\r\n");
 
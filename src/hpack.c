@@ -0,0 +1,568 @@
+/* hpack.c: HPACK Header Compression (RFC 7541) */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <pthread.h>
+
+/* Constants */
+
+#define HPACK_ENTRY_OVERHEAD    32      /* Per-entry size overhead (RFC 7541 4.1) */
+#define HPACK_STATIC_COUNT      61
+#define HPACK_LIST_MAX          (4 * BUFSIZ)    /* Largest decoded header list */
+
+/* Static Table (RFC 7541 Appendix A) */
+
+static const struct {
+    const char *name;
+    const char *value;
+} StaticTable[HPACK_STATIC_COUNT] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+/* Huffman Code (RFC 7541 Appendix B): {code, length} for symbols 0 - 256 */
+
+static const struct {
+    uint32_t code;
+    uint8_t  length;
+} HuffmanCodes[257] = {
+    {0x00001ff8, 13}, {0x007fffd8, 23}, {0x0fffffe2, 28}, {0x0fffffe3, 28},
+    {0x0fffffe4, 28}, {0x0fffffe5, 28}, {0x0fffffe6, 28}, {0x0fffffe7, 28},
+    {0x0fffffe8, 28}, {0x00ffffea, 24}, {0x3ffffffc, 30}, {0x0fffffe9, 28},
+    {0x0fffffea, 28}, {0x3ffffffd, 30}, {0x0fffffeb, 28}, {0x0fffffec, 28},
+    {0x0fffffed, 28}, {0x0fffffee, 28}, {0x0fffffef, 28}, {0x0ffffff0, 28},
+    {0x0ffffff1, 28}, {0x0ffffff2, 28}, {0x3ffffffe, 30}, {0x0ffffff3, 28},
+    {0x0ffffff4, 28}, {0x0ffffff5, 28}, {0x0ffffff6, 28}, {0x0ffffff7, 28},
+    {0x0ffffff8, 28}, {0x0ffffff9, 28}, {0x0ffffffa, 28}, {0x0ffffffb, 28},
+    {0x00000014,  6}, {0x000003f8, 10}, {0x000003f9, 10}, {0x00000ffa, 12},
+    {0x00001ff9, 13}, {0x00000015,  6}, {0x000000f8,  8}, {0x000007fa, 11},
+    {0x000003fa, 10}, {0x000003fb, 10}, {0x000000f9,  8}, {0x000007fb, 11},
+    {0x000000fa,  8}, {0x00000016,  6}, {0x00000017,  6}, {0x00000018,  6},
+    {0x00000000,  5}, {0x00000001,  5}, {0x00000002,  5}, {0x00000019,  6},
+    {0x0000001a,  6}, {0x0000001b,  6}, {0x0000001c,  6}, {0x0000001d,  6},
+    {0x0000001e,  6}, {0x0000001f,  6}, {0x0000005c,  7}, {0x000000fb,  8},
+    {0x00007ffc, 15}, {0x00000020,  6}, {0x00000ffb, 12}, {0x000003fc, 10},
+    {0x00001ffa, 13}, {0x00000021,  6}, {0x0000005d,  7}, {0x0000005e,  7},
+    {0x0000005f,  7}, {0x00000060,  7}, {0x00000061,  7}, {0x00000062,  7},
+    {0x00000063,  7}, {0x00000064,  7}, {0x00000065,  7}, {0x00000066,  7},
+    {0x00000067,  7}, {0x00000068,  7}, {0x00000069,  7}, {0x0000006a,  7},
+    {0x0000006b,  7}, {0x0000006c,  7}, {0x0000006d,  7}, {0x0000006e,  7},
+    {0x0000006f,  7}, {0x00000070,  7}, {0x00000071,  7}, {0x00000072,  7},
+    {0x000000fc,  8}, {0x00000073,  7}, {0x000000fd,  8}, {0x00001ffb, 13},
+    {0x0007fff0, 19}, {0x00001ffc, 13}, {0x00003ffc, 14}, {0x00000022,  6},
+    {0x00007ffd, 15}, {0x00000003,  5}, {0x00000023,  6}, {0x00000004,  5},
+    {0x00000024,  6}, {0x00000005,  5}, {0x00000025,  6}, {0x00000026,  6},
+    {0x00000027,  6}, {0x00000006,  5}, {0x00000074,  7}, {0x00000075,  7},
+    {0x00000028,  6}, {0x00000029,  6}, {0x0000002a,  6}, {0x00000007,  5},
+    {0x0000002b,  6}, {0x00000076,  7}, {0x0000002c,  6}, {0x00000008,  5},
+    {0x00000009,  5}, {0x0000002d,  6}, {0x00000077,  7}, {0x00000078,  7},
+    {0x00000079,  7}, {0x0000007a,  7}, {0x0000007b,  7}, {0x00007ffe, 15},
+    {0x000007fc, 11}, {0x00003ffd, 14}, {0x00001ffd, 13}, {0x0ffffffc, 28},
+    {0x000fffe6, 20}, {0x003fffd2, 22}, {0x000fffe7, 20}, {0x000fffe8, 20},
+    {0x003fffd3, 22}, {0x003fffd4, 22}, {0x003fffd5, 22}, {0x007fffd9, 23},
+    {0x003fffd6, 22}, {0x007fffda, 23}, {0x007fffdb, 23}, {0x007fffdc, 23},
+    {0x007fffdd, 23}, {0x007fffde, 23}, {0x00ffffeb, 24}, {0x007fffdf, 23},
+    {0x00ffffec, 24}, {0x00ffffed, 24}, {0x003fffd7, 22}, {0x007fffe0, 23},
+    {0x00ffffee, 24}, {0x007fffe1, 23}, {0x007fffe2, 23}, {0x007fffe3, 23},
+    {0x007fffe4, 23}, {0x001fffdc, 21}, {0x003fffd8, 22}, {0x007fffe5, 23},
+    {0x003fffd9, 22}, {0x007fffe6, 23}, {0x007fffe7, 23}, {0x00ffffef, 24},
+    {0x003fffda, 22}, {0x001fffdd, 21}, {0x000fffe9, 20}, {0x003fffdb, 22},
+    {0x003fffdc, 22}, {0x007fffe8, 23}, {0x007fffe9, 23}, {0x001fffde, 21},
+    {0x007fffea, 23}, {0x003fffdd, 22}, {0x003fffde, 22}, {0x00fffff0, 24},
+    {0x001fffdf, 21}, {0x003fffdf, 22}, {0x007fffeb, 23}, {0x007fffec, 23},
+    {0x001fffe0, 21}, {0x001fffe1, 21}, {0x003fffe0, 22}, {0x001fffe2, 21},
+    {0x007fffed, 23}, {0x003fffe1, 22}, {0x007fffee, 23}, {0x007fffef, 23},
+    {0x000fffea, 20}, {0x003fffe2, 22}, {0x003fffe3, 22}, {0x003fffe4, 22},
+    {0x007ffff0, 23}, {0x003fffe5, 22}, {0x003fffe6, 22}, {0x007ffff1, 23},
+    {0x03ffffe0, 26}, {0x03ffffe1, 26}, {0x000fffeb, 20}, {0x0007fff1, 19},
+    {0x003fffe7, 22}, {0x007ffff2, 23}, {0x003fffe8, 22}, {0x01ffffec, 25},
+    {0x03ffffe2, 26}, {0x03ffffe3, 26}, {0x03ffffe4, 26}, {0x07ffffde, 27},
+    {0x07ffffdf, 27}, {0x03ffffe5, 26}, {0x00fffff1, 24}, {0x01ffffed, 25},
+    {0x0007fff2, 19}, {0x001fffe3, 21}, {0x03ffffe6, 26}, {0x07ffffe0, 27},
+    {0x07ffffe1, 27}, {0x03ffffe7, 26}, {0x07ffffe2, 27}, {0x00fffff2, 24},
+    {0x001fffe4, 21}, {0x001fffe5, 21}, {0x03ffffe8, 26}, {0x03ffffe9, 26},
+    {0x0ffffffd, 28}, {0x07ffffe3, 27}, {0x07ffffe4, 27}, {0x07ffffe5, 27},
+    {0x000fffec, 20}, {0x00fffff3, 24}, {0x000fffed, 20}, {0x001fffe6, 21},
+    {0x003fffe9, 22}, {0x001fffe7, 21}, {0x001fffe8, 21}, {0x007ffff3, 23},
+    {0x003fffea, 22}, {0x003fffeb, 22}, {0x01ffffee, 25}, {0x01ffffef, 25},
+    {0x00fffff4, 24}, {0x00fffff5, 24}, {0x03ffffea, 26}, {0x007ffff4, 23},
+    {0x03ffffeb, 26}, {0x07ffffe6, 27}, {0x03ffffec, 26}, {0x03ffffed, 26},
+    {0x07ffffe7, 27}, {0x07ffffe8, 27}, {0x07ffffe9, 27}, {0x07ffffea, 27},
+    {0x07ffffeb, 27}, {0x0ffffffe, 28}, {0x07ffffec, 27}, {0x07ffffed, 27},
+    {0x07ffffee, 27}, {0x07ffffef, 27}, {0x07fffff0, 27}, {0x03ffffee, 26},
+    {0x3fffffff, 30},
+};
+
+/*
+ * The HPACK code is canonical: sorted by (length, code), the codes of each
+ * length are consecutive.  Decoding therefore only needs, per length, the
+ * first code, how many codes there are, and where their symbols start in the
+ * sorted symbol list.
+ */
+#define HUFFMAN_LENGTH_MAX  30
+
+static uint32_t HuffmanFirst[HUFFMAN_LENGTH_MAX + 1];
+static uint16_t HuffmanCount[HUFFMAN_LENGTH_MAX + 1];
+static uint16_t HuffmanOffset[HUFFMAN_LENGTH_MAX + 1];
+static uint16_t HuffmanSymbols[257];
+static pthread_once_t HuffmanOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * Build canonical decoding tables from HuffmanCodes.
+ **/
+static void huffman_init(void) {
+    uint16_t next[HUFFMAN_LENGTH_MAX + 1];
+    uint32_t code = 0;
+    uint16_t offset = 0;
+
+    for (int s = 0; s < 257; s++) {
+        HuffmanCount[HuffmanCodes[s].length]++;
+    }
+    for (int l = 1; l <= HUFFMAN_LENGTH_MAX; l++) {
+        code = (code + HuffmanCount[l - 1]) << 1;
+        HuffmanFirst[l]  = code;
+        HuffmanOffset[l] = next[l] = offset;
+        offset += HuffmanCount[l];
+    }
+    /* Codes of one length ascend with the symbol value */
+    for (int s = 0; s < 257; s++) {
+        HuffmanSymbols[next[HuffmanCodes[s].length]++] = s;
+    }
+}
+
+/**
+ * Decode Huffman encoded string.
+ *
+ * @param   src         Encoded octets.
+ * @param   length      Number of encoded octets.
+ * @param   dst         Output buffer (at least 8 * length / 5 + 1 bytes).
+ * @return  Number of decoded bytes (or -1 if the encoding is invalid).
+ **/
+static ssize_t huffman_decode(const uint8_t *src, size_t length, char *dst) {
+    uint32_t code  = 0;
+    int      bits  = 0;
+    size_t   n     = 0;
+
+    /* Once per process, whichever thread of a hybrid server gets here first */
+    pthread_once(&HuffmanOnce, huffman_init);
+
+    for (size_t i = 0; i < length; i++) {
+        for (int b = 7; b >= 0; b--) {
+            code = (code << 1) | ((src[i] >> b) & 1);
+            bits++;
+            if (bits > HUFFMAN_LENGTH_MAX) {
+                return -1;
+            }
+            if (code - HuffmanFirst[bits] < HuffmanCount[bits]) {
+                uint16_t symbol = HuffmanSymbols[HuffmanOffset[bits] + code - HuffmanFirst[bits]];
+                if (symbol == 256) {
+                    /* EOS must not appear in a string literal */
+                    return -1;
+                }
+                dst[n++] = symbol;
+                code = 0;
+                bits = 0;
+            }
+        }
+    }
+
+    /* Padding must be fewer than 8 bits and all ones (a prefix of EOS) */
+    if (bits > 7 || code != (1U << bits) - 1) {
+        return -1;
+    }
+    return n;
+}
+
+/**
+ * Decode integer with an N-bit prefix (RFC 7541 5.1).
+ *
+ * @param   p           Cursor into header block (advanced past integer).
+ * @param   end         End of header block.
+ * @param   prefix      Number of prefix bits.
+ * @param   value       Decoded integer.
+ * @return  true if an integer was decoded.
+ **/
+static bool hpack_integer(const uint8_t **p, const uint8_t *end, int prefix, uint32_t *value) {
+    uint32_t mask = (1U << prefix) - 1;
+
+    if (*p >= end) {
+        return false;
+    }
+    *value = *(*p)++ & mask;
+    if (*value < mask) {
+        return true;
+    }
+    for (int shift = 0; *p < end; shift += 7) {
+        uint8_t b = *(*p)++;
+        if (shift > 21) {
+            return false;
+        }
+        *value += (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Decode string literal (RFC 7541 5.2).
+ *
+ * @return  Newly allocated string (or NULL if invalid).
+ **/
+static char * hpack_string(const uint8_t **p, const uint8_t *end) {
+    if (*p >= end) {
+        return NULL;
+    }
+    bool     huffman = **p & 0x80;
+    uint32_t length;
+    if (!hpack_integer(p, end, 7, &length) || length > (size_t)(end - *p) || length > HPACK_LIST_MAX) {
+        return NULL;
+    }
+
+    char *s = malloc(huffman ? length * 8 / 5 + 1 : length + 1);
+    if (!s) {
+        return NULL;
+    }
+    ssize_t n = length;
+    if (huffman) {
+        n = huffman_decode(*p, length, s);
+        if (n < 0) {
+            free(s);
+            return NULL;
+        }
+    } else {
+        memcpy(s, *p, length);
+    }
+    s[n] = '\0';
+    *p += length;
+    return s;
+}
+
+/**
+ * Evict oldest entries until the table fits in size.
+ **/
+static void hpack_evict(HpackTable *t, size_t size) {
+    while (t->count > 0 && t->size > size) {
+        HpackField *f = &t->fields[--t->count];
+        t->size -= strlen(f->name) + strlen(f->value) + HPACK_ENTRY_OVERHEAD;
+        free(f->name);
+        free(f->value);
+    }
+}
+
+/**
+ * Insert entry at the front of the dynamic table (RFC 7541 4.4).
+ **/
+static bool hpack_insert(HpackTable *t, const char *name, const char *value) {
+    size_t size = strlen(name) + strlen(value) + HPACK_ENTRY_OVERHEAD;
+
+    if (size > t->max_size) {
+        /* An entry larger than the table empties it and is not added */
+        hpack_evict(t, 0);
+        return true;
+    }
+    hpack_evict(t, t->max_size - size);
+
+    if (t->count == t->capacity) {
+        size_t      capacity = t->capacity ? 2 * t->capacity : 16;
+        HpackField *fields   = realloc(t->fields, capacity * sizeof(HpackField));
+        if (!fields) {
+            return false;
+        }
+        t->fields   = fields;
+        t->capacity = capacity;
+    }
+    memmove(&t->fields[1], &t->fields[0], t->count * sizeof(HpackField));
+    t->fields[0].name  = strdup(name);
+    t->fields[0].value = strdup(value);
+    t->count++;
+    t->size += size;
+    return t->fields[0].name && t->fields[0].value;
+}
+
+/**
+ * Lookup entry by index in the combined static and dynamic table.
+ **/
+static bool hpack_lookup(HpackTable *t, uint32_t index, const char **name, const char **value) {
+    if (index == 0) {
+        return false;
+    }
+    if (index <= HPACK_STATIC_COUNT) {
+        *name  = StaticTable[index - 1].name;
+        *value = StaticTable[index - 1].value;
+        return true;
+    }
+    index -= HPACK_STATIC_COUNT + 1;
+    if (index >= t->count) {
+        return false;
+    }
+    *name  = t->fields[index].name;
+    *value = t->fields[index].value;
+    return true;
+}
+
+/**
+ * Initialize decoding table.
+ *
+ * @param   t           HPACK table.
+ * @param   max_size    SETTINGS_HEADER_TABLE_SIZE advertised to the peer.
+ **/
+void hpack_table_init(HpackTable *t, size_t max_size) {
+    memset(t, 0, sizeof(HpackTable));
+    t->max_size = t->limit = max_size;
+}
+
+/**
+ * Release every entry of decoding table.
+ **/
+void hpack_table_free(HpackTable *t) {
+    hpack_evict(t, 0);
+    free(t->fields);
+    t->fields   = NULL;
+    t->capacity = 0;
+}
+
+/**
+ * Decode header block.
+ *
+ * @param   t           HPACK decoding table for the connection.
+ * @param   block       Complete header block (all CONTINUATION frames joined).
+ * @param   length      Length of header block.
+ * @param   headers     Decoded list of headers (including pseudo-headers).
+ * @return  true if successful, false on a compression error.
+ *
+ * The dynamic table is updated even when the caller ends up refusing the
+ * stream, so later header blocks still decode.
+ **/
+bool hpack_decode(HpackTable *t, const uint8_t *block, size_t length, Header **headers) {
+    const uint8_t *p    = block;
+    const uint8_t *end  = block + length;
+    Header        *head = NULL;
+    Header       **cur  = &head;
+    size_t         size = 0;
+
+    while (p < end) {
+        uint32_t    index;
+        const char *name  = NULL;
+        const char *value = NULL;
+        char       *literal_name  = NULL;
+        char       *literal_value = NULL;
+        bool        indexing = false;
+
+        if (*p & 0x80) {
+            /* Indexed Header Field */
+            if (!hpack_integer(&p, end, 7, &index) || !hpack_lookup(t, index, &name, &value)) {
+                goto fail;
+            }
+        } else if ((*p & 0xe0) == 0x20) {
+            /* Dynamic Table Size Update */
+            if (!hpack_integer(&p, end, 5, &index) || index > t->limit || head) {
+                goto fail;
+            }
+            t->max_size = index;
+            hpack_evict(t, t->max_size);
+            continue;
+        } else {
+            /* Literal Header Field with, without or never indexing */
+            int prefix = 4;
+            if (*p & 0x40) {
+                prefix   = 6;
+                indexing = true;
+            }
+            if (!hpack_integer(&p, end, prefix, &index)) {
+                goto fail;
+            }
+            if (index) {
+                if (!hpack_lookup(t, index, &name, &value)) {
+                    goto fail;
+                }
+            } else if (!(name = literal_name = hpack_string(&p, end))) {
+                goto fail;
+            }
+            if (!(value = literal_value = hpack_string(&p, end))) {
+                free(literal_name);
+                goto fail;
+            }
+        }
+
+        *cur = calloc(1, sizeof(Header));
+        if (*cur) {
+            (*cur)->name = strdup(name);
+            (*cur)->data = strdup(value);
+        }
+        bool stored = *cur && (*cur)->name && (*cur)->data &&
+                      (!indexing || hpack_insert(t, name, value));
+        size += strlen(name) + strlen(value) + HPACK_ENTRY_OVERHEAD;
+        free(literal_name);
+        free(literal_value);
+        if (!stored || size > HPACK_LIST_MAX) {
+            goto fail;
+        }
+        cur = &(*cur)->next;
+    }
+
+    *headers = head;
+    return true;
+
+fail:
+    debug("Invalid HPACK header block");
+    free_headers(head);
+    return false;
+}
+
+/**
+ * Encode integer with an N-bit prefix.
+ **/
+static size_t hpack_encode_integer(uint8_t *buffer, size_t size, uint8_t flags, int prefix, uint32_t value) {
+    uint32_t mask = (1U << prefix) - 1;
+    size_t   n    = 0;
+
+    if (size == 0) {
+        return 0;
+    }
+    if (value < mask) {
+        buffer[n++] = flags | value;
+        return n;
+    }
+    buffer[n++] = flags | mask;
+    for (value -= mask; value >= 0x80; value >>= 7) {
+        if (n == size) {
+            return 0;
+        }
+        buffer[n++] = (value & 0x7f) | 0x80;
+    }
+    if (n == size) {
+        return 0;
+    }
+    buffer[n++] = value;
+    return n;
+}
+
+/**
+ * Encode raw string literal.
+ **/
+static size_t hpack_encode_string(uint8_t *buffer, size_t size, const char *s) {
+    size_t length = strlen(s);
+    size_t n      = hpack_encode_integer(buffer, size, 0x00, 7, length);
+    if (n == 0 || size - n < length) {
+        return 0;
+    }
+    memcpy(buffer + n, s, length);
+    return n + length;
+}
+
+/**
+ * Encode response header field.
+ *
+ * @param   buffer      Output buffer.
+ * @param   size        Space left in buffer.
+ * @param   name        Header name (lowercase).
+ * @param   value       Header value.
+ * @return  Number of bytes written (0 if there was no room).
+ *
+ * Response headers are sent as literals without indexing, so the peer's
+ * SETTINGS_HEADER_TABLE_SIZE never matters and no encoder state is kept.
+ **/
+size_t hpack_encode(uint8_t *buffer, size_t size, const char *name, const char *value) {
+    if (size == 0) {
+        return 0;
+    }
+    buffer[0] = 0x00;
+    size_t n = hpack_encode_string(buffer + 1, size - 1, name);
+    size_t m = n ? hpack_encode_string(buffer + 1 + n, size - 1 - n, value) : 0;
+    return m ? 1 + n + m : 0;
+}
+
+/**
+ * Encode :status pseudo-header.
+ *
+ * @param   buffer      Output buffer.
+ * @param   size        Space left in buffer.
+ * @param   status      Numeric HTTP status code.
+ * @return  Number of bytes written (0 if there was no room or the status
+ *          is not three digits).
+ **/
+size_t hpack_encode_status(uint8_t *buffer, size_t size, int status) {
+    char value[4];
+
+    /* Common codes are in the static table (indices 8 - 14) */
+    for (uint32_t i = 8; i <= 14; i++) {
+        if (atoi(StaticTable[i - 1].value) == status) {
+            return hpack_encode_integer(buffer, size, 0x80, 7, i);
+        }
+    }
+
+    /* Literal without indexing, name from static table entry 8 (:status) */
+    if (status < 100 || status > 999) {
+        return 0;
+    }
+    snprintf(value, sizeof(value), "%d", status);
+    size_t n = hpack_encode_integer(buffer, size, 0x00, 4, 8);
+    size_t m = n ? hpack_encode_string(buffer + n, size - n, value) : 0;
+    return m ? n + m : 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
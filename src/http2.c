@@ -0,0 +1,1129 @@
+/* http2.c: Cleartext HTTP/2 (h2c) */
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Each stream is served by a producer: a forked process that runs the usual
+ * handle_request with its response stream pointed at a pipe.  The connection
+ * process reads every pipe it has window for, turns the HTTP/1 response head
+ * into a HEADERS frame and the rest into DATA frames, so the file, browse and
+ * CGI handlers stay untouched while one connection carries many responses at
+ * once.  A producer whose stream has no send window left simply blocks on its
+ * full pipe.
+ */
+
+/* Constants */
+
+#define H2_PREFACE          "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LENGTH   24
+#define H2_PREFACE_REQUEST  18          /* "PRI * HTTP/2.0\r\n\r\n" */
+#define H2_FRAME_HEADER     9
+#define H2_FRAME_SIZE       16384       /* SETTINGS_MAX_FRAME_SIZE we accept */
+#define H2_FRAME_SIZE_MAX   16777215
+#define H2_WINDOW           65535       /* Initial flow control window */
+#define H2_WINDOW_MAX       0x7fffffff
+#define H2_STREAMS          32          /* SETTINGS_MAX_CONCURRENT_STREAMS */
+#define H2_BLOCK_MAX        (4 * BUFSIZ)    /* Largest header block we assemble */
+
+/* Frame Types */
+
+enum {
+    H2_DATA = 0,
+    H2_HEADERS,
+    H2_PRIORITY,
+    H2_RST_STREAM,
+    H2_SETTINGS,
+    H2_PUSH_PROMISE,
+    H2_PING,
+    H2_GOAWAY,
+    H2_WINDOW_UPDATE,
+    H2_CONTINUATION,
+};
+
+/* Frame Flags */
+
+#define H2_END_STREAM       0x01
+#define H2_ACK              0x01
+#define H2_END_HEADERS      0x04
+#define H2_PADDED           0x08
+#define H2_PRIORITY_FLAG    0x20
+
+/* Error Codes */
+
+enum {
+    H2_NO_ERROR = 0,
+    H2_PROTOCOL_ERROR,
+    H2_INTERNAL_ERROR,
+    H2_FLOW_CONTROL_ERROR,
+    H2_SETTINGS_TIMEOUT,
+    H2_STREAM_CLOSED,
+    H2_FRAME_SIZE_ERROR,
+    H2_REFUSED_STREAM,
+    H2_CANCEL,
+    H2_COMPRESSION_ERROR,
+    H2_CONNECT_ERROR,
+    H2_ENHANCE_YOUR_CALM,
+};
+
+/* Settings */
+
+enum {
+    H2_SETTINGS_HEADER_TABLE_SIZE = 1,
+    H2_SETTINGS_ENABLE_PUSH,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE,
+    H2_SETTINGS_MAX_FRAME_SIZE,
+    H2_SETTINGS_MAX_HEADER_LIST_SIZE,
+};
+
+/* Structures */
+
+typedef struct {
+    uint32_t    id;                     /*< Stream identifier (0 if slot is free) */
+    pid_t       pid;                    /*< Producer process (0 once reaped) */
+    int         fd;                     /*< Producer pipe (-1 once at EOF) */
+    int32_t     window;                 /*< Send window */
+    bool        head_only;              /*< HEAD request: discard the body */
+    bool        responded;              /*< HEADERS frame sent */
+    bool        remote_closed;          /*< Peer sent END_STREAM */
+    bool        closed;                 /*< We sent END_STREAM or RST_STREAM */
+    size_t      length;                 /*< Bytes in buffer */
+    size_t      offset;                 /*< Bytes of buffer already sent */
+    uint8_t     buffer[H2_FRAME_SIZE];  /*< Response bytes read from producer */
+} H2Stream;
+
+typedef struct {
+    Request    *request;                /*< Connection socket and client address */
+    HpackTable  decoder;                /*< Request header decoding table */
+    H2Stream    streams[H2_STREAMS];
+    size_t      active;                 /*< Streams occupying a slot */
+    uint32_t    last_stream;            /*< Highest stream opened by the peer */
+    int32_t     window;                 /*< Connection send window */
+    int32_t     initial_window;         /*< Peer SETTINGS_INITIAL_WINDOW_SIZE */
+    uint32_t    max_frame;              /*< Peer SETTINGS_MAX_FRAME_SIZE */
+    bool        preface;                /*< Client connection preface received */
+    bool        goaway;                 /*< No new streams will be accepted */
+    bool        broken;                 /*< Socket can no longer be written */
+    uint8_t     input[H2_FRAME_HEADER + H2_FRAME_SIZE];
+    size_t      input_length;
+    uint8_t     block[H2_BLOCK_MAX];    /*< Header block being assembled */
+    size_t      block_length;
+    uint32_t    block_stream;           /*< Stream expecting CONTINUATION (0 if none) */
+    bool        block_end_stream;       /*< END_STREAM seen on the HEADERS frame */
+} H2Connection;
+
+/* Byte Order Helpers */
+
+static uint32_t h2_get24(const uint8_t *p) {
+    return ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+}
+
+static uint32_t h2_get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void h2_put32(uint8_t *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+/**
+ * Write frame to the connection.
+ *
+ * @return  true if the whole frame was written.
+ **/
+static bool h2_frame(H2Connection *c, uint8_t type, uint8_t flags, uint32_t stream, const void *payload, size_t length) {
+    uint8_t header[H2_FRAME_HEADER] = {
+        length >> 16, length >> 8, length, type, flags,
+    };
+    h2_put32(header + 5, stream & H2_WINDOW_MAX);
+
+    struct iovec iov[2] = {
+        {.iov_base = header,          .iov_len = sizeof(header)},
+        {.iov_base = (void *)payload, .iov_len = length},
+    };
+    int     iovcnt = 2;
+    struct iovec *v = iov;
+
+    if (c->broken) {
+        return false;
+    }
+    while (iovcnt > 0) {
+        ssize_t n = writev(c->request->fd, v, iovcnt);
+        if (n < 0 && (errno == EINTR || (errno == EAGAIN && coroutine_wait(c->request->fd, POLLOUT, WriteTimeout)))) {
+            continue;
+        }
+        if (n <= 0) {
+            debug("Unable to write frame: %s", strerror(errno));
+            c->broken = true;
+            return false;
+        }
+        while (iovcnt > 0 && (size_t)n >= v->iov_len) {
+            n -= v->iov_len;
+            v++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            v->iov_base = (uint8_t *)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+static void h2_goaway(H2Connection *c, uint32_t error) {
+    uint8_t payload[8];
+    h2_put32(payload, c->last_stream);
+    h2_put32(payload + 4, error);
+    h2_frame(c, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+    c->goaway = true;
+}
+
+static void h2_window_update(H2Connection *c, uint32_t stream, uint32_t increment) {
+    uint8_t payload[4];
+    h2_put32(payload, increment);
+    h2_frame(c, H2_WINDOW_UPDATE, 0, stream, payload, sizeof(payload));
+}
+
+static H2Stream * h2_stream_find(H2Connection *c, uint32_t id) {
+    for (int i = 0; i < H2_STREAMS; i++) {
+        if (c->streams[i].id == id) {
+            return &c->streams[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Free stream slot once both sides are done and the producer is reaped.
+ **/
+static void h2_stream_release(H2Connection *c, H2Stream *s) {
+    if (s->id && s->closed && s->fd < 0 && !s->pid) {
+        s->id = 0;
+        c->active--;
+    }
+}
+
+/**
+ * Stop producing a stream (its producer sees EPIPE and exits).
+ **/
+static void h2_stream_close(H2Connection *c, H2Stream *s) {
+    if (s->fd >= 0) {
+        close(s->fd);
+        s->fd = -1;
+    }
+    s->closed = true;
+    h2_stream_release(c, s);
+}
+
+static void h2_reset(H2Connection *c, H2Stream *s, uint32_t id, uint32_t error) {
+    uint8_t payload[4];
+    h2_put32(payload, error);
+    h2_frame(c, H2_RST_STREAM, 0, id, payload, sizeof(payload));
+    if (s) {
+        h2_stream_close(c, s);
+    }
+}
+
+/**
+ * Reap producers that have exited.
+ **/
+static void h2_reap(H2Connection *c, bool wait) {
+    for (int i = 0; i < H2_STREAMS; i++) {
+        H2Stream *s = &c->streams[i];
+        if (s->pid && waitpid(s->pid, NULL, wait ? 0 : WNOHANG) != 0) {
+            s->pid = 0;
+            h2_stream_release(c, s);
+        }
+    }
+}
+
+/**
+ * Fork producer for a stream.
+ *
+ * @param   c           HTTP/2 connection.
+ * @param   s           Stream slot.
+ * @param   r           Parsed request (method, uri, query, headers); freed.
+ * @return  true if the producer was started.
+ **/
+static bool h2_produce(H2Connection *c, H2Stream *s, Request *r) {
+    int fds[2];
+
+    r->addr = c->request->addr;
+    s->head_only = streq(r->method, "HEAD");
+
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        debug("Unable to create producer pipe: %s", strerror(errno));
+        free_request(r);
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        log("Unable to fork producer: %s", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        free_request(r);
+        return false;
+    }
+
+    if (pid == 0) {
+        /* Producer: only the write end of its own pipe stays open */
+        close(fds[0]);
+        close(c->request->fd);
+        for (int i = 0; i < H2_STREAMS; i++) {
+            if (c->streams[i].fd >= 0) {
+                close(c->streams[i].fd);
+            }
+        }
+        event_loop_detach();
+
+        r->fd = fds[1];
+        if (request_attach(r)) {
+            handle_request(r);
+        }
+        free_request(r);
+        _exit(EXIT_SUCCESS);
+    }
+
+    close(fds[1]);
+    free_request(r);
+    s->pid = pid;
+    s->fd  = fds[0];
+    return true;
+}
+
+/**
+ * Build request from a decoded header block.
+ *
+ * @param   headers     Decoded headers (consumed).
+ * @return  Newly allocated Request (or NULL if the pseudo-headers are invalid).
+ **/
+static Request * h2_request(Header *headers) {
+    Request *r = calloc(1, sizeof(Request));
+    char    *authority = NULL;
+    Header **cur = &r->headers;
+
+    if (!r) {
+        free_headers(headers);
+        return NULL;
+    }
+    r->fd = -1;
+
+    /* Pseudo-headers become the request line; the rest stay headers */
+    while (headers) {
+        Header *h = headers;
+        headers = h->next;
+        h->next = NULL;
+
+        if (h->name[0] != ':') {
+            *cur = h;
+            cur  = &h->next;
+            continue;
+        }
+        if (streq(h->name, ":method") && !r->method) {
+            r->method = h->data;
+            h->data   = NULL;
+        } else if (streq(h->name, ":path") && !r->uri) {
+            r->uri  = h->data;
+            h->data = NULL;
+        } else if (streq(h->name, ":authority") && !authority) {
+            authority = h->data;
+            h->data   = NULL;
+        }
+        free_headers(h);
+    }
+
+    if (!r->method || !r->uri || r->uri[0] != '/') {
+        free(authority);
+        free_request(r);
+        return NULL;
+    }
+
+    char *query = strchr(r->uri, '?');
+    if (query) {
+        r->query = strdup(query + 1);
+    }
+
+    /* :authority stands in for Host (CGI scripts expect HTTP_HOST) */
+    if (authority && !request_header(r, "Host")) {
+        Header *h = calloc(1, sizeof(Header));
+        if (h) {
+            h->name    = strdup("Host");
+            h->data    = authority;
+            h->next    = r->headers;
+            r->headers = h;
+            authority  = NULL;
+        }
+    }
+    free(authority);
+
+    debug("HTTP/2 REQUEST: %s %s", r->method, r->uri);
+    return r;
+}
+
+/**
+ * Open stream slot for a new peer stream.
+ **/
+static H2Stream * h2_stream_open(H2Connection *c, uint32_t id) {
+    for (int i = 0; i < H2_STREAMS; i++) {
+        H2Stream *s = &c->streams[i];
+        if (!s->id) {
+            memset(s, 0, offsetof(H2Stream, buffer));
+            s->id     = id;
+            s->fd     = -1;
+            s->window = c->initial_window;
+            c->active++;
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Start stream once its complete header block has been received.
+ *
+ * @return  Connection error code (H2_NO_ERROR if the connection is fine).
+ **/
+static uint32_t h2_headers_complete(H2Connection *c, uint32_t id, bool end_stream) {
+    Header *headers;
+
+    /* Decode even if the stream is refused: the table must stay in sync */
+    if (!hpack_decode(&c->decoder, c->block, c->block_length, &headers)) {
+        return H2_COMPRESSION_ERROR;
+    }
+    c->block_length = 0;
+    c->block_stream = 0;
+
+    H2Stream *s = h2_stream_find(c, id);
+    if (s) {
+        /* Trailers: nothing to do besides noting the end of the stream */
+        free_headers(headers);
+        if (end_stream) {
+            s->remote_closed = true;
+        }
+        return H2_NO_ERROR;
+    }
+
+    if (c->goaway || !(s = h2_stream_open(c, id))) {
+        free_headers(headers);
+        h2_reset(c, NULL, id, H2_REFUSED_STREAM);
+        return H2_NO_ERROR;
+    }
+    s->remote_closed = end_stream;
+
+    Request *r = h2_request(headers);
+    if (!r) {
+        h2_reset(c, s, id, H2_PROTOCOL_ERROR);
+    } else if (!h2_produce(c, s, r)) {
+        h2_reset(c, s, id, H2_INTERNAL_ERROR);
+    }
+    return H2_NO_ERROR;
+}
+
+/**
+ * Append header block fragment.
+ **/
+static uint32_t h2_block_append(H2Connection *c, const uint8_t *fragment, size_t length) {
+    if (c->block_length + length > sizeof(c->block)) {
+        return H2_ENHANCE_YOUR_CALM;
+    }
+    memcpy(c->block + c->block_length, fragment, length);
+    c->block_length += length;
+    return H2_NO_ERROR;
+}
+
+/**
+ * Turn the producer's HTTP/1 response head into a HEADERS frame.
+ *
+ * @return  true if the head was complete and has been sent (or rejected).
+ *
+ * Both a full status line and a CGI style header block (with an optional
+ * Status header) are accepted.  Hop-by-hop headers are dropped since they
+ * are meaningless in HTTP/2.
+ **/
+static bool h2_respond(H2Connection *c, H2Stream *s) {
+    char    head[H2_FRAME_SIZE + 1];
+    uint8_t block[H2_FRAME_SIZE];
+    size_t  length = 0;
+    int     status = 200;
+
+    memcpy(head, s->buffer, s->length);
+    head[s->length] = '\0';
+
+    char *crlf = strstr(head, "\r\n\r\n");
+    char *lf   = strstr(head, "\n\n");
+    char *end  = crlf && (!lf || crlf < lf) ? crlf + 4 : (lf ? lf + 2 : NULL);
+    if (!end) {
+        if (s->fd >= 0 && s->length < sizeof(s->buffer)) {
+            return false;
+        }
+        /* Producer ended (or overflowed) without a complete head */
+        s->length = s->offset = 0;
+        length = hpack_encode_status(block, sizeof(block), 500);
+        s->responded = true;
+        h2_frame(c, H2_HEADERS, H2_END_HEADERS | H2_END_STREAM, s->id, block, length);
+        h2_stream_close(c, s);
+        return true;
+    }
+    s->offset = end - head;
+    *end = '\0';
+
+    char *save;
+    char *line = strtok_r(head, "\r\n", &save);
+    if (line && strncmp(line, "HTTP/", 5) == 0) {
+        char *code = strchr(line, ' ');
+        status = code ? atoi(code + 1) : 500;
+        line   = strtok_r(NULL, "\r\n", &save);
+    }
+
+    uint8_t fields[H2_FRAME_SIZE];
+    size_t  nfields = 0;
+    for (; line; line = strtok_r(NULL, "\r\n", &save)) {
+        char *value = strchr(line, ':');
+        if (!value) {
+            continue;
+        }
+        *value++ = '\0';
+        value = skip_whitespace(value);
+        for (char *p = line; *p; p++) {
+            *p = tolower((unsigned char)*p);
+        }
+
+        if (streq(line, "status")) {
+            status = atoi(value);
+            continue;
+        }
+        if (streq(line, "connection") || streq(line, "keep-alive") ||
+            streq(line, "transfer-encoding") || streq(line, "upgrade") ||
+            streq(line, "proxy-connection")) {
+            continue;
+        }
+
+        size_t n = hpack_encode(fields + nfields, sizeof(fields) - nfields, line, value);
+        if (n == 0) {
+            status  = 500;
+            nfields = 0;
+            break;
+        }
+        nfields += n;
+    }
+
+    length = hpack_encode_status(block, sizeof(block), status);
+    if (length == 0 || length + nfields > c->max_frame) {
+        length  = hpack_encode_status(block, sizeof(block), 500);
+        nfields = 0;
+    }
+    memcpy(block + length, fields, nfields);
+    length += nfields;
+
+    s->responded = true;
+    h2_frame(c, H2_HEADERS, H2_END_HEADERS, s->id, block, length);
+    return true;
+}
+
+/**
+ * Send buffered response bytes as far as the flow control windows allow.
+ **/
+static void h2_flush(H2Connection *c, H2Stream *s) {
+    if (!s->id || s->closed || !s->responded) {
+        return;
+    }
+    if (s->head_only) {
+        s->offset = s->length;
+    }
+
+    while (s->offset < s->length) {
+        size_t n = s->length - s->offset;
+        if (n > (size_t)s->window)  n = s->window > 0 ? s->window : 0;
+        if (n > (size_t)c->window)  n = c->window > 0 ? c->window : 0;
+        if (n > c->max_frame)       n = c->max_frame;
+        if (n == 0) {
+            return;
+        }
+
+        uint8_t flags = (s->fd < 0 && s->offset + n == s->length) ? H2_END_STREAM : 0;
+        if (!h2_frame(c, H2_DATA, flags, s->id, s->buffer + s->offset, n)) {
+            return;
+        }
+        s->offset += n;
+        s->window -= n;
+        c->window -= n;
+        if (flags) {
+            h2_stream_close(c, s);
+            return;
+        }
+    }
+
+    s->offset = s->length = 0;
+    if (s->fd < 0) {
+        h2_frame(c, H2_DATA, H2_END_STREAM, s->id, NULL, 0);
+        h2_stream_close(c, s);
+    }
+}
+
+/**
+ * Read more of a producer's response.
+ **/
+static void h2_pump(H2Connection *c, H2Stream *s) {
+    ssize_t n = read(s->fd, s->buffer + s->length, sizeof(s->buffer) - s->length);
+    if (n < 0 && errno == EINTR) {
+        return;
+    }
+    if (n <= 0) {
+        close(s->fd);
+        s->fd = -1;
+    } else {
+        s->length += n;
+    }
+
+    if (!s->responded && !h2_respond(c, s)) {
+        return;
+    }
+    h2_flush(c, s);
+}
+
+/**
+ * Apply the peer's SETTINGS.
+ *
+ * @return  Connection error code (H2_NO_ERROR if the settings are valid).
+ **/
+static uint32_t h2_settings(H2Connection *c, const uint8_t *payload, size_t length) {
+    if (length % 6) {
+        return H2_FRAME_SIZE_ERROR;
+    }
+    for (size_t i = 0; i < length; i += 6) {
+        uint16_t id    = (payload[i] << 8) | payload[i + 1];
+        uint32_t value = h2_get32(payload + i + 2);
+
+        switch (id) {
+            case H2_SETTINGS_ENABLE_PUSH:
+                if (value > 1) {
+                    return H2_PROTOCOL_ERROR;
+                }
+                break;
+            case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+                if (value > H2_WINDOW_MAX) {
+                    return H2_FLOW_CONTROL_ERROR;
+                }
+                /* Adjust every open stream by the difference */
+                for (int s = 0; s < H2_STREAMS; s++) {
+                    if (c->streams[s].id) {
+                        int64_t window = (int64_t)c->streams[s].window + value - c->initial_window;
+                        if (window > H2_WINDOW_MAX) {
+                            return H2_FLOW_CONTROL_ERROR;
+                        }
+                        c->streams[s].window = window;
+                    }
+                }
+                c->initial_window = value;
+                break;
+            case H2_SETTINGS_MAX_FRAME_SIZE:
+                if (value < H2_FRAME_SIZE || value > H2_FRAME_SIZE_MAX) {
+                    return H2_PROTOCOL_ERROR;
+                }
+                c->max_frame = value;
+                break;
+            default:
+                /* Header table size only matters to an indexing encoder */
+                break;
+        }
+    }
+    return H2_NO_ERROR;
+}
+
+/**
+ * Handle one frame from the peer.
+ *
+ * @return  Connection error code (H2_NO_ERROR if the connection is fine).
+ **/
+static uint32_t h2_received(H2Connection *c, uint8_t type, uint8_t flags, uint32_t id, const uint8_t *payload, uint32_t length) {
+    H2Stream *s = id ? h2_stream_find(c, id) : NULL;
+    uint32_t  error;
+
+    /* A header block must not be interleaved with any other frame */
+    if (c->block_stream && (type != H2_CONTINUATION || id != c->block_stream)) {
+        return H2_PROTOCOL_ERROR;
+    }
+
+    switch (type) {
+        case H2_DATA:
+            if (id == 0 || id > c->last_stream) {
+                return H2_PROTOCOL_ERROR;
+            }
+            /* Request bodies are not used: hand the window straight back */
+            if (length > 0) {
+                h2_window_update(c, 0, length);
+                if (s && !s->remote_closed && !(flags & H2_END_STREAM)) {
+                    h2_window_update(c, id, length);
+                }
+            }
+            if (s && s->remote_closed) {
+                h2_reset(c, s, id, H2_STREAM_CLOSED);
+            } else if (s && (flags & H2_END_STREAM)) {
+                s->remote_closed = true;
+            }
+            break;
+
+        case H2_HEADERS: {
+            size_t offset  = 0;
+            size_t padding = 0;
+            if (id == 0 || !(id & 1)) {
+                return H2_PROTOCOL_ERROR;
+            }
+            if (flags & H2_PADDED) {
+                if (length < 1) {
+                    return H2_FRAME_SIZE_ERROR;
+                }
+                padding = payload[offset++];
+            }
+            if (flags & H2_PRIORITY_FLAG) {
+                offset += 5;
+            }
+            if (offset + padding > length) {
+                return H2_PROTOCOL_ERROR;
+            }
+            if (!s && id <= c->last_stream) {
+                return H2_STREAM_CLOSED;
+            }
+            if (id > c->last_stream) {
+                c->last_stream = id;
+            }
+            if ((error = h2_block_append(c, payload + offset, length - offset - padding))) {
+                return error;
+            }
+            if (flags & H2_END_HEADERS) {
+                return h2_headers_complete(c, id, flags & H2_END_STREAM);
+            }
+            c->block_stream     = id;
+            c->block_end_stream = flags & H2_END_STREAM;
+            break;
+        }
+
+        case H2_CONTINUATION:
+            if (!c->block_stream || id != c->block_stream) {
+                return H2_PROTOCOL_ERROR;
+            }
+            if ((error = h2_block_append(c, payload, length))) {
+                return error;
+            }
+            if (flags & H2_END_HEADERS) {
+                return h2_headers_complete(c, id, c->block_end_stream);
+            }
+            break;
+
+        case H2_PRIORITY:
+            if (id == 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+            if (length != 5) {
+                h2_reset(c, s, id, H2_FRAME_SIZE_ERROR);
+            }
+            break;
+
+        case H2_RST_STREAM:
+            if (id == 0 || id > c->last_stream) {
+                return H2_PROTOCOL_ERROR;
+            }
+            if (length != 4) {
+                return H2_FRAME_SIZE_ERROR;
+            }
+            if (s) {
+                s->remote_closed = true;
+                h2_stream_close(c, s);
+            }
+            break;
+
+        case H2_SETTINGS:
+            if (id != 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+            if (flags & H2_ACK) {
+                return length ? H2_FRAME_SIZE_ERROR : H2_NO_ERROR;
+            }
+            if ((error = h2_settings(c, payload, length))) {
+                return error;
+            }
+            h2_frame(c, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+            for (int i = 0; i < H2_STREAMS; i++) {
+                h2_flush(c, &c->streams[i]);
+            }
+            break;
+
+        case H2_PUSH_PROMISE:
+            return H2_PROTOCOL_ERROR;
+
+        case H2_PING:
+            if (id != 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+            if (length != 8) {
+                return H2_FRAME_SIZE_ERROR;
+            }
+            if (!(flags & H2_ACK)) {
+                h2_frame(c, H2_PING, H2_ACK, 0, payload, length);
+            }
+            break;
+
+        case H2_GOAWAY:
+            if (id != 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+            /* Finish the streams already started, but open no more */
+            c->goaway = true;
+            break;
+
+        case H2_WINDOW_UPDATE: {
+            if (length != 4) {
+                return H2_FRAME_SIZE_ERROR;
+            }
+            uint32_t increment = h2_get32(payload) & H2_WINDOW_MAX;
+            if (id == 0) {
+                if (increment == 0 || (int64_t)c->window + increment > H2_WINDOW_MAX) {
+                    return increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR;
+                }
+                c->window += increment;
+                for (int i = 0; i < H2_STREAMS; i++) {
+                    h2_flush(c, &c->streams[i]);
+                }
+            } else if (s) {
+                if (increment == 0 || (int64_t)s->window + increment > H2_WINDOW_MAX) {
+                    h2_reset(c, s, id, increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+                } else {
+                    s->window += increment;
+                    h2_flush(c, s);
+                }
+            } else if (id > c->last_stream) {
+                return H2_PROTOCOL_ERROR;
+            }
+            break;
+        }
+
+        default:
+            /* Unknown frame types must be ignored */
+            break;
+    }
+    return H2_NO_ERROR;
+}
+
+/**
+ * Read from the socket and handle every complete frame.
+ *
+ * @return  false once the connection is done (closed by peer or in error).
+ **/
+static bool h2_read(H2Connection *c) {
+    ssize_t n = read(c->request->fd, c->input + c->input_length, sizeof(c->input) - c->input_length);
+    if (n < 0 && errno == EINTR) {
+        return true;
+    }
+    if (n <= 0) {
+        return false;
+    }
+    c->input_length += n;
+
+    size_t offset = 0;
+    if (!c->preface) {
+        size_t check = c->input_length < H2_PREFACE_LENGTH ? c->input_length : H2_PREFACE_LENGTH;
+        if (memcmp(c->input, H2_PREFACE, check) != 0) {
+            h2_goaway(c, H2_PROTOCOL_ERROR);
+            return false;
+        }
+        if (check < H2_PREFACE_LENGTH) {
+            return true;
+        }
+        c->preface = true;
+        offset = H2_PREFACE_LENGTH;
+    }
+
+    while (c->input_length - offset >= H2_FRAME_HEADER) {
+        const uint8_t *header = c->input + offset;
+        uint32_t length = h2_get24(header);
+        if (length > H2_FRAME_SIZE) {
+            h2_goaway(c, H2_FRAME_SIZE_ERROR);
+            return false;
+        }
+        if (c->input_length - offset < H2_FRAME_HEADER + length) {
+            break;
+        }
+
+        uint32_t error = h2_received(c, header[3], header[4], h2_get32(header + 5) & H2_WINDOW_MAX,
+                                     header + H2_FRAME_HEADER, length);
+        if (error) {
+            debug("HTTP/2 connection error %u", error);
+            h2_goaway(c, error);
+            return false;
+        }
+        offset += H2_FRAME_HEADER + length;
+    }
+
+    memmove(c->input, c->input + offset, c->input_length - offset);
+    c->input_length -= offset;
+    return !c->broken;
+}
+
+/**
+ * Serve connection until the peer goes away or it has been idle too long.
+ **/
+static void h2_run(H2Connection *c) {
+    struct pollfd fds[1 + H2_STREAMS];
+    H2Stream     *polled[1 + H2_STREAMS];
+
+    while (!c->broken && !(c->goaway && c->active == 0)) {
+        nfds_t n = 0;
+
+        fds[n].fd     = c->request->fd;
+        fds[n].events = POLLIN;
+        polled[n++]   = NULL;
+
+        /* Only read producers whose output can go out right away, so the
+         * rest are held back by their full pipes */
+        for (int i = 0; i < H2_STREAMS; i++) {
+            H2Stream *s = &c->streams[i];
+            if (s->id && s->fd >= 0 && !s->closed &&
+                (!s->responded || (s->offset == s->length && s->window > 0 && c->window > 0))) {
+                fds[n].fd     = s->fd;
+                fds[n].events = POLLIN;
+                polled[n++]   = s;
+            }
+        }
+
+        /* An idle connection is closed after IdleTimeout; a busy one that
+         * makes no progress for WriteTimeout is given up on */
+        int timeout = c->active ? WriteTimeout : IdleTimeout;
+        hybrid_idle();
+        coroutine_idle();
+        int ready   = coroutine_poll(fds, n, timeout > 0 ? timeout : -1);
+        coroutine_busy();
+        hybrid_busy();
+        if (ready < 0 && errno != EINTR) {
+            debug("Unable to poll: %s", strerror(errno));
+            break;
+        }
+        if (ready == 0) {
+            debug("HTTP/2 connection timed out");
+            h2_goaway(c, H2_NO_ERROR);
+            break;
+        }
+
+        for (nfds_t i = 1; i < n && ready > 0; i++) {
+            if (fds[i].revents && polled[i]->fd >= 0) {
+                h2_pump(c, polled[i]);
+            }
+        }
+        if (ready > 0 && fds[0].revents && !h2_read(c)) {
+            break;
+        }
+        h2_reap(c, false);
+    }
+}
+
+/**
+ * Allocate connection state and send our SETTINGS.
+ **/
+static H2Connection * h2_connection(Request *r) {
+    H2Connection *c = calloc(1, sizeof(H2Connection));
+    if (!c) {
+        debug("Unable to allocate HTTP/2 connection: %s", strerror(errno));
+        return NULL;
+    }
+    c->request        = r;
+    c->window         = H2_WINDOW;
+    c->initial_window = H2_WINDOW;
+    c->max_frame      = H2_FRAME_SIZE;
+    hpack_table_init(&c->decoder, HPACK_TABLE_SIZE);
+    for (int i = 0; i < H2_STREAMS; i++) {
+        c->streams[i].fd = -1;
+    }
+    return c;
+}
+
+static void h2_send_settings(H2Connection *c) {
+    uint8_t payload[6] = {0, H2_SETTINGS_MAX_CONCURRENT_STREAMS};
+    h2_put32(payload + 2, H2_STREAMS);
+    h2_frame(c, H2_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+/**
+ * Tear down connection: stop every producer and wait for it.
+ **/
+static void h2_finish(H2Connection *c) {
+    for (int i = 0; i < H2_STREAMS; i++) {
+        if (c->streams[i].fd >= 0) {
+            close(c->streams[i].fd);
+            c->streams[i].fd = -1;
+        }
+    }
+    h2_reap(c, true);
+    hpack_table_free(&c->decoder);
+    free(c);
+}
+
+/**
+ * Check whether connection starts with the HTTP/2 connection preface.
+ *
+ * @param   r           Request whose headers have arrived (nothing read yet).
+ * @return  true if the client speaks HTTP/2 with prior knowledge.
+ *
+ * The preface is only peeked at; http2_serve reads and checks all of it.
+ **/
+bool http2_preface(Request *r) {
+    char    buffer[H2_PREFACE_REQUEST];
+    ssize_t n = recv(r->fd, buffer, sizeof(buffer), MSG_PEEK | MSG_DONTWAIT);
+    return n == H2_PREFACE_REQUEST && memcmp(buffer, H2_PREFACE, H2_PREFACE_REQUEST) == 0;
+}
+
+/**
+ * Serve HTTP/2 connection started with prior knowledge.
+ *
+ * @param   r           Connection request (nothing read yet).
+ * @return  HTTP_STATUS_OK once the connection is done.
+ **/
+Status http2_serve(Request *r) {
+    H2Connection *c = h2_connection(r);
+    if (!c) {
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+    log("HTTP/2 connection from %s:%s", request_host(r), request_port(r));
+    h2_send_settings(c);
+    h2_run(c);
+    h2_finish(c);
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Check whether a parsed HTTP/1 request asks to upgrade to h2c.
+ *
+ * @param   r           Parsed request.
+ * @return  true if the request carries Upgrade: h2c and HTTP2-Settings.
+ **/
+bool http2_upgradable(Request *r) {
+    const char *upgrade = request_header(r, "Upgrade");
+    if (!upgrade || !request_header(r, "HTTP2-Settings")) {
+        return false;
+    }
+    /* The request body would have to be read before switching protocols */
+    const char *length = request_header(r, "Content-Length");
+    if ((length && atoi(length) > 0) || request_header(r, "Transfer-Encoding")) {
+        return false;
+    }
+    if (!streq(r->method, "GET") && !streq(r->method, "HEAD")) {
+        return false;
+    }
+
+    char token[BUFSIZ];
+    strncpy(token, upgrade, sizeof(token) - 1);
+    token[sizeof(token) - 1] = '\0';
+    char *save;
+    for (char *t = strtok_r(token, ", \t", &save); t; t = strtok_r(NULL, ", \t", &save)) {
+        if (strcasecmp(t, "h2c") == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Decode base64url (no padding) as used by HTTP2-Settings.
+ *
+ * @return  Number of decoded bytes (or -1 if invalid).
+ **/
+static ssize_t h2_base64url(const char *src, uint8_t *dst, size_t size) {
+    uint32_t bits  = 0;
+    int      nbits = 0;
+    size_t   n     = 0;
+
+    for (; *src && *src != '='; src++) {
+        int v;
+        if (*src >= 'A' && *src <= 'Z')         v = *src - 'A';
+        else if (*src >= 'a' && *src <= 'z')    v = *src - 'a' + 26;
+        else if (*src >= '0' && *src <= '9')    v = *src - '0' + 52;
+        else if (*src == '-' || *src == '+')    v = 62;
+        else if (*src == '_' || *src == '/')    v = 63;
+        else                                    return -1;
+
+        bits   = (bits << 6) | v;
+        nbits += 6;
+        if (nbits >= 8) {
+            nbits -= 8;
+            if (n == size) {
+                return -1;
+            }
+            dst[n++] = bits >> nbits;
+        }
+    }
+    return n;
+}
+
+/**
+ * Switch an HTTP/1.1 request to HTTP/2 (Upgrade: h2c).
+ *
+ * @param   r           Parsed request that asked to upgrade.
+ * @return  HTTP_STATUS_OK once the connection is done.
+ *
+ * The request itself becomes stream 1, already half-closed by the client.
+ **/
+Status http2_upgrade(Request *r) {
+    static const char Switching[] =
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Connection: Upgrade\r\n"
+        "Upgrade: h2c\r\n"
+        "\r\n";
+    uint8_t settings[H2_FRAME_SIZE];
+
+    H2Connection *c = h2_connection(r);
+    if (!c) {
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    ssize_t length = h2_base64url(request_header(r, "HTTP2-Settings"), settings, sizeof(settings));
+    if (length < 0 || h2_settings(c, settings, length) != H2_NO_ERROR) {
+        debug("Invalid HTTP2-Settings");
+        h2_finish(c);
+        return HTTP_STATUS_BAD_REQUEST;
+    }
+
+    if (coroutine_write(r->fd, Switching, sizeof(Switching) - 1, WriteTimeout) != sizeof(Switching) - 1) {
+        h2_finish(c);
+        return HTTP_STATUS_OK;
+    }
+    log("HTTP/2 upgrade from %s:%s", request_host(r), request_port(r));
+    h2_send_settings(c);
+
+    /* Hand the parsed request over to stream 1 */
+    Request  *stream = calloc(1, sizeof(Request));
+    H2Stream *s      = h2_stream_open(c, 1);
+    c->last_stream   = 1;
+    s->remote_closed = true;
+    if (stream) {
+        stream->fd     = -1;
+        stream->method = r->method;
+        stream->uri    = r->uri;
+        stream->query  = r->query;
+        stream->headers = r->headers;
+        r->method  = r->uri = r->query = NULL;
+        r->headers = NULL;
+    }
+    if (!stream || !h2_produce(c, s, stream)) {
+        h2_reset(c, s, 1, H2_INTERNAL_ERROR);
+    }
+
+    h2_run(c);
+    h2_finish(c);
+    return HTTP_STATUS_OK;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
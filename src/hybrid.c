@@ -0,0 +1,200 @@
+/* hybrid.c: Hybrid HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/* Internal State */
+
+static pthread_mutex_t  Lock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   Ready = PTHREAD_COND_INITIALIZER;
+static Request         *Done  = NULL;   /* Requests handled, for the loop */
+static int              DoneFd = -1;    /* eventfd the loop watches for Done */
+
+static pthread_rwlock_t Config;         /* Held for reading while a task runs */
+static bool             Started = false;
+static __thread bool    Holding = false;
+
+/*
+ * The event loop accepts connections, finishes TLS handshakes and waits for
+ * request headers without ever blocking, exactly as in single mode.  Instead
+ * of handling a request inline it hands the connection to a bounded pool of
+ * PoolThreads task threads, where file reads, directory scans, CGI waits and
+ * upstream round trips may block without stalling anyone else.  Waiting
+ * requests are queued by class (see schedule.c), so slow scripts cannot
+ * hold every thread while static files wait behind them.
+ *
+ * A finished task is pushed onto Done and announced through an eventfd; the
+ * loop then either waits for the connection's next request or closes it.
+ * Connections are only ever queued, detached and freed by the loop, so the
+ * waiting list and timers need no locks.
+ *
+ * Reloading swaps the root, bundle and certificate that running tasks use,
+ * so the loop takes Config for writing first.  The lock prefers writers: new
+ * tasks wait behind a reload instead of starving it.
+ */
+
+/**
+ * Stop new tasks from starting and wait for running ones to finish.
+ **/
+void hybrid_pause(void) {
+    if (Started) {
+        pthread_rwlock_wrlock(&Config);
+    }
+}
+
+void hybrid_resume(void) {
+    if (Started) {
+        pthread_rwlock_unlock(&Config);
+    }
+}
+
+/**
+ * Let a reload proceed while this task waits on the network.
+ *
+ * Long-lived tasks (an HTTP/2 connection multiplexing its streams) call this
+ * around their poll so a reload need not wait for the client to leave.
+ **/
+void hybrid_idle(void) {
+    if (Holding) {
+        pthread_rwlock_unlock(&Config);
+    }
+}
+
+void hybrid_busy(void) {
+    if (Holding) {
+        pthread_rwlock_rdlock(&Config);
+    }
+}
+
+/**
+ * Handle queued requests until the process exits.
+ **/
+static void * hybrid_task(void *arg) {
+    uint64_t one = 1;
+
+    worker_unpin();
+    for (;;) {
+        Request *r;
+        pthread_mutex_lock(&Lock);
+        while (!(r = schedule_pop())) {
+            pthread_cond_wait(&Ready, &Lock);
+        }
+        pthread_mutex_unlock(&Lock);
+
+        pthread_rwlock_rdlock(&Config);
+        Holding = true;
+        handle_request(r);
+        if (r->persistent) {
+            /* Cleared by the reset, but the loop needs to know */
+            request_reset(r);
+            r->persistent = true;
+        }
+        Holding = false;
+        pthread_rwlock_unlock(&Config);
+
+        /* This thread pops next, so a class at its cap needs no wakeup */
+        pthread_mutex_lock(&Lock);
+        schedule_done(r);
+        r->next = Done;
+        Done    = r;
+        pthread_mutex_unlock(&Lock);
+        if (write(DoneFd, &one, sizeof(one)) < 0) {
+            /* Counter saturated: the loop has been told already */
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Resume or close every connection whose request the pool has finished.
+ **/
+static void hybrid_complete(void) {
+    uint64_t count;
+    if (read(DoneFd, &count, sizeof(count)) < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&Lock);
+    Request *r = Done;
+    Done = NULL;
+    pthread_mutex_unlock(&Lock);
+
+    while (r) {
+        Request *next = r->next;
+        r->next = NULL;
+        admission_end();
+        if (r->persistent) {
+            event_loop_resume(r);
+        } else {
+            free_request(r);
+        }
+        r = next;
+    }
+}
+
+/**
+ * Queue request for the task pool.
+ *
+ * @param   request     Request whose headers have arrived.
+ * @return  false since the pool owns the connection until it is done.
+ **/
+static bool hybrid_dispatch(Request *request) {
+    admission_begin();
+    schedule_classify(request);
+
+    pthread_mutex_lock(&Lock);
+    schedule_push(request);
+    pthread_mutex_unlock(&Lock);
+    pthread_cond_signal(&Ready);
+    return false;
+}
+
+/**
+ * Handle requests on a pool of task threads fed by the event loop.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Exit status of server (EXIT_SUCCESS) once drained.
+ *
+ * Run one per CPU with -w N -a: each worker's loop stays on its own core and
+ * its task threads on the rest of the node.
+ **/
+int hybrid_server(int sfd) {
+    pthread_rwlockattr_t attributes;
+    pthread_rwlockattr_init(&attributes);
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&Config, &attributes);
+    pthread_rwlockattr_destroy(&attributes);
+
+    DoneFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (DoneFd < 0) {
+        fatal("Unable to create eventfd: %s", strerror(errno));
+    }
+    event_loop_watch(DoneFd, hybrid_complete);
+
+    /* Signals are for the loop thread: tasks start with all of them blocked */
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    for (int i = 0; i < PoolThreads; i++) {
+        pthread_t thread;
+        int       error = pthread_create(&thread, NULL, hybrid_task, NULL);
+        if (error) {
+            fatal("Unable to create task thread: %s", strerror(error));
+        }
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    Started = true;
+
+    log("Handling requests on %d task threads", PoolThreads);
+    return event_loop(sfd, hybrid_dispatch);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,136 @@
+/* large.c: Large File Streaming */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/* Global Variables */
+off_t LargeFileSize = 64 << 20;
+
+/* Constants */
+
+#define LARGE_ALIGN     4096            /* O_DIRECT offset and buffer alignment */
+
+/* Internal State */
+
+static size_t Window = 1 << 20;         /* Bytes read, sent and dropped at a time */
+static bool   Direct = false;           /* Read with O_DIRECT instead of dropping pages */
+
+/*
+ * A download of a file much larger than the working set would otherwise pull
+ * every page of it through the page cache and evict the small, hot files
+ * that make up most requests.  Large files are instead read a window at a
+ * time: the kernel is told the access is sequential and asked to read the
+ * next window ahead while the current one is sent, and each window is
+ * dropped from the cache (POSIX_FADV_DONTNEED) once it has been copied into
+ * the socket.  With direct=1 the file is read with O_DIRECT into an aligned
+ * buffer and never enters the cache at all, where the filesystem allows it.
+ *
+ * Concurrent downloads of one large file each read it from disk; that is
+ * the price of keeping it from displacing everything else.
+ */
+
+/**
+ * Parse large file specification.
+ *
+ * @param   spec        Comma separated name=value pairs, where name is one of
+ *                      size (threshold in MB, 0 disables), window (KB read
+ *                      at a time, a multiple of 4) or direct (1 to use
+ *                      O_DIRECT).
+ * @return  true if parsing was successful, false if there was an error.
+ **/
+bool parse_large(char *spec) {
+    for (char *pair = strtok(spec, ","); pair; pair = strtok(NULL, ",")) {
+        char *value = strchr(pair, '=');
+        char *end;
+        if (!value) {
+            return false;
+        }
+        *value++ = '\0';
+        long n = strtol(value, &end, 10);
+        if (*end || end == value || n < 0) {
+            return false;
+        }
+
+        if (streq(pair, "size")) {
+            LargeFileSize = (off_t)n << 20;
+        } else if (streq(pair, "window") && n > 0 && (n << 10) % LARGE_ALIGN == 0) {
+            Window = (size_t)n << 10;
+        } else if (streq(pair, "direct") && n <= 1) {
+            Direct = n;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Return whether a file should be streamed around the page cache.
+ **/
+bool large_file(off_t size) {
+    return LargeFileSize > 0 && size >= LargeFileSize;
+}
+
+/**
+ * Stream a large file to the client.
+ *
+ * @param   r           HTTP Request structure (headers already written).
+ * @param   fd          File being sent, not read from yet.
+ * @param   size        Size of the file when it was opened.
+ * @return  Bytes of the file written.
+ *
+ * A persistent response stops at size bytes, so the body matches its
+ * Content-Length even if the file grew.
+ **/
+off_t large_send(Request *r, int fd, off_t size) {
+    char *buffer = NULL;
+    off_t sent   = 0;
+    if (posix_memalign((void **)&buffer, LARGE_ALIGN, Window) != 0) {
+        debug("Unable to allocate large file window");
+        return sent;
+    }
+
+    /* Fall back to dropping pages if the filesystem refuses O_DIRECT */
+    bool direct = Direct && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) == 0;
+    if (!direct) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    off_t dropped = 0;              /* Start of the pages not yet dropped */
+
+    while (!r->persistent || sent < size) {
+        if (!direct) {
+            posix_fadvise(fd, sent + Window, Window, POSIX_FADV_WILLNEED);
+        }
+
+        ssize_t nread = pread(fd, buffer, Window, sent);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            break;
+        }
+        if (r->persistent && nread > size - sent) {
+            nread = size - sent;
+        }
+        if (fwrite(buffer, 1, nread, r->stream) != (size_t)nread) {
+            break;
+        }
+        sent += nread;
+
+        /* The window has been copied out: its pages are no longer needed */
+        if (!direct) {
+            posix_fadvise(fd, dropped, sent - dropped, POSIX_FADV_DONTNEED);
+            dropped = sent;
+        }
+    }
+
+    free(buffer);
+    return sent;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
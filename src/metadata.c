@@ -0,0 +1,223 @@
+/* metadata.c: Shared File Metadata Cache */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+/* Constants */
+
+#define METADATA_PROBES     4           /* Slots examined per lookup */
+#define METADATA_PATH_MAX   192         /* Longest path cached */
+
+/* Internal State */
+
+typedef struct {
+    uint32_t    sequence;               /*< Odd while the entry is rewritten */
+    uint32_t    mode;                   /*< File type and permissions */
+    uint64_t    hash;                   /*< Hash of path (0 = empty) */
+    uint64_t    device;
+    uint64_t    inode;
+    int64_t     size;
+    int64_t     mtime;                  /*< Modification time in nanoseconds */
+    char        path[METADATA_PATH_MAX];
+    char        mimetype[METADATA_MIME_MAX];
+    char        etag[METADATA_ETAG_MAX];
+} __attribute__((aligned(64))) MetadataSlot;
+
+static size_t        SlotCount = 4096;  /* Entries in the table (0 disables it) */
+static MetadataSlot *Table     = NULL;  /* Shared by every worker and child */
+
+/*
+ * Serving a file needs its mimetype, which determine_mimetype finds by
+ * reading MimeTypesPath line by line, and its ETag.  A forked child learns
+ * both and exits, and every worker would otherwise warm a private copy, so
+ * they are kept in a table of fixed size slots mapped before any worker is
+ * forked.  A slot is found by probing from the hash of the file's path.
+ *
+ * An entry records the type, size, modification time and inode of the file
+ * it describes and is only used while the fstat the handler makes anyway
+ * still agrees, so an edited, replaced or chmod'ed file is looked up afresh.
+ * The open and the fstat themselves are not skipped: they are what proves an
+ * entry current, and the open is a single openat2 already.
+ *
+ * Readers copy a slot out under its sequence counter (a seqlock) and retry
+ * if it changed.  A writer makes the counter odd with a compare and swap, so
+ * of several workers storing the same slot one wins and the rest move on; a
+ * reader that finds a slot being written treats it as a miss instead of
+ * waiting for the writer.
+ */
+
+/**
+ * Parse metadata cache specification.
+ *
+ * @param   spec        Comma separated name=value pairs: entries=N (slots
+ *                      in the table, 0 disables the cache).
+ * @return  true if parsing was successful, false if there was an error.
+ **/
+bool parse_metadata(char *spec) {
+    for (char *pair = strtok(spec, ","); pair; pair = strtok(NULL, ",")) {
+        char *value = strchr(pair, '=');
+        char *end;
+        if (!value) {
+            return false;
+        }
+        *value++ = '\0';
+        long n = strtol(value, &end, 10);
+        if (*end || end == value || n < 0) {
+            return false;
+        }
+
+        if (streq(pair, "entries")) {
+            SlotCount = n;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Map the metadata table before forking.
+ **/
+void metadata_init(void) {
+    if (!SlotCount) {
+        return;
+    }
+
+    Table = mmap(NULL, SlotCount * sizeof(MetadataSlot), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Table == MAP_FAILED) {
+        fatal("Unable to mmap metadata cache: %s", strerror(errno));
+    }
+    log("Caching file metadata in %lu shared slots", (unsigned long)SlotCount);
+}
+
+/**
+ * Hash a path into a non-zero value (FNV-1a).
+ **/
+static uint64_t metadata_hash(const char *path) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *c = path; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    }
+    return hash ? hash : 1;
+}
+
+static int64_t metadata_mtime(const struct stat *stats) {
+    return (int64_t)stats->st_mtim.tv_sec * 1000000000 + stats->st_mtim.tv_nsec;
+}
+
+/**
+ * Return whether a slot describes the file at path with the given status.
+ **/
+static bool metadata_current(const MetadataSlot *s, uint64_t hash, const char *path, const struct stat *stats) {
+    return s->hash == hash && s->mode == stats->st_mode && s->size == stats->st_size &&
+           s->device == stats->st_dev && s->inode == stats->st_ino &&
+           s->mtime == metadata_mtime(stats) && streq(s->path, path);
+}
+
+/**
+ * Copy a consistent snapshot of a slot, or return false if it is being
+ * written.
+ **/
+static bool slot_read(MetadataSlot *s, MetadataSlot *copy) {
+    for (;;) {
+        uint32_t before = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            return false;
+        }
+        *copy = *s;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&s->sequence, __ATOMIC_RELAXED) == before) {
+            copy->path[METADATA_PATH_MAX - 1] = '\0';
+            return true;
+        }
+    }
+}
+
+/**
+ * Store an entry in a slot unless another writer holds it.
+ **/
+static void slot_write(MetadataSlot *s, const MetadataSlot *entry) {
+    uint32_t before = __atomic_load_n(&s->sequence, __ATOMIC_RELAXED);
+    if ((before & 1) || !__atomic_compare_exchange_n(&s->sequence, &before, before + 1, false,
+                                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char *)s + offsetof(MetadataSlot, mode), (const char *)entry + offsetof(MetadataSlot, mode),
+           sizeof(MetadataSlot) - offsetof(MetadataSlot, mode));
+    __atomic_store_n(&s->sequence, before + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Determine the mimetype and ETag of an open file.
+ *
+ * @param   path        Path of the file (RootPath and URI).
+ * @param   stats       Status of the open file.
+ * @param   metadata    Filled with the mimetype and ETag.
+ *
+ * The ETag is derived from the inode, size and modification time, so it
+ * changes whenever the file does.
+ **/
+void metadata_lookup(const char *path, const struct stat *stats, Metadata *metadata) {
+    uint64_t     hash = metadata_hash(path);
+    MetadataSlot copy;
+
+    if (Table) {
+        for (size_t i = 0; i < METADATA_PROBES; i++) {
+            if (slot_read(&Table[(hash + i) % SlotCount], &copy) &&
+                metadata_current(&copy, hash, path, stats)) {
+                memcpy(metadata->mimetype, copy.mimetype, sizeof(metadata->mimetype));
+                memcpy(metadata->etag, copy.etag, sizeof(metadata->etag));
+                metadata->mimetype[METADATA_MIME_MAX - 1] = '\0';
+                metadata->etag[METADATA_ETAG_MAX - 1] = '\0';
+                return;
+            }
+        }
+    }
+
+    /* No mime.types line is near METADATA_MIME_MAX; anything that long is
+     * served as DefaultMimeType rather than truncated */
+    char *mimetype = determine_mimetype(path);
+    bool  fits     = mimetype && strlen(mimetype) < METADATA_MIME_MAX;
+    snprintf(metadata->mimetype, sizeof(metadata->mimetype), "%s", fits ? mimetype : DefaultMimeType);
+    snprintf(metadata->etag, sizeof(metadata->etag), "\"%llx-%llx-%llx\"",
+             (unsigned long long)stats->st_ino, (unsigned long long)stats->st_size,
+             (unsigned long long)metadata_mtime(stats));
+    free(mimetype);
+
+    if (!Table || !fits || strlen(path) >= METADATA_PATH_MAX) {
+        return;
+    }
+
+    /* Replace the stale entry for this path, else an empty slot, else the
+     * first probed */
+    MetadataSlot *victim = &Table[hash % SlotCount];
+    for (size_t i = 0; i < METADATA_PROBES; i++) {
+        MetadataSlot *s = &Table[(hash + i) % SlotCount];
+        if (slot_read(s, &copy) && (copy.hash == 0 || (copy.hash == hash && streq(copy.path, path)))) {
+            victim = s;
+            break;
+        }
+    }
+
+    MetadataSlot entry = {
+        .mode   = stats->st_mode,
+        .hash   = hash,
+        .device = stats->st_dev,
+        .inode  = stats->st_ino,
+        .size   = stats->st_size,
+        .mtime  = metadata_mtime(stats),
+    };
+    strcpy(entry.path, path);
+    memcpy(entry.mimetype, metadata->mimetype, sizeof(entry.mimetype));
+    memcpy(entry.etag, metadata->etag, sizeof(entry.etag));
+    slot_write(victim, &entry);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
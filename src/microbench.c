@@ -0,0 +1,463 @@
+/* microbench.c: Microbenchmarks for the spidey library functions */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Global Variables */
+char *Port	      = "9894";
+char *MimeTypesPath   = "/etc/mime.types";
+char *DefaultMimeType = "text/plain";
+char *RootPath;
+char *root = "www";
+char *BundlePath      = NULL;
+
+/* Internal Declarations (request.c) */
+int parse_request_method(Request *r);
+int parse_request_headers(Request *r);
+void free_headers(Header *h);
+
+/* Allocation Counting */
+
+/*
+ * The executable's definitions interpose on glibc's allocator for the whole
+ * process, so allocations made inside libc on behalf of the library (fopen,
+ * strdup, scandir, ...) are counted too.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void  __libc_free(void *ptr);
+
+static size_t Allocations = 0;
+
+void *malloc(size_t size) {
+    Allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    Allocations++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    Allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+/* Cycle Counting */
+
+static int CyclesFd = -1;
+
+/**
+ * Open a perf event counting CPU cycles for this thread.
+ *
+ * @return  Counter file descriptor or -1 if perf events are not available.
+ **/
+int cycles_open(void) {
+    struct perf_event_attr attr = {
+        .type           = PERF_TYPE_HARDWARE,
+        .size           = sizeof(struct perf_event_attr),
+        .config         = PERF_COUNT_HW_CPU_CYCLES,
+        .disabled       = 1,
+        .exclude_hv     = 1,
+    };
+
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0) {
+        /* Retry without kernel cycles for perf_event_paranoid >= 2 */
+        attr.exclude_kernel = 1;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    if (fd < 0) {
+        debug("perf_event_open failed: %s", strerror(errno));
+    }
+    return fd;
+}
+
+uint64_t cycles_read(void) {
+    uint64_t count = 0;
+    if (CyclesFd < 0 || read(CyclesFd, &count, sizeof(count)) != sizeof(count)) {
+        return 0;
+    }
+    return count;
+}
+
+/* Benchmark Cases */
+
+typedef struct {
+    const char *name;                   /*< Benchmark name */
+    void      (*setup)(void);           /*< Called once before timing */
+    void      (*run)(size_t i);         /*< Called once per operation */
+    void      (*teardown)(void);        /*< Called once after timing */
+} Benchmark;
+
+static const char *RequestLines[] = {
+    "GET / HTTP/1.0\r\n",
+    "GET /html/index.html HTTP/1.1\r\n",
+    "GET /scripts/hello.py?name=world HTTP/1.1\r\n",
+    "GET /images/a.png HTTP/1.1\r\n",
+    "GET /scripts/cowsay.sh?message=hi&template=vader HTTP/1.1\r\n",
+};
+
+static const char *HeaderBlocks[] = {
+    /* curl */
+    "Host: localhost:9894\r\n"
+    "User-Agent: curl/7.88.1\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+    /* Firefox */
+    "Host: localhost:9894\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "\r\n",
+    /* Chrome */
+    "Host: localhost:9894\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "\r\n",
+};
+
+static const char *MimePaths[] = {
+    "/srv/www/html/index.html",
+    "/srv/www/images/a.png",
+    "/srv/www/images/b.jpg",
+    "/srv/www/song.txt",
+    "/srv/www/text/pass/fail",
+};
+
+static const char *RequestURIs[] = {
+    "/",
+    "/html/index.html",
+    "/images/a.png",
+    "/text/pass/fail",
+    "/../etc/passwd",
+    "/missing",
+};
+
+#define NELEMS(a)   (sizeof(a) / sizeof((a)[0]))
+
+static FILE *Streams[NELEMS(HeaderBlocks) > NELEMS(RequestLines) ? NELEMS(HeaderBlocks) : NELEMS(RequestLines)];
+
+void streams_open(const char **corpus, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        Streams[i] = fmemopen((void *)corpus[i], strlen(corpus[i]), "r");
+        if (!Streams[i]) {
+            fatal("Unable to fmemopen: %s", strerror(errno));
+        }
+    }
+}
+
+void streams_close(void) {
+    for (size_t i = 0; i < NELEMS(Streams); i++) {
+        if (Streams[i]) {
+            fclose(Streams[i]);
+            Streams[i] = NULL;
+        }
+    }
+}
+
+void setup_request_lines(void) {
+    streams_open(RequestLines, NELEMS(RequestLines));
+}
+
+void setup_header_blocks(void) {
+    streams_open(HeaderBlocks, NELEMS(HeaderBlocks));
+}
+
+void run_parse_request_method(size_t i) {
+    Request r = {0};
+    r.stream = Streams[i % NELEMS(RequestLines)];
+    rewind(r.stream);
+    if (parse_request_method(&r) < 0) {
+        fatal("parse_request_method failed");
+    }
+    free(r.method);
+    free(r.uri);
+    free(r.query);
+    free(r.version);
+}
+
+void run_parse_request_headers(size_t i) {
+    Request r = {0};
+    r.stream = Streams[i % NELEMS(HeaderBlocks)];
+    rewind(r.stream);
+    if (parse_request_headers(&r) < 0) {
+        fatal("parse_request_headers failed");
+    }
+    free_headers(r.headers);
+}
+
+void run_determine_mimetype(size_t i) {
+    free(determine_mimetype(MimePaths[i % NELEMS(MimePaths)]));
+}
+
+static struct stat MetadataStats;
+
+void setup_metadata_lookup(void) {
+    static bool mapped = false;
+    if (!mapped) {
+        metadata_init();
+        mapped = true;
+    }
+    if (stat(RootPath, &MetadataStats) < 0) {
+        fatal("Unable to stat %s: %s", RootPath, strerror(errno));
+    }
+}
+
+void run_metadata_lookup(size_t i) {
+    Metadata metadata;
+    metadata_lookup(MimePaths[i % NELEMS(MimePaths)], &MetadataStats, &metadata);
+}
+
+void run_determine_request_path(size_t i) {
+    free(determine_request_path(RequestURIs[i % NELEMS(RequestURIs)]));
+}
+
+void run_open_request_path(size_t i) {
+    int fd = open_request_path(RequestURIs[i % NELEMS(RequestURIs)]);
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static Coroutine *Yielder  = NULL;
+static bool       Stopping = false;
+
+void yield_until_stopped(void *arg) {
+    while (!Stopping) {
+        coroutine_yield();
+    }
+}
+
+void return_at_once(void *arg) {
+}
+
+void setup_coroutine_switch(void) {
+    Stopping = false;
+    Yielder  = coroutine_create(yield_until_stopped, NULL);
+    if (!Yielder) {
+        fatal("Unable to create coroutine");
+    }
+}
+
+void run_coroutine_switch(size_t i) {
+    coroutine_resume(Yielder);
+}
+
+void teardown_coroutine_switch(void) {
+    Stopping = true;
+    coroutine_resume(Yielder);
+}
+
+void run_coroutine_create(size_t i) {
+    Coroutine *co = coroutine_create(return_at_once, NULL);
+    if (!co) {
+        fatal("Unable to create coroutine");
+    }
+    coroutine_resume(co);
+}
+
+volatile const char *Sink;
+
+void run_http_status_string(size_t i) {
+    Sink = http_status_string((Status)(i % (HTTP_STATUS_GATEWAY_TIMEOUT + 1)));
+}
+
+static Benchmark Benchmarks[] = {
+    {"parse_request_method",    setup_request_lines, run_parse_request_method,   streams_close},
+    {"parse_request_headers",   setup_header_blocks, run_parse_request_headers,  streams_close},
+    {"determine_mimetype",      NULL,                run_determine_mimetype,     NULL},
+    {"metadata_lookup",         setup_metadata_lookup, run_metadata_lookup,    NULL},
+    {"determine_request_path",  NULL,                run_determine_request_path, NULL},
+    {"open_request_path",       NULL,                run_open_request_path,      NULL},
+    {"http_status_string",      NULL,                run_http_status_string,     NULL},
+    {"coroutine_switch",        setup_coroutine_switch, run_coroutine_switch,    teardown_coroutine_switch},
+    {"coroutine_create",        NULL,                run_coroutine_create,       NULL},
+};
+
+/* Driver */
+
+static int NullFd    = -1;
+static int ConsoleFd = -1;
+
+/**
+ * Point stderr at /dev/null (or back at the console) so the log() calls left
+ * in the measured functions do not reach the terminal while timing.
+ *
+ * @param   quiet       Whether to discard stderr.
+ **/
+void stderr_quiet(bool quiet) {
+    if (NullFd < 0 || ConsoleFd < 0) {
+        return;
+    }
+    fflush(stderr);
+    dup2(quiet ? NullFd : ConsoleFd, STDERR_FILENO);
+}
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Run a benchmark for the specified number of operations and print a row.
+ *
+ * @param   b           Benchmark to run.
+ * @param   ops         Number of operations to time.
+ **/
+void run_benchmark(Benchmark *b, size_t ops) {
+    if (b->setup) {
+        b->setup();
+    }
+    stderr_quiet(true);
+
+    /* Warm up caches and lazily initialized libc state */
+    for (size_t i = 0; i < ops / 10 + 1; i++) {
+        b->run(i);
+    }
+
+    if (CyclesFd >= 0) {
+        ioctl(CyclesFd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(CyclesFd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    size_t   allocations = Allocations;
+    uint64_t start       = now_ns();
+
+    for (size_t i = 0; i < ops; i++) {
+        b->run(i);
+    }
+
+    uint64_t elapsed     = now_ns() - start;
+    allocations          = Allocations - allocations;
+    if (CyclesFd >= 0) {
+        ioctl(CyclesFd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+    uint64_t cycles      = cycles_read();
+    stderr_quiet(false);
+
+    if (b->teardown) {
+        b->teardown();
+    }
+
+    if (CyclesFd >= 0) {
+        printf("%-24s %10zu %12.1f %12.2f %12.1f\n", b->name, ops,
+            (double)elapsed / ops, (double)allocations / ops, (double)cycles / ops);
+    } else {
+        printf("%-24s %10zu %12.1f %12.2f %12s\n", b->name, ops,
+            (double)elapsed / ops, (double)allocations / ops, "n/a");
+    }
+    fflush(stdout);
+}
+
+void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [hmnr] [benchmark ...]\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -m path       Path to mimetypes file\n");
+    fprintf(stderr, "    -n ops        Operations per benchmark (default: 100000)\n");
+    fprintf(stderr, "    -r path       Root directory\n");
+    exit(status);
+}
+
+/**
+ * Time each library function against its corpus and report ns/op,
+ * allocations/op and cycles/op.
+ **/
+int main(int argc, char *argv[]) {
+    char   buffer[PATH_MAX];
+    size_t ops = 100000;
+
+    int argind = 1;
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
+        char *arg = argv[argind++];
+        if (argind >= argc && arg[1] != 'h') {
+            usage(argv[0], EXIT_FAILURE);
+        }
+        switch (arg[1]) {
+            case 'h':
+                usage(argv[0], EXIT_SUCCESS);
+                break;
+            case 'm':
+                MimeTypesPath = argv[argind++];
+                break;
+            case 'n':
+                ops = strtoul(argv[argind++], NULL, 10);
+                break;
+            case 'r':
+                root = argv[argind++];
+                break;
+            default:
+                usage(argv[0], EXIT_FAILURE);
+                break;
+        }
+    }
+
+    RootPath = realpath(root, buffer);
+    if (!RootPath || !open_root(RootPath)) {
+        fatal("Unable to resolve root %s: %s", root, strerror(errno));
+    }
+    if (ops == 0) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+
+    CyclesFd  = cycles_open();
+    NullFd    = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    ConsoleFd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+
+    printf("%-24s %10s %12s %12s %12s\n", "benchmark", "ops", "ns/op", "allocs/op", "cycles/op");
+    for (size_t b = 0; b < NELEMS(Benchmarks); b++) {
+        bool selected = argind == argc;
+        for (int i = argind; i < argc && !selected; i++) {
+            selected = streq(argv[i], Benchmarks[b].name);
+        }
+        if (selected) {
+            run_benchmark(&Benchmarks[b], ops);
+        }
+    }
+
+    if (CyclesFd >= 0) {
+        close(CyclesFd);
+    }
+    if (NullFd >= 0) {
+        close(NullFd);
+    }
+    if (ConsoleFd >= 0) {
+        close(ConsoleFd);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
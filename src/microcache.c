@@ -0,0 +1,498 @@
+/* microcache.c: CGI Response Microcache */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <strings.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define MICROCACHE_VARY     8           /* Largest number of varying headers */
+#define MICROCACHE_PROBES   4           /* Slots examined per lookup */
+#define MICROCACHE_KEY_MAX  1024        /* Longest key cached */
+#define MICROCACHE_PASS_MS  5000        /* Uncacheable keys skip the lock this long */
+#define MICROCACHE_POLL_MS  1           /* Interval between checks of a fill */
+#define MICROCACHE_SPINS    1000        /* Reads of a slot being written before giving up */
+
+/* Internal State */
+
+typedef struct {
+    uint32_t    sequence;               /*< Odd while the entry is rewritten */
+    pid_t       owner;                  /*< Thread filling the entry (0 = none) */
+    uint64_t    hash;                   /*< Hash of key (0 = empty) */
+    uint64_t    stored;                 /*< timer_now when the response was stored */
+    uint64_t    expires;                /*< timer_now when it goes stale (0 = filling) */
+    bool        pass;                   /*< Uncacheable: run the script, do not wait */
+    uint32_t    key_length;
+    uint32_t    status_length;
+    uint32_t    headers_length;
+    uint32_t    body_length;
+    char        data[];                 /*< Key, status, headers, then body */
+} MicrocacheSlot;
+
+static const char *Vary[MICROCACHE_VARY];
+static size_t      VaryCount   = 0;
+static size_t      CacheSize   = 16 << 20;  /* Bytes mapped for the table */
+static size_t      EntrySize   = 64 << 10;  /* Largest key and response */
+static int         LockTimeout = 10000;     /* Milliseconds to wait for a fill */
+static bool        Enabled     = false;
+
+static char       *Table      = NULL;   /* Shared by every worker and child */
+static size_t      SlotSize;
+static size_t      SlotCount;
+
+/*
+ * Responses are stored in a table of fixed size slots mapped before any
+ * worker is forked, so every process (forked children included) shares
+ * them.  A slot is found by probing from the hash of its key: the URI, the
+ * query string and the value of each varying header (-C vary=...).  Only
+ * GETs and HEADs without a body are cached, and only responses the script
+ * marks with Cache-Control: max-age (or s-maxage), without private,
+ * no-store, no-cache or Set-Cookie.
+ *
+ * Readers copy a slot out under its sequence counter (a seqlock) and retry
+ * if it changed, so a hit never takes a lock.  A slot still being written
+ * after MICROCACHE_SPINS tries is skipped, and one left half written by a
+ * thread that died is taken over like an empty slot.  A miss claims the slot by
+ * setting its owner with a compare and swap and then runs the script,
+ * relaying its output to the client and into the slot as it arrives.  Other
+ * requests for the same key find the slot owned and poll until the owner
+ * stores the response, so N concurrent misses run the script once.  Owners
+ * are thread ids (the pid outside hybrid mode), so one that dies is noticed
+ * with kill(tid, 0) and its slot taken over.
+ *
+ * When the response turns out to be uncacheable the slot remembers that
+ * for MICROCACHE_PASS_MS, so later requests run the script at once instead
+ * of queueing behind one another.
+ */
+
+/**
+ * Parse microcache specification.
+ *
+ * @param   spec        Comma separated name=value pairs: size=MB (table),
+ *                      entry=KB (largest response), vary=HEADER+HEADER
+ *                      (request headers the key includes), lock=SECONDS
+ *                      (longest wait for another request's fill).
+ * @return  true if parsing was successful, false if there was an error.
+ **/
+bool parse_microcache(char *spec) {
+    for (char *pair = strtok(spec, ","); pair; pair = strtok(NULL, ",")) {
+        char *value = strchr(pair, '=');
+        if (!value) {
+            return false;
+        }
+        *value++ = '\0';
+
+        if (streq(pair, "size")) {
+            CacheSize = (size_t)atol(value) << 20;
+        } else if (streq(pair, "entry")) {
+            EntrySize = (size_t)atol(value) << 10;
+        } else if (streq(pair, "lock")) {
+            LockTimeout = atoi(value) * 1000;
+        } else if (streq(pair, "vary")) {
+            for (char *name = strsep(&value, "+"); name; name = strsep(&value, "+")) {
+                if (!*name || VaryCount == MICROCACHE_VARY) {
+                    return false;
+                }
+                Vary[VaryCount++] = name;
+            }
+        } else {
+            return false;
+        }
+    }
+    Enabled = true;
+    return EntrySize > 0 && CacheSize >= EntrySize && LockTimeout >= 0;
+}
+
+/**
+ * Map the response table before forking.
+ **/
+void microcache_init(void) {
+    if (!Enabled) {
+        return;
+    }
+
+    SlotSize  = (sizeof(MicrocacheSlot) + EntrySize + 63) & ~(size_t)63;
+    SlotCount = CacheSize / SlotSize;
+    Table = mmap(NULL, SlotCount * SlotSize, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (Table == MAP_FAILED) {
+        fatal("Unable to mmap microcache: %s", strerror(errno));
+    }
+    log("Caching CGI responses in %lu shared slots of %lu KB", (unsigned long)SlotCount,
+        (unsigned long)(EntrySize >> 10));
+}
+
+static MicrocacheSlot * slot_at(size_t index) {
+    return (MicrocacheSlot *)(Table + (index % SlotCount) * SlotSize);
+}
+
+/**
+ * Build the key of a request (NUL separated) and return its length, or 0 if
+ * it is too long.
+ **/
+static size_t microcache_key(Request *r, char *key) {
+    const char *parts[2 + MICROCACHE_VARY] = {r->uri, r->query ? r->query : ""};
+    size_t      count  = 2;
+    size_t      length = 0;
+
+    for (size_t i = 0; i < VaryCount; i++) {
+        const char *value = request_header(r, Vary[i]);
+        parts[count++] = value ? value : "";
+    }
+    for (size_t i = 0; i < count; i++) {
+        size_t n = strlen(parts[i]) + 1;
+        if (length + n > MICROCACHE_KEY_MAX) {
+            return 0;
+        }
+        memcpy(key + length, parts[i], n);
+        length += n;
+    }
+    return length;
+}
+
+/**
+ * Hash a key into a non-zero value (FNV-1a).
+ **/
+static uint64_t microcache_hash(const char *key, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+    }
+    return hash ? hash : 1;
+}
+
+/**
+ * Copy a consistent snapshot of a slot into copy (SlotSize bytes), or
+ * return false if none was had in MICROCACHE_SPINS tries.
+ **/
+static bool slot_read(MicrocacheSlot *s, MicrocacheSlot *copy) {
+    for (int spin = 0; spin < MICROCACHE_SPINS; spin++) {
+        uint32_t before = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            continue;
+        }
+        *copy = *s;
+        size_t used = (size_t)copy->key_length + copy->status_length + copy->headers_length + copy->body_length;
+        if (used <= EntrySize) {
+            memcpy(copy->data, s->data, used);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&s->sequence, __ATOMIC_RELAXED) == before && used <= EntrySize) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Begin and end rewriting a slot this process owns.  A slot taken over from
+ * a writer that died is odd already and stays odd until the end.
+ **/
+static void slot_write_begin(MicrocacheSlot *s) {
+    __atomic_store_n(&s->sequence, s->sequence | 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void slot_write_end(MicrocacheSlot *s) {
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Take ownership of a slot from expected (0 or a dead thread).
+ **/
+static bool slot_claim(MicrocacheSlot *s, pid_t expected) {
+    return __atomic_compare_exchange_n(&s->owner, &expected, gettid(), false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Return whether a thread filling a slot still exists.
+ **/
+static bool owner_alive(pid_t owner) {
+    return kill(owner, 0) == 0 || errno == EPERM;
+}
+
+/**
+ * Send a stored response.
+ **/
+static void microcache_send(Request *r, const MicrocacheSlot *s, uint64_t now) {
+    const char *status  = s->data + s->key_length;
+    const char *headers = status + s->status_length;
+    const char *body    = headers + s->headers_length;
+
+    r->persistent = request_keep_alive(r);
+    fprintf(r->stream, "HTTP/1.0 %.*s\r\n", (int)s->status_length, status);
+    fwrite(headers, 1, s->headers_length, r->stream);
+    fprintf(r->stream, "Age: %lu\r\n", (unsigned long)((now - s->stored) / 1000));
+    fprintf(r->stream, "Content-Length: %u\r\n", s->body_length);
+    if (r->persistent) {
+        fprintf(r->stream, "Connection: keep-alive\r\n");
+    }
+    fprintf(r->stream, "\r\n");
+    if (!streq(r->method, "HEAD")) {
+        fwrite(body, 1, s->body_length, r->stream);
+    }
+    if (fflush(r->stream) != 0) {
+        r->persistent = false;
+    }
+}
+
+/**
+ * Claim a slot for a new key and record the key in it.
+ **/
+static void slot_fill_begin(MicrocacheSlot *s, uint64_t hash, const char *key, size_t length) {
+    slot_write_begin(s);
+    s->hash           = hash;
+    s->expires        = 0;
+    s->pass           = false;
+    s->key_length     = length;
+    s->status_length  = 0;
+    s->headers_length = 0;
+    s->body_length    = 0;
+    memcpy(s->data, key, length);
+    slot_write_end(s);
+}
+
+/**
+ * Answer a CGI request from the microcache, or claim the entry to fill.
+ *
+ * @param   r           Request for a CGI script.
+ * @param   m           Fill state, handed to the other microcache calls.
+ * @return  true if a stored response was sent; false if the script must
+ *          run (with m->slot set when its response should be stored).
+ *
+ * A request whose key is being filled by another process waits for that
+ * fill, up to the lock timeout, so concurrent misses run the script once.
+ **/
+bool microcache_lookup(Request *r, Microcache *m) {
+    char key[MICROCACHE_KEY_MAX];
+
+    *m = (Microcache){0};
+    if (!Table || (!streq(r->method, "GET") && !streq(r->method, "HEAD"))) {
+        return false;
+    }
+    off_t length;
+    if (request_body(r, &length) != 0) {
+        return false;
+    }
+    size_t key_length = microcache_key(r, key);
+    if (!key_length) {
+        return false;
+    }
+
+    uint64_t        hash     = microcache_hash(key, key_length);
+    uint64_t        deadline = timer_now() + LockTimeout;
+    MicrocacheSlot *copy     = malloc(SlotSize);
+    if (!copy) {
+        return false;
+    }
+
+    for (;;) {
+        uint64_t        now    = timer_now();
+        MicrocacheSlot *victim = NULL;
+        pid_t           holder = 0;
+        uint64_t        oldest = UINT64_MAX;
+        bool            wait   = false;
+
+        for (size_t i = 0; i < MICROCACHE_PROBES; i++) {
+            MicrocacheSlot *s = slot_at(hash + i);
+            bool   read  = slot_read(s, copy);
+            pid_t  owner = __atomic_load_n(&s->owner, __ATOMIC_ACQUIRE);
+
+            if (!read) {
+                /* Left mid-write by a writer that died, or busy: a miss */
+                if (owner && !owner_alive(owner) && oldest) {
+                    victim = s;
+                    holder = owner;
+                    oldest = 0;
+                }
+                continue;
+            }
+
+            bool match = copy->hash == hash && copy->key_length == key_length &&
+                         memcmp(copy->data, key, key_length) == 0;
+            if (!match) {
+                /* Replace an empty slot, else the one closest to going stale */
+                uint64_t expires = copy->hash ? copy->expires : 0;
+                if ((!owner || !owner_alive(owner)) && expires < oldest) {
+                    victim = s;
+                    holder = owner;
+                    oldest = expires;
+                }
+                continue;
+            }
+
+            if (copy->expires > now && !copy->pass) {
+                debug("Microcache hit for %s", r->uri);
+                microcache_send(r, copy, now);
+                free(copy);
+                return true;
+            }
+            if (copy->expires > now) {
+                break;
+            }
+            /* Coroutines of this thread fill under the same owner */
+            if (owner && (owner != gettid() || coroutine_running()) && owner_alive(owner)) {
+                /* Past the deadline, run the script without waiting further */
+                wait = now < deadline;
+                break;
+            }
+            if (slot_claim(s, owner)) {
+                slot_fill_begin(s, hash, key, key_length);
+                m->slot = s;
+            }
+            break;
+        }
+
+        if (wait) {
+            coroutine_poll(NULL, 0, MICROCACHE_POLL_MS);
+            continue;
+        }
+        if (!m->slot && victim && slot_claim(victim, holder)) {
+            slot_fill_begin(victim, hash, key, key_length);
+            m->slot = victim;
+        }
+        free(copy);
+        debug("Microcache %s for %s", m->slot ? "miss" : "pass", r->uri);
+        return false;
+    }
+}
+
+/**
+ * Append bytes to the response being filled, giving up when it is too large.
+ **/
+static void fill_append(Microcache *m, const void *data, size_t size) {
+    MicrocacheSlot *s = m->slot;
+    if (m->failed || s->key_length + m->length + size > EntrySize) {
+        m->failed = true;
+        return;
+    }
+    /* Readers ignore the slot while it is filling (expires is 0), so the
+     * response goes straight in; its lengths are set when it is stored */
+    memcpy(s->data + s->key_length + m->length, data, size);
+    m->length += size;
+}
+
+/**
+ * Find a directive in the Cache-Control value between value and end (NULL if
+ * absent).
+ **/
+static const char * cache_directive(const char *value, const char *end, const char *name) {
+    size_t length = strlen(name);
+    for (const char *s = value; s && s < end; s = memchr(s, ',', end - s), s = s ? s + 1 : NULL) {
+        while (s < end && (*s == ' ' || *s == '\t')) {
+            s++;
+        }
+        if ((size_t)(end - s) >= length && strncasecmp(s, name, length) == 0 &&
+            (s + length == end || s[length] == '=' || s[length] == ',' ||
+             s[length] == ' '  || s[length] == '\t')) {
+            return s + length;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Record the status and headers of the response being filled.
+ *
+ * @param   m           Fill state from microcache_lookup.
+ * @param   status      Status (code and reason).
+ * @param   headers     Header lines (each ending in CRLF).
+ * @param   length      Length of headers.
+ *
+ * The script's Cache-Control decides whether the response is stored.
+ * Content-Length is dropped: stored responses are sent with their own.
+ **/
+void microcache_headers(Microcache *m, const char *status, const char *headers, size_t length) {
+    if (!m->slot) {
+        return;
+    }
+
+    fill_append(m, status, strlen(status));
+    m->status_length = m->length;
+
+    for (const char *line = headers; line < headers + length; ) {
+        const char *eol   = strstr(line, "\r\n");
+        const char *end   = eol + 2;
+        const char *value = strchr(line, ':') + 1;
+        while (value < eol && (*value == ' ' || *value == '\t')) {
+            value++;
+        }
+
+        if (strncasecmp(line, "Cache-Control:", 14) == 0) {
+            const char *age = cache_directive(value, eol, "s-maxage");
+            if (!age) {
+                age = cache_directive(value, eol, "max-age");
+            }
+            if (age && *age == '=') {
+                m->max_age = atol(age + 1);
+            }
+            if (cache_directive(value, eol, "private") || cache_directive(value, eol, "no-store") ||
+                cache_directive(value, eol, "no-cache")) {
+                m->max_age = -1;
+            }
+        } else if (strncasecmp(line, "Set-Cookie:", 11) == 0) {
+            m->max_age = -1;
+        }
+        if (strncasecmp(line, "Content-Length:", 15) != 0) {
+            fill_append(m, line, end - line);
+        }
+        line = end;
+    }
+    m->headers_length = m->length - m->status_length;
+}
+
+/**
+ * Record a piece of the body of the response being filled.
+ **/
+void microcache_body(Microcache *m, const char *data, size_t length) {
+    if (m->slot) {
+        fill_append(m, data, length);
+    }
+}
+
+/**
+ * Store the response being filled and release its slot.
+ *
+ * @param   m           Fill state from microcache_lookup.
+ * @param   complete    The script exited successfully and its whole output
+ *                      was captured.
+ *
+ * The slot is released in every case, which wakes requests waiting on it.
+ **/
+void microcache_finish(Microcache *m, bool complete) {
+    MicrocacheSlot *s = m->slot;
+    if (!s) {
+        return;
+    }
+    uint64_t now = timer_now();
+
+    slot_write_begin(s);
+    if (complete && !m->failed && m->max_age > 0) {
+        s->status_length  = m->status_length;
+        s->headers_length = m->headers_length;
+        s->body_length    = m->length - m->status_length - m->headers_length;
+        s->stored         = now;
+        s->expires        = now + (uint64_t)m->max_age * 1000;
+        s->pass           = false;
+    } else {
+        /* Partial responses are retried; uncacheable ones are passed */
+        s->status_length  = 0;
+        s->headers_length = 0;
+        s->body_length    = 0;
+        s->pass           = complete && !m->failed;
+        s->expires        = s->pass ? now + MICROCACHE_PASS_MS : 0;
+    }
+    slot_write_end(s);
+
+    __atomic_store_n(&s->owner, 0, __ATOMIC_RELEASE);
+    m->slot = NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,336 @@
+/* plugin.c: Native Handler Plugins */
+
+#include "spidey.h"
+#include "plugin.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+
+#include <unistd.h>
+
+/* Constants */
+
+#define PLUGIN_ROUTES   16              /* Largest number of plugin prefixes */
+#define PLUGIN_HEADERS  (2 * BUFSIZ)    /* Largest response header block */
+#define PLUGIN_REASON   64              /* Longest reason phrase */
+
+/* Internal State */
+
+typedef struct {
+    char          *prefix;              /*< URI prefix */
+    size_t         length;              /*< Length of prefix */
+    char          *path;                /*< Shared object */
+    SpideyHandler  handler;             /*< spidey_handle in the shared object */
+} Plugin;
+
+typedef struct {
+    SpideyRequest  view;                /*< Handed to the plugin (first) */
+    Request       *request;
+    off_t          remaining;           /*< Body bytes not yet read */
+} PluginRequest;
+
+typedef struct {
+    SpideyResponse builder;             /*< Handed to the plugin (first) */
+    int            code;                /*< Status code */
+    char           reason[PLUGIN_REASON];
+    char           headers[PLUGIN_HEADERS];
+    size_t         nheaders;
+    bool           typed;               /*< Content-Type was set */
+    char          *body;                /*< Body built so far */
+    size_t         length;
+    size_t         capacity;
+    bool           failed;              /*< Invalid header or out of memory */
+} PluginResponse;
+
+static Plugin Plugins[PLUGIN_ROUTES];
+static size_t PluginCount = 0;
+
+/*
+ * Plugins are loaded with dlopen before any worker is forked, so every
+ * process shares their text and calls them like any other handler: no fork,
+ * no exec, no environment, no pipe.  The response is built in memory and
+ * sent with a Content-Length, which lets HTTP/1.1 connections stay open.
+ *
+ * The ABI (include/plugin.h) is a pair of structs of strings and function
+ * pointers, so a plugin needs no symbols from spidey and can be built
+ * against that header alone.
+ */
+
+/**
+ * Parse plugin specification.
+ *
+ * @param   spec        Comma separated prefix=PATH pairs, where PATH is a
+ *                      shared object exporting spidey_handle.
+ * @return  true if parsing was successful, false if there was an error.
+ **/
+bool parse_plugins(char *spec) {
+    for (char *pair = strtok(spec, ","); pair; pair = strtok(NULL, ",")) {
+        char *path = strchr(pair, '=');
+        if (!path || *pair != '/' || !path[1] || PluginCount == PLUGIN_ROUTES) {
+            return false;
+        }
+        *path++ = '\0';
+
+        Plugin *p = &Plugins[PluginCount++];
+        p->prefix = pair;
+        p->length = strlen(pair);
+        p->path   = path;
+    }
+    return PluginCount > 0;
+}
+
+/**
+ * Load every plugin before any worker is forked.
+ **/
+void plugin_init(void) {
+    for (size_t i = 0; i < PluginCount; i++) {
+        Plugin *p = &Plugins[i];
+
+        void *handle = dlopen(p->path, RTLD_NOW | RTLD_LOCAL);
+        if (!handle) {
+            fatal("Unable to load plugin %s: %s", p->path, dlerror());
+        }
+        const int *abi = dlsym(handle, "spidey_plugin_abi");
+        if (!abi || *abi != SPIDEY_PLUGIN_ABI) {
+            fatal("Plugin %s was not built for ABI %d", p->path, SPIDEY_PLUGIN_ABI);
+        }
+        p->handler = (SpideyHandler)dlsym(handle, "spidey_handle");
+        if (!p->handler) {
+            fatal("Plugin %s does not export spidey_handle", p->path);
+        }
+        SpideyInit init = (SpideyInit)dlsym(handle, "spidey_init");
+        if (init && init(p->prefix) != 0) {
+            fatal("Plugin %s failed to initialize", p->path);
+        }
+        log("Serving %s with plugin %s", p->prefix, p->path);
+    }
+}
+
+/**
+ * Return the plugin with the longest prefix of uri (NULL if none).
+ **/
+static Plugin * plugin_route(const char *uri) {
+    Plugin *best = NULL;
+    for (size_t i = 0; i < PluginCount; i++) {
+        Plugin *p = &Plugins[i];
+        if ((!best || p->length > best->length) && strncmp(uri, p->prefix, p->length) == 0) {
+            best = p;
+        }
+    }
+    return best;
+}
+
+/**
+ * Return whether a URI is served by a plugin.
+ **/
+bool plugin_routed(const char *uri) {
+    return PluginCount > 0 && plugin_route(uri) != NULL;
+}
+
+/* Request view */
+
+static const char * view_header(const SpideyRequest *view, const char *name) {
+    return request_header(((PluginRequest *)view)->request, name);
+}
+
+static ssize_t view_read(const SpideyRequest *view, void *buffer, size_t size) {
+    PluginRequest *p = (PluginRequest *)view;
+    Request       *r = p->request;
+
+    if (p->remaining <= 0 || size == 0) {
+        return 0;
+    }
+    if ((off_t)size > p->remaining) {
+        size = p->remaining;
+    }
+
+    /* Bytes stdio read past the header block come first */
+    ssize_t n;
+    size_t  pending = stream_pending(r->stream);
+    if (pending > 0) {
+        n = fread(buffer, 1, size < pending ? size : pending, r->stream);
+    } else {
+        n = coroutine_read(r->fd, buffer, size, BodyTimeout);
+    }
+    if (n <= 0) {
+        return -1;
+    }
+    p->remaining -= n;
+    return n;
+}
+
+/* Response builder */
+
+static void builder_status(SpideyResponse *builder, int code, const char *reason) {
+    PluginResponse *p = (PluginResponse *)builder;
+    if (code < 100 || code > 599 || !reason || strpbrk(reason, "\r\n")) {
+        p->failed = true;
+        return;
+    }
+    p->code = code;
+    snprintf(p->reason, sizeof(p->reason), "%s", reason);
+}
+
+static void builder_header(SpideyResponse *builder, const char *name, const char *value) {
+    PluginResponse *p = (PluginResponse *)builder;
+    if (!name || !value || !*name || strpbrk(name, "\r\n: ") || strpbrk(value, "\r\n")) {
+        p->failed = true;
+        return;
+    }
+    if (strcasecmp(name, "Content-Length") == 0 || strcasecmp(name, "Connection") == 0 ||
+        strcasecmp(name, "Transfer-Encoding") == 0) {
+        return;
+    }
+    p->typed = p->typed || strcasecmp(name, "Content-Type") == 0;
+
+    int n = snprintf(p->headers + p->nheaders, sizeof(p->headers) - p->nheaders, "%s: %s\r\n", name, value);
+    if (n < 0 || (size_t)n >= sizeof(p->headers) - p->nheaders) {
+        p->failed = true;
+        return;
+    }
+    p->nheaders += n;
+}
+
+/**
+ * Make room for size more body bytes.
+ **/
+static bool builder_reserve(PluginResponse *p, size_t size) {
+    if (p->failed) {
+        return false;
+    }
+    if (p->length + size > p->capacity) {
+        size_t capacity = p->capacity ? p->capacity : BUFSIZ;
+        while (capacity < p->length + size) {
+            capacity *= 2;
+        }
+        char *body = realloc(p->body, capacity);
+        if (!body) {
+            p->failed = true;
+            return false;
+        }
+        p->body     = body;
+        p->capacity = capacity;
+    }
+    return true;
+}
+
+static void builder_write(SpideyResponse *builder, const void *data, size_t size) {
+    PluginResponse *p = (PluginResponse *)builder;
+    if (builder_reserve(p, size)) {
+        memcpy(p->body + p->length, data, size);
+        p->length += size;
+    }
+}
+
+static void builder_printf(SpideyResponse *builder, const char *format, ...) {
+    PluginResponse *p = (PluginResponse *)builder;
+    va_list args;
+
+    /* Format straight into the body, growing it once if it was too small */
+    for (size_t room = BUFSIZ; builder_reserve(p, room); ) {
+        va_start(args, format);
+        int n = vsnprintf(p->body + p->length, room, format, args);
+        va_end(args);
+        if (n < 0) {
+            p->failed = true;
+        } else if ((size_t)n < room) {
+            p->length += n;
+        } else {
+            room = n + 1;
+            continue;
+        }
+        return;
+    }
+}
+
+/**
+ * Serve a request with its plugin.
+ *
+ * @param   r           Request whose URI is under a plugin prefix.
+ * @return  HTTP_STATUS_OK once the response is sent, or an error status for
+ *          the caller to report.
+ **/
+Status plugin_request(Request *r) {
+    Plugin *plugin = plugin_route(r->uri);
+    off_t   length;
+    int     body = request_body(r, &length);
+
+    if (body > 0 && length < 0) {
+        /* The ABI has no chunked reader */
+        return HTTP_STATUS_LENGTH_REQUIRED;
+    }
+
+    PluginRequest request = {
+        .view = {
+            .method      = r->method,
+            .uri         = r->uri,
+            .path        = r->uri + plugin->length,
+            .query       = r->query,
+            .version     = r->version,
+            .remote_addr = request_host(r),
+            .header      = view_header,
+            .read        = view_read,
+            .internal    = r,
+        },
+        .request   = r,
+        .remaining = body > 0 ? length : 0,
+    };
+    PluginResponse response = {
+        .builder = {
+            .status   = builder_status,
+            .header   = builder_header,
+            .write    = builder_write,
+            .printf   = builder_printf,
+            .internal = r,
+        },
+        .code   = 200,
+        .reason = "OK",
+    };
+
+    int status = plugin->handler(&request.view, &response.builder);
+    if (status != 0 || response.failed) {
+        log("Plugin %s failed for %s", plugin->path, r->uri);
+        free(response.body);
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    /* An unread body would be taken for the next request: close after this.
+     * Whatever stdio buffered of it must be consumed before writing. */
+    r->persistent = request_keep_alive(r) && request.remaining == 0;
+    while (request.remaining > 0 && stream_pending(r->stream) > 0) {
+        char   discard[BUFSIZ];
+        size_t n = stream_pending(r->stream);
+        if (n > sizeof(discard)) {
+            n = sizeof(discard);
+        }
+        if ((off_t)n > request.remaining) {
+            n = request.remaining;
+        }
+        request.remaining -= fread(discard, 1, n, r->stream);
+    }
+
+    fprintf(r->stream, "HTTP/1.0 %d %s\r\n", response.code, response.reason);
+    if (!response.typed) {
+        fprintf(r->stream, "Content-Type: %s\r\n", DefaultMimeType);
+    }
+    fwrite(response.headers, 1, response.nheaders, r->stream);
+    fprintf(r->stream, "Content-Length: %zu\r\n", response.length);
+    if (r->persistent) {
+        fprintf(r->stream, "Connection: keep-alive\r\n");
+    }
+    fprintf(r->stream, "\r\n");
+    if (!streq(r->method, "HEAD")) {
+        fwrite(response.body, 1, response.length, r->stream);
+    }
+    if (fflush(r->stream) != 0) {
+        r->persistent = false;
+    }
+
+    free(response.body);
+    return HTTP_STATUS_OK;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,80 @@
+/* plugin_hello.c: Sample Native Handler (www/scripts/hello.py as a plugin) */
+
+#include "plugin.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+const int spidey_plugin_abi = SPIDEY_PLUGIN_ABI;
+
+/**
+ * Copy the URL-decoded value of a query parameter into value.
+ *
+ * @return  1 if the parameter is present, 0 otherwise.
+ **/
+static int query_param(const char *query, const char *name, char *value, size_t size) {
+    size_t length = strlen(name);
+
+    for (const char *s = query; s && *s; s = strchr(s, '&'), s = s ? s + 1 : NULL) {
+        if (strncmp(s, name, length) != 0 || s[length] != '=') {
+            continue;
+        }
+        size_t n = 0;
+        for (s += length + 1; *s && *s != '&' && n + 1 < size; s++) {
+            if (*s == '+') {
+                value[n++] = ' ';
+            } else if (*s == '%' && isxdigit((unsigned char)s[1]) && isxdigit((unsigned char)s[2])) {
+                char hex[3] = {s[1], s[2], '\0'};
+                value[n++] = strtol(hex, NULL, 16);
+                s += 2;
+            } else {
+                value[n++] = *s;
+            }
+        }
+        value[n] = '\0';
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Write text with HTML special characters escaped.
+ **/
+static void write_escaped(SpideyResponse *response, const char *text) {
+    for (const char *s = text; *s; s++) {
+        switch (*s) {
+            case '<':  response->write(response, "&lt;", 4);   break;
+            case '>':  response->write(response, "&gt;", 4);   break;
+            case '&':  response->write(response, "&amp;", 5);  break;
+            case '"':  response->write(response, "&quot;", 6); break;
+            default:   response->write(response, s, 1);        break;
+        }
+    }
+}
+
+/**
+ * Greet the user named in the query and show the form.
+ **/
+int spidey_handle(const SpideyRequest *request, SpideyResponse *response) {
+    char user[256];
+
+    response->header(response, "Content-Type", "text/html");
+
+    if (query_param(request->query, "user", user, sizeof(user))) {
+        response->printf(response, "<h1>Hello, ");
+        write_escaped(response, user);
+        response->printf(response, "</h1>\n");
+    }
+
+    response->printf(response,
+        "\n"
+        "<form>\n"
+        "    <input type=\"text\" name=\"user\">\n"
+        "    <input type=\"submit\">\n"
+        "</form>\n"
+        "\n");
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,827 @@
+/* proxy.c: Reverse Proxy */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define PROXY_ROUTES        16          /* Largest number of proxied prefixes */
+#define PROXY_UPSTREAMS     32          /* Largest number of upstreams overall */
+#define PROXY_IDLE          16          /* Pooled connections per upstream */
+#define PROXY_BUFFER        (4 * BUFSIZ) /* Response header block and read buffer */
+#define PROXY_SPLICE        (1 << 16)   /* Largest single splice */
+#define PROXY_LINE          256         /* Longest chunk size or trailer line */
+
+/* Internal State */
+
+typedef struct {
+    char                    *name;      /*< Upstream as configured (for logs) */
+    struct sockaddr_storage  address;   /*< Resolved address */
+    socklen_t                length;    /*< Length of address */
+    int                      idle[PROXY_IDLE]; /*< Pooled connections (this process) */
+    size_t                   nidle;     /*< Number of pooled connections */
+} Upstream;
+
+typedef struct {
+    char    *prefix;                    /*< URI prefix */
+    size_t   length;                    /*< Length of prefix */
+    size_t   first;                     /*< Index of first upstream */
+    size_t   count;                     /*< Number of upstreams */
+} Route;
+
+typedef struct {
+    int      fd;                        /*< Upstream connection */
+    char     buffer[PROXY_BUFFER];      /*< Bytes read but not yet relayed */
+    size_t   start;                     /*< First unconsumed byte */
+    size_t   end;                       /*< End of buffered bytes */
+} ProxySource;
+
+typedef enum {
+    FRAMING_NONE,                       /* No body (HEAD, 204, 304) */
+    FRAMING_LENGTH,                     /* Content-Length */
+    FRAMING_CHUNKED,                    /* Transfer-Encoding: chunked */
+    FRAMING_CLOSE,                      /* Until the upstream closes */
+} Framing;
+
+static Upstream  Upstreams[PROXY_UPSTREAMS];
+static size_t    UpstreamCount = 0;
+static Route     Routes[PROXY_ROUTES];
+static size_t    RouteCount    = 0;
+static unsigned *Outstanding   = NULL;  /* Requests in flight per upstream (shared) */
+static bool      Proxying      = false;
+
+static pid_t     Owner   = 0;           /* Process the pools belong to */
+static pthread_mutex_t PoolLock = PTHREAD_MUTEX_INITIALIZER;   /* Guards Owner and pools */
+static __thread int    Pipe[2]  = {-1, -1};    /* Splice buffer between two sockets */
+static unsigned  Rotation = 0;          /* Tie breaker between idle upstreams */
+
+/* Headers that only describe one hop and are never forwarded */
+static const char *HopHeaders[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+    "Transfer-Encoding", "Upgrade", "Expect",
+};
+
+/*
+ * Connections to upstreams are kept open between requests in the process
+ * that handles them: each single-mode worker keeps one pool for all of its
+ * clients, a forking child keeps one for the lifetime of its keep-alive
+ * connection.  A child forked while a pool is open (an HTTP/2 stream, for
+ * instance) never touches its parent's connections: it notices it is not
+ * the Owner and starts with empty pools.  The task threads of a hybrid
+ * server share their process's pools under PoolLock; each thread splices
+ * through its own pipe.
+ *
+ * Requests go to the upstream of the route with the fewest requests in
+ * flight.  Those counts are kept in shared memory, so every worker and
+ * child balances against the same numbers.
+ *
+ * Bodies are moved with splice(2): socket to pipe to socket, or straight
+ * into the stream pipe of an HTTP/2 stream.  Only response headers and chunk
+ * size lines are read into user space.
+ */
+
+/**
+ * Resolve one upstream: unix:PATH or HOST:PORT.
+ **/
+static bool parse_upstream(Upstream *u, char *spec) {
+    u->name = spec;
+
+    if (strncmp(spec, "unix:", 5) == 0) {
+        struct sockaddr_un *sun = (struct sockaddr_un *)&u->address;
+        if (strlen(spec + 5) >= sizeof(sun->sun_path)) {
+            return false;
+        }
+        sun->sun_family = AF_UNIX;
+        strcpy(sun->sun_path, spec + 5);
+        u->length = sizeof(*sun);
+        return true;
+    }
+
+    char  host[NI_MAXHOST];
+    char *port = strrchr(spec, ':');
+    if (!port || port == spec || (size_t)(port - spec) >= sizeof(host)) {
+        return false;
+    }
+    memcpy(host, spec, port - spec);
+    host[port - spec] = '\0';
+    port++;
+
+    /* [::1]:8080 */
+    char *name = host;
+    if (*name == '[' && name[strlen(name) - 1] == ']') {
+        name[strlen(name) - 1] = '\0';
+        name++;
+    }
+
+    struct addrinfo  hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *results;
+    int status = getaddrinfo(name, port, &hints, &results);
+    if (status != 0) {
+        log("Unable to resolve upstream %s: %s", spec, gai_strerror(status));
+        return false;
+    }
+    memcpy(&u->address, results->ai_addr, results->ai_addrlen);
+    u->length = results->ai_addrlen;
+    freeaddrinfo(results);
+    return true;
+}
+
+/**
+ * Parse reverse proxy specification.
+ *
+ * @param   spec        Comma separated prefix=UPSTREAM[+UPSTREAM...] pairs,
+ *                      where each upstream is HOST:PORT or unix:PATH.
+ * @return  true if parsing was successful, false if there was an error.
+ **/
+bool parse_proxy(char *spec) {
+    char *pairs;
+
+    for (char *pair = strtok_r(spec, ",", &pairs); pair; pair = strtok_r(NULL, ",", &pairs)) {
+        char *upstreams = strchr(pair, '=');
+        if (!upstreams || *pair != '/' || RouteCount == PROXY_ROUTES) {
+            return false;
+        }
+        *upstreams++ = '\0';
+
+        Route *route  = &Routes[RouteCount++];
+        route->prefix = pair;
+        route->length = strlen(pair);
+        route->first  = UpstreamCount;
+
+        char *names;
+        for (char *name = strtok_r(upstreams, "+", &names); name; name = strtok_r(NULL, "+", &names)) {
+            if (UpstreamCount == PROXY_UPSTREAMS || !parse_upstream(&Upstreams[UpstreamCount], name)) {
+                return false;
+            }
+            UpstreamCount++;
+        }
+        route->count = UpstreamCount - route->first;
+        if (route->count == 0) {
+            return false;
+        }
+    }
+    Proxying = RouteCount > 0;
+    return Proxying;
+}
+
+/* PoolLock is held across fork, so no child inherits it locked by a thread
+ * that does not exist there */
+static void proxy_fork_prepare(void) {
+    pthread_mutex_lock(&PoolLock);
+}
+
+static void proxy_fork_done(void) {
+    pthread_mutex_unlock(&PoolLock);
+}
+
+/**
+ * Map the outstanding request counters before any worker is forked.
+ **/
+void proxy_init(void) {
+    if (!Proxying) {
+        return;
+    }
+    Outstanding = mmap(NULL, PROXY_UPSTREAMS * sizeof(unsigned), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Outstanding == MAP_FAILED) {
+        fatal("Unable to mmap upstream counters: %s", strerror(errno));
+    }
+    for (size_t i = 0; i < RouteCount; i++) {
+        log("Proxying %s to %lu upstreams", Routes[i].prefix, (unsigned long)Routes[i].count);
+    }
+    pthread_atfork(proxy_fork_prepare, proxy_fork_done, proxy_fork_done);
+}
+
+/**
+ * Return the route with the longest prefix of uri (NULL if none).
+ **/
+static Route * proxy_route(const char *uri) {
+    Route *best = NULL;
+    for (size_t i = 0; i < RouteCount; i++) {
+        Route *route = &Routes[i];
+        if ((!best || route->length > best->length) && strncmp(uri, route->prefix, route->length) == 0) {
+            best = route;
+        }
+    }
+    return best;
+}
+
+/**
+ * Return whether a URI is served by an upstream.
+ **/
+bool proxy_routed(const char *uri) {
+    return Proxying && proxy_route(uri) != NULL;
+}
+
+/**
+ * Drop pools and pipe inherited from another process.
+ **/
+static void proxy_local(void) {
+    pid_t pid = getpid();
+    pthread_mutex_lock(&PoolLock);
+    if (Owner == pid) {
+        pthread_mutex_unlock(&PoolLock);
+        return;
+    }
+    for (size_t i = 0; i < UpstreamCount; i++) {
+        while (Upstreams[i].nidle > 0) {
+            close(Upstreams[i].idle[--Upstreams[i].nidle]);
+        }
+    }
+    if (Pipe[0] >= 0) {
+        close(Pipe[0]);
+        close(Pipe[1]);
+        Pipe[0] = Pipe[1] = -1;
+    }
+    Owner = pid;
+    pthread_mutex_unlock(&PoolLock);
+}
+
+/**
+ * Open a new connection to an upstream.
+ **/
+static int upstream_connect(Upstream *u) {
+    int type = SOCK_STREAM | SOCK_CLOEXEC | (coroutine_running() ? SOCK_NONBLOCK : 0);
+    int fd   = socket(u->address.ss_family, type, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct timeval tv = {
+        .tv_sec  = UpstreamTimeout / 1000,
+        .tv_usec = (UpstreamTimeout % 1000) * 1000,
+    };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (u->address.ss_family != AF_UNIX) {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+
+    /* A coroutine waits for the connection on the loop instead */
+    int connected = connect(fd, (struct sockaddr *)&u->address, u->length);
+    if (connected < 0 && errno == EINPROGRESS && coroutine_running()) {
+        int       error  = 0;
+        socklen_t length = sizeof(error);
+        if (!coroutine_wait(fd, POLLOUT, UpstreamTimeout)) {
+            error = EAGAIN;
+        } else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0) {
+            error = errno;
+        }
+        connected = error ? -1 : 0;
+        errno     = error;
+    }
+    if (connected < 0) {
+        int error = errno;
+        debug("Unable to connect to upstream %s: %s", u->name, strerror(errno));
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Take a pooled connection that the upstream has not closed (-1 if none).
+ **/
+static int upstream_pooled(Upstream *u) {
+    pthread_mutex_lock(&PoolLock);
+    while (u->nidle > 0) {
+        int  fd = u->idle[--u->nidle];
+        char c;
+        if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            pthread_mutex_unlock(&PoolLock);
+            return fd;
+        }
+        /* Closed, failed, or sent something unasked for */
+        close(fd);
+    }
+    pthread_mutex_unlock(&PoolLock);
+    return -1;
+}
+
+/**
+ * Return a connection to the pool (or close it).
+ **/
+static void upstream_release(Upstream *u, int fd, bool reusable) {
+    pthread_mutex_lock(&PoolLock);
+    if (reusable && u->nidle < PROXY_IDLE) {
+        u->idle[u->nidle++] = fd;
+        fd = -1;
+    }
+    pthread_mutex_unlock(&PoolLock);
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+/**
+ * Choose the untried upstream of a route with the fewest requests in flight.
+ **/
+static Upstream * upstream_choose(Route *route, uint32_t *tried) {
+    Upstream *best  = NULL;
+    unsigned  least = 0;
+    unsigned  start = __atomic_fetch_add(&Rotation, 1, __ATOMIC_RELAXED);
+
+    for (size_t n = 0; n < route->count; n++) {
+        size_t i = (start + n) % route->count;
+        if (*tried & (1U << i)) {
+            continue;
+        }
+        unsigned outstanding = __atomic_load_n(&Outstanding[route->first + i], __ATOMIC_RELAXED);
+        if (!best || outstanding < least) {
+            best  = &Upstreams[route->first + i];
+            least = outstanding;
+        }
+    }
+    if (best) {
+        *tried |= 1U << (best - &Upstreams[route->first]);
+    }
+    return best;
+}
+
+/**
+ * Write exactly length bytes to fd.
+ **/
+static bool proxy_write(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = coroutine_write(fd, data, length, WriteTimeout);
+        if (n <= 0) {
+            return false;
+        }
+        data   += n;
+        length -= n;
+    }
+    return true;
+}
+
+/**
+ * Move bytes from one descriptor to another with splice.
+ *
+ * @param   in          Source socket.
+ * @param   out         Destination socket or pipe.
+ * @param   length      Bytes to move, or -1 to move everything until EOF.
+ * @return  true if length bytes (or everything) were moved.
+ *
+ * Sockets go through Pipe; a pipe destination is spliced into directly.  If
+ * anything fails midway the pipe may hold stray bytes, so it is discarded.
+ **/
+static bool proxy_splice(int in, int out, off_t length) {
+    struct stat st;
+    bool direct = fstat(out, &st) == 0 && S_ISFIFO(st.st_mode);
+
+    if (!direct && Pipe[0] < 0 && pipe2(Pipe, O_CLOEXEC) < 0) {
+        debug("Unable to create splice pipe: %s", strerror(errno));
+        return false;
+    }
+
+    while (length != 0) {
+        size_t  want = length > 0 && length < PROXY_SPLICE ? length : PROXY_SPLICE;
+        ssize_t n    = splice(in, NULL, direct ? out : Pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && (errno == EINTR || (errno == EAGAIN && coroutine_wait(in, POLLIN, UpstreamTimeout)))) {
+            continue;
+        }
+        if (n == 0 && length < 0) {
+            return true;
+        }
+        if (n <= 0) {
+            debug("Upstream splice ended early: %s", n < 0 ? strerror(errno) : "EOF");
+            goto fail;
+        }
+        for (ssize_t left = direct ? 0 : n; left > 0; ) {
+            ssize_t m = splice(Pipe[0], NULL, out, NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m < 0 && (errno == EINTR || (errno == EAGAIN && coroutine_wait(out, POLLOUT, WriteTimeout)))) {
+                continue;
+            }
+            if (m <= 0) {
+                debug("Client splice failed: %s", m < 0 ? strerror(errno) : "EOF");
+                goto fail;
+            }
+            left -= m;
+        }
+        if (length > 0) {
+            length -= n;
+        }
+    }
+    return true;
+
+fail:
+    if (!direct) {
+        close(Pipe[0]);
+        close(Pipe[1]);
+        Pipe[0] = Pipe[1] = -1;
+    }
+    return false;
+}
+
+/**
+ * Read more of the response into the source buffer.
+ **/
+static bool source_fill(ProxySource *s) {
+    if (s->start == s->end) {
+        s->start = s->end = 0;
+    }
+    if (s->end == sizeof(s->buffer)) {
+        return false;
+    }
+    ssize_t n = coroutine_read(s->fd, s->buffer + s->end, sizeof(s->buffer) - s->end, UpstreamTimeout);
+    if (n <= 0) {
+        return false;
+    }
+    s->end += n;
+    return true;
+}
+
+/**
+ * Read one line (chunk size or trailer) of the response, CRLF included.
+ **/
+static bool source_line(ProxySource *s, char *line, size_t size) {
+    size_t length = 0;
+    for (;;) {
+        while (s->start < s->end) {
+            char c = s->buffer[s->start++];
+            if (length + 1 >= size) {
+                return false;
+            }
+            line[length++] = c;
+            if (c == '\n') {
+                line[length] = '\0';
+                return true;
+            }
+        }
+        if (!source_fill(s)) {
+            return false;
+        }
+    }
+}
+
+/**
+ * Relay length body bytes (-1 for all until EOF) to the client.
+ **/
+static bool source_relay(ProxySource *s, int out, off_t length) {
+    size_t buffered = s->end - s->start;
+    if (length >= 0 && buffered > (uint64_t)length) {
+        buffered = length;
+    }
+    if (!proxy_write(out, s->buffer + s->start, buffered)) {
+        return false;
+    }
+    s->start += buffered;
+    return proxy_splice(s->fd, out, length < 0 ? -1 : length - (off_t)buffered);
+}
+
+/**
+ * Relay a chunked body, keeping its framing only for HTTP/1.1 clients.
+ **/
+static bool source_chunks(ProxySource *s, int out, bool framed) {
+    char line[PROXY_LINE];
+
+    for (;;) {
+        if (!source_line(s, line, sizeof(line))) {
+            return false;
+        }
+        char *end;
+        errno = 0;
+        long long size = strtoll(line, &end, 16);
+        if (errno || end == line || size < 0) {
+            debug("Bad upstream chunk size: %s", line);
+            return false;
+        }
+        if (framed && !proxy_write(out, line, strlen(line))) {
+            return false;
+        }
+        if (size == 0) {
+            break;
+        }
+        if (!source_relay(s, out, size) || !source_line(s, line, sizeof(line)) ||
+            (framed && !proxy_write(out, line, strlen(line)))) {
+            return false;
+        }
+    }
+
+    /* Trailer fields up to the blank line */
+    do {
+        if (!source_line(s, line, sizeof(line)) || (framed && !proxy_write(out, line, strlen(line)))) {
+            return false;
+        }
+    } while (line[0] != '\r' && line[0] != '\n');
+    return true;
+}
+
+/**
+ * Return whether a header only describes one hop.
+ **/
+static bool hop_header(const char *name) {
+    for (size_t i = 0; i < sizeof(HopHeaders) / sizeof(HopHeaders[0]); i++) {
+        if (strcasecmp(name, HopHeaders[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Send the request line, headers and body to an upstream.
+ *
+ * @return  0 on success, -1 if nothing of the body was consumed (so another
+ *          connection may be tried), -2 if the request cannot be retried.
+ **/
+static int proxy_send(Request *r, int fd, off_t length) {
+    char   head[PROXY_BUFFER];
+    size_t n = 0;
+    const char *forwarded = request_header(r, "X-Forwarded-For");
+
+    n += snprintf(head + n, sizeof(head) - n, "%s %s HTTP/1.1\r\n", r->method, r->uri);
+    for (Header *h = r->headers; h && n < sizeof(head); h = h->next) {
+        if (!hop_header(h->name) && strcasecmp(h->name, "X-Forwarded-For") != 0) {
+            n += snprintf(head + n, sizeof(head) - n, "%s: %s\r\n", h->name, h->data);
+        }
+    }
+    if (n < sizeof(head)) {
+        n += snprintf(head + n, sizeof(head) - n,
+            "X-Forwarded-For: %s%s%s\r\n"
+            "X-Forwarded-Proto: %s\r\n"
+            "\r\n",
+            forwarded ? forwarded : "", forwarded ? ", " : "", request_host(r), r->secure ? "https" : "http");
+    }
+    if (n >= sizeof(head)) {
+        debug("Request headers too large to forward");
+        return -2;
+    }
+    if (send(fd, head, n, MSG_NOSIGNAL | (length > 0 ? MSG_MORE : 0)) != (ssize_t)n) {
+        return -1;
+    }
+    if (length == 0) {
+        return 0;
+    }
+
+    /* Let a client waiting on Expect: 100-continue send its body */
+    const char *expect = request_header(r, "Expect");
+    if (expect && strcasecmp(expect, "100-continue") == 0 && streq(r->version, "HTTP/1.1")) {
+        static const char Continue[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        if (!proxy_write(r->fd, Continue, sizeof(Continue) - 1)) {
+            return -2;
+        }
+    }
+
+    /* Body bytes stdio already read, then the rest straight from the socket */
+    char   buffer[BUFSIZ];
+    size_t pending = stream_pending(r->stream);
+    while (pending > 0 && length > 0) {
+        size_t want = pending < sizeof(buffer) ? pending : sizeof(buffer);
+        if ((off_t)want > length) {
+            want = length;
+        }
+        size_t got = fread(buffer, 1, want, r->stream);
+        if (got == 0 || !proxy_write(fd, buffer, got)) {
+            return -2;
+        }
+        pending -= got;
+        length  -= got;
+    }
+    return length > 0 && !proxy_splice(r->fd, fd, length) ? -2 : 0;
+}
+
+/**
+ * Read the upstream response header block, skipping 1xx interim responses.
+ *
+ * @return  Length of the header block in s->buffer, 0 if the upstream closed
+ *          without responding, or -1 on error or timeout.
+ **/
+static ssize_t proxy_head(ProxySource *s) {
+    for (;;) {
+        char *end = NULL;
+        while (!end) {
+            s->buffer[s->end < sizeof(s->buffer) ? s->end : sizeof(s->buffer) - 1] = '\0';
+            char *crlf = strstr(s->buffer + s->start, "\r\n\r\n");
+            char *lf   = strstr(s->buffer + s->start, "\n\n");
+            if (crlf && (!lf || crlf < lf)) {
+                end = crlf + 4;
+            } else if (lf) {
+                end = lf + 2;
+            } else if (s->end >= sizeof(s->buffer) - 1) {
+                debug("Upstream header block too large");
+                return -1;
+            } else {
+                size_t before = s->end;
+                ssize_t n = coroutine_read(s->fd, s->buffer + s->end, sizeof(s->buffer) - 1 - s->end, UpstreamTimeout);
+                if (n <= 0) {
+                    return n == 0 && before == 0 ? 0 : -1;
+                }
+                s->end += n;
+            }
+        }
+
+        /* 100 Continue, 103 Early Hints: wait for the final response */
+        if (strncmp(s->buffer + s->start, "HTTP/1.", 7) == 0 && s->buffer[s->start + 9] == '1') {
+            s->start = end - s->buffer;
+            memmove(s->buffer, s->buffer + s->start, s->end - s->start);
+            s->end  -= s->start;
+            s->start = 0;
+            continue;
+        }
+        return end - s->buffer;
+    }
+}
+
+/**
+ * Relay the upstream response to the client.
+ *
+ * @param   r           Request being proxied.
+ * @param   s           Source holding the complete header block.
+ * @param   head        Length of the header block.
+ * @return  true if the upstream connection can be reused.
+ **/
+static bool proxy_respond(Request *r, ProxySource *s, size_t head) {
+    char   *line;
+    char   *saveptr;
+    off_t   length   = -1;
+    Framing framing  = FRAMING_CLOSE;
+    bool    reusable = true;
+
+    s->buffer[head - 1] = '\0';
+    s->start = head;
+
+    /* Status line */
+    line = strtok_r(s->buffer, "\r\n", &saveptr);
+    char *status = line ? strchr(line, ' ') : NULL;
+    if (!line || strncmp(line, "HTTP/1.", 7) != 0 || !status) {
+        debug("Bad upstream status line");
+        return false;
+    }
+    reusable = strncmp(line, "HTTP/1.1", 8) == 0;
+    status   = skip_whitespace(status);
+    int code = atoi(status);
+
+    bool http11 = r->version && streq(r->version, "HTTP/1.1");
+    char headers[PROXY_BUFFER];
+    size_t nheaders = 0;
+
+    for (line = strtok_r(NULL, "\r\n", &saveptr); line; line = strtok_r(NULL, "\r\n", &saveptr)) {
+        char *value = strchr(line, ':');
+        if (!value) {
+            continue;
+        }
+        *value++ = '\0';
+        value = skip_whitespace(value);
+
+        if (strcasecmp(line, "Content-Length") == 0) {
+            length  = strtoll(value, NULL, 10);
+            framing = framing == FRAMING_CHUNKED ? framing : FRAMING_LENGTH;
+        } else if (strcasecmp(line, "Transfer-Encoding") == 0 && strcasestr(value, "chunked")) {
+            framing = FRAMING_CHUNKED;
+        } else if (strcasecmp(line, "Connection") == 0 && strcasestr(value, "close")) {
+            reusable = false;
+        }
+        if (hop_header(line) || strcasecmp(line, "Content-Length") == 0) {
+            continue;
+        }
+        int n = snprintf(headers + nheaders, sizeof(headers) - nheaders, "%s: %s\r\n", line, value);
+        if (n < 0 || (size_t)n >= sizeof(headers) - nheaders) {
+            debug("Upstream headers too large");
+            return false;
+        }
+        nheaders += n;
+    }
+    if (streq(r->method, "HEAD") || code == 204 || code == 304) {
+        framing = FRAMING_NONE;
+    }
+    if (framing == FRAMING_CLOSE) {
+        reusable = false;
+    }
+
+    r->persistent = http11 && framing != FRAMING_CLOSE && request_keep_alive(r);
+    fprintf(r->stream, "%s %s\r\n", http11 ? "HTTP/1.1" : "HTTP/1.0", status);
+    fwrite(headers, 1, nheaders, r->stream);
+    if (framing == FRAMING_LENGTH || (framing == FRAMING_NONE && length >= 0)) {
+        fprintf(r->stream, "Content-Length: %lld\r\n", (long long)length);
+    }
+    if (framing == FRAMING_CHUNKED && http11) {
+        fprintf(r->stream, "Transfer-Encoding: chunked\r\n");
+    }
+    if (http11 && !r->persistent) {
+        fprintf(r->stream, "Connection: close\r\n");
+    }
+    fprintf(r->stream, "\r\n");
+    if (fflush(r->stream) != 0) {
+        r->persistent = false;
+        return false;
+    }
+
+    bool relayed = true;
+    switch (framing) {
+        case FRAMING_NONE:
+            break;
+        case FRAMING_LENGTH:
+            relayed = length >= 0 && source_relay(s, r->fd, length);
+            break;
+        case FRAMING_CHUNKED:
+            relayed = source_chunks(s, r->fd, http11);
+            break;
+        case FRAMING_CLOSE:
+            relayed = source_relay(s, r->fd, -1);
+            break;
+    }
+    if (!relayed) {
+        r->persistent = false;
+    }
+    return relayed && reusable && s->start == s->end;
+}
+
+/**
+ * Forward a request to an upstream and relay its response.
+ *
+ * @param   r           Request whose URI is under a proxied prefix.
+ * @return  HTTP_STATUS_OK once a response has been relayed (whatever its
+ *          status), or an error status if none could be obtained.
+ *
+ * Pooled connections the upstream closed in the meantime are retried on a
+ * new connection as long as no body bytes were taken from the client.  If
+ * an upstream refuses connections the next least loaded one is tried.
+ **/
+Status proxy_request(Request *r) {
+    Route      *route = proxy_route(r->uri);
+    uint32_t    tried = 0;
+    off_t       length;
+    ProxySource s;
+
+    if (!route) {
+        return HTTP_STATUS_NOT_FOUND;
+    }
+    int body = request_body(r, &length);
+    if (body > 0 && length < 0) {
+        /* The upstream would have to be sent a length we do not know */
+        return HTTP_STATUS_LENGTH_REQUIRED;
+    }
+    proxy_local();
+
+    Upstream *u;
+    while ((u = upstream_choose(route, &tried))) {
+        size_t    index = u - Upstreams;
+        unsigned *count = &Outstanding[index];
+        __atomic_add_fetch(count, 1, __ATOMIC_RELAXED);
+        PROBE2(proxy_upstream, index, *count);
+
+        for (bool pooled = true; ; pooled = false) {
+            int fd = pooled ? upstream_pooled(u) : -1;
+            if (fd < 0) {
+                pooled = false;
+                fd = upstream_connect(u);
+            }
+            if (fd < 0) {
+                bool timeout = errno == EAGAIN || errno == EINPROGRESS;
+                log("Upstream %s unavailable: %s", u->name, strerror(errno));
+                __atomic_sub_fetch(count, 1, __ATOMIC_RELAXED);
+                if (timeout && tried == (1U << route->count) - 1) {
+                    return HTTP_STATUS_GATEWAY_TIMEOUT;
+                }
+                break;
+            }
+
+            int sent = proxy_send(r, fd, body > 0 ? length : 0);
+            ssize_t head = -1;
+            if (sent == 0) {
+                s.fd    = fd;
+                s.start = s.end = 0;
+                head    = proxy_head(&s);
+            }
+            if (head > 0) {
+                bool reusable = proxy_respond(r, &s, head);
+                upstream_release(u, fd, reusable);
+                __atomic_sub_fetch(count, 1, __ATOMIC_RELAXED);
+                return HTTP_STATUS_OK;
+            }
+
+            int error = errno;
+            close(fd);
+            if (pooled && sent != -2 && head == 0 && body == 0) {
+                debug("Pooled connection to %s was closed: retrying", u->name);
+                continue;
+            }
+            if (pooled && sent == -1) {
+                continue;
+            }
+            __atomic_sub_fetch(count, 1, __ATOMIC_RELAXED);
+            log("Upstream %s failed: %s", u->name, head < 0 && sent == 0 ? strerror(error) : "closed");
+            if (head < 0 && sent == 0 && (error == EAGAIN || error == EWOULDBLOCK)) {
+                return HTTP_STATUS_GATEWAY_TIMEOUT;
+            }
+            return HTTP_STATUS_BAD_GATEWAY;
+        }
+    }
+    return HTTP_STATUS_BAD_GATEWAY;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,278 @@
+/* ratelimit.c: Per-Client Rate Limiting */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define RATE_CLASSES    16              /* Largest number of path classes */
+#define RATE_SLOTS      (1 << 16)       /* Buckets in the shared table */
+#define RATE_PROBES     8               /* Slots examined per lookup */
+#define RATE_SCALE      1000            /* Bucket resolution (millitokens) */
+#define RATE_TOKEN_BITS 24              /* Low bits of state hold tokens */
+#define RATE_TOKEN_MASK ((1UL << RATE_TOKEN_BITS) - 1)
+#define RATE_BURST_MAX  (RATE_TOKEN_MASK / RATE_SCALE)
+
+/* Internal State */
+
+typedef struct {
+    const char *prefix;                 /*< URI prefix of the class */
+    size_t      length;                 /*< Length of prefix */
+    long        rate;                   /*< Tokens added per second */
+    long        burst;                  /*< Bucket capacity */
+} RateClass;
+
+typedef struct {
+    uint64_t    key;                    /*< Hash of client and class (0 = free) */
+    uint64_t    state;                  /*< Update time << 24 | millitokens */
+} RateBucket;
+
+static RateClass   Classes[RATE_CLASSES];
+static size_t      ClassCount = 0;
+static RateBucket *Table      = NULL;   /* Shared by every worker */
+static uint64_t    Epoch      = 0;      /* timer_now when the table was made */
+
+static char   Rejection[256];           /* Pre-rendered 429 response */
+static size_t RejectionLength;
+
+/*
+ * Every (client address, path class) pair has a token bucket in a fixed
+ * table of RATE_SLOTS entries mapped before any worker is forked.  A bucket
+ * is found by linear probing from its hash and claimed with a compare and
+ * swap on its key; tokens are taken with a compare and swap on one 64-bit
+ * word holding both the time of the last update (milliseconds since Epoch)
+ * and the tokens left at that time.  The refill is computed from the
+ * elapsed time on every access, so nothing ever sweeps the table.
+ *
+ * A state of 0 reads as "full at Epoch", which is a full bucket now: freshly
+ * claimed slots need no initialization.  When all RATE_PROBES slots are
+ * taken by other clients, the one that has been idle long enough to refill
+ * completely is reused, which loses nothing.  If none has, the request is
+ * let through rather than charged to someone else's bucket.
+ */
+
+/**
+ * Parse rate limit specification.
+ *
+ * @param   spec        Comma separated prefix=RATE[:BURST] pairs: clients may
+ *                      make RATE requests per second (in bursts of up to
+ *                      BURST, default RATE) for URIs starting with prefix.
+ *                      The longest matching prefix applies.
+ * @return  true if parsing was successful, false if there was an error.
+ **/
+bool parse_rates(char *spec) {
+    for (char *pair = strtok(spec, ","); pair; pair = strtok(NULL, ",")) {
+        char *value = strrchr(pair, '=');
+        char *end;
+        if (!value || *pair != '/' || ClassCount == RATE_CLASSES) {
+            return false;
+        }
+        *value++ = '\0';
+
+        RateClass *c = &Classes[ClassCount++];
+        c->prefix = pair;
+        c->length = strlen(pair);
+        c->rate   = strtol(value, &end, 10);
+        c->burst  = c->rate;
+        if (*end == ':') {
+            value    = end + 1;
+            c->burst = strtol(value, &end, 10);
+        }
+        if (*end || end == value || c->rate < 1 || c->burst < 1 || c->burst > (long)RATE_BURST_MAX) {
+            return false;
+        }
+    }
+    return ClassCount > 0;
+}
+
+/**
+ * Map the bucket table and render the 429 response before forking.
+ **/
+void rate_init(void) {
+    if (ClassCount == 0) {
+        return;
+    }
+
+    const char *status = http_status_string(HTTP_STATUS_TOO_MANY_REQUESTS);
+    char body[64];
+    int  length = snprintf(body, sizeof(body), "<strong>%s</strong>", status);
+
+    RejectionLength = snprintf(Rejection, sizeof(Rejection),
+        "HTTP/1.0 %s\r\n"
+        "Retry-After: %d\r\n"
+        "Content-Type: text/html\r\n"
+        "Content-Length: %d\r\n"
+        "Connection: close\r\n"
+        "\r\n"
+        "%s", status, RetryAfter, length, body);
+
+    Table = mmap(NULL, RATE_SLOTS * sizeof(RateBucket), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Table == MAP_FAILED) {
+        fatal("Unable to mmap rate limit table: %s", strerror(errno));
+    }
+    Epoch = timer_now();
+    log("Rate limiting %lu path classes in %d shared buckets", (unsigned long)ClassCount, RATE_SLOTS);
+}
+
+/**
+ * Return the class with the longest prefix of uri (NULL if none).
+ **/
+static RateClass * rate_class(const char *uri) {
+    RateClass *best = NULL;
+    for (size_t i = 0; i < ClassCount; i++) {
+        RateClass *c = &Classes[i];
+        if ((!best || c->length > best->length) && strncmp(uri, c->prefix, c->length) == 0) {
+            best = c;
+        }
+    }
+    return best;
+}
+
+/**
+ * Hash a client address (without its port) into a non-zero key (FNV-1a)
+ * whose low bits are the index of the class.
+ **/
+static uint64_t rate_key(const Address *addr, const RateClass *c) {
+    const unsigned char *bytes = (const unsigned char *)&addr->in.sin_addr;
+    size_t               size  = sizeof(addr->in.sin_addr);
+    if (addr->sa.sa_family == AF_INET6) {
+        bytes = (const unsigned char *)&addr->in6.sin6_addr;
+        size  = sizeof(addr->in6.sin6_addr);
+    }
+
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    hash = (hash & ~(uint64_t)(RATE_CLASSES - 1)) | (uint64_t)(c - Classes);
+    return hash ? hash : RATE_CLASSES;
+}
+
+/**
+ * Return the tokens a bucket holds at now (in millitokens).
+ **/
+static uint64_t rate_tokens(uint64_t state, uint64_t now, const RateClass *c) {
+    uint64_t then    = state >> RATE_TOKEN_BITS;
+    uint64_t tokens  = state & RATE_TOKEN_MASK;
+    uint64_t limit   = c->burst * RATE_SCALE;
+    uint64_t elapsed = now > then ? now - then : 0;
+
+    /* RATE_SCALE millitokens per token, 1000 ms per second */
+    if (state == 0 || elapsed * c->rate >= limit - (tokens < limit ? tokens : limit)) {
+        return limit;
+    }
+    return tokens + elapsed * c->rate;
+}
+
+/**
+ * Find or claim the bucket for key.
+ **/
+static RateBucket * rate_bucket(uint64_t key, uint64_t now) {
+    RateBucket *idle = NULL;
+
+    for (size_t i = 0; i < RATE_PROBES; i++) {
+        RateBucket *b = &Table[(key / RATE_CLASSES + i) & (RATE_SLOTS - 1)];
+        uint64_t    current = __atomic_load_n(&b->key, __ATOMIC_ACQUIRE);
+
+        if (current == key) {
+            return b;
+        }
+        if (current == 0) {
+            if (__atomic_compare_exchange_n(&b->key, &current, key, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || current == key) {
+                return b;
+            }
+        }
+        const RateClass *owner = &Classes[current & (RATE_CLASSES - 1)];
+        if (!idle && owner < Classes + ClassCount &&
+            rate_tokens(__atomic_load_n(&b->state, __ATOMIC_RELAXED), now, owner) == (uint64_t)owner->burst * RATE_SCALE) {
+            idle = b;
+        }
+    }
+
+    /* Reuse a full bucket: its owner would find a full bucket again anyway */
+    if (idle) {
+        uint64_t current = __atomic_load_n(&idle->key, __ATOMIC_ACQUIRE);
+        if (__atomic_compare_exchange_n(&idle->key, &current, key, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&idle->state, 0, __ATOMIC_RELEASE);
+            return idle;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Take a token for the request from its client's bucket.
+ *
+ * @param   r           Request whose request line has been parsed.
+ * @return  true if the request may proceed.
+ **/
+bool rate_admit(Request *r) {
+    if (!Table || !r->uri) {
+        return true;
+    }
+    RateClass *c = rate_class(r->uri);
+    if (!c) {
+        return true;
+    }
+
+    uint64_t    now = timer_now() - Epoch;
+    RateBucket *b   = rate_bucket(rate_key(&r->addr, c), now);
+    if (!b) {
+        debug("Rate limit table full around %s", request_host(r));
+        return true;
+    }
+
+    uint64_t state = __atomic_load_n(&b->state, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint64_t tokens = rate_tokens(state, now, c);
+        if (tokens < RATE_SCALE) {
+            return false;
+        }
+        uint64_t next = now << RATE_TOKEN_BITS | (tokens - RATE_SCALE);
+        if (__atomic_compare_exchange_n(&b->state, &state, next, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    }
+}
+
+/**
+ * Turn away a request over its rate limit.
+ *
+ * @param   r           Request whose headers have not been read.
+ * @return  HTTP_STATUS_TOO_MANY_REQUESTS.
+ *
+ * The pre-rendered response closes the connection, so the unread headers
+ * never need parsing.  Whatever of them is still in the socket is discarded
+ * after sending, so closing does not reset the connection before the client
+ * reads the response.
+ **/
+Status rate_reject(Request *r) {
+    char discard[BUFSIZ];
+
+    log("Rate limited %s for %s", request_host(r), r->uri);
+    r->persistent = false;
+    if (!r->version) {
+        /* HTTP/2 stream: the response goes through the stream's pipe */
+        fwrite(Rejection, 1, RejectionLength, r->stream);
+        return HTTP_STATUS_TOO_MANY_REQUESTS;
+    }
+
+    /* The stream still holds unread header bytes, so bypass it */
+    if (send(r->fd, Rejection, RejectionLength, MSG_NOSIGNAL) < 0) {
+        debug("Unable to send 429: %s", strerror(errno));
+    }
+    while (recv(r->fd, discard, sizeof(discard), MSG_DONTWAIT) > 0);
+    return HTTP_STATUS_TOO_MANY_REQUESTS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,154 @@
+/* reload.c: Configuration Reload and Binary Upgrade */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/* Global Variables */
+char **ExecArguments = NULL;
+
+/* Constants */
+
+#define PARENT_PID_ENV  "SPIDEY_PARENT_PID"    /* Server to stop once we listen */
+
+/**
+ * Save a copy of the command line for re-executing the server.
+ *
+ * @param   argc        Number of arguments.
+ * @param   argv        Array of argument strings.
+ *
+ * Option parsing tokenizes some arguments in place, so the copy has to be
+ * taken before parse_options runs.
+ **/
+void save_arguments(int argc, char *argv[]) {
+    ExecArguments = calloc(argc + 1, sizeof(char *));
+    if (!ExecArguments) {
+        fatal("Unable to allocate arguments: %s", strerror(errno));
+    }
+    for (int i = 0; i < argc; i++) {
+        ExecArguments[i] = strdup(argv[i]);
+    }
+}
+
+/**
+ * Re-read configuration that can change while the server is running.
+ *
+ * @return  true if the new configuration was applied.
+ *
+ * This re-resolves and reopens the root directory (so a symlinked root can
+ * be switched to a new release), re-maps the static bundle and reloads the TLS
+ * certificate.  On failure the previous configuration stays in place.
+ **/
+bool server_reload(void) {
+    char *path = realpath(root, NULL);
+    if (!path) {
+        log("Unable to resolve root %s: %s", root, strerror(errno));
+        return false;
+    }
+
+    if (TlsPort && !tls_init()) {
+        log("Unable to reload TLS certificate %s", TlsCertificate);
+        free(path);
+        return false;
+    }
+
+    Bundle *bundle = NULL;
+    if (BundlePath) {
+        bundle = bundle_open(BundlePath);
+        if (!bundle) {
+            log("Unable to reopen bundle %s", BundlePath);
+            free(path);
+            return false;
+        }
+    }
+
+    if (!open_root(path)) {
+        bundle_close(bundle);
+        free(path);
+        return false;
+    }
+    free(RootPath);
+    RootPath = path;
+    bundle_close(StaticBundle);
+    StaticBundle = bundle;
+
+    log("Reloaded configuration: RootPath = %s", RootPath);
+    return true;
+}
+
+/**
+ * Start a new server binary that takes over the listening socket.
+ *
+ * @param   sfd         Server socket file descriptor (-1 for workers, which
+ *                      rebind their SO_REUSEPORT listeners instead).
+ *
+ * The new binary is executed with the original command line and finds the
+ * inherited socket through the environment (see socket_inherit).  Once it is
+ * accepting it tells this process to drain (SIGQUIT), so there is no window
+ * in which connections are refused.  If the exec fails, this process simply
+ * keeps serving.
+ **/
+void server_upgrade(int sfd) {
+    char fd[16];
+    char pid[16];
+
+    snprintf(fd, sizeof(fd), "%d", sfd);
+    snprintf(pid, sizeof(pid), "%d", getpid());
+
+    /* The new binary is not our child: it outlives us, and forking_reap
+     * never mistakes its exit for a finished request */
+    int forked = fork_detached();
+    if (forked != 0) {
+        if (forked < 0) {
+            log("Unable to start upgraded server");
+        }
+        return;
+    }
+
+    event_loop_detach();
+
+    if (sfd >= 0) {
+        setenv(SOCKET_INHERIT_ENV, fd, 1);
+    }
+    if (TlsSocket >= 0) {
+        snprintf(fd, sizeof(fd), "%d", TlsSocket);
+        setenv(TLS_INHERIT_ENV, fd, 1);
+    }
+    if (UnixSocket >= 0) {
+        /* Made close-on-exec to keep it from CGI scripts, but not from us */
+        fcntl(UnixSocket, F_SETFD, 0);
+        snprintf(fd, sizeof(fd), "%d", UnixSocket);
+        setenv(UNIX_INHERIT_ENV, fd, 1);
+    }
+    setenv(PARENT_PID_ENV, pid, 1);
+    /* A worker master takes signals with them blocked: start clean */
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    execvp(ExecArguments[0], ExecArguments);
+    log("Unable to exec %s: %s", ExecArguments[0], strerror(errno));
+    _exit(EXIT_FAILURE);
+}
+
+/**
+ * Tell the server being upgraded that this one has taken over.
+ **/
+void upgrade_complete(void) {
+    char *value = getenv(PARENT_PID_ENV);
+    if (!value) {
+        return;
+    }
+    unsetenv(PARENT_PID_ENV);
+
+    pid_t parent = atoi(value);
+    if (parent > 1 && kill(parent, SIGQUIT) < 0) {
+        log("Unable to signal old server %d: %s", parent, strerror(errno));
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -5,11 +5,46 @@
 #include <errno.h>
 #include <string.h>
 
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 int parse_request_method(Request *r);
 int parse_request_headers(Request *r);
 
+/* Constants */
+
+#define PROXY_V1_MAX        107         /* Longest PROXY v1 line (CRLF included) */
+#define PROXY_V2_SIGNATURE  12          /* Length of the PROXY v2 signature */
+#define PROXY_HEADER_MAX    (16 + 512)  /* Largest PROXY v2 header accepted */
+
+#define REQUEST_BUFFER      BUFSIZ      /* Stream buffer of an active connection */
+#define REQUEST_BUFFERS     64          /* Released buffers kept for reuse */
+
+/* Internal State */
+
+typedef union buffer Buffer;
+union buffer {
+    Buffer *next;                       /*< Next free buffer */
+    char    data[REQUEST_BUFFER];
+};
+
+static __thread Buffer *FreeBuffers = NULL;
+static __thread size_t  FreeCount   = 0;
+
+/*
+ * A connection waiting in the event loop is only its Request: the client
+ * address is kept as a binary sockaddr (formatted on demand) and there is no
+ * stdio stream.  A stream is attached when the connection becomes active and
+ * detached again when it goes back to waiting, so an idle keep-alive
+ * connection costs a couple of hundred bytes instead of several kilobytes.
+ *
+ * Streams are opened with fopencookie on the Request, so closing one leaves
+ * the socket open, and read and write through a buffer borrowed from a small
+ * free list (one per thread) rather than one glibc allocates per stream.
+ */
+
 /**
  * Accept request from server socket.
  *
@@ -21,10 +56,10 @@ int parse_request_headers(Request *r);
  *  1. Allocates a request struct initialized to 0.
  *  2. Initializes the headers list in the request struct.
  *  3. Accepts a client connection from the server socket.
- *  4. Looks up the client information and stores it in the request struct.
- *  5. Opens the client socket stream for the request struct.
- *  6. Returns the request struct.
+ *  4. Stores the client address in the request struct.
+ *  5. Returns the request struct.
  *
+ * No stream is opened until the request is attached (see request_attach).
  * The returned request struct must be deallocated using free_request.
  **/
 Request * accept_request(int sfd) {
@@ -37,31 +72,14 @@ Request * accept_request(int sfd) {
         goto fail;
     }
     /* Accept a client */
-    struct sockaddr raddr;
-    socklen_t rlen = sizeof(struct sockaddr);
-    r->fd = accept(sfd, &raddr, &rlen);
+    socklen_t rlen = sizeof(r->addr);
+    r->fd = accept4(sfd, &r->addr.sa, &rlen, SOCK_CLOEXEC);
     if(r->fd < 0) {
         debug("Unable to accept: %s", strerror(errno));
         goto fail;
     }
 
-    /* Lookup client information */
-    // gives ip addr and port
-    int status = getnameinfo(&raddr, rlen, r->host, sizeof(r->host), r->port, sizeof(r->port), NI_NUMERICHOST | NI_NUMERICSERV);
-    if(status < 0)
-    {
-        debug("Unable to getnameinfo %s", gai_strerror(status));
-        goto fail;
-    }
-
-    /* Open socket stream */
-    r->stream = fdopen(r->fd, "w+");
-    if(!r->stream){
-        debug("Unable to fdopen: %s", strerror(errno));
-        goto fail;
-    }
-    
-    log("Accepted request from %s:%s", r->host, r->port);
+    log("Accepted request from %s:%s", request_host(r), request_port(r));
     return r;
 
 fail:
@@ -70,6 +88,267 @@ fail:
     return NULL;
 }
 
+/**
+ * Format the address of the client.
+ *
+ * @param   r           Request structure.
+ * @return  Numeric host (or "unix" for local sockets) in a per-thread buffer.
+ **/
+const char * request_host(const Request *r) {
+    static __thread char host[NI_MAXHOST];
+
+    if (r->addr.sa.sa_family != AF_INET && r->addr.sa.sa_family != AF_INET6) {
+        return "unix";
+    }
+    if (getnameinfo(&r->addr.sa, sizeof(r->addr), host, sizeof(host), NULL, 0, NI_NUMERICHOST) != 0) {
+        return "unknown";
+    }
+    return host;
+}
+
+/**
+ * Format the port of the client.
+ *
+ * @param   r           Request structure.
+ * @return  Numeric port in a per-thread buffer.
+ **/
+const char * request_port(const Request *r) {
+    static __thread char port[NI_MAXSERV];
+
+    if (r->addr.sa.sa_family != AF_INET && r->addr.sa.sa_family != AF_INET6) {
+        return "0";
+    }
+    /* sin_port and sin6_port are at the same offset */
+    snprintf(port, sizeof(port), "%u", ntohs(r->addr.in.sin_port));
+    return port;
+}
+
+/*
+ * A load balancer in front of the UNIX listener passes the real client
+ * address in a PROXY protocol header (v1 text or v2 binary) before the
+ * request: https://www.haproxy.org/download/2.8/doc/proxy-protocol.txt
+ * Neither can be mistaken for the start of an HTTP request, so the header is
+ * optional; only the UNIX listener honours it, since anyone able to connect
+ * there is already trusted by the socket's permissions.
+ */
+static const char ProxyV2Signature[PROXY_V2_SIGNATURE] = "\r\n\r\n\0\r\nQUIT\n";
+
+/**
+ * Parse the addresses of a PROXY v1 line ("PROXY TCP4 src dst sport dport").
+ **/
+static bool request_proxy_v1(Request *r, char *line) {
+    char *save;
+    char *family  = strtok_r(line + 6, " ", &save);
+    char *source  = strtok_r(NULL, " ", &save);
+    char *dest    = strtok_r(NULL, " ", &save);
+    char *port    = strtok_r(NULL, " ", &save);
+
+    if (!family) {
+        return false;
+    }
+    if (streq(family, "UNKNOWN")) {
+        return true;
+    }
+    if (!source || !dest || !port || !strtok_r(NULL, " ", &save)) {
+        return false;
+    }
+
+    char *end;
+    long  n = strtol(port, &end, 10);
+    if (*end || end == port || n < 0 || n > 65535) {
+        return false;
+    }
+    Address address = {{0}};
+    if (streq(family, "TCP4") && inet_pton(AF_INET, source, &address.in.sin_addr) == 1) {
+        address.in.sin_family = AF_INET;
+        address.in.sin_port   = htons(n);
+    } else if (streq(family, "TCP6") && inet_pton(AF_INET6, source, &address.in6.sin6_addr) == 1) {
+        address.in6.sin6_family = AF_INET6;
+        address.in6.sin6_port   = htons(n);
+    } else {
+        return false;
+    }
+    r->addr = address;
+    return true;
+}
+
+/**
+ * Take the addresses from a PROXY v2 header (16 bytes plus its payload).
+ **/
+static bool request_proxy_v2(Request *r, const uint8_t *header, size_t length) {
+    const uint8_t *payload = header + 16;
+    uint8_t        command = header[12] & 0x0F;
+
+    if ((header[12] & 0xF0) != 0x20 || command > 1) {
+        return false;
+    }
+    /* LOCAL (a health check from the balancer itself) keeps our address */
+    if (command == 0) {
+        return true;
+    }
+    switch (header[13]) {
+        case 0x11:      /* TCP over IPv4 */
+            if (length < 12) {
+                return false;
+            }
+            memset(&r->addr, 0, sizeof(r->addr));
+            r->addr.in.sin_family = AF_INET;
+            memcpy(&r->addr.in.sin_addr, payload, 4);
+            memcpy(&r->addr.in.sin_port, payload + 8, 2);
+            return true;
+        case 0x21:      /* TCP over IPv6 */
+            if (length < 36) {
+                return false;
+            }
+            memset(&r->addr, 0, sizeof(r->addr));
+            r->addr.in6.sin6_family = AF_INET6;
+            memcpy(&r->addr.in6.sin6_addr, payload, 16);
+            memcpy(&r->addr.in6.sin6_port, payload + 32, 2);
+            return true;
+        default:        /* UNSPEC, UDP or UNIX: nothing to report */
+            return true;
+    }
+}
+
+/**
+ * Consume a PROXY protocol header from a connection on the UNIX listener.
+ *
+ * @param   r           Request accepted on the UNIX listener.
+ * @return  1 once the header has been consumed (or is absent), 0 to keep
+ *          waiting for the rest of it, -1 to drop the connection.
+ *
+ * The socket is peeked at until the whole header has arrived, then exactly
+ * the header is read, leaving the request for the event loop to find.  The
+ * client address then replaces the local one.
+ **/
+int request_proxy(Request *r) {
+    uint8_t buffer[PROXY_HEADER_MAX + 1];
+    ssize_t n = recv(r->fd, buffer, PROXY_HEADER_MAX, MSG_PEEK | MSG_DONTWAIT);
+    if (n < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+    if (n == 0) {
+        return -1;
+    }
+
+    size_t length = 0;
+    bool   valid  = false;
+    if (memcmp(buffer, ProxyV2Signature, n < PROXY_V2_SIGNATURE ? n : PROXY_V2_SIGNATURE) == 0) {
+        if (n < 16) {
+            return 0;
+        }
+        length = 16 + (buffer[14] << 8 | buffer[15]);
+        if (length > PROXY_HEADER_MAX) {
+            return -1;
+        }
+        if ((size_t)n < length) {
+            return 0;
+        }
+        valid = request_proxy_v2(r, buffer, length - 16);
+    } else if (memcmp(buffer, "PROXY ", n < 6 ? n : 6) == 0) {
+        buffer[n] = '\0';
+        char *crlf = strstr((char *)buffer, "\r\n");
+        if (!crlf) {
+            return n < PROXY_V1_MAX ? 0 : -1;
+        }
+        *crlf  = '\0';
+        length = crlf + 2 - (char *)buffer;
+        valid  = length <= PROXY_V1_MAX && request_proxy_v1(r, (char *)buffer);
+    } else {
+        r->local = false;
+        return 1;
+    }
+
+    if (!valid) {
+        log("Invalid PROXY header on UNIX socket");
+        return -1;
+    }
+    if (recv(r->fd, buffer, length, MSG_DONTWAIT) != (ssize_t)length) {
+        return -1;
+    }
+    r->local = false;
+    debug("PROXY header: client is %s:%s", request_host(r), request_port(r));
+    return 1;
+}
+
+static ssize_t request_stream_read(void *cookie, char *buffer, size_t size) {
+    return coroutine_read(((Request *)cookie)->fd, buffer, size, BodyTimeout);
+}
+
+static ssize_t request_stream_write(void *cookie, const char *buffer, size_t size) {
+    return coroutine_write(((Request *)cookie)->fd, buffer, size, WriteTimeout);
+}
+
+static int request_stream_close(void *cookie) {
+    return 0;
+}
+
+/**
+ * Open a stream on the request socket for handling a request.
+ *
+ * @param   r           Request structure.
+ * @return  true if r->stream is open.
+ *
+ * The stream reads and writes r->fd through a pooled buffer; closing it (see
+ * request_detach) leaves r->fd open.
+ **/
+bool request_attach(Request *r) {
+    static const cookie_io_functions_t functions = {
+        .read  = request_stream_read,
+        .write = request_stream_write,
+        .close = request_stream_close,
+    };
+
+    if (r->stream) {
+        return true;
+    }
+
+    Buffer *b = FreeBuffers;
+    if (b) {
+        FreeBuffers = b->next;
+        FreeCount--;
+    } else if (!(b = malloc(sizeof(Buffer)))) {
+        debug("Unable to allocate stream buffer: %s", strerror(errno));
+        return false;
+    }
+
+    r->stream = fopencookie(r, "w+", functions);
+    if (!r->stream) {
+        debug("Unable to fopencookie: %s", strerror(errno));
+        r->buffer = b->data;
+        request_detach(r);
+        return false;
+    }
+    r->buffer = b->data;
+    setvbuf(r->stream, r->buffer, _IOFBF, REQUEST_BUFFER);
+    return true;
+}
+
+/**
+ * Close the stream of a request that is going idle, keeping its socket.
+ *
+ * @param   r           Request structure.
+ *
+ * Anything still buffered is flushed first; the buffer goes back to the pool.
+ **/
+void request_detach(Request *r) {
+    if (r->stream) {
+        fclose(r->stream);
+        r->stream = NULL;
+    }
+    if (r->buffer) {
+        Buffer *b = (Buffer *)r->buffer;
+        r->buffer = NULL;
+        if (FreeCount < REQUEST_BUFFERS) {
+            b->next     = FreeBuffers;
+            FreeBuffers = b;
+            FreeCount++;
+        } else {
+            free(b);
+        }
+    }
+}
+
 /**
  * Deallocate request struct.
  *
@@ -77,7 +356,7 @@ fail:
  *
  * This function does the following:
  *
- *  1. Closes the request socket stream or file descriptor.
+ *  1. Closes the request stream and socket.
  *  2. Frees all allocated strings in request struct.
  *  3. Frees all of the headers (including any allocated fields).
  *  4. Frees request struct.
@@ -112,9 +391,12 @@ void free_request(Request *r) {
         return;
     }
 
-    /* Close socket or fd */
-    if(r->stream)
-        fclose(r->stream);
+    /* Close stream and socket */
+    if(r->ssl)
+        tls_free(r);
+    request_detach(r);
+    if(r->fd >= 0)
+        close(r->fd);
     /* Free allocated strings */
     if(r->method)
         free(r->method);
@@ -122,6 +404,8 @@ void free_request(Request *r) {
         free(r->uri);
     if(r->query)
         free(r->query);
+    if(r->version)
+        free(r->version);
     if(r->path){
         free(r->path);
     }
@@ -135,6 +419,53 @@ void free_request(Request *r) {
         free(r);
 }
 
+/**
+ * Prepare request struct for the next request on a persistent connection.
+ *
+ * @param   r           Request structure.
+ *
+ * This flushes the response and frees everything parsed from the previous
+ * request, keeping the socket, stream and client information.
+ **/
+void request_reset(Request *r) {
+    fflush(r->stream);
+
+    free(r->method);
+    free(r->uri);
+    free(r->query);
+    free(r->version);
+    free(r->path);
+    free_headers(r->headers);
+
+    r->method  = r->uri = r->query = r->version = r->path = NULL;
+    r->headers = NULL;
+    r->persistent = false;
+}
+
+/**
+ * Wait for the next request on a persistent connection.
+ *
+ * @param   r           Request structure (already reset).
+ * @param   timeout     Milliseconds to wait (0 waits forever).
+ * @return  true if the client sent more data, false if it went idle or closed.
+ *
+ * Clients are expected to wait for each response before sending the next
+ * request: the stream shares one buffer for reading and writing, so bytes
+ * pipelined behind a request are dropped once the response is written.
+ **/
+bool request_await(Request *r, int timeout) {
+    struct pollfd pfd = {
+        .fd     = r->fd,
+        .events = POLLIN,
+    };
+    char c;
+
+    if (poll(&pfd, 1, timeout > 0 ? timeout : -1) <= 0) {
+        return false;
+    }
+    return recv(r->fd, &c, 1, MSG_PEEK) > 0;
+}
+
 /**
  * Parse HTTP Request.
  *
@@ -177,6 +508,7 @@ int parse_request_method(Request *r) {
     char *method;
     char *uri;
     char *query;
+    char *version;
 
     /* Read line from socket */
     if (!fgets(buffer, BUFSIZ, r->stream)) {
@@ -184,21 +516,23 @@ int parse_request_method(Request *r) {
         goto fail;
     }
 
-    /* Parse method and uri */
-    method = strtok(buffer, WHITESPACE);
+    /* Parse method and uri (strtok_r: hybrid servers parse on many threads) */
+    char *save;
+    method = strtok_r(buffer, WHITESPACE, &save);
     if(!method)
     {
         debug("bad method");
         goto fail;
     }
     method = skip_whitespace(method);
-    uri = strtok(NULL, WHITESPACE);
+    uri = strtok_r(NULL, WHITESPACE, &save);
     if(!uri)
     {
         debug("bad method");
         goto fail;
     }
     uri = skip_whitespace(uri);
+    version = strtok_r(NULL, WHITESPACE, &save);
 
 
     /* Parse query from uri */
@@ -231,6 +565,14 @@ int parse_request_method(Request *r) {
         }
     }
     
+    /* HTTP/0.9 style request lines have no version (and no headers) */
+    r->version  = strdup(version ? chomp(version) : "HTTP/0.9");
+    if(!r->version)
+    {
+        debug("get version failed");
+        goto fail;
+    }
+
     debug("HTTP METHOD: %s", r->method);
     debug("HTTP URI:    %s", r->uri);
     debug("HTTP QUERY:  %s", r->query);
@@ -242,6 +584,39 @@ fail:
     return -1;
 }
 
+/**
+ * Lookup request header.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   name        Header name (case-insensitive).
+ * @return  Header data (or NULL if the header was not sent).
+ **/
+const char * request_header(Request *r, const char *name) {
+    for (Header *h = r->headers; h; h = h->next) {
+        if (strcasecmp(h->name, name) == 0) {
+            return h->data;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Determine whether the client wants to keep the connection open.
+ *
+ * @param   r           Parsed request.
+ * @return  true for HTTP/1.1 unless it sent Connection: close.
+ *
+ * Only HTTP/1.1 is kept alive, since it is the only version a chunked
+ * response can be sent to.
+ **/
+bool request_keep_alive(Request *r) {
+    if (!r->version || !streq(r->version, "HTTP/1.1")) {
+        return false;
+    }
+    const char *connection = request_header(r, "Connection");
+    return !connection || strcasecmp(connection, "close") != 0;
+}
+
 /**
  * Parse HTTP Request Headers.
  *
@@ -265,7 +640,7 @@ fail:
  * pseudo-code:
  *
  *  while (buffer = read_from_socket() and buffer is not empty):
- *      name, data  = buffer.split(':')
+ *      name, data  = buffer.split(':', 1)
  *      header      = new Header(name, data)
  *      headers.append(header)
  **/
@@ -276,8 +651,12 @@ int parse_request_headers(Request *r) {
     char buffer[BUFSIZ];
     char *name;
     char *data;
+
+    /* An HTTP/0.9 request ends with its request line */
+    if (r->version && streq(r->version, "HTTP/0.9")) {
+        return 0;
+    }
     
-    int i = 1;
     /* Parse headers from socket */
     
     while (fgets(buffer, BUFSIZ, r->stream) && strlen(buffer) > 2)
@@ -288,22 +667,16 @@ int parse_request_headers(Request *r) {
             debug("could not calloc header");
             goto fail;
         }
-        name = strtok(buffer, ":");
-        if(!name)
+        /* Split at the first colon only: values (Host, Referer) may hold more */
+        data = strchr(buffer, ':');
+        if(!data)
         {
             debug("bad header");
-            free_headers(*cur);
             goto fail;
         }
-        name = chomp(name);
+        *data++ = '\0';
+        name = chomp(buffer);
         name = skip_whitespace(name);
-        data = strtok(NULL,   ":");
-        if(!data)
-        {
-            debug("bad header d");
-            free_headers(*cur);
-            goto fail;
-        }
         data = chomp(data);
         data = skip_whitespace(data);
         debug("Name: %s", name);
@@ -322,6 +695,9 @@ int parse_request_headers(Request *r) {
 
 fail:
     debug("failure");
+    /* Every node, the one being filled included, is linked from head */
+    free_headers(head);
+    r->headers = NULL;
     return -1;
 }
 
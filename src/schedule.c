@@ -0,0 +1,324 @@
+/* schedule.c: Request Class Scheduling */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+/* Constants */
+
+#define SCHEDULE_LINE_MAX   1024        /* Bytes of request line peeked at */
+#define SCHEDULE_STRIDE     (1 << 20)   /* Pass advanced per pick at weight 1 */
+#define SCHEDULE_WEIGHT_MAX 1000
+
+/* Internal State */
+
+typedef struct {
+    uint64_t    queued;                 /*< Requests waiting for a thread */
+    uint64_t    running;                /*< Requests on a thread */
+    uint64_t    dispatched;             /*< Requests handed to a thread */
+    uint64_t    wait_total;             /*< Milliseconds waited, summed */
+    uint64_t    wait_max;               /*< Longest wait in milliseconds */
+} ClassStats;
+
+typedef struct {
+    const char *name;
+    long        weight;                 /*< Share of picks while backlogged */
+    long        cap;                    /*< Threads of a pool it may hold (0 = all, -1 = default) */
+    Request    *head;                   /*< Requests waiting (FIFO) */
+    Request   **tail;
+    long        running;                /*< Threads of this pool it holds */
+    uint64_t    pass;                   /*< Virtual time of its next pick */
+} Class;
+
+static Class Classes[CLASS_COUNT] = {
+    [CLASS_STATIC] = {"static", 1, -1},
+    [CLASS_BROWSE] = {"browse", 1, -1},
+    [CLASS_CGI]    = {"cgi",    1, -1},
+    [CLASS_PROXY]  = {"proxy",  1, -1},
+    [CLASS_PLUGIN] = {"plugin", 1, -1},
+};
+
+static uint64_t    Virtual    = 0;      /* Pass of the last class picked */
+static ClassStats *Stats      = NULL;   /* Shared by every worker */
+static const char *StatusPath = NULL;   /* URI answered with the statistics */
+
+/*
+ * A hybrid server's task pool used to take requests first come, first
+ * served, so a burst of slow CGI requests occupied every thread and the
+ * static requests behind them waited for the scripts.  Requests are now
+ * sorted into classes (static, browse, cgi, proxy, plugin) as they are
+ * dispatched: the event loop peeks at the request line, checks the proxy
+ * and plugin prefixes and the bundle, and otherwise makes one fstatat
+ * beneath the root to tell directories and scripts from files.  HTTP/2
+ * connections count as static.
+ *
+ * Each class has its own queue.  An idle task thread takes the head of the
+ * class with the smallest pass among those with requests waiting and
+ * threads to spare under their cap, then advances its pass by
+ * SCHEDULE_STRIDE / weight (stride scheduling), so backlogged classes are
+ * served in proportion to their weights.  A class that was idle starts
+ * from the current virtual time instead of spending credit it saved up.
+ *
+ * Caps are per worker, in threads of its pool.  Unless told otherwise cgi
+ * may hold half of the pool, so static requests keep a thread whatever the
+ * scripts do.  Queue depth, threads in use and time spent waiting are
+ * counted per class in shared memory (summed over workers) and served as
+ * text at status=URI.
+ */
+
+/**
+ * Parse request class specification.
+ *
+ * @param   spec        Comma separated class=WEIGHT[:CAP] pairs, where
+ *                      class is static, browse, cgi, proxy or plugin, and
+ *                      status=URI (path answered with the statistics).
+ * @return  true if parsing was successful, false if there was an error.
+ **/
+bool parse_schedule(char *spec) {
+    for (char *pair = strtok(spec, ","); pair; pair = strtok(NULL, ",")) {
+        char *value = strchr(pair, '=');
+        char *end;
+        if (!value) {
+            return false;
+        }
+        *value++ = '\0';
+
+        if (streq(pair, "status")) {
+            if (*value != '/') {
+                return false;
+            }
+            StatusPath = value;
+            continue;
+        }
+
+        Class *c = NULL;
+        for (int i = 0; i < CLASS_COUNT; i++) {
+            if (streq(pair, Classes[i].name)) {
+                c = &Classes[i];
+            }
+        }
+        if (!c) {
+            return false;
+        }
+
+        c->weight = strtol(value, &end, 10);
+        if (end == value || c->weight < 1 || c->weight > SCHEDULE_WEIGHT_MAX) {
+            return false;
+        }
+        if (*end == ':') {
+            value   = end + 1;
+            c->cap  = strtol(value, &end, 10);
+            if (end == value || c->cap < 0) {
+                return false;
+            }
+        }
+        if (*end) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Map the class statistics before forking and settle default caps (no cap
+ * exceeds PoolThreads).
+ **/
+void schedule_init(void) {
+    for (int i = 0; i < CLASS_COUNT; i++) {
+        Class *c = &Classes[i];
+        if (c->cap < 0) {
+            c->cap = i == CLASS_CGI ? (PoolThreads > 1 ? PoolThreads / 2 : 1) : 0;
+        }
+        if (c->cap > PoolThreads) {
+            c->cap = PoolThreads;
+        }
+        c->tail = &c->head;
+    }
+
+    Stats = mmap(NULL, CLASS_COUNT * sizeof(ClassStats), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Stats == MAP_FAILED) {
+        fatal("Unable to mmap class statistics: %s", strerror(errno));
+    }
+}
+
+/**
+ * Determine the class of a request whose headers have arrived.
+ *
+ * @param   r           Request not yet parsed.
+ *
+ * The socket is only peeked at, so the request parser later reads the same
+ * bytes.  A request that cannot be classified counts as static.
+ **/
+void schedule_classify(Request *r) {
+    char buffer[SCHEDULE_LINE_MAX + 1];
+    char *save;
+
+    r->class = CLASS_STATIC;
+    ssize_t n = recv(r->fd, buffer, SCHEDULE_LINE_MAX, MSG_PEEK | MSG_DONTWAIT);
+    if (n <= 0) {
+        return;
+    }
+    buffer[n] = '\0';
+
+    char *method = strtok_r(buffer, WHITESPACE, &save);
+    char *uri    = method ? strtok_r(NULL, WHITESPACE, &save) : NULL;
+    if (!uri || *uri != '/') {
+        return;
+    }
+    *strchrnul(uri, '?') = '\0';
+
+    if (proxy_routed(uri)) {
+        r->class = CLASS_PROXY;
+        return;
+    }
+    if (plugin_routed(uri)) {
+        r->class = CLASS_PLUGIN;
+        return;
+    }
+    if (StaticBundle && bundle_lookup(StaticBundle, uri)) {
+        return;
+    }
+
+    /* Only a guess for scheduling: dispatch_request opens the path safely */
+    struct stat stats;
+    const char *relative = uri + strspn(uri, "/");
+    if (fstatat(RootFd, *relative ? relative : ".", &stats, 0) < 0) {
+        return;
+    }
+    if (S_ISDIR(stats.st_mode)) {
+        r->class = CLASS_BROWSE;
+    } else if (S_ISREG(stats.st_mode) && (stats.st_mode & S_IXOTH)) {
+        r->class = CLASS_CGI;
+    }
+}
+
+/**
+ * Queue a classified request (the caller serializes push, pop and done).
+ **/
+void schedule_push(Request *r) {
+    Class *c = &Classes[r->class];
+    if (!c->head && c->pass < Virtual) {
+        c->pass = Virtual;
+    }
+
+    r->next   = NULL;
+    r->queued = timer_now();
+    *c->tail  = r;
+    c->tail   = &r->next;
+    __atomic_add_fetch(&Stats[r->class].queued, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Take the next request to handle.
+ *
+ * @return  Head of the class with the smallest pass that is under its cap,
+ *          or NULL if no class may run a request now.
+ **/
+Request * schedule_pop(void) {
+    Class *best = NULL;
+    for (int i = 0; i < CLASS_COUNT; i++) {
+        Class *c = &Classes[i];
+        if (c->head && (!c->cap || c->running < c->cap) && (!best || c->pass < best->pass)) {
+            best = c;
+        }
+    }
+    if (!best) {
+        return NULL;
+    }
+
+    Request *r = best->head;
+    if (!(best->head = r->next)) {
+        best->tail = &best->head;
+    }
+    r->next = NULL;
+    Virtual = best->pass;
+    best->pass += SCHEDULE_STRIDE / best->weight;
+    best->running++;
+
+    ClassStats *s    = &Stats[r->class];
+    uint64_t    wait = timer_now() - r->queued;
+    uint64_t    max  = __atomic_load_n(&s->wait_max, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&s->queued, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->running, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->dispatched, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->wait_total, wait, __ATOMIC_RELAXED);
+    while (wait > max && !__atomic_compare_exchange_n(&s->wait_max, &max, wait, true,
+                                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return r;
+}
+
+/**
+ * Release the thread a popped request held.
+ **/
+void schedule_done(Request *r) {
+    Classes[r->class].running--;
+    __atomic_sub_fetch(&Stats[r->class].running, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Return whether a URI asks for the class statistics.
+ **/
+bool schedule_routed(const char *uri) {
+    if (!StatusPath) {
+        return false;
+    }
+    size_t length = strlen(StatusPath);
+    return strncmp(uri, StatusPath, length) == 0 && (!uri[length] || uri[length] == '?');
+}
+
+/**
+ * Send the class statistics as text, one class per line.
+ *
+ * @param   r           Request for StatusPath.
+ * @return  HTTP_STATUS_OK.
+ *
+ * Weights and caps are this worker's; the counters are summed over every
+ * worker.  wait_ms is the total time dispatched requests spent queued, so
+ * its rate over dispatched gives the mean wait.
+ **/
+Status schedule_status(Request *r) {
+    char   body[CLASS_COUNT * 256];        /* Widest line is about 220 bytes */
+    size_t length = 0;
+
+    for (int i = 0; i < CLASS_COUNT; i++) {
+        const ClassStats *s = &Stats[i];
+        length += snprintf(body + length, sizeof(body) - length,
+            "%s weight=%ld cap=%ld queued=%lu running=%lu dispatched=%lu wait_ms=%lu wait_max_ms=%lu\n",
+            Classes[i].name, Classes[i].weight, Classes[i].cap,
+            (unsigned long)__atomic_load_n(&s->queued, __ATOMIC_RELAXED),
+            (unsigned long)__atomic_load_n(&s->running, __ATOMIC_RELAXED),
+            (unsigned long)__atomic_load_n(&s->dispatched, __ATOMIC_RELAXED),
+            (unsigned long)__atomic_load_n(&s->wait_total, __ATOMIC_RELAXED),
+            (unsigned long)__atomic_load_n(&s->wait_max, __ATOMIC_RELAXED));
+        if (length >= sizeof(body)) {
+            length = sizeof(body) - 1;
+            break;
+        }
+    }
+
+    r->persistent = request_keep_alive(r);
+    fprintf(r->stream, "HTTP/1.0 200 OK\r\n");
+    fprintf(r->stream, "Content-Type: text/plain\r\n");
+    fprintf(r->stream, "Content-Length: %zu\r\n", length);
+    fprintf(r->stream, "Cache-Control: no-store\r\n");
+    if (r->persistent) {
+        fprintf(r->stream, "Connection: keep-alive\r\n");
+    }
+    fprintf(r->stream, "\r\n");
+    if (!streq(r->method, "HEAD")) {
+        fwrite(body, 1, length, r->stream);
+    }
+    if (fflush(r->stream) != 0) {
+        r->persistent = false;
+    }
+    return HTTP_STATUS_OK;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
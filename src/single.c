@@ -8,32 +8,36 @@
 #include <unistd.h>
 
 /**
- * Handle one HTTP request at a time.
+ * Handle request inline.
  *
- * @param   sfd         Server socket file descriptor.
- * @return  Exit status of server (EXIT_SUCCESS).
+ * @param   request     Request whose headers have arrived.
+ * @return  true if the connection is persistent and should wait for the
+ *          next request, false if it was closed.
  **/
-int single_server(int sfd) {
-    /* Accept and handle HTTP request */
-    while (true) {
-    	/* Accept request */
-        Request *request = accept_request(sfd);
-        if (!request) {
-            log("Unable to accept request: %s", strerror(errno));
-            continue;
-        }
-
-
-
-	/* Handle request */
+static bool single_dispatch(Request *request) {
+    /* Handle request */
     handle_request(request);
     debug("****************HANDLED REQUEST******************");
-	/* Free request */
-    free_request(request);
+    if (request->persistent) {
+        request_reset(request);
+        return true;
     }
+    /* Free request */
+    free_request(request);
+    return false;
+}
 
-    /* Close server socket */
-    return EXIT_SUCCESS;
+/**
+ * Handle one HTTP request at a time.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * Connections only reach the handler once their headers have arrived, so a
+ * client that never sends a request cannot stall everyone else.
+ **/
+int single_server(int sfd) {
+    return event_loop(sfd, single_dispatch);
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
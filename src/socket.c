@@ -10,15 +10,27 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+/* Global Variables */
+char *UnixPath   = NULL;
+int   UnixSocket = -1;
+
 /**
  * Allocate socket, bind it, and listen to specified port.
  *
  * @param   port        Port number to bind to and listen on.
+ * @param   cpu         CPU whose connections this listener should get (-1 for
+ *                      any).
  * @return  Allocated server socket file descriptor.
+ *
+ * With workers every listener joins an SO_REUSEPORT group on the port, and a
+ * listener for a CPU is marked with SO_INCOMING_CPU so connections arriving
+ * on that CPU are steered to it.
  **/
-int socket_listen(const char *port) {
+int socket_listen(const char *port, int cpu) {
     /* Lookup server address information */
     struct addrinfo  hints = {
         .ai_family   = AF_UNSPEC,   /* Return IPv4 and IPv6 choices */
@@ -43,6 +55,17 @@ int socket_listen(const char *port) {
             fprintf(stderr, "Unable to make socket: %s\n", strerror(errno));
             continue;
         }
+        /* Allow quick restarts while old connections sit in TIME_WAIT */
+        int on = 1;
+        if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+            fprintf(stderr, "Unable to set SO_REUSEADDR: %s\n", strerror(errno));
+        }
+        if (Workers > 0 && setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+            fprintf(stderr, "Unable to set SO_REUSEPORT: %s\n", strerror(errno));
+        }
+        if (cpu >= 0 && setsockopt(socket_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) {
+            fprintf(stderr, "Unable to set SO_INCOMING_CPU: %s\n", strerror(errno));
+        }
         /* Bind socket */
         if (bind(socket_fd, p->ai_addr, p->ai_addrlen) < 0) {
             fprintf(stderr, "Unable to bind: %s\n", strerror(errno));
@@ -63,4 +86,71 @@ int socket_listen(const char *port) {
     return socket_fd;
 }
 
+/**
+ * Allocate UNIX domain socket, bind it to path, and listen on it.
+ *
+ * @param   path        Filesystem path of the socket.
+ * @return  Allocated server socket file descriptor (or -1 on error).
+ *
+ * A socket left behind by an earlier server is removed first; anything else
+ * at path is left alone and the bind fails.  Workers share the one listener
+ * opened before they are forked.
+ **/
+int socket_listen_unix(const char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    struct stat        st;
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "UNIX socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    int socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket_fd < 0) {
+        fprintf(stderr, "Unable to make socket: %s\n", strerror(errno));
+        return -1;
+    }
+    if (bind(socket_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        fprintf(stderr, "Unable to bind %s: %s\n", path, strerror(errno));
+        close(socket_fd);
+        return -1;
+    }
+    if (listen(socket_fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "Unable to listen: %s\n", strerror(errno));
+        close(socket_fd);
+        return -1;
+    }
+    return socket_fd;
+}
+
+/**
+ * Return listening socket inherited from a server being upgraded.
+ *
+ * @param   name        Environment variable holding the descriptor
+ *                      (SOCKET_INHERIT_ENV, TLS_INHERIT_ENV or
+ *                      UNIX_INHERIT_ENV).
+ * @return  Server socket file descriptor (or -1 if nothing was inherited).
+ **/
+int socket_inherit(const char *name) {
+    char *value = getenv(name);
+    if (!value) {
+        return -1;
+    }
+    unsetenv(name);
+
+    int fd = atoi(value);
+    int type;
+    socklen_t length = sizeof(type);
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &length) < 0 || type != SOCK_STREAM) {
+        log("Ignoring invalid inherited socket %s", value);
+        return -1;
+    }
+    return fd;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -6,6 +6,8 @@
 #include <stdbool.h>
 #include <string.h>
 #include <limits.h>
+#include <signal.h>
+#include <sys/resource.h>
 #include <unistd.h>
 
 /* Global Variables */
@@ -16,6 +18,7 @@ char *MimeTypesPath   = "/etc/mime.types";
 char *DefaultMimeType = "text/plain";
 char *RootPath;
 char *root = "www";
+char *BundlePath      = NULL;
 
 /**
  * Display usage message and exit with specified status code.
@@ -24,14 +27,29 @@ char *root = "www";
  * @param   status      Exit status.
  */
 void usage(const char *progname, int status) {
-    fprintf(stderr, "Usage: %s [hcmMpr]\n", progname);
+    fprintf(stderr, "Usage: %s [habcCflLmMpPRrsStTuwx]\n", progname);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -h            Display help message\n");
-    fprintf(stderr, "    -c mode       Single or Forking mode\n");
+    fprintf(stderr, "    -a            Pin workers to CPUs and their NUMA nodes\n");
+    fprintf(stderr, "    -b bundle     Serve static files from bundle\n");
+    fprintf(stderr, "    -c mode       Single, Forking, Hybrid or Coroutine mode\n");
+    fprintf(stderr, "    -C cache      CGI microcache (size=MB,entry=KB,vary=HEADER+HEADER,lock=S)\n");
+    fprintf(stderr, "    -f files      Shared file metadata cache (entries=N)\n");
+    fprintf(stderr, "    -l limits     Admission limits (conns=N,queue=N,cgi=N,adaptive=MS,retry=S,body=BYTES,threads=N,stack=KB)\n");
+    fprintf(stderr, "    -L large      Stream large files around the page cache (size=MB,window=KB,direct=0|1)\n");
     fprintf(stderr, "    -m path       Path to mimetypes file\n");
     fprintf(stderr, "    -M mimetype   Default mimetype\n");
     fprintf(stderr, "    -p port       Port to listen on\n");
+    fprintf(stderr, "    -P proxy      Reverse proxy by URI prefix (/api/=HOST:PORT+unix:PATH,...)\n");
+    fprintf(stderr, "    -R rates      Per-client rate limits by URI prefix (/scripts/=RATE:BURST,...)\n");
     fprintf(stderr, "    -r path       Root directory\n");
+    fprintf(stderr, "    -s tls        TLS listener (port=N,cert=PATH,key=PATH,version=1.2|1.3)\n");
+    fprintf(stderr, "    -S classes    Hybrid request classes (cgi=WEIGHT:CAP,static=...,status=/URI)\n");
+    fprintf(stderr, "    -t timeouts   Timeouts in seconds (header=10,body=30,idle=15,write=30,drain=30,upstream=30,cgi=30)\n");
+    fprintf(stderr, "    -T trace      Sampled request tracing (file=PATH,sample=N)\n");
+    fprintf(stderr, "    -u path       UNIX socket to listen on, with PROXY headers (alone unless -p is given)\n");
+    fprintf(stderr, "    -w workers    Number of worker processes, each with its own listener\n");
+    fprintf(stderr, "    -x plugins    Native handler plugins by URI prefix (/hello=lib/hello.so,...)\n");
     exit(status);
 }
 
@@ -47,23 +65,54 @@ void usage(const char *progname, int status) {
  * if specified.
  */
 bool parse_options(int argc, char *argv[], ServerMode *mode) {
-    int argind = 1;
+    bool port   = false;
+    int  argind = 1;
     while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
         char *arg = argv[argind++];
     	switch (arg[1]) {
+	    case 'a':
+	    	PinWorkers = true;
+	    	break;
+	    case 'b':
+	    	BundlePath = argv[argind++];
+	    	break;
 	    case 'c':
 	    	if (streq(argv[argind], "single")) {
 	    	    *mode = SINGLE;
                 } else if (streq(argv[argind], "forking")) {
 	    	    *mode = FORKING;
+	    	} else if (streq(argv[argind], "hybrid")) {
+	    	    *mode = HYBRID;
+	    	} else if (streq(argv[argind], "coroutine")) {
+	    	    *mode = COROUTINE;
 	    	} else {
 	    	    return false;
 	    	}
 	    	argind++;
 	    	break;
+	    case 'C':
+	    	if (!parse_microcache(argv[argind++])) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 'f':
+	    	if (!parse_metadata(argv[argind++])) {
+	    	    return false;
+	    	}
+	    	break;
 	    case 'h':
 	    	usage(argv[0], EXIT_SUCCESS);
 	    	break;
+	    case 'l':
+	    	if (!parse_limits(argv[argind++])) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 'L':
+	    	if (!parse_large(argv[argind++])) {
+	    	    return false;
+	    	}
+	    	break;
 	    case 'm':
 	    	MimeTypesPath = argv[argind++];
 	    	break;
@@ -72,16 +121,65 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
 	    	break;
 	    case 'p':
 	    	Port = argv[argind++];
+	    	port = true;
+	    	break;
+	    case 'P':
+	    	if (!parse_proxy(argv[argind++])) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 'R':
+	    	if (!parse_rates(argv[argind++])) {
+	    	    return false;
+	    	}
 	    	break;
 	    case 'r':
 	    	root = argv[argind++];
 	    	break;
+	    case 's':
+	    	if (!parse_tls(argv[argind++])) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 'S':
+	    	if (!parse_schedule(argv[argind++])) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 't':
+	    	if (!parse_timeouts(argv[argind++])) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 'T':
+	    	if (!parse_trace(argv[argind++])) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 'u':
+	    	UnixPath = argv[argind++];
+	    	break;
+	    case 'w':
+	    	Workers = atoi(argv[argind++]);
+	    	if (Workers < 1) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 'x':
+	    	if (!parse_plugins(argv[argind++])) {
+	    	    return false;
+	    	}
+	    	break;
 	    default:
 	        return false;
 	    	break;
 	}
     }
 
+    /* A UNIX listener replaces the TCP one unless a port was asked for */
+    if (UnixPath && !port) {
+        Port = NULL;
+    }
     return true;
 }
 
@@ -90,33 +188,114 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
  **/
 int main(int argc, char *argv[]) {
     ServerMode mode = SINGLE; // default for valgrind sake
-    char buffer[PATH_MAX];
-    
+
+    /* Keep the original command line for SIGUSR2 upgrades */
+    save_arguments(argc, argv);
 
     /* Parse command line options */
     if(!parse_options(argc, argv, &mode))
         usage(argv[0], 1);
 
-    RootPath = realpath(root, buffer);
-    /* Listen to server socket */
-    int server_fd = socket_listen(Port);
-    if (server_fd < 0) {
-        return EXIT_FAILURE;
+    /* Allocated so SIGHUP can replace it */
+    RootPath = realpath(root, NULL);
+    if (!RootPath || !open_root(RootPath)) {
+        fatal("Unable to resolve root %s", root);
+    }
+
+    /* Map static bundle before forking so every child shares it */
+    if (BundlePath) {
+        StaticBundle = bundle_open(BundlePath);
+        if (!StaticBundle) {
+            fatal("Unable to open bundle %s", BundlePath);
+        }
+        log("Serving %lu bundled entries from %s", (unsigned long)StaticBundle->header->entries, BundlePath);
+    }
+
+    /* Idle connections are cheap: allow as many as the hard limit permits */
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
     }
+
+    /* Writes to disconnected clients should fail, not kill the server */
+    signal(SIGPIPE, SIG_IGN);
+    admission_init();
+    rate_init();
+    proxy_init();
+    plugin_init();
+    microcache_init();
+    metadata_init();
+    schedule_init();
+
+    /* Load TLS certificate before any worker is forked */
+    if (TlsPort && !tls_init()) {
+        fatal("Unable to load TLS certificate %s", TlsCertificate);
+    }
+
+    /* Every worker appends to the same trace file */
+    trace_init();
+
     /* Determine real RootPath */
-    log("Listening on port %s", Port);
     debug("RootPath        = %s", RootPath);
     debug("MimeTypesPath   = %s", MimeTypesPath);
     debug("DefaultMimeType = %s", DefaultMimeType);
-    debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : "Forking");
+    debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : mode == HYBRID ? "Hybrid" :
+                                  mode == COROUTINE ? "Coroutine" : "Forking");
+    debug("Timeouts        = header %dms, body %dms, idle %dms, write %dms, drain %dms",
+          HeaderTimeout, BodyTimeout, IdleTimeout, WriteTimeout, DrainTimeout);
+
+    /* Listen on the UNIX socket (shared by every worker) */
+    if (UnixPath) {
+        UnixSocket = socket_inherit(UNIX_INHERIT_ENV);
+        if (UnixSocket < 0) {
+            UnixSocket = socket_listen_unix(UnixPath);
+        }
+        if (UnixSocket < 0) {
+            return EXIT_FAILURE;
+        }
+        log("Listening on UNIX socket %s", UnixPath);
+    }
+
+    /* Workers open their own listeners */
+    if (Workers > 0) {
+        return workers_server(mode);
+    }
+
+    /* Listen to server socket (or take over the one being upgraded) */
+    int server_fd = socket_inherit(SOCKET_INHERIT_ENV);
+    if (server_fd < 0 && Port) {
+        server_fd = socket_listen(Port, -1);
+    }
+    if (server_fd < 0 && Port) {
+        return EXIT_FAILURE;
+    }
+    if (Port) {
+        log("Listening on port %s", Port);
+    }
+
+    /* Listen for TLS connections on a second socket */
+    if (TlsPort) {
+        TlsSocket = socket_inherit(TLS_INHERIT_ENV);
+        if (TlsSocket < 0) {
+            TlsSocket = socket_listen(TlsPort, -1);
+        }
+        if (TlsSocket < 0) {
+            return EXIT_FAILURE;
+        }
+        log("Listening for TLS on port %s", TlsPort);
+    }
 
-    /* Start either forking or single HTTP server */
+    /* Start either forking, hybrid, coroutine or single HTTP server */
     debug("Root path: %s", RootPath);
     if(mode == SINGLE)
-        single_server(server_fd);
+        return single_server(server_fd);
+    else if(mode == HYBRID)
+        return hybrid_server(server_fd);
+    else if(mode == COROUTINE)
+        return coroutine_server(server_fd);
     else
-        forking_server(server_fd);
-    return 0;
+        return forking_server(server_fd);
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
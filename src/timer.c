@@ -0,0 +1,180 @@
+/* timer.c: Hierarchical Timer Wheel */
+
+#include "spidey.h"
+
+#include <time.h>
+
+/*
+ * Timers live in TIMER_LEVELS wheels of TIMER_SLOTS slots.  Level 0 slots are
+ * one tick wide, level 1 slots TIMER_SLOTS ticks wide, and so on.  A timer is
+ * hashed into the lowest level whose span covers its remaining delay; when
+ * level 0 wraps around, the next slot of the level above is cascaded down.
+ * Adding and cancelling are O(1) list operations.
+ */
+
+#define TIMER_BITS      6
+#define TIMER_MASK      (TIMER_SLOTS - 1)
+
+/**
+ * Return monotonic clock in milliseconds.
+ **/
+uint64_t timer_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Initialize timer wheel.
+ *
+ * @param   w           Timer wheel.
+ * @param   now         Current time (timer_now).
+ **/
+void timer_wheel_init(TimerWheel *w, uint64_t now) {
+    w->tick  = now / TIMER_TICK_MS;
+    w->count = 0;
+    for (int l = 0; l < TIMER_LEVELS; l++) {
+        for (int s = 0; s < TIMER_SLOTS; s++) {
+            w->slots[l][s].next = w->slots[l][s].prev = &w->slots[l][s];
+        }
+    }
+}
+
+/**
+ * Hash timer into the slot covering its expiration tick.
+ **/
+static void timer_link(TimerWheel *w, Timer *t) {
+    if (t->expires < w->tick) {
+        t->expires = w->tick;
+    }
+    uint64_t delta = t->expires > w->tick ? t->expires - w->tick : 0;
+    int      level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >= (1ULL << (TIMER_BITS * (level + 1)))) {
+        level++;
+    }
+    if (delta >= (1ULL << (TIMER_BITS * TIMER_LEVELS))) {
+        /* Clamp to the furthest slot; it is re-hashed when cascaded */
+        t->expires = w->tick + (1ULL << (TIMER_BITS * TIMER_LEVELS)) - 1;
+    }
+
+    Timer *head = &w->slots[level][(t->expires >> (TIMER_BITS * level)) & TIMER_MASK];
+    t->prev          = head->prev;
+    t->next          = head;
+    head->prev->next = t;
+    head->prev       = t;
+}
+
+static void timer_unlink(Timer *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+/**
+ * Arm timer to fire after the specified delay.
+ *
+ * @param   w           Timer wheel.
+ * @param   t           Timer with callback set.
+ * @param   delay       Delay in milliseconds.
+ *
+ * A timer that is already armed is re-armed.
+ **/
+void timer_add(TimerWheel *w, Timer *t, uint64_t delay) {
+    if (timer_pending(t)) {
+        timer_cancel(w, t);
+    }
+    /* The wheel only catches up with the clock after events are handled, so
+     * count from the current time; the current tick's slot has already fired,
+     * so round up to the next one */
+    t->expires = timer_now() / TIMER_TICK_MS + (delay + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (t->expires <= w->tick) {
+        t->expires = w->tick + 1;
+    }
+    timer_link(w, t);
+    w->count++;
+}
+
+/**
+ * Disarm timer (no-op if it is not armed).
+ **/
+void timer_cancel(TimerWheel *w, Timer *t) {
+    if (timer_pending(t)) {
+        timer_unlink(t);
+        w->count--;
+    }
+}
+
+/**
+ * Move every timer in a higher level slot down to where it now belongs.
+ **/
+static void timer_cascade(TimerWheel *w, int level) {
+    Timer *head = &w->slots[level][(w->tick >> (TIMER_BITS * level)) & TIMER_MASK];
+    while (head->next != head) {
+        Timer *t = head->next;
+        timer_unlink(t);
+        timer_link(w, t);
+    }
+}
+
+/**
+ * Advance wheel to the current time, firing expired timers.
+ *
+ * @param   w           Timer wheel.
+ * @param   now         Current time (timer_now).
+ **/
+void timer_advance(TimerWheel *w, uint64_t now) {
+    uint64_t target = now / TIMER_TICK_MS;
+
+    while (w->tick < target) {
+        if (w->count == 0) {
+            w->tick = target;
+            break;
+        }
+
+        /* Cascade from the highest level that wrapped down, so timers
+         * landing in a lower level's current slot are cascaded again */
+        w->tick++;
+        int top = 0;
+        while (top + 1 < TIMER_LEVELS && (w->tick & ((1ULL << (TIMER_BITS * (top + 1))) - 1)) == 0) {
+            top++;
+        }
+        for (int l = top; l > 0; l--) {
+            timer_cascade(w, l);
+        }
+
+        Timer *head = &w->slots[0][w->tick & TIMER_MASK];
+        while (head->next != head) {
+            Timer *t = head->next;
+            timer_unlink(t);
+            w->count--;
+            t->callback(t);
+        }
+    }
+}
+
+/**
+ * Return milliseconds until the wheel next needs advancing.
+ *
+ * @param   w           Timer wheel.
+ * @return  Timeout suitable for epoll_wait (-1 if no timers are armed).
+ *
+ * Only level 0 is scanned; if it is empty the wheel wakes up at the next
+ * cascade boundary instead.
+ **/
+int timer_wheel_timeout(TimerWheel *w) {
+    if (w->count == 0) {
+        return -1;
+    }
+    for (uint64_t d = 1; d <= TIMER_SLOTS; d++) {
+        Timer *head = &w->slots[0][(w->tick + d) & TIMER_MASK];
+        if (head->next != head) {
+            return d * TIMER_TICK_MS;
+        }
+        if (((w->tick + d) & TIMER_MASK) == 0) {
+            return d * TIMER_TICK_MS;
+        }
+    }
+    return TIMER_SLOTS * TIMER_TICK_MS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,350 @@
+/* tls.c: TLS Termination */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+/* Global Variables */
+char *TlsPort        = NULL;
+char *TlsCertificate = NULL;
+char *TlsKey         = NULL;
+int   TlsSocket      = -1;
+
+/* Constants */
+
+#define TLS_SESSION_CONTEXT "spidey"    /* Sessions are only resumed by us */
+#define TLS_RELAY_BUFFER    (1 << 14)   /* One full TLS record of plaintext */
+
+/* Internal State */
+
+static int      TlsVersion = 0;         /* Highest protocol version (0 = any) */
+static SSL_CTX *Context    = NULL;
+
+/*
+ * The handshake runs in the event loop on a non-blocking socket, so a slow
+ * TLS client costs no more than a slow plaintext one.  Once it completes the
+ * connection is handed to the rest of the server as a plain socket:
+ *
+ *  - With kernel TLS in both directions, the socket itself is that plain
+ *    socket: reads are decrypted and writes (sendfile included) encrypted by
+ *    the kernel, so handlers need no changes at all.
+ *
+ *  - Otherwise a relay process holds the SSL session and pumps plaintext
+ *    through a socketpair whose other end replaces the request socket.
+ */
+
+/**
+ * Parse TLS listener specification.
+ *
+ * @param   spec        Comma separated name=value pairs, where name is one of
+ *                      port, cert (PEM certificate chain), key (PEM private
+ *                      key, defaults to cert), or version (highest protocol
+ *                      version: 1.2 or 1.3).
+ * @return  true if parsing was successful, false if there was an error.
+ **/
+bool parse_tls(char *spec) {
+    for (char *pair = strtok(spec, ","); pair; pair = strtok(NULL, ",")) {
+        char *value = strchr(pair, '=');
+        if (!value) {
+            return false;
+        }
+        *value++ = '\0';
+
+        if (streq(pair, "port")) {
+            TlsPort = value;
+        } else if (streq(pair, "cert")) {
+            TlsCertificate = value;
+        } else if (streq(pair, "key")) {
+            TlsKey = value;
+        } else if (streq(pair, "version")) {
+            if (streq(value, "1.2")) {
+                TlsVersion = TLS1_2_VERSION;
+            } else if (streq(value, "1.3")) {
+                TlsVersion = TLS1_3_VERSION;
+            } else {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    return TlsPort && TlsCertificate;
+}
+
+/**
+ * Log and clear the OpenSSL error queue.
+ **/
+static void tls_errors(const char *message) {
+    unsigned long error;
+    char          buffer[256];
+
+    while ((error = ERR_get_error())) {
+        ERR_error_string_n(error, buffer, sizeof(buffer));
+        log("%s: %s", message, buffer);
+    }
+}
+
+/**
+ * Choose h2 when the client offers it, so HTTP/2 works over TLS too.
+ **/
+static int tls_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                    const unsigned char *in, unsigned int inlen, void *arg) {
+    static const unsigned char Protocols[] = "\x02h2\x08http/1.1";
+    if (SSL_select_next_proto((unsigned char **)out, outlen, Protocols, sizeof(Protocols) - 1,
+                              in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/**
+ * Load the certificate and key into a new TLS context.
+ *
+ * @return  true if the context is ready.
+ *
+ * Called at startup and again on SIGHUP to pick up a renewed certificate;
+ * on failure the previous context stays in use.  Sessions are resumed either
+ * from the server-side cache or from session tickets.  Both live in the
+ * process doing the handshakes (the event loop), so every worker benefits.
+ * Reloading starts a new ticket key, so clients do one full handshake again.
+ **/
+bool tls_init(void) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        tls_errors("Unable to create TLS context");
+        return false;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    if (TlsVersion) {
+        SSL_CTX_set_max_proto_version(ctx, TlsVersion);
+    }
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *)TLS_SESSION_CONTEXT,
+                                   sizeof(TLS_SESSION_CONTEXT) - 1);
+    SSL_CTX_set_alpn_select_cb(ctx, tls_alpn, NULL);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, TlsCertificate) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, TlsKey ? TlsKey : TlsCertificate, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        tls_errors("Unable to load certificate");
+        SSL_CTX_free(ctx);
+        return false;
+    }
+
+    SSL_CTX_free(Context);
+    Context = ctx;
+    return true;
+}
+
+/**
+ * Start a TLS handshake on a newly accepted connection.
+ *
+ * @param   r           Request accepted from TlsSocket.
+ * @return  true if the handshake can proceed.
+ **/
+bool tls_accept(Request *r) {
+    r->ssl = SSL_new(Context);
+    if (!r->ssl || SSL_set_fd(r->ssl, r->fd) != 1) {
+        tls_errors("Unable to start TLS session");
+        return false;
+    }
+    SSL_set_accept_state(r->ssl);
+    r->secure = true;
+    return fcntl(r->fd, F_SETFL, fcntl(r->fd, F_GETFL) | O_NONBLOCK) == 0;
+}
+
+/**
+ * Advance the handshake with whatever the client has sent.
+ *
+ * @param   r           Request with a handshake in progress.
+ * @return  1 when complete, 0 to keep waiting, -1 to drop the connection.
+ *
+ * Handshake messages are small enough to fit the socket buffer, so only
+ * readability is waited for.
+ **/
+int tls_handshake(Request *r) {
+    int status = SSL_do_handshake(r->ssl);
+    if (status == 1) {
+        return 1;
+    }
+    switch (SSL_get_error(r->ssl, status)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            return 0;
+        default:
+            debug("TLS handshake with %s:%s failed", request_host(r), request_port(r));
+            ERR_clear_error();
+            return -1;
+    }
+}
+
+/**
+ * Pump plaintext between the TLS session and the local socket.
+ *
+ * @param   ssl         Established TLS session (non-blocking socket).
+ * @param   local       Relay end of the socketpair (non-blocking).
+ *
+ * Runs until the server side closes the connection or either side fails.
+ * A client close_notify is passed on as a half close.
+ **/
+static void tls_relay(SSL *ssl, int local) {
+    char   in[TLS_RELAY_BUFFER];        /* Client to server plaintext */
+    char   out[TLS_RELAY_BUFFER];       /* Server to client plaintext */
+    size_t in_length  = 0, in_offset  = 0;
+    size_t out_length = 0, out_offset = 0;
+    bool   client_open = true;
+    bool   local_open  = true;
+    int    remote = SSL_get_fd(ssl);
+
+    for (;;) {
+        bool progress = false;
+
+        if (client_open && in_length == 0) {
+            int n = SSL_read(ssl, in, sizeof(in));
+            if (n > 0) {
+                in_length = n;
+                in_offset = 0;
+                progress  = true;
+            } else {
+                int error = SSL_get_error(ssl, n);
+                if (error == SSL_ERROR_ZERO_RETURN) {
+                    client_open = false;
+                    shutdown(local, SHUT_WR);
+                } else if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+                    return;
+                }
+            }
+        }
+        if (in_length) {
+            ssize_t n = write(local, in + in_offset, in_length - in_offset);
+            if (n > 0) {
+                in_offset += n;
+                progress   = true;
+                if (in_offset == in_length) {
+                    in_length = 0;
+                }
+            } else if (errno != EAGAIN && errno != EINTR) {
+                return;
+            }
+        }
+
+        if (local_open && out_length == 0) {
+            ssize_t n = read(local, out, sizeof(out));
+            if (n > 0) {
+                out_length = n;
+                out_offset = 0;
+                progress   = true;
+            } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+                local_open = false;
+            }
+        }
+        if (out_length) {
+            int n = SSL_write(ssl, out + out_offset, out_length - out_offset);
+            if (n > 0) {
+                out_offset += n;
+                progress    = true;
+                if (out_offset == out_length) {
+                    out_length = 0;
+                }
+            } else {
+                int error = SSL_get_error(ssl, n);
+                if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+                    return;
+                }
+            }
+        }
+
+        if (!local_open && out_length == 0) {
+            SSL_shutdown(ssl);
+            return;
+        }
+        if (progress) {
+            continue;
+        }
+
+        struct pollfd fds[2] = {
+            {.fd = remote, .events = (client_open && in_length == 0 ? POLLIN : 0) | (out_length ? POLLOUT : 0)},
+            {.fd = local,  .events = (local_open && out_length == 0 ? POLLIN : 0) | (in_length ? POLLOUT : 0)},
+        };
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+            return;
+        }
+        if ((fds[0].revents | fds[1].revents) & POLLNVAL) {
+            return;
+        }
+    }
+}
+
+/**
+ * Hand an established TLS connection to the rest of the server.
+ *
+ * @param   r           Request whose handshake just completed.
+ * @return  true if r->fd now carries plaintext.
+ *
+ * If OpenSSL moved both directions of the session into the kernel (and has
+ * nothing buffered), the socket is used as is.  Otherwise a relay process is
+ * started with fork_detached, like server_upgrade, so it is never mistaken
+ * for a request by forking_reap.
+ **/
+bool tls_offload(Request *r) {
+    SSL *ssl = r->ssl;
+
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl)) &&
+        !SSL_has_pending(ssl)) {
+        debug("Kernel TLS enabled for %s:%s", request_host(r), request_port(r));
+        r->ssl = NULL;
+        SSL_free(ssl);
+        return fcntl(r->fd, F_SETFL, fcntl(r->fd, F_GETFL) & ~O_NONBLOCK) == 0;
+    }
+
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+        log("Unable to create TLS relay socket: %s", strerror(errno));
+        return false;
+    }
+
+    int forked = fork_detached();
+    if (forked < 0) {
+        log("Unable to start TLS relay");
+        close(pair[0]);
+        close(pair[1]);
+        return false;
+    }
+    if (forked == 0) {
+        event_loop_detach();
+        close(pair[0]);
+        fcntl(pair[1], F_SETFL, O_NONBLOCK);
+        tls_relay(ssl, pair[1]);
+        _exit(EXIT_SUCCESS);
+    }
+
+    /* The relay owns the session now: drop our copy without a close_notify */
+    close(pair[1]);
+    r->ssl = NULL;
+    SSL_free(ssl);
+    close(r->fd);
+    r->fd = pair[0];
+    return true;
+}
+
+/**
+ * Release the TLS session of a connection dropped during its handshake.
+ **/
+void tls_free(Request *r) {
+    SSL_free(r->ssl);
+    r->ssl = NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
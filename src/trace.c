@@ -0,0 +1,232 @@
+/* trace.c: Sampled Request Tracing */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Global Variables */
+__thread bool Tracing = false;
+
+/* Constants */
+
+#define TRACE_EVENTS    64              /* Events recorded per request */
+#define TRACE_RECORD    160             /* Longest JSON record (without arguments) */
+#define TRACE_FIELD     128             /* Longest method or client recorded */
+
+/* Internal State */
+
+typedef struct {
+    const char *name;                   /*< Phase name (string literal) */
+    char        phase;                  /*< 'B'egin or 'E'nd */
+    uint64_t    ts;                     /*< Microseconds (CLOCK_MONOTONIC) */
+} TraceEvent;
+
+static char          *TracePath   = NULL;
+static int            TraceSample = 100;
+static int            TraceFd     = -1;
+static unsigned long *Sequence    = NULL; /* Requests seen across all processes */
+
+static __thread TraceEvent Events[TRACE_EVENTS];   /* Phases of this thread's request */
+static __thread size_t     EventCount = 0;
+
+/*
+ * One request in TraceSample records a begin and an end event at every phase
+ * boundary (TRACE_BEGIN/TRACE_END) into a small static array.  When the
+ * request finishes the events are rendered as Chrome trace records and
+ * appended to the trace file with a single write, so records from different
+ * workers never interleave.  The file is in the JSON Array Format, whose
+ * closing bracket is optional: it can be opened in chrome://tracing or
+ * ui.perfetto.dev at any time.
+ */
+
+/**
+ * Parse tracing specification.
+ *
+ * @param   spec        Comma separated name=value pairs, where name is file
+ *                      (trace JSON to write) or sample (trace one request in
+ *                      N).
+ * @return  true if parsing was successful, false if there was an error.
+ **/
+bool parse_trace(char *spec) {
+    for (char *pair = strtok(spec, ","); pair; pair = strtok(NULL, ",")) {
+        char *value = strchr(pair, '=');
+        if (!value) {
+            return false;
+        }
+        *value++ = '\0';
+
+        if (streq(pair, "file")) {
+            TracePath = value;
+        } else if (streq(pair, "sample")) {
+            TraceSample = atoi(value);
+            if (TraceSample < 1) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    return TracePath != NULL;
+}
+
+/**
+ * Create the trace file before any worker is forked.
+ **/
+void trace_init(void) {
+    if (!TracePath) {
+        return;
+    }
+
+    TraceFd = open(TracePath, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (TraceFd < 0) {
+        fatal("Unable to open trace file %s: %s", TracePath, strerror(errno));
+    }
+    if (write(TraceFd, "[\n", 2) != 2) {
+        fatal("Unable to write trace file %s: %s", TracePath, strerror(errno));
+    }
+
+    Sequence = mmap(NULL, sizeof(*Sequence), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Sequence == MAP_FAILED) {
+        fatal("Unable to mmap trace sequence: %s", strerror(errno));
+    }
+    *Sequence = 0;
+    log("Tracing 1 in %d requests to %s", TraceSample, TracePath);
+}
+
+/**
+ * Record a phase boundary of the current request.
+ *
+ * @param   name        Phase name.
+ * @param   phase       'B' at the start of the phase, 'E' at the end.
+ **/
+void trace_event(const char *name, char phase) {
+    struct timespec ts;
+
+    if (EventCount == TRACE_EVENTS) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    Events[EventCount++] = (TraceEvent){
+        .name  = name,
+        .phase = phase,
+        .ts    = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000,
+    };
+}
+
+/**
+ * Decide whether the request about to be handled is traced.
+ **/
+void trace_request(void) {
+    Tracing = false;
+    if (TraceFd < 0) {
+        return;
+    }
+    if (__atomic_fetch_add(Sequence, 1, __ATOMIC_RELAXED) % TraceSample == 0) {
+        Tracing    = true;
+        EventCount = 0;
+        trace_event("request", 'B');
+    }
+}
+
+/**
+ * Stop tracing the current request without writing it.
+ *
+ * Used when handle_request turns out to be serving a whole HTTP/2
+ * connection; its streams are traced as requests of their own.
+ **/
+void trace_discard(void) {
+    Tracing = false;
+}
+
+/**
+ * Append JSON string with quotes and backslashes escaped.
+ **/
+static size_t trace_escape(char *buffer, size_t size, const char *s) {
+    size_t n = 0;
+    for (; s && *s && n + 2 < size; s++) {
+        if (*s == '"' || *s == '\\') {
+            buffer[n++] = '\\';
+        }
+        buffer[n++] = (unsigned char)*s < ' ' ? ' ' : *s;
+    }
+    buffer[n] = '\0';
+    return n;
+}
+
+/**
+ * Append to a trace record, stopping at the end of the buffer.
+ **/
+static void trace_append(char *buffer, size_t size, size_t *length, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buffer + *length, size - *length, format, args);
+    va_end(args);
+    if (n > 0) {
+        *length += n;
+    }
+    if (*length >= size) {
+        *length = size - 1;
+    }
+}
+
+/**
+ * Write the events of a traced request to the trace file.
+ *
+ * @param   r           Request that was handled.
+ * @param   status      Status it was handled with.
+ *
+ * Every client supplied string is escaped and bounded, so the record stays
+ * valid JSON and within its buffer.
+ **/
+void trace_finish(Request *r, Status status) {
+    char uri[BUFSIZ];
+    char method[TRACE_FIELD];
+    char client[TRACE_FIELD];
+
+    if (!Tracing) {
+        return;
+    }
+    Tracing = false;
+    trace_event("request", 'E');
+
+    trace_escape(uri, sizeof(uri), r->uri);
+    trace_escape(method, sizeof(method), r->method);
+    trace_escape(client, sizeof(client), request_host(r));
+    size_t size   = EventCount * TRACE_RECORD + sizeof(uri) + sizeof(method) + sizeof(client);
+    char  *buffer = malloc(size);
+    if (!buffer) {
+        return;
+    }
+
+    size_t length = 0;
+    int    pid    = getpid();
+    for (size_t i = 0; i < EventCount; i++) {
+        TraceEvent *e = &Events[i];
+        trace_append(buffer, size, &length,
+            "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":%d,\"tid\":%d",
+            e->name, e->phase, (unsigned long long)e->ts, pid, pid);
+        if (i == 0) {
+            trace_append(buffer, size, &length,
+                ",\"args\":{\"method\":\"%s\",\"uri\":\"%s\",\"client\":\"%s\"}",
+                method, uri, client);
+        } else if (i + 1 == EventCount) {
+            const char *result = http_status_string(status);
+            trace_append(buffer, size, &length, ",\"args\":{\"status\":\"%s\"}", result ? result : "");
+        }
+        trace_append(buffer, size, &length, "},\n");
+    }
+
+    if (write(TraceFd, buffer, length) < 0) {
+        debug("Unable to write trace: %s", strerror(errno));
+    }
+    free(buffer);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -4,12 +4,21 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 
+#include <linux/openat2.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <limits.h>
 
+/* Global Variables */
+int RootFd = -1;
+
+/* Constants */
+#define REQUEST_OPEN_FLAGS  (O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC)
+
 /**
  * Determine mime-type from file extension.
  *
@@ -33,14 +42,15 @@
  * This function returns an allocated string that must be free'd.
  **/
 char * determine_mimetype(const char *path) {
-    char *ext;
+    const char *ext;
     char *mimetype;
     char *token;
     char buffer[BUFSIZ];
     FILE *fs = NULL;
-    /* Find file extension */
-    ext = strchr(path, '.');
-    ext = strtok(ext, ".");
+    /* Find file extension (of the last path component only) */
+    ext = strrchr(path, '/');
+    ext = strchr(ext ? ext : path, '.');
+    if (ext) ext++;
 
     mimetype = DefaultMimeType;
     /* Open MimeTypesPath file */
@@ -57,8 +67,9 @@ char * determine_mimetype(const char *path) {
         while (fgets(buffer, BUFSIZ, fs))
         {   
             if (*buffer == '#') continue; // ignore comments
-            mimetype = skip_whitespace(strtok(buffer, WHITESPACE));
-            token = skip_whitespace(strtok(NULL, WHITESPACE));
+            char *save;
+            mimetype = skip_whitespace(strtok_r(buffer, WHITESPACE, &save));
+            token = skip_whitespace(strtok_r(NULL, WHITESPACE, &save));
             while (token)
             {
                 if (strcmp(ext, token) == 0)
@@ -67,9 +78,10 @@ char * determine_mimetype(const char *path) {
                     fclose(fs);
                     return strdup(mimetype);
                 }
-                token = strtok(NULL, WHITESPACE);
+                token = strtok_r(NULL, WHITESPACE, &save);
             }
         }
+        mimetype = DefaultMimeType;
     }
     fclose(fs);
     return strdup(mimetype);
@@ -124,6 +136,121 @@ char * determine_request_path(const char *uri) {
     return realURI;
 }
 
+/**
+ * Open the document root that request paths are resolved beneath.
+ *
+ * @param   path        Real path of the root directory.
+ * @return  true if RootFd now refers to path.
+ *
+ * The previous RootFd (if any) is only replaced on success, so a failed
+ * reload keeps serving the old root.
+ **/
+bool open_root(const char *path) {
+    int fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        log("Unable to open root %s: %s", path, strerror(errno));
+        return false;
+    }
+    if (RootFd >= 0) {
+        close(RootFd);
+    }
+    RootFd = fd;
+    return true;
+}
+
+/**
+ * Open a URI beneath RootFd one component at a time.
+ *
+ * @param   relative    URI without its leading slashes.
+ * @return  Open descriptor, or -1 on error.
+ *
+ * Fallback for kernels without openat2.  Each directory is opened with
+ * O_NOFOLLOW relative to its parent, so ".." components and symlinks are
+ * refused outright instead of being checked.
+ **/
+static int open_beneath(const char *relative) {
+    char  buffer[PATH_MAX];
+    char *saveptr;
+    int   dirfd = RootFd;
+
+    if (strlen(relative) >= sizeof(buffer)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(buffer, relative);
+
+    char *name = strtok_r(buffer, "/", &saveptr);
+    while (name && streq(name, ".")) {
+        name = strtok_r(NULL, "/", &saveptr);
+    }
+    if (!name) {
+        return openat(RootFd, ".", REQUEST_OPEN_FLAGS | O_DIRECTORY);
+    }
+
+    for (;;) {
+        char *next = strtok_r(NULL, "/", &saveptr);
+        while (next && streq(next, ".")) {
+            next = strtok_r(NULL, "/", &saveptr);
+        }
+
+        int fd = -1;
+        if (streq(name, "..")) {
+            errno = EXDEV;
+        } else if (next) {
+            fd = openat(dirfd, name, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        } else {
+            fd = openat(dirfd, name, REQUEST_OPEN_FLAGS | O_NOFOLLOW);
+        }
+        if (dirfd != RootFd) {
+            int error = errno;
+            close(dirfd);
+            errno = error;
+        }
+        if (fd < 0 || !next) {
+            return fd;
+        }
+        dirfd = fd;
+        name  = next;
+    }
+}
+
+/**
+ * Open the resource a URI names beneath the document root.
+ *
+ * @param   uri         Resource path of URI.
+ * @return  Descriptor opened for reading, or -1 with errno set.
+ *
+ * This replaces realpath(3) and the string prefix check of
+ * determine_request_path with a single openat2(2) relative to RootFd: with
+ * RESOLVE_BENEATH the kernel itself refuses any ".." or symlink that would
+ * leave the root, and RESOLVE_NO_MAGICLINKS refuses /proc style links.  The
+ * caller dispatches on fstat of the returned descriptor and serves from it,
+ * so the file checked is the file served.  Kernels older than 5.6 fall back
+ * to open_beneath.
+ **/
+int open_request_path(const char *uri) {
+    static bool unsupported = false;
+
+    while (*uri == '/') {
+        uri++;
+    }
+    const char *relative = *uri ? uri : ".";
+
+    if (!unsupported) {
+        struct open_how how = {
+            .flags   = REQUEST_OPEN_FLAGS,
+            .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+        };
+        int fd = syscall(SYS_openat2, RootFd, relative, &how, sizeof(how));
+        if (fd >= 0 || errno != ENOSYS) {
+            return fd;
+        }
+        debug("openat2 unsupported: resolving paths component by component");
+        unsupported = true;
+    }
+    return open_beneath(relative);
+}
+
 /**
  * Return static string corresponding to HTTP Status code.
  *
@@ -135,22 +262,45 @@ char * determine_request_path(const char *uri) {
 const char * http_status_string(Status status) {
     static char *StatusStrings[] = {
         "200 OK",
+        "304 Not Modified",
         "400 Bad Request",
         "404 Not Found",
+        "411 Length Required",
+        "413 Payload Too Large",
+        "429 Too Many Requests",
+        "431 Request Header Fields Too Large",
         "500 Internal Server Error",
-        "418 I'm A Teapot",
+        "502 Bad Gateway",
+        "503 Service Unavailable",
+        "504 Gateway Timeout",
     };
 
     switch (status)
     {
         case HTTP_STATUS_OK: return StatusStrings[0]; 
                              break;
-        case HTTP_STATUS_BAD_REQUEST: return StatusStrings[1];
+        case HTTP_STATUS_NOT_MODIFIED: return StatusStrings[1];
+                                       break;
+        case HTTP_STATUS_BAD_REQUEST: return StatusStrings[2];
                                       break;
-        case HTTP_STATUS_NOT_FOUND: return StatusStrings[2]; 
+        case HTTP_STATUS_NOT_FOUND: return StatusStrings[3]; 
                                     break;
-        case HTTP_STATUS_INTERNAL_SERVER_ERROR: return StatusStrings[3]; 
+        case HTTP_STATUS_LENGTH_REQUIRED: return StatusStrings[4];
+                                          break;
+        case HTTP_STATUS_PAYLOAD_TOO_LARGE: return StatusStrings[5];
+                                            break;
+        case HTTP_STATUS_TOO_MANY_REQUESTS: return StatusStrings[6];
+                                            break;
+        case HTTP_STATUS_HEADER_FIELDS_TOO_LARGE: return StatusStrings[7];
+                                                  break;
+        case HTTP_STATUS_INTERNAL_SERVER_ERROR: return StatusStrings[8]; 
                                                 break;
+        case HTTP_STATUS_BAD_GATEWAY: return StatusStrings[9];
+                                      break;
+        case HTTP_STATUS_SERVICE_UNAVAILABLE: return StatusStrings[10];
+                                              break;
+        case HTTP_STATUS_GATEWAY_TIMEOUT: return StatusStrings[11];
+                                              break;
         default: return NULL;
                  break;
     }
@@ -199,7 +349,7 @@ char * chomp(char *s)
 
     while(s[i] != '\0')
     {
-        if(s[i] != ' ' && s[i] != '\t' && s[i] != '\n')
+        if(s[i] != ' ' && s[i] != '\t' && s[i] != '\n' && s[i] != '\r')
         {
             index=i;
         }
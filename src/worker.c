@@ -0,0 +1,281 @@
+/* worker.c: Worker Processes and CPU Placement */
+
+#include "spidey.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Global Variables */
+int  Workers    = 0;
+bool PinWorkers = false;
+
+/* Constants */
+
+#define WORKER_MAX      1024            /* Largest number of workers */
+
+/* Internal State */
+
+typedef struct {
+    pid_t   pid;                        /*< Worker process (0 if not running) */
+    int     cpu;                        /*< CPU the worker is pinned to (-1 if not) */
+} Worker;
+
+static Worker   *Pool = NULL;
+static cpu_set_t NodeCpus;              /* CPUs of this worker's NUMA node */
+static bool      Pinned = false;
+
+/*
+ * With -w the server runs as a master that only supervises workers.  Each
+ * worker has its own SO_REUSEPORT listener and event loop.  With -a, worker
+ * i is pinned to the i-th CPU the master may run on and its listener is
+ * marked with SO_INCOMING_CPU, so the kernel (6.2 or newer) hands each
+ * connection to the worker on the CPU that processed its packets.  Memory
+ * is preferred on the worker's NUMA node, so its buffers and the pages of
+ * files it reads stay local.
+ */
+
+/**
+ * Return the NUMA node of a CPU (0 if the system does not say).
+ **/
+static int cpu_node(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+    DIR *d = opendir(path);
+    if (!d) {
+        return 0;
+    }
+    int node = 0;
+    for (struct dirent *e = readdir(d); e; e = readdir(d)) {
+        if (strncmp(e->d_name, "node", 4) == 0 && sscanf(e->d_name + 4, "%d", &node) == 1) {
+            break;
+        }
+    }
+    closedir(d);
+    return node;
+}
+
+/**
+ * Read the CPUs of a NUMA node into a set.
+ **/
+static void node_cpus(int node, cpu_set_t *set) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+    CPU_ZERO(set);
+    FILE *fs = fopen(path, "r");
+    if (!fs) {
+        return;
+    }
+    int first, last;
+    char separator;
+    while (fscanf(fs, "%d", &first) == 1) {
+        last = first;
+        separator = fgetc(fs);
+        if (separator == '-') {
+            if (fscanf(fs, "%d", &last) != 1) {
+                break;
+            }
+            separator = fgetc(fs);
+        }
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (separator != ',') {
+            break;
+        }
+    }
+    fclose(fs);
+}
+
+/**
+ * Pin the calling worker to a CPU and prefer memory on its node.
+ **/
+static void worker_pin(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        log("Unable to pin worker to CPU %d: %s", cpu, strerror(errno));
+        return;
+    }
+
+    int node = cpu_node(cpu);
+    unsigned long mask[(node / (8 * sizeof(unsigned long))) + 1];
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, 8 * sizeof(mask)) < 0) {
+        debug("Unable to prefer NUMA node %d: %s", node, strerror(errno));
+    }
+
+    node_cpus(node, &NodeCpus);
+    Pinned = CPU_COUNT(&NodeCpus) > 0;
+    log("Worker pinned to CPU %d (node %d)", cpu, node);
+}
+
+/**
+ * Let a process forked off a pinned worker (or a task thread it started) run
+ * on any CPU of its node.
+ *
+ * Connection handlers and CGI scripts would otherwise all compete with the
+ * worker's event loop for its one CPU; the node keeps their memory local.
+ * Affinity is per thread, so every caller widens its own.
+ **/
+void worker_unpin(void) {
+    if (Pinned && sched_setaffinity(0, sizeof(NodeCpus), &NodeCpus) < 0) {
+        debug("Unable to widen affinity: %s", strerror(errno));
+    }
+}
+
+/**
+ * Start a worker: place it, open its listeners and run the server loop.
+ **/
+static pid_t worker_start(Worker *w, ServerMode mode, const sigset_t *mask) {
+    pid_t pid = fork();
+    if (pid != 0) {
+        if (pid < 0) {
+            log("Unable to fork worker: %s", strerror(errno));
+        }
+        return pid;
+    }
+
+    sigprocmask(SIG_SETMASK, mask, NULL);
+    if (w->cpu >= 0) {
+        worker_pin(w->cpu);
+    }
+
+    int sfd = Port ? socket_listen(Port, w->cpu) : -1;
+    if (Port && sfd < 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (TlsPort && (TlsSocket = socket_listen(TlsPort, w->cpu)) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    switch (mode) {
+        case SINGLE:    exit(single_server(sfd));
+        case HYBRID:    exit(hybrid_server(sfd));
+        case COROUTINE: exit(coroutine_server(sfd));
+        default:        exit(forking_server(sfd));
+    }
+}
+
+/**
+ * Send a signal to every running worker.
+ **/
+static void workers_signal(int signum) {
+    for (int i = 0; i < Workers; i++) {
+        if (Pool[i].pid > 0) {
+            kill(Pool[i].pid, signum);
+        }
+    }
+}
+
+/**
+ * Run Workers copies of the server and supervise them.
+ *
+ * @param   mode        Concurrency mode each worker runs.
+ * @return  Exit status of server once every worker has exited.
+ *
+ * SIGHUP and SIGQUIT are passed on to the workers, SIGINT and SIGTERM stop
+ * them, and SIGUSR2 starts a new binary as usual: its workers join the same
+ * SO_REUSEPORT groups before it tells this master to drain.  A worker that
+ * crashes is restarted on the same CPU; one that fails to start is not.
+ **/
+int workers_server(ServerMode mode) {
+    cpu_set_t allowed;
+    int       cpus[CPU_SETSIZE];
+    int       ncpus = 0;
+
+    if (Workers > WORKER_MAX) {
+        Workers = WORKER_MAX;
+    }
+    Pool = calloc(Workers, sizeof(Worker));
+    if (!Pool) {
+        fatal("Unable to allocate workers: %s", strerror(errno));
+    }
+
+    if (PinWorkers && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cpus[ncpus++] = cpu;
+            }
+        }
+    }
+
+    /* Signals are taken synchronously; workers get the original mask back */
+    sigset_t set, original;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGUSR2);
+    sigaddset(&set, SIGQUIT);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigprocmask(SIG_BLOCK, &set, &original);
+
+    int running = 0;
+    for (int i = 0; i < Workers; i++) {
+        Pool[i].cpu = ncpus > 0 ? cpus[i % ncpus] : -1;
+        Pool[i].pid = worker_start(&Pool[i], mode, &original);
+        running += Pool[i].pid > 0;
+    }
+    log("Started %d workers%s", running, ncpus > 0 ? " pinned to CPUs" : "");
+
+    bool stopping = false;
+    int  status   = EXIT_SUCCESS;
+    while (running > 0) {
+        int signum = sigwaitinfo(&set, NULL);
+        switch (signum) {
+            case SIGHUP:
+            case SIGQUIT:
+                stopping |= signum == SIGQUIT;
+                workers_signal(signum);
+                break;
+            case SIGINT:
+            case SIGTERM:
+                stopping = true;
+                workers_signal(SIGTERM);
+                break;
+            case SIGUSR2:
+                if (!stopping) {
+                    server_upgrade(-1);
+                }
+                break;
+            case SIGCHLD: {
+                int   wstatus;
+                pid_t pid;
+                while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+                    for (int i = 0; i < Workers; i++) {
+                        if (Pool[i].pid != pid) {
+                            continue;
+                        }
+                        Pool[i].pid = 0;
+                        running--;
+                        if (!stopping && WIFSIGNALED(wstatus)) {
+                            log("Worker %d killed by signal %d: restarting", pid, WTERMSIG(wstatus));
+                            Pool[i].pid = worker_start(&Pool[i], mode, &original);
+                            running += Pool[i].pid > 0;
+                        } else if (!stopping) {
+                            log("Worker %d exited with status %d", pid, WEXITSTATUS(wstatus));
+                            status = EXIT_FAILURE;
+                        }
+                    }
+                }
+                break;
+            }
+        }
+    }
+
+    log("All workers exited");
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */